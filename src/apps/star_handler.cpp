@@ -39,6 +39,7 @@ class star_handler_parameters
 	RFLOAT eps, select_minval, select_maxval, multiply_by, add_to, center_X, center_Y, center_Z, hist_min, hist_max;
 	bool do_ignore_optics, do_combine, do_combine_picks, do_split, do_center, do_random_order, show_frac, show_cumulative, do_discard;
 	long int nr_split, size_split, nr_bin, random_seed;
+	int nr_threads;
 	RFLOAT discard_sigma, duplicate_threshold, extract_angpix, cl_angpix;
 	ObservationModel obsModel;
 	// I/O Parser
@@ -122,6 +123,7 @@ class star_handler_parameters
 		int duplicate_section = parser.addSection("Duplicate removal");
 		duplicate_threshold = textToFloat(parser.getOption("--remove_duplicates","Remove duplicated particles within this distance [Angstrom]. Negative values disable this.", "-1"));
 		extract_angpix = textToFloat(parser.getOption("--image_angpix", "For down-sampled particles, specify the pixel size [A/pix] of the original images used in the Extract job", "-1"));
+		nr_threads = textToInteger(parser.getOption("--j", "Number of threads to process micrographs in parallel", "1"));
 
 		// Check for errors in the command-line option
 		if (parser.checkForErrors())
@@ -640,7 +642,7 @@ class star_handler_parameters
                 MDsort.setValue(label, fn_this);
             }
             // sort on the label
-            MDsort.newSort(label);
+            MDsort.newSort(label, false, false, false, nr_threads);
             long int nr_duplicates = 0;
             FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDsort)
             {
@@ -1186,7 +1188,7 @@ class star_handler_parameters
 		FileName fn_removed = fn_out.withoutExtension() + "_removed.star";
 
 
-		MetaDataTable MDout = removeDuplicatedParticles(MD, mic_label, duplicate_threshold, scale, fn_removed, true);
+		MetaDataTable MDout = removeDuplicatedParticles(MD, mic_label, duplicate_threshold, scale, fn_removed, true, nr_threads);
 
 		write_check_ignore_optics(MDout, fn_out, "particles");
 		std::cout << " Written: " << fn_out << std::endl;
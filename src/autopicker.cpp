@@ -20,6 +20,7 @@
  ***************************************************************************/
 #include "src/autopicker.h"
 #include <src/jaz/single_particle/new_ft.h>
+#include <omp.h>
 
 //#define DEBUG
 //#define DEBUG_HELIX
@@ -184,6 +185,8 @@ if(do_gpu)
 	workFrac = textToFloat(parser.getOption("--shrink", "Reduce micrograph to this fraction size, during correlation calc (saves memory and time)", "1.0"));
 	LoG_max_search = textToFloat(parser.getOption("--Log_max_search", "Maximum diameter in LoG-picking multi-scale approach is this many times the min/max diameter", "5."));
 	extra_padding = textToInteger(parser.getOption("--extra_pad", "Number of pixels for additional padding of the original micrograph", "0"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for the cross-correlations with the references (CPU only)", "1"));
+	ref_cache_mb = textToFloat(parser.getOption("--ref_cache_mb", "Memory (in MB) to keep the rotated references for all micrographs; this is used by every MPI rank (CPU only, default is to recalculate them for every micrograph)", "0"));
 
 	// Check for errors in the command-line option
 	if (parser.checkForErrors())
@@ -813,6 +816,11 @@ void AutoPicker::initialise(int rank)
 		timer.tic(TIMING_A4);
 	#endif
 
+		// All in-plane rotations to be sampled (psi_sampling may have been changed for Gaussian blobs above)
+		psis.clear();
+		for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+			psis.push_back(psi);
+
 		// Pre-calculate and store Projectors for all references at the right size
 		if (!do_read_fom_maps && !do_LoG)
 		{
@@ -945,6 +953,10 @@ void AutoPicker::initialise(int rank)
 
 			if (verb > 0)
 				progress_bar(Mrefs.size());
+
+			// The rotated references do not depend on the CTF, so they can be re-used for all micrographs
+			if (!do_gpu)
+				precalculateRotatedReferences();
 		}
 	}
 
@@ -3369,10 +3381,58 @@ void AutoPicker::autoPickLoGOneMicrograph(FileName &fn_mic, long int imic)
 	MDout.write(fn_tmp);
 }
 
+void AutoPicker::precalculateRotatedReferences()
+{
+	Frefs_rot.clear();
+	Frefs_rot.resize(PPref.size());
+
+	const long int nr_total = PPref.size() * psis.size();
+	const RFLOAT mb_per_ref = (RFLOAT)downsize_mic * (RFLOAT)(downsize_mic/2 + 1) * sizeof(Complex) / (1024. * 1024.);
+	long int nr_cached = (mb_per_ref > 0.) ? FLOOR(ref_cache_mb / mb_per_ref) : 0;
+	nr_cached = XMIPP_MIN(nr_cached, nr_total);
+	if (nr_cached <= 0)
+		return;
+
+	if (verb > 0)
+		std::cout << " Storing " << nr_cached << " of " << nr_total << " rotated references (" << ROUND(nr_cached * mb_per_ref) << " MB) ... " << std::endl;
+
+	for (int iref = 0; iref < PPref.size(); iref++)
+	{
+		const long int nr_psi = XMIPP_MIN((long int)psis.size(), nr_cached - iref * (long int)psis.size());
+		if (nr_psi <= 0)
+			break;
+
+		Frefs_rot[iref].resize(nr_psi);
+
+		#pragma omp parallel for num_threads(nr_threads)
+		for (int ipsi = 0; ipsi < nr_psi; ipsi++)
+		{
+			Matrix2D<RFLOAT> A(3,3);
+			Euler_angles2matrix(0., 0., psis[ipsi], A);
+			Frefs_rot[iref][ipsi].initZeros(downsize_mic, downsize_mic/2 + 1);
+			PPref[iref].get2DFourierTransform(Frefs_rot[iref][ipsi], A);
+		}
+	}
+}
+
+const MultidimArray<Complex>& AutoPicker::getRotatedReference(int iref, int ipsi, MultidimArray<Complex> &Fbuffer)
+{
+	if (iref < Frefs_rot.size() && ipsi < Frefs_rot[iref].size())
+		return Frefs_rot[iref][ipsi];
+
+	// Not stored: get the FT of the rotated (non-ctf-corrected) template
+	Matrix2D<RFLOAT> A(3,3);
+	Euler_angles2matrix(0., 0., psis[ipsi], A);
+	Fbuffer.initZeros(downsize_mic, downsize_mic/2 + 1);
+	PPref[iref].get2DFourierTransform(Fbuffer, A);
+
+	return Fbuffer;
+}
+
 void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 {
 	Image<RFLOAT> Imic;
-	MultidimArray<Complex > Faux, Faux2, Fmic;
+	MultidimArray<Complex > Faux, Faux2, Fmic, Fref_rot;
 	MultidimArray<RFLOAT> Maux, Mstddev, Mmean, Mstddev2, Mavg, Mdiff2, MsumX2, Mccf_best, Mpsi_best, Fctf, Mccf_best_combined, Mpsi_best_combined;
 	MultidimArray<int> Mclass_best_combined;
 	FourierTransformer transformer;
@@ -3666,44 +3726,32 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 			timer.tic(TIMING_B3);
 #endif
 			Mccf_best.initConstant(-LARGE_NUMBER);
-			bool is_first_psi = true;
-			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
-			{
-				// Get the Euler matrix
-				Matrix2D<RFLOAT> A(3,3);
-				Euler_angles2matrix(0., 0., psi, A);
 
-				// Now get the FT of the rotated (non-ctf-corrected) template
-				Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
-				PPref[iref].get2DFourierTransform(Faux, A);
+			// Get the FT of the non-rotated (non-ctf-corrected) template
+			Faux = getRotatedReference(iref, 0, Fref_rot);
 
 #ifdef DEBUG
-				std::cerr << " psi= " << psi << std::endl;
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				tt().resize(micrograph_size, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mref_rot.spi");
-
-				windowFourierTransform(Fmic, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mmic.spi");
-
+			windowFourierTransform(Faux, Faux2, micrograph_size);
+			CenterFFTbySign(Faux2);
+			tt().resize(micrograph_size, micrograph_size);
+			transformer.inverseFourierTransform(Faux2, tt());
+			tt.write("Mref_rot.spi");
+
+			windowFourierTransform(Fmic, Faux2, micrograph_size);
+			CenterFFTbySign(Faux2);
+			transformer.inverseFourierTransform(Faux2, tt());
+			tt.write("Mmic.spi");
 #endif
 #ifdef TIMING
 	timer.tic(TIMING_B4);
 #endif
-				// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
-				if (do_ctf)
+			// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
+			if (do_ctf)
+			{
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
 				{
-					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-					{
-						DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
-					}
-#ifdef TIMING
-	timer.toc(TIMING_B4);
-#endif
+					DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+				}
 #ifdef DEBUG
 				MultidimArray<RFLOAT> ttt(micrograph_size, micrograph_size);
 				windowFourierTransform(Faux, Faux2, micrograph_size);
@@ -3718,124 +3766,147 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 				}
 				tt.write("Mref_rot_ctf.spi");
 #endif
-				}
-
-				if (is_first_psi)
-				{
+			}
 #ifdef TIMING
+	timer.toc(TIMING_B4);
 	timer.tic(TIMING_B5);
 #endif
-					// Calculate the expected ratio of probabilities for this CTF-corrected reference
-					// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
-					// Do this also if we're not recalculating the fom maps...
-					// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
-					windowFourierTransform(Faux, Faux2, micrograph_size);
-					CenterFFTbySign(Faux2);
-					Maux.resize(micrograph_size, micrograph_size);
-					transformer.inverseFourierTransform(Faux2, Maux);
-					Maux.setXmippOrigin();
+			// Calculate the expected ratio of probabilities for this CTF-corrected reference
+			// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
+			// Do this also if we're not recalculating the fom maps...
+			// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
+			windowFourierTransform(Faux, Faux2, micrograph_size);
+			CenterFFTbySign(Faux2);
+			Maux.resize(micrograph_size, micrograph_size);
+			transformer.inverseFourierTransform(Faux2, Maux);
+			Maux.setXmippOrigin();
 #ifdef DEBUG
-					Image<RFLOAT> ttt;
-					ttt()=Maux;
-					ttt.write("Maux.spi");
+			Image<RFLOAT> ttt;
+			ttt()=Maux;
+			ttt.write("Maux.spi");
 #endif
-					sum_ref_under_circ_mask = 0.;
-					sum_ref2_under_circ_mask = 0.;
-					RFLOAT suma2 = 0.;
-					RFLOAT sumn = 1.;
-					MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
-					Mctfref.setXmippOrigin();
-					FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
-					{
-						if (i*i + j*j < particle_radius2)
-						{
-							suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
-							sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
-							sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							sumn += 1.;
-						}
+			sum_ref_under_circ_mask = 0.;
+			sum_ref2_under_circ_mask = 0.;
+			RFLOAT suma2 = 0.;
+			RFLOAT sumn = 1.;
+			MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
+			Mctfref.setXmippOrigin();
+			FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+			{
+				if (i*i + j*j < particle_radius2)
+				{
+					suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+					suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
+					sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
+					sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+					sumn += 1.;
+				}
 #ifdef DEBUG
-						A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
+				A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
 #endif
-					}
-					sum_ref_under_circ_mask /= sumn;
-					sum_ref2_under_circ_mask /= sumn;
-					expected_Pratio = exp(suma2 / (2. * sumn));
+			}
+			sum_ref_under_circ_mask /= sumn;
+			sum_ref2_under_circ_mask /= sumn;
+			expected_Pratio = exp(suma2 / (2. * sumn));
 #ifdef DEBUG
-					std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
-					tt()=Mctfref;
-					tt.write("Mctfref.spi");
-					std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
-					std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
-					std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
-					std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
-					std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
+			std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
+			tt()=Mctfref;
+			tt.write("Mctfref.spi");
+			std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
+			std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
+			std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
+			std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
+			std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
 #endif
 
-					// Maux goes back to the workSize
-					Maux.resize(workSize, workSize);
+			// Maux goes back to the workSize
+			Maux.resize(workSize, workSize);
 #ifdef TIMING
-					timer.toc(TIMING_B5);
+			timer.toc(TIMING_B5);
+			timer.tic(TIMING_B6);
 #endif
-				}
+			// The above draws random numbers, so only now loop over all psi angles, in contiguous ranges per thread.
+			// Thread 0 keeps its best values directly in Mccf_best and Mpsi_best, the others in their own maps.
+			// These are combined in the order of psi afterwards, so the result does not depend on the number of threads.
+			const int my_nr_threads = XMIPP_MAX(1, XMIPP_MIN(nr_threads, (int)psis.size()));
+			std::vector<MultidimArray<RFLOAT> > thread_ccf(my_nr_threads), thread_psi(my_nr_threads);
 
-#ifdef TIMING
-				timer.tic(TIMING_B6);
-#endif
-				// Now multiply template and micrograph to calculate the cross-correlation
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+			#pragma omp parallel num_threads(my_nr_threads)
+			{
+				const int thread_id = omp_get_thread_num();
+				MultidimArray<RFLOAT> &my_ccf = (thread_id == 0) ? Mccf_best : thread_ccf[thread_id];
+				MultidimArray<RFLOAT> &my_psi = (thread_id == 0) ? Mpsi_best : thread_psi[thread_id];
+				if (thread_id > 0)
 				{
-					DIRECT_MULTIDIM_ELEM(Faux, n) = conj(DIRECT_MULTIDIM_ELEM(Faux, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
+					my_ccf.resize(workSize, workSize);
+					my_ccf.initConstant(-LARGE_NUMBER);
+					my_psi.resize(workSize, workSize);
 				}
 
-				// If we're not doing shrink, then Faux is bigger than Faux2!
-				windowFourierTransform(Faux, Faux2, workSize);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, Maux);
-#ifdef DEBUG
-				tt()=Maux*normfft;
-				tt.write("Mcc.spi");
-#endif
+				FourierTransformer my_transformer;
+				MultidimArray<Complex> Fmy_rot, Fcc, Fcc_window;
+				MultidimArray<RFLOAT> Mcc(workSize, workSize);
+
+				#pragma omp for schedule(static)
+				for (int ipsi = 0; ipsi < psis.size(); ipsi++)
+				{
+					const RFLOAT psi = psis[ipsi];
+					const MultidimArray<Complex> &Fref = getRotatedReference(iref, ipsi, Fmy_rot);
+
+					// Now multiply the CTF-corrected template and micrograph to calculate the cross-correlation
+					Fcc.resize(Fref);
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fcc)
+					{
+						Complex fref = DIRECT_MULTIDIM_ELEM(Fref, n);
+						if (do_ctf)
+							fref *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+						DIRECT_MULTIDIM_ELEM(Fcc, n) = conj(fref) * DIRECT_MULTIDIM_ELEM(Fmic, n);
+					}
+
+					// If we're not doing shrink, then Fcc is bigger than Fcc_window!
+					windowFourierTransform(Fcc, Fcc_window, workSize);
+					CenterFFTbySign(Fcc_window);
+					my_transformer.inverseFourierTransform(Fcc_window, Mcc);
 
-				// Calculate ratio of prabilities P(ref)/P(zero)
-				// Keep track of the best values and their corresponding iref and psi
+					// Calculate ratio of prabilities P(ref)/P(zero)
+					// Keep track of the best values and their corresponding psi
 
-				// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
-				// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Maux)
+					// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
+					// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mcc)
+					{
+						RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Mcc, n);
+						diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
+						if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
+							diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
+						diff2 += sum_ref2_under_circ_mask;
+						diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
+
+						// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
+						diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
+						if (diff2 > DIRECT_MULTIDIM_ELEM(my_ccf, n))
+						{
+							DIRECT_MULTIDIM_ELEM(my_ccf, n) = diff2;
+							DIRECT_MULTIDIM_ELEM(my_psi, n) = psi;
+						}
+					}
+				} // end for psi
+			} // end omp parallel
+
+			for (int ithread = 1; ithread < my_nr_threads; ithread++)
+			{
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mccf_best)
 				{
-					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Maux, n);
-					diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
-					if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
-						diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
-					diff2 += sum_ref2_under_circ_mask;
-					diff2 = exp(- diff2 / 2.); // exponentiate to reflect the Gaussian error model. sigma=1 after normalization, 0.4=1/sqrt(2pi)
-
-					// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
-					diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
-#ifdef DEBUG
-					DIRECT_MULTIDIM_ELEM(Maux, n) = diff2;
-#endif
-					if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
+					if (DIRECT_MULTIDIM_ELEM(thread_ccf[ithread], n) > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
 					{
-						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
-						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
+						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = DIRECT_MULTIDIM_ELEM(thread_ccf[ithread], n);
+						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = DIRECT_MULTIDIM_ELEM(thread_psi[ithread], n);
 					}
 				}
-#ifdef DEBUG
-				std::cerr << " Maux.computeMax()= " << Maux.computeMax() << std::endl;
-				tt()=Maux;
-				tt.write("Mccf.spi");
-			    std::cerr << " Press any key to continue... "  << std::endl;
-			    char c;
-			    std::cin >> c;
-#endif
-			    is_first_psi = false;
+			}
 #ifdef TIMING
-	timer.toc(TIMING_B6);
+			timer.toc(TIMING_B6);
 #endif
-			} // end for psi
 #ifdef TIMING
 	timer.toc(TIMING_B3);
 #endif
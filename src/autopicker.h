@@ -292,6 +292,19 @@ public:
 	// In-plane rotational sampling (in degrees)
 	RFLOAT psi_sampling;
 
+	// All in-plane rotations that are sampled (in degrees)
+	std::vector<RFLOAT> psis;
+
+	// Number of threads for the cross-correlations with the rotated references
+	int nr_threads;
+
+	// Maximum memory (in MB) for the cache of rotated references
+	RFLOAT ref_cache_mb;
+
+	// CTF-independent FTs of the rotated references, reused for all micrographs: Frefs_rot[iref][ipsi]
+	// Only as many as fit in ref_cache_mb are stored, the others are recalculated for every micrograph
+	std::vector<std::vector<MultidimArray<Complex> > > Frefs_rot;
+
 	// Fraction of expected probability ratio to consider as peaks
 	RFLOAT min_fraction_expected_Pratio;
 
@@ -418,6 +431,12 @@ public:
 	void autoPickLoGOneMicrograph(FileName &fn_mic, long int imic);
 	void autoPickOneMicrograph(FileName &fn_mic, long int imic);
 
+	// Fill Frefs_rot with as many rotated references as fit in ref_cache_mb
+	void precalculateRotatedReferences();
+
+	// Return the FT of reference iref rotated by psis[ipsi], either from Frefs_rot or calculated into Fbuffer
+	const MultidimArray<Complex>& getRotatedReference(int iref, int ipsi, MultidimArray<Complex> &Fbuffer);
+
 	// Get the output coordinate filename given the micrograph filename
 	FileName getOutputRootName(FileName fn_mic);
 	// Uses Roseman2003 formulae to calculate stddev under the mask through FFTs
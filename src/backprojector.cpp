@@ -1606,9 +1606,24 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 		Fnewweight.reshape(Fconv);
 		decenter(weight, Fnewweight, max_r2);
 
+		// Start from the converged weights of the previous reconstruction, where these exist.
+		// An overall change in scale of Fweight is corrected in the first iteration.
+		if (do_gridding_warm_start && Fpreweight.sameShape(Fnewweight))
+		{
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fnewweight)
+			{
+				if (DIRECT_MULTIDIM_ELEM(Fnewweight, n) > 0. && DIRECT_MULTIDIM_ELEM(Fpreweight, n) > 0.)
+					DIRECT_MULTIDIM_ELEM(Fnewweight, n) = DIRECT_MULTIDIM_ELEM(Fpreweight, n);
+			}
+		}
+
+		// Real-space array for the blob convolutions, kept between iterations so that the FFTW plans are reused
+		MultidimArray<RFLOAT> Mconv;
+
 		RCTOC(ReconTimer,ReconS_5);
 		// Iterative algorithm as in  Eq. [14] in Pipe & Menon (1999)
 		// or Eq. (4) in Matej (2001)
+		nr_gridding_iter = 0;
 		for (int iter = 0; iter < max_iter_preweight; iter++)
 		{
 			//std::cout << "    iteration " << (iter+1) << "/" << max_iter_preweight << "\n";
@@ -1627,9 +1642,9 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 
 			// convolute through Fourier-transform (as both grids are rectangular)
 			// Note that convoluteRealSpace acts on the complex array inside the transformer
-			convoluteBlobRealSpace(transformer, false);
+			convoluteBlobRealSpace(transformer, Mconv, false);
 
-			RFLOAT w, corr_min = LARGE_NUMBER, corr_max = -LARGE_NUMBER, corr_avg=0., corr_nn=0.;
+			RFLOAT w, corr_min = LARGE_NUMBER, corr_max = -LARGE_NUMBER, corr_avg=0., corr_nn=0., corr_dev=0.;
 
 			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fconv)
 			{
@@ -1642,6 +1657,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 					corr_min = XMIPP_MIN(corr_min, w);
 					corr_max = XMIPP_MAX(corr_max, w);
 					corr_avg += w;
+					corr_dev += ABS(w - 1.);
 					corr_nn += 1.;
 					// Apply division of Eq. [14] in Pipe & Menon (1999)
 					DIRECT_A3D_ELEM(Fnewweight, k, i, j) /= w;
@@ -1657,7 +1673,16 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 			std::cerr << " corr_min= " << corr_min << std::endl;
 			std::cerr << " corr_max= " << corr_max << std::endl;
 #endif
+
+			// At convergence, the convolved weights are all one
+			nr_gridding_iter = iter + 1;
+			if (gridding_tolerance > 0. && corr_nn > 0. && corr_dev / corr_nn < gridding_tolerance)
+				break;
 		}
+		Mconv.clear();
+
+		if (do_gridding_warm_start)
+			Fpreweight = Fnewweight;
 
 		RCTIC(ReconTimer,ReconS_7);
 
@@ -1756,14 +1781,19 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	RCTIC(ReconTimer,ReconS_16);
 	// Gridding correction for the blob
 	RFLOAT normftblob = tab_ftblob(0.);
-	FOR_ALL_ELEMENTS_IN_ARRAY3D(vol_out)
+	std::vector<RFLOAT> row_rval(XSIZE(vol_out)), row_ftblob(XSIZE(vol_out));
+	for (long int k = STARTINGZ(vol_out); k <= FINISHINGZ(vol_out); k++)
+	for (long int i = STARTINGY(vol_out); i <= FINISHINGY(vol_out); i++)
 	{
-
-		RFLOAT r = sqrt((RFLOAT)(k*k+i*i+j*j));
-		RFLOAT rval = r / (ori_size * padding_factor);
-		A3D_ELEM(vol_out, k, i, j) /= tab_ftblob(rval) / normftblob;
-		//if (k==0 && i==0)
-		//	std::cerr << " j= " << j << " rval= " << rval << " tab_ftblob(rval) / normftblob= " << tab_ftblob(rval) / normftblob << std::endl;
+		// Look up the whole row at once
+		for (long int j = STARTINGX(vol_out); j <= FINISHINGX(vol_out); j++)
+		{
+			RFLOAT r = sqrt((RFLOAT)(k*k+i*i+j*j));
+			row_rval[j - STARTINGX(vol_out)] = r / (ori_size * padding_factor);
+		}
+		tab_ftblob(row_rval.data(), row_ftblob.data(), XSIZE(vol_out));
+		for (long int j = STARTINGX(vol_out); j <= FINISHINGX(vol_out); j++)
+			A3D_ELEM(vol_out, k, i, j) /= row_ftblob[j - STARTINGX(vol_out)] / normftblob;
 	}
 	RCTOC(ReconTimer,ReconS_16);
 
@@ -2321,6 +2351,140 @@ void BackProjector::applyHelicalSymmetry(int nr_helical_asu, RFLOAT helical_twis
 	weight = sum_weight;
 }
 
+// Where the voxel (x,y,z) falls in the data array after rotation by R: the offset of the (z0,y0,x0) corner and the interpolation fractions
+static inline void getSymmetryStencilEntry(const Matrix2D<RFLOAT> &R, RFLOAT x, RFLOAT y, RFLOAT z,
+		long int yinit, long int zinit, long int xdim, long int yxdim,
+		long int &offset, RFLOAT &fx, RFLOAT &fy, RFLOAT &fz, bool &is_neg_x)
+{
+	// coords_output(x,y) = A * coords_input (xp,yp)
+	RFLOAT xp = x * R(0, 0) + y * R(0, 1) + z * R(0, 2);
+	RFLOAT yp = x * R(1, 0) + y * R(1, 1) + z * R(1, 2);
+	RFLOAT zp = x * R(2, 0) + y * R(2, 1) + z * R(2, 2);
+
+	// Only asymmetric half is stored
+	if (xp < 0)
+	{
+		// Get complex conjugated hermitian symmetry pair
+		xp = -xp;
+		yp = -yp;
+		zp = -zp;
+		is_neg_x = true;
+	}
+	else
+	{
+		is_neg_x = false;
+	}
+
+	// Trilinear interpolation (with physical coords)
+	// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
+	int x0 = FLOOR(xp);
+	fx = xp - x0;
+
+	int y0 = FLOOR(yp);
+	fy = yp - y0;
+	y0 -= yinit;
+
+	int z0 = FLOOR(zp);
+	fz = zp - z0;
+	z0 -= zinit;
+
+	offset = z0 * yxdim + y0 * xdim + x0;
+}
+
+// Trilinear interpolation from the (z0,y0,x0) corner at ptr
+template <typename T>
+static inline T interpolateSymmetryStencil(const T *ptr, long int xdim, long int yxdim, RFLOAT fx, RFLOAT fy, RFLOAT fz)
+{
+	T dx00 = LIN_INTERP(fx, ptr[0], ptr[1]);
+	T dx01 = LIN_INTERP(fx, ptr[yxdim], ptr[yxdim + 1]);
+	T dx10 = LIN_INTERP(fx, ptr[xdim], ptr[xdim + 1]);
+	T dx11 = LIN_INTERP(fx, ptr[yxdim + xdim], ptr[yxdim + xdim + 1]);
+
+	T dxy0 = LIN_INTERP(fy, dx00, dx10);
+	T dxy1 = LIN_INTERP(fy, dx01, dx11);
+
+	return LIN_INTERP(fz, dxy0, dxy1);
+}
+
+const SymmetryStencil* BackProjector::getSymmetryStencil(int rmax2, const std::vector<Matrix2D<RFLOAT> > &R, int threads)
+{
+	std::vector<RFLOAT> matrices;
+	for (int isym = 0; isym < R.size(); isym++)
+		for (int ii = 0; ii < 3; ii++)
+			for (int jj = 0; jj < 3; jj++)
+				matrices.push_back(R[isym](ii, jj));
+
+	if (!sym_stencil)
+		sym_stencil = std::make_shared<SymmetryStencil>();
+	SymmetryStencil &stencil = *sym_stencil;
+
+	if (stencil.isValid(data, rmax2, matrices))
+		return &stencil;
+
+	stencil.clear();
+
+	const int nr_sym = R.size();
+	const long int xdim = XSIZE(data), yxdim = YXSIZE(data), nr_rows = ZSIZE(data) * YSIZE(data);
+
+	// The offsets (and the last corner of the stencil) should fit in an int
+	if (symmetry_stencil_max_mb <= 0 || MULTIDIM_SIZE(data) + yxdim + xdim + 1 > INT_MAX)
+		return NULL;
+
+	// Voxels inside r_max are contiguous from x=0 in each row
+	std::vector<long int> row_start(nr_rows + 1);
+	row_start[0] = 0;
+	for (long int row = 0; row < nr_rows; row++)
+	{
+		long int k = STARTINGZ(data) + row / YSIZE(data);
+		long int i = STARTINGY(data) + row % YSIZE(data);
+		long int j = 0;
+		while (j < xdim && k*k + i*i + j*j <= rmax2)
+			j++;
+		row_start[row + 1] = row_start[row] + j * nr_sym;
+	}
+
+	const RFLOAT entry_size = sizeof(int) + sizeof(SymmetryStencil::Fractions);
+	if ((RFLOAT)row_start[nr_rows] * entry_size > symmetry_stencil_max_mb * 1024. * 1024.)
+		return NULL;
+
+	stencil.offsets.resize(row_start[nr_rows]);
+	stencil.fractions.resize(row_start[nr_rows]);
+
+	#pragma omp parallel for num_threads(threads)
+	for (long int row = 0; row < nr_rows; row++)
+	{
+		long int k = STARTINGZ(data) + row / YSIZE(data);
+		long int i = STARTINGY(data) + row % YSIZE(data);
+		long int ientry = row_start[row];
+		for (long int j = 0; j < (row_start[row + 1] - row_start[row]) / nr_sym; j++)
+		{
+			for (int isym = 0; isym < nr_sym; isym++, ientry++)
+			{
+				long int offset;
+				RFLOAT fx, fy, fz;
+				bool is_neg_x;
+				getSymmetryStencilEntry(R[isym], j, i, k, STARTINGY(data), STARTINGZ(data), xdim, yxdim,
+						offset, fx, fy, fz, is_neg_x);
+				stencil.offsets[ientry] = (is_neg_x) ? -offset - 1 : offset;
+				stencil.fractions[ientry].fx = SymmetryStencil::quantiseFraction(fx);
+				stencil.fractions[ientry].fy = SymmetryStencil::quantiseFraction(fy);
+				stencil.fractions[ientry].fz = SymmetryStencil::quantiseFraction(fz);
+			}
+		}
+	}
+
+	stencil.row_start.swap(row_start);
+	stencil.xdim = XSIZE(data);
+	stencil.ydim = YSIZE(data);
+	stencil.zdim = ZSIZE(data);
+	stencil.yinit = STARTINGY(data);
+	stencil.zinit = STARTINGZ(data);
+	stencil.rmax2 = rmax2;
+	stencil.matrices.swap(matrices);
+
+	return &stencil;
+}
+
 void BackProjector::applyPointGroupSymmetry(int threads)
 {
 
@@ -2333,137 +2497,93 @@ void BackProjector::applyPointGroupSymmetry(int threads)
 	int rmax2 = ROUND(r_max * padding_factor) * ROUND(r_max * padding_factor);
 	if (SL.SymsNo() > 0 && ref_dim == 3)
 	{
-		Matrix2D<RFLOAT> L(4, 4), R(4, 4); // A matrix from the list
+		const int nr_sym = SL.SymsNo();
+		Matrix2D<RFLOAT> L(4, 4);
+		std::vector<Matrix2D<RFLOAT> > R(nr_sym, Matrix2D<RFLOAT>(4, 4)); // The matrices from the list
+		for (int isym = 0; isym < nr_sym; isym++)
+		{
+			SL.get_matrices(isym, L, R[isym]);
+#ifdef DEBUG_SYMM
+			std::cerr << " isym= " << isym << " R= " << R[isym] << std::endl;
+#endif
+		}
+
+		// Precalculated stencils, or NULL if these would take too much memory
+		const SymmetryStencil *stencil = getSymmetryStencil(rmax2, R, threads);
+
 		MultidimArray<RFLOAT> sum_weight;
 		MultidimArray<Complex > sum_data;
 
 		// First symmetry operator (not stored in SL) is the identity matrix
 		sum_weight = weight;
 		sum_data = data;
-		// Loop over all other symmetry operators
-		for (int isym = 0; isym < SL.SymsNo(); isym++)
-		{
-			SL.get_matrices(isym, L, R);
-#ifdef DEBUG_SYMM
-			std::cerr << " isym= " << isym << " R= " << R << std::endl;
-#endif
-			// Loop over all points in the output (i.e. rotated, or summed) array
 
-			#pragma omp parallel for num_threads(threads)
-			for (long int k=STARTINGZ(sum_weight); k<=FINISHINGZ(sum_weight); k++)
-			for (long int i=STARTINGY(sum_weight); i<=FINISHINGY(sum_weight); i++)
-			for (long int j=STARTINGX(sum_weight); j<=FINISHINGX(sum_weight); j++)
+		const long int xdim = XSIZE(data), yxdim = YXSIZE(data), nr_rows = ZSIZE(data) * YSIZE(data);
+
+		// Loop over all points in the output (i.e. rotated, or summed) array, and sum all other symmetry operators for each
+		#pragma omp parallel for num_threads(threads) schedule(dynamic)
+		for (long int row = 0; row < nr_rows; row++)
+		{
+			long int k = STARTINGZ(sum_weight) + row / YSIZE(sum_weight);
+			long int i = STARTINGY(sum_weight) + row % YSIZE(sum_weight);
+			Complex *out_data = &A3D_ELEM(sum_data, k, i, 0); // STARTINGX(sum_weight) is zero!
+			RFLOAT *out_weight = &A3D_ELEM(sum_weight, k, i, 0);
+			const int *entry_offset = (stencil != NULL) ? &stencil->offsets[stencil->row_start[row]] : NULL;
+			const SymmetryStencil::Fractions *entry_fractions = (stencil != NULL) ? &stencil->fractions[stencil->row_start[row]] : NULL;
+
+			for (long int j = 0; j < xdim && k*k + i*i + j*j <= rmax2; j++)
 			{
-	        	RFLOAT x = (RFLOAT)j; // STARTINGX(sum_weight) is zero!
-	        	RFLOAT y = (RFLOAT)i;
-	        	RFLOAT z = (RFLOAT)k;
-	        	RFLOAT r2 = x*x + y*y + z*z;
-
-	        	if (r2 <= rmax2)
-	        	{
-	        		// coords_output(x,y) = A * coords_input (xp,yp)
-					RFLOAT xp = x * R(0, 0) + y * R(0, 1) + z * R(0, 2);
-					RFLOAT yp = x * R(1, 0) + y * R(1, 1) + z * R(1, 2);
-					RFLOAT zp = x * R(2, 0) + y * R(2, 1) + z * R(2, 2);
+				Complex sum_d = out_data[j];
+				RFLOAT sum_w = out_weight[j];
 
+				for (int isym = 0; isym < nr_sym; isym++)
+				{
+					long int offset;
+					RFLOAT fx, fy, fz;
 					bool is_neg_x;
-
-					// Only asymmetric half is stored
-					if (xp < 0)
+					if (entry_offset != NULL)
 					{
-						// Get complex conjugated hermitian symmetry pair
-						xp = -xp;
-						yp = -yp;
-						zp = -zp;
-						is_neg_x = true;
+						is_neg_x = (*entry_offset < 0);
+						offset = (is_neg_x) ? -(long int)*entry_offset - 1 : *entry_offset;
+						fx = SymmetryStencil::fraction(entry_fractions->fx);
+						fy = SymmetryStencil::fraction(entry_fractions->fy);
+						fz = SymmetryStencil::fraction(entry_fractions->fz);
+						entry_offset++;
+						entry_fractions++;
 					}
 					else
 					{
-						is_neg_x = false;
+						getSymmetryStencilEntry(R[isym], j, i, k, STARTINGY(data), STARTINGZ(data), xdim, yxdim,
+								offset, fx, fy, fz, is_neg_x);
 					}
 
-					// Trilinear interpolation (with physical coords)
-					// Subtract STARTINGY and STARTINGZ to accelerate access to data (STARTINGX=0)
-					// In that way use DIRECT_A3D_ELEM, rather than A3D_ELEM
-					int x0 = FLOOR(xp);
-					RFLOAT fx = xp - x0;
-					int x1 = x0 + 1;
-
-					int y0 = FLOOR(yp);
-					RFLOAT fy = yp - y0;
-					y0 -=  STARTINGY(data);
-					int y1 = y0 + 1;
-
-					int z0 = FLOOR(zp);
-					RFLOAT fz = zp - z0;
-					z0 -= STARTINGZ(data);
-					int z1 = z0 + 1;
-
 #ifdef CHECK_SIZE
-					if (x0 < 0 || y0 < 0 || z0 < 0 ||
-						x1 < 0 || y1 < 0 || z1 < 0 ||
-						x0 >= XSIZE(data) || y0  >= YSIZE(data) || z0 >= ZSIZE(data) ||
-						x1 >= XSIZE(data) || y1  >= YSIZE(data)  || z1 >= ZSIZE(data) 	)
+					if (offset < 0 || offset + yxdim + xdim + 1 >= MULTIDIM_SIZE(data))
 					{
-						std::cerr << " x0= " << x0 << " y0= " << y0 << " z0= " << z0 << std::endl;
-						std::cerr << " x1= " << x1 << " y1= " << y1 << " z1= " << z1 << std::endl;
+						std::cerr << " k= " << k << " i= " << i << " j= " << j << " offset= " << offset << std::endl;
 						data.printShape();
 						REPORT_ERROR("BackProjector::applyPointGroupSymmetry: checksize!!!");
 					}
 #endif
 					// First interpolate (complex) data
-					Complex d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
-					Complex d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
-					Complex d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
-					Complex d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
-					Complex d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
-					Complex d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
-					Complex d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
-					Complex d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
-
-					Complex dx00 = LIN_INTERP(fx, d000, d001);
-					Complex dx01 = LIN_INTERP(fx, d100, d101);
-					Complex dx10 = LIN_INTERP(fx, d010, d011);
-					Complex dx11 = LIN_INTERP(fx, d110, d111);
-
-					Complex dxy0 = LIN_INTERP(fy, dx00, dx10);
-					Complex dxy1 = LIN_INTERP(fy, dx01, dx11);
+					Complex ddd = interpolateSymmetryStencil(MULTIDIM_ARRAY(data) + offset, xdim, yxdim, fx, fy, fz);
 
 					// Take complex conjugated for half with negative x
 					if (is_neg_x)
-					{
-						A3D_ELEM(sum_data, k, i, j) += conj(LIN_INTERP(fz, dxy0, dxy1));
-					}
+						sum_d += conj(ddd);
 					else
-					{
-						A3D_ELEM(sum_data, k, i, j) += LIN_INTERP(fz, dxy0, dxy1);
-					}
+						sum_d += ddd;
 
 					// Then interpolate (real) weight
-					RFLOAT dd000 = DIRECT_A3D_ELEM(weight, z0, y0, x0);
-					RFLOAT dd001 = DIRECT_A3D_ELEM(weight, z0, y0, x1);
-					RFLOAT dd010 = DIRECT_A3D_ELEM(weight, z0, y1, x0);
-					RFLOAT dd011 = DIRECT_A3D_ELEM(weight, z0, y1, x1);
-					RFLOAT dd100 = DIRECT_A3D_ELEM(weight, z1, y0, x0);
-					RFLOAT dd101 = DIRECT_A3D_ELEM(weight, z1, y0, x1);
-					RFLOAT dd110 = DIRECT_A3D_ELEM(weight, z1, y1, x0);
-					RFLOAT dd111 = DIRECT_A3D_ELEM(weight, z1, y1, x1);
-
-					RFLOAT ddx00 = LIN_INTERP(fx, dd000, dd001);
-					RFLOAT ddx01 = LIN_INTERP(fx, dd100, dd101);
-					RFLOAT ddx10 = LIN_INTERP(fx, dd010, dd011);
-					RFLOAT ddx11 = LIN_INTERP(fx, dd110, dd111);
-
-					RFLOAT ddxy0 = LIN_INTERP(fy, ddx00, ddx10);
-					RFLOAT ddxy1 = LIN_INTERP(fy, ddx01, ddx11);
-
-					A3D_ELEM(sum_weight, k, i, j) += LIN_INTERP(fz, ddxy0, ddxy1);
+					sum_w += interpolateSymmetryStencil(MULTIDIM_ARRAY(weight) + offset, xdim, yxdim, fx, fy, fz);
+				}
 
-	        	} // end if r2 <= rmax2
+				out_data[j] = sum_d;
+				out_weight[j] = sum_w;
 
-	        } // end loop over all elements of sum_weight
+			} // end loop over the voxels inside r_max in this row
 
-	    } // end loop over symmetry operators
+		} // end loop over all rows of sum_weight
 
 	    data = sum_data;
 	    weight = sum_weight;
@@ -2482,11 +2602,17 @@ void BackProjector::applyPointGroupSymmetry(int threads)
 
 void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool do_mask)
 {
-
 	MultidimArray<RFLOAT> Mconv;
+	convoluteBlobRealSpace(transformer, Mconv, do_mask);
+}
+
+void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, MultidimArray<RFLOAT> &Mconv, bool do_mask)
+{
+
 	int padhdim = pad_size / 2;
 
 	// Set up right dimension of real-space array
+	// This keeps the memory (and thereby the FFTW plans) if Mconv already has the right size
 	// TODO: resize this according to r_max!!!
 	if (ref_dim==2)
 		Mconv.reshape(pad_size, pad_size);
@@ -2506,21 +2632,29 @@ void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool
 	//blob.radius = 1.9 * padding_factor;
 	//blob.alpha = 15;
 
+	// Tabulate the (normalised) FT of the blob kernel as a function of the squared radius,
+	// to avoid a square root and a table lookup for every voxel
+	// In the final reconstruction: mask the real-space map beyond its original size to prevent aliasing ghosts
+	// Note that rval goes until 1/2 in the oversampled map
+	std::vector<RFLOAT> rval_r2(ref_dim * (padhdim + 1) * (padhdim + 1) + 1), ftblob_r2(rval_r2.size());
+	for (int r2 = 0; r2 < rval_r2.size(); r2++)
+		rval_r2[r2] = sqrt((RFLOAT)r2) / (ori_size * padding_factor);
+	tab_ftblob(rval_r2.data(), ftblob_r2.data(), rval_r2.size());
+	for (int r2 = 0; r2 < rval_r2.size(); r2++)
+	{
+		if (do_mask && rval_r2[r2] > 1./(2. * padding_factor))
+			ftblob_r2[r2] = 0.;
+		else
+			ftblob_r2[r2] /= normftblob;
+	}
+
     // Multiply with FT of the blob kernel
 	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Mconv)
     {
 		int kp = (k < padhdim) ? k : k - pad_size;
 		int ip = (i < padhdim) ? i : i - pad_size;
 		int jp = (j < padhdim) ? j : j - pad_size;
-    	RFLOAT rval = sqrt ( (RFLOAT)(kp * kp + ip * ip + jp * jp) ) / (ori_size * padding_factor);
-    	//if (kp==0 && ip==0 && jp > 0)
-		//	std::cerr << " jp= " << jp << " rval= " << rval << " tab_ftblob(rval) / normftblob= " << tab_ftblob(rval) / normftblob << " ori_size/2= " << ori_size/2 << std::endl;
-    	// In the final reconstruction: mask the real-space map beyond its original size to prevent aliasing ghosts
-    	// Note that rval goes until 1/2 in the oversampled map
-    	if (do_mask && rval > 1./(2. * padding_factor))
-    		DIRECT_A3D_ELEM(Mconv, k, i, j) = 0.;
-    	else
-    		DIRECT_A3D_ELEM(Mconv, k, i, j) *= (tab_ftblob(rval) / normftblob);
+		DIRECT_A3D_ELEM(Mconv, k, i, j) *= ftblob_r2[kp * kp + ip * ip + jp * jp];
     }
 
     // forward FFT to go back to Fourier-space
@@ -421,7 +421,20 @@ void CTF::getFftwImage(MultidimArray<RFLOAT> &result, int orixdim, int oriydim,
 				                 << angpix << " is not consistent with that in the optics group table "
 				                 << obsModel->getPixelSize(opticsGroup) << "\n");
 			}
+		}
 
+		// Geometry-dependent terms are cached per optics group in the observation model,
+		// only for its own box size to keep the cache small (e.g. not for the padded CTFs above)
+		if (obsModel != 0 && orixdim == oriydim && obsModel->hasBoxSizes
+		    && obsModel->getBoxSize(opticsGroup) == orixdim
+		    && obsModel->getPixelSize(opticsGroup) == angpix
+		    && YSIZE(result) == oriydim && XSIZE(result) == orixdim/2 + 1)
+		{
+			getFftwImage(result, obsModel->getCtfGeometry(opticsGroup, orixdim),
+			             do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping, do_intact_after_first_peak);
+		}
+		else if (obsModel != 0 && obsModel->hasEvenZernike)
+		{
 			const BufferedImage<RFLOAT>& gammaOffset = obsModel->getGammaOffset(opticsGroup, oriydim);
 
 			for (int y1 = 0; y1 < result.ydim; y1++)
@@ -453,6 +466,81 @@ void CTF::getFftwImage(MultidimArray<RFLOAT> &result, int orixdim, int oriydim,
 	}
 }
 
+void CTF::getFftwImage(MultidimArray<RFLOAT> &result, const CtfGeometry &geom,
+                       bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak,
+                       bool do_damping, bool do_intact_after_first_peak) const
+{
+	result.resize(geom.oriydim, geom.orixdim/2 + 1);
+
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(result)
+	{
+		const RFLOAT X = DIRECT_MULTIDIM_ELEM(geom.X, n);
+		const RFLOAT Y = DIRECT_MULTIDIM_ELEM(geom.Y, n);
+		const RFLOAT gammaOffset = geom.hasOffset? DIRECT_MULTIDIM_ELEM(geom.gammaOffset, n) : 0.0;
+
+		RFLOAT u2 = X * X + Y * Y;
+		RFLOAT u4 = u2 * u2;
+
+		RFLOAT gamma = K1 * (Axx*X*X + 2.0*Axy*X*Y + Ayy*Y*Y) + K2 * u4 - K5 - K3 + gammaOffset;
+
+		DIRECT_MULTIDIM_ELEM(result, n) = getCTFFromGamma(gamma, u2, do_abs, do_only_flip_phases,
+		                                                  do_intact_until_first_peak, do_damping, do_intact_after_first_peak);
+	}
+}
+
+void CTF::getFftwImages(const std::vector<CTF> &ctfs, std::vector<MultidimArray<RFLOAT> > &results,
+                        int orixdim, int oriydim, RFLOAT angpix,
+                        bool do_abs, bool do_only_flip_phases, bool do_intact_until_first_peak,
+                        bool do_damping, bool do_intact_after_first_peak, int nr_threads)
+{
+	results.resize(ctfs.size());
+	// CTFs with an observation model use its cache, the others share this one
+	CtfGeometry plain;
+	for (int i = 0; i < ctfs.size(); i++)
+	{
+		if (ctfs[i].obsModel == 0)
+		{
+			plain.initialise(orixdim, oriydim, angpix);
+			break;
+		}
+	}
+
+	int nr_errors = 0;
+	std::string error_message;
+
+	#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+	for (int i = 0; i < ctfs.size(); i++)
+	{
+		int my_nr_errors;
+		#pragma omp atomic read
+		my_nr_errors = nr_errors;
+		if (my_nr_errors > 0)
+			continue;
+
+		try
+		{
+			results[i].resize(oriydim, orixdim/2 + 1);
+			if (ctfs[i].obsModel == 0)
+				ctfs[i].getFftwImage(results[i], plain, do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping, do_intact_after_first_peak);
+			else
+				ctfs[i].getFftwImage(results[i], orixdim, oriydim, angpix, do_abs, do_only_flip_phases, do_intact_until_first_peak, do_damping, false, do_intact_after_first_peak);
+		}
+		catch (RelionError &e)
+		{
+			#pragma omp critical(CTF_getFftwImages_error)
+			{
+				if (nr_errors == 0)
+					error_message = e.msg;
+			}
+			#pragma omp atomic
+			nr_errors++;
+		}
+	}
+
+	if (nr_errors > 0)
+		REPORT_ERROR(error_message);
+}
+
 /* Generate a complete CTFP (complex) image (with sector along angle) ------------------------------------------------------ */
 void CTF::getCTFPImage(MultidimArray<Complex> &result, int orixdim, int oriydim, RFLOAT angpix,
                        bool is_positive, float angle)
@@ -204,6 +204,16 @@ public:
 		//RFLOAT gamma = K1 * deltaf * u2 + K2 * u4 - K5 - K3 + gammaOffset;
 		RFLOAT gamma = K1 * (Axx*X*X + 2.0*Axy*X*Y + Ayy*Y*Y) + K2 * u4 - K5 - K3 + gammaOffset;
 
+		return getCTFFromGamma(gamma, u2, do_abs, do_only_flip_phases,
+		                       do_intact_until_first_peak, do_damping, do_intact_after_first_peak);
+	}
+
+	// The part of getCTF() that follows the phase gamma at squared frequency u2
+	inline RFLOAT getCTFFromGamma(RFLOAT gamma, RFLOAT u2,
+	                              bool do_abs, bool do_only_flip_phases,
+	                              bool do_intact_until_first_peak, bool do_damping,
+	                              bool do_intact_after_first_peak) const
+	{
 		RFLOAT retval;
 
 		if ((do_intact_until_first_peak && ABS(gamma) < PI/2.) ||
@@ -326,6 +336,20 @@ public:
 	                  bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false,
 	                  bool do_damping = true, bool do_ctf_padding = false, bool do_intact_after_first_peak = false) const;
 
+	/// As above, but with the geometry-dependent terms precomputed (e.g. by ObservationModel::getCtfGeometry()).
+	/// The result is resized to geom.oriydim x geom.orixdim/2+1; the values are identical to those of getCTF().
+	/// The magnification matrix and the symmetric aberrations are taken from geom, not from the observation model.
+	void getFftwImage(MultidimArray < RFLOAT > &result, const CtfGeometry &geom,
+	                  bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false,
+	                  bool do_damping = true, bool do_intact_after_first_peak = false) const;
+
+	/// Batch version of getFftwImage() for many particles of the same image size and pixel size.
+	/// The geometry is looked up (or computed) once per optics group and shared between all CTFs.
+	static void getFftwImages(const std::vector<CTF> &ctfs, std::vector<MultidimArray<RFLOAT> > &results,
+	                          int orixdim, int oriydim, RFLOAT angpix,
+	                          bool do_abs = false, bool do_only_flip_phases = false, bool do_intact_until_first_peak = false,
+	                          bool do_damping = true, bool do_intact_after_first_peak = false, int nr_threads = 1);
+
 	// Get a complex image with the CTFP/Q values, where the angle is in degrees between the Y-axis and the CTFP/Q sector line
 	void getCTFPImage(MultidimArray<Complex> &result, int orixdim, int oriydim, RFLOAT angpix,
 	                  bool is_positive, float angle);
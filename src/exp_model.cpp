@@ -1198,7 +1198,7 @@ bool Experiment::read(FileName fn_exp, FileName fn_tomo, FileName fn_motion,
 }
 
 // Write to file
-void Experiment::write(FileName fn_out, bool remove_offset_priors)
+void Experiment::write(FileName fn_out, bool remove_offset_priors, int nr_threads)
 {
     std::ofstream ofs(fn_out);
 
@@ -1214,7 +1214,7 @@ void Experiment::write(FileName fn_out, bool remove_offset_priors)
         if (MDimg.containsLabel(EMDL_ORIENT_ORIGIN_Z_PRIOR_ANGSTROM))
             MDimg.deactivateLabel(EMDL_ORIENT_ORIGIN_Z_PRIOR_ANGSTROM);
     }
-    MDimg.write(ofs);
+    MDimg.write(ofs, nr_threads);
 
     if (nr_bodies > 1)
     {
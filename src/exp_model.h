@@ -387,7 +387,7 @@ public:
         bool set_offset_priors_to_offsets = false, int verb = 0);
 
 	// Write
-	void write(FileName fn_root, bool remove_offset_priors = false);
+	void write(FileName fn_root, bool remove_offset_priors = false, int nr_threads = 1);
 
 
 private:
@@ -786,6 +786,11 @@ void shiftImageInFourierTransformWithTabSincos(MultidimArray<Complex > &in,
 	case 3: out.initZeros(newdim, newdim, newhdim); break;
 	default: REPORT_ERROR("shiftImageInFourierTransformWithTabSincos ERROR: dimension should be 2 or 3!");
 	}
+	// This is called for every particle and translation: keep the row buffers of each thread between calls
+	static thread_local std::vector<RFLOAT> row_dotp, row_cos, row_sin;
+	row_dotp.resize(XSIZE(out));
+	row_cos.resize(XSIZE(out));
+	row_sin.resize(XSIZE(out));
 
 	if (in.getDim() == 2)
 	{
@@ -797,18 +802,25 @@ void shiftImageInFourierTransformWithTabSincos(MultidimArray<Complex > &in,
 			return;
 		}
 
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(out)
+		for (long int i = 0, ip = 0 ; i<YSIZE(out); i++, ip = (i < XSIZE(out)) ? i : i - YSIZE(out))
 		{
-			dotp = twopi * (jp * xshift + ip * yshift);
+			// Look up the sines and cosines of the whole row at once
+			for (long int j = 0; j < XSIZE(out); j++)
+				row_dotp[j] = twopi * (j * xshift + ip * yshift);
+			tabcos(row_dotp.data(), row_cos.data(), XSIZE(out));
+			tabsin(row_dotp.data(), row_sin.data(), XSIZE(out));
 
-			a = tabcos(dotp);
-			b = tabsin(dotp);
-			c = DIRECT_A2D_ELEM(in, i, j).real;
-			d = DIRECT_A2D_ELEM(in, i, j).imag;
-			ac = a * c;
-			bd = b * d;
-			ab_cd = (a + b) * (c + d);
-			DIRECT_A2D_ELEM(out, i, j) = Complex(ac - bd, ab_cd - ac - bd);
+			for (long int j = 0; j < XSIZE(out); j++)
+			{
+				a = row_cos[j];
+				b = row_sin[j];
+				c = DIRECT_A2D_ELEM(in, i, j).real;
+				d = DIRECT_A2D_ELEM(in, i, j).imag;
+				ac = a * c;
+				bd = b * d;
+				ab_cd = (a + b) * (c + d);
+				DIRECT_A2D_ELEM(out, i, j) = Complex(ac - bd, ab_cd - ac - bd);
+			}
 		}
 	}
 	else if (in.getDim() == 3)
@@ -822,18 +834,26 @@ void shiftImageInFourierTransformWithTabSincos(MultidimArray<Complex > &in,
 			return;
 		}
 
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(out)
+		for (long int k = 0, kp = 0; k<ZSIZE(out); k++, kp = (k < XSIZE(out)) ? k : k - ZSIZE(out))
+		for (long int i = 0, ip = 0 ; i<YSIZE(out); i++, ip = (i < XSIZE(out)) ? i : i - YSIZE(out))
 		{
-			dotp = twopi * (jp * xshift + ip * yshift + kp * zshift);
+			// Look up the sines and cosines of the whole row at once
+			for (long int j = 0; j < XSIZE(out); j++)
+				row_dotp[j] = twopi * (j * xshift + ip * yshift + kp * zshift);
+			tabcos(row_dotp.data(), row_cos.data(), XSIZE(out));
+			tabsin(row_dotp.data(), row_sin.data(), XSIZE(out));
 
-			a = tabcos(dotp);
-			b = tabsin(dotp);
-			c = DIRECT_A3D_ELEM(in, k, i, j).real;
-			d = DIRECT_A3D_ELEM(in, k, i, j).imag;
-			ac = a * c;
-			bd = b * d;
-			ab_cd = (a + b) * (c + d);
-			DIRECT_A3D_ELEM(out, k, i, j) = Complex(ac - bd, ab_cd - ac - bd);
+			for (long int j = 0; j < XSIZE(out); j++)
+			{
+				a = row_cos[j];
+				b = row_sin[j];
+				c = DIRECT_A3D_ELEM(in, k, i, j).real;
+				d = DIRECT_A3D_ELEM(in, k, i, j).imag;
+				ac = a * c;
+				bd = b * d;
+				ab_cd = (a + b) * (c + d);
+				DIRECT_A3D_ELEM(out, k, i, j) = Complex(ac - bd, ab_cd - ac - bd);
+			}
 		}
 	}
 }
@@ -1218,6 +1238,26 @@ void resizeMap(MultidimArray<RFLOAT > &img, int newsize)
 
 }
 
+void MapResizer::resize(MultidimArray<RFLOAT> &img, int newsize)
+{
+	if (!in.sameShape(img))
+		in.resize(img);
+	memcpy(MULTIDIM_ARRAY(in), MULTIDIM_ARRAY(img), MULTIDIM_SIZE(img) * sizeof(RFLOAT));
+
+	MultidimArray<Complex > FT, FT2;
+	forward.FourierTransform(in, FT, false);
+	windowFourierTransform(FT, FT2, newsize);
+
+	if (img.getDim() == 2)
+		out.resize(newsize, newsize);
+	else if (img.getDim() == 3)
+		out.resize(newsize, newsize, newsize);
+	backward.inverseFourierTransform(FT2, out);
+
+	img.resize(out);
+	memcpy(MULTIDIM_ARRAY(img), MULTIDIM_ARRAY(out), MULTIDIM_SIZE(out) * sizeof(RFLOAT));
+}
+
 void applyBFactorToMap(MultidimArray<Complex > &FT, int ori_size, RFLOAT bfactor, RFLOAT angpix)
 {
 	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(FT)
@@ -1052,6 +1052,18 @@ RFLOAT getKullbackLeiblerDivergence(MultidimArray<Complex> &Fimg,
 // Resize a map by windowing it's Fourier Transform
 void resizeMap(MultidimArray<RFLOAT> &img, int newsize);
 
+// As resizeMap(), but for many maps of the same size: the FFTW plans are made once
+// and reused, since they are tied to the internal arrays. Use one per thread.
+class MapResizer
+{
+public:
+	void resize(MultidimArray<RFLOAT> &img, int newsize);
+
+private:
+	FourierTransformer forward, backward;
+	MultidimArray<RFLOAT> in, out;
+};
+
 // Apply a B-factor to a map (given it's Fourier transform)
 void applyBFactorToMap(MultidimArray<Complex> &FT, int ori_size, RFLOAT bfactor, RFLOAT angpix);
 
@@ -514,8 +514,9 @@ public:
 	 * file name takes precedence over select_img
 	 * If -1 is given the whole object is read
 	 * The number before @ in the filename is 1-indexed, while select_img is 0-indexed.
+	 * nr_threads is used only for decompressing TIFF files.
 	 */
-	int read(const FileName &name, bool readdata=true, long int select_img=-1, bool mapData = false, bool is_2D = false)
+	int read(const FileName &name, bool readdata=true, long int select_img=-1, bool mapData = false, bool is_2D = false, int nr_threads = 1)
 	{
 
 		if (name == "")
@@ -523,7 +524,7 @@ public:
 		int err = 0;
 		fImageHandler hFile;
 		hFile.openFile(name);
-		err = _read(name, hFile, readdata, select_img, mapData, is_2D);
+		err = _read(name, hFile, readdata, select_img, mapData, is_2D, nr_threads);
 		// the destructor of fImageHandler will close the file
 
 		// Negative errors are bad
@@ -1385,7 +1386,7 @@ public:
 
 private:
 	int _read(const FileName &name, fImageHandler &hFile, bool readdata=true, long int select_img = -1,
-			  bool mapData = false, bool is_2D = false)
+			  bool mapData = false, bool is_2D = false, int nr_threads = 1)
 	{
 		int err = 0;
 
@@ -1433,7 +1434,7 @@ private:
 				ext_name.contains("st")) //stk stack MUST go BEFORE plain st
 			err = readMRC(select_img, true, name);
 		else if (ext_name.contains("tif"))
-			err = readTIFF(hFile.ftiff, select_img, readdata, true, name);
+			err = readTIFF(hFile.ftiff, select_img, readdata, true, name, nr_threads);
 		else if (select_img >= 0 && ext_name.contains("mrc"))
 			REPORT_ERROR("Image::read ERROR: stacks of images in MRC-format should have extension .mrcs; .mrc extensions are reserved for 3D maps.");
 		else if (ext_name.contains("mrc") || ext_name.contains("map")) // mrc 3D map
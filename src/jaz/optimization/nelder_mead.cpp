@@ -28,7 +28,7 @@ std::vector<double> NelderMead::optimize(
 		const Optimization& opt,
 		double initialStep, double tolerance, long maxIters,
 		double alpha, double gamma, double rho, double sigma,
-		bool verbose, double* minCost)
+		bool verbose, double* minCost, long patience)
 {
 	const double n = initial.size();
 	const double m = initial.size() + 1;
@@ -51,10 +51,10 @@ std::vector<double> NelderMead::optimize(
 	void* tempStorage = opt.allocateTempStorage();
 
 	// compute values
-	for (int j = 0; j < m; j++)
-	{
-		values[j] = opt.f(simplex[j], tempStorage);
-	}
+	opt.fBatch(simplex, values, tempStorage);
+
+	double bestValue = 0.0;
+	long stalled = 0;
 
 	for (long i = 0; i < maxIters; i++)
 	{
@@ -66,6 +66,20 @@ std::vector<double> NelderMead::optimize(
 			opt.report(i, values[order[0]], simplex[order[0]]);
 		}
 
+		if (patience > 0)
+		{
+			if (i == 0 || values[order[0]] < bestValue)
+			{
+				bestValue = values[order[0]];
+				stalled = 0;
+			}
+			else if (++stalled >= patience)
+			{
+				if (verbose) std::cout << "no improvement in " << patience << " iterations - stopping." << std::endl;
+				break;
+			}
+		}
+
 		for (int j = 0; j < m; j++)
 		{
 			nextSimplex[j] = simplex[order[j]];
@@ -172,6 +186,8 @@ std::vector<double> NelderMead::optimize(
 		}
 
 		// shrink
+		std::vector<std::vector<double>> shrunk(m-1);
+
 		for (int j = 1; j < m; j++)
 		{
 			for (int k = 0; k < n; k++)
@@ -179,7 +195,15 @@ std::vector<double> NelderMead::optimize(
 				simplex[j][k] = (1.0 - sigma) * simplex[0][k] + sigma * simplex[j][k];
 			}
 
-			values[j] = opt.f(simplex[j], tempStorage);
+			shrunk[j-1] = simplex[j];
+		}
+
+		std::vector<double> shrunkValues;
+		opt.fBatch(shrunk, shrunkValues, tempStorage);
+
+		for (int j = 1; j < m; j++)
+		{
+			values[j] = shrunkValues[j-1];
 		}
 	}
 
@@ -28,13 +28,17 @@ class NelderMead
 {
     public:
 
+        // The initial simplex and shrunk simplices are evaluated through Optimization::fBatch().
+        // With patience > 0, the search stops once the best cost has not improved
+        // for that many iterations.
         static std::vector<double> optimize(
                 const std::vector<double>& initial,
                 const Optimization& opt,
                 double initialStep, double tolerance, long maxIters,
                 double alpha = 1.0, double gamma = 2.0,
                 double rho = 0.5, double sigma = 0.5,
-                bool verbose = false, double* minCost = 0);
+                bool verbose = false, double* minCost = 0,
+                long patience = 0);
 
         static void test();
 };
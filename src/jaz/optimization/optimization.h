@@ -34,6 +34,19 @@ class Optimization
 		
 		virtual double f(const std::vector<double>& x, void* tempStorage) const = 0;
 		
+		// Evaluates several points at once; problems that can evaluate
+		// independent points in parallel should override this.
+		virtual void fBatch(const std::vector<std::vector<double>>& xs, 
+		                    std::vector<double>& out, void* tempStorage) const
+		{
+			out.resize(xs.size());
+			
+			for (int i = 0; i < xs.size(); i++)
+			{
+				out[i] = f(xs[i], tempStorage);
+			}
+		}
+		
 		virtual void* allocateTempStorage() const 
 		{
 			return 0;
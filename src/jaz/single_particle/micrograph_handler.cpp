@@ -430,8 +430,6 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 				DIRECT_MULTIDIM_ELEM(defectMask, n) = true;
 	}
 	
-	BufferedImage<float> muGraph;
-	
 	RawImage<RFLOAT> gainRef_new(lastGainRef);
 	RawImage<bool> defectMask_new(defectMask);
 	
@@ -460,28 +458,51 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 		{
 			eer_grouping = micrograph.getEERGrouping();
 		}
+	}
+
+	// The movie is read and extracted in chunks of frames, so that only one chunk
+	// of full-size frames is held in memory at any time, next to the particle stacks.
+	// Compressed MRC movies can only be decompressed from the start, so they are read at once.
+	const int chunk_size = CompressedMRCReader::isCompressedMRC(movieFn)? fc :
+			(saveMem? 1 : XMIPP_MAX(1, nr_omp_threads));
+
+	std::vector<std::vector<Image<Complex>>> movie(mdt.numberOfObjects());
 
-		muGraph = MovieLoader::readEER<float>(
-			movieFn, gainRefToUse, defectMaskToUse,
-			frame0, fc,
-			eer_upsampling, eer_grouping,
-			nr_omp_threads);
+	for (long p = 0; p < movie.size(); p++)
+	{
+		movie[p] = std::vector<Image<Complex>>(fc);
 	}
-	else
+
+	for (int chunk_start = 0; chunk_start < fc; chunk_start += chunk_size)
 	{
-		muGraph = MovieLoader::readDense<float>(
-			movieFn, gainRefToUse, defectMaskToUse,
-			frame0, fc,
-			hotCutoff,
-			nr_omp_threads);
+		const int chunk_fc = XMIPP_MIN(chunk_size, fc - chunk_start);
+
+		BufferedImage<float> muGraph;
+
+		if (isEER)
+		{
+			muGraph = MovieLoader::readEER<float>(
+				movieFn, gainRefToUse, defectMaskToUse,
+				frame0 + chunk_start, chunk_fc,
+				eer_upsampling, eer_grouping,
+				nr_omp_threads);
+		}
+		else
+		{
+			muGraph = MovieLoader::readDense<float>(
+				movieFn, gainRefToUse, defectMaskToUse,
+				frame0 + chunk_start, chunk_fc,
+				hotCutoff,
+				nr_omp_threads);
+		}
+
+		SpaExtraction::extractMovieFramesFS(
+				mdt, muGraph, chunk_start, s,
+				angpix, coords_angpix, movie_angpix, data_angpix,
+				offsets_in, offsets_out, movie,
+				nr_omp_threads);
 	}
 	
-	std::vector<std::vector<Image<Complex>>> movie = SpaExtraction::extractMovieStackFS(
-			mdt, muGraph, s,
-			angpix, coords_angpix, movie_angpix, data_angpix,
-			offsets_in, offsets_out, 
-			nr_omp_threads);
-	
 	const int pc = movie.size();
 
 	if (!returnSingleFrame)
@@ -65,12 +65,14 @@ class MotionEstimator
             std::vector<gravis::d2Vector>& globComp);
 
         // perform the actual optimization (also used by MotionParamEstimator)
+        // num_threads < 0 means nr_omp_threads
         std::vector<std::vector<gravis::d2Vector>> optimize(
             const std::vector<std::vector<Image<double>>>& movieCC,
             const std::vector<std::vector<gravis::d2Vector>>& inTracks,
             double sig_vel_px, double sig_acc_px, double sig_div_px,
             const std::vector<gravis::d2Vector>& positions,
-            const std::vector<gravis::d2Vector>& globComp) const;
+            const std::vector<gravis::d2Vector>& globComp,
+            int num_threads = -1) const;
 
         // syntactic sugar for float-valued CCs
         std::vector<std::vector<gravis::d2Vector>> optimize(
@@ -78,7 +80,8 @@ class MotionEstimator
             const std::vector<std::vector<gravis::d2Vector>>& inTracks,
             double sig_vel_px, double sig_acc_px, double sig_div_px,
             const std::vector<gravis::d2Vector>& positions,
-            const std::vector<gravis::d2Vector>& globComp) const;
+            const std::vector<gravis::d2Vector>& globComp,
+            int num_threads = -1) const;
 
 	std::vector<Image<RFLOAT>> computeDamageWeights(int opticsGroup);
 		
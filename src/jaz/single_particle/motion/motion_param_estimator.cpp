@@ -60,6 +60,7 @@ void MotionParamEstimator::read(IOParser& parser, int argc, char *argv[])
     iniStep = textToDouble(parser.getOption("--in_step", "Initial step size in s_div", "3000"));
     conv = textToDouble(parser.getOption("--conv", "Abort when simplex diameter falls below this", "30"));
     maxIters = textToInteger(parser.getOption("--par_iters", "Max. number of iterations", "100"));
+    patience = textToInteger(parser.getOption("--par_patience", "Stop early if the FSC has not improved for this many iterations (0 means never)", "0"));
     maxRange = textToInteger(parser.getOption("--mot_range", "Limit allowed motion range [Px]", "50"));
     seed = textToInteger(parser.getOption("--seed", "Random seed for micrograph selection", "23"));
 
@@ -353,7 +354,7 @@ d4Vector MotionParamEstimator::estimateTwoParamsNM(
 
     std::vector<double> final = NelderMead::optimize(
             initial, thpp, inStep, conv, maxIters,
-			1.0, 2.0, 0.5, 0.5, true, &minTsc);
+			1.0, 2.0, 0.5, 0.5, true, &minTsc, patience);
 
     d2Vector vd = TwoHyperParameterProblem::problemToMotion(final);
 
@@ -374,7 +375,7 @@ d4Vector MotionParamEstimator::estimateThreeParamsNM(
 
     std::vector<double> final = NelderMead::optimize(
             initial, thpp, inStep, conv, maxIters,
-			1.0, 2.0, 0.5, 0.5, true, &minTsc);
+			1.0, 2.0, 0.5, 0.5, true, &minTsc, patience);
 
     d3Vector vd = ThreeHyperParameterProblem::problemToMotion(final);
 
@@ -399,71 +400,95 @@ void MotionParamEstimator::evaluateParams(
         sig_a_vals_px[i] = motionEstimator->normalizeSigAcc(sig_vals[i][2], reference->angpix);
     }
 
-    int pctot = 0;
-    std::vector<d3Vector> tscsAs(paramCount, d3Vector(0.0, 0.0, 0.0));
-
     const int gc = mdts.size();
 
-    for (long g = 0; g < gc; g++)
+    if (debug)
     {
-        const int pc = mdts[g].numberOfObjects();
+        int pctot = 0;
 
-        if (pc < 2) continue; // not really needed, mdts are pre-screened
+        for (long g = 0; g < gc; g++)
+        {
+            const int pc = mdts[g].numberOfObjects();
 
-        pctot += pc;
+            if (pc < 2) continue;
+
+            pctot += pc;
 
-        if (debug)
-        {
             std::cout << "    micrograph " << (g+1) << " / " << mdts.size() << ": "
                 << pc << " particles [" << pctot << " total]" << std::endl;
         }
+    }
 
-        for (int i = 0; i < paramCount; i++)
-        {
-            if (debug)
-            {
-                std::cout << "        evaluating: " << sig_vals[i] << std::endl;
-            }
+    // All (micrograph, parameter set) pairs are independent, since the CCs and the
+    // accelerated observations of all micrographs have been prepared in prepAlignment().
+    // With enough of them, they are processed in parallel with one thread each;
+    // otherwise, each motion fit uses all threads.
+    const int jobCount = gc * paramCount;
+    const int job_threads = (jobCount >= nr_omp_threads)? nr_omp_threads : 1;
+    const int fit_threads = (job_threads > 1)? 1 : nr_omp_threads;
 
-            RCTIC(paramTimer,timeOpt);
+    std::vector<d3Vector> jobTscs(jobCount, d3Vector(0.0, 0.0, 0.0));
 
-            std::vector<std::vector<gravis::d2Vector>> tracks =
-                motionEstimator->optimize(
-                    alignmentSet.CCs[g],
-                    alignmentSet.initialTracks[g],
-                    sig_v_vals_px[i], sig_a_vals_px[i], sig_d_vals_px[i],
-                    alignmentSet.positions[g], alignmentSet.globComp[g]);
+    RCTIC(paramTimer,timeOpt);
 
-			if (debug)
-            {
-				std::stringstream sts;
-				sts << "debug-track_" << sig_vals[i][0] << "_" << sig_vals[i][1] << "_" << sig_vals[i][2] << ".dat";
+    #pragma omp parallel for schedule(dynamic) num_threads(job_threads)
+    for (int job = 0; job < jobCount; job++)
+    {
+        const int g = job / paramCount;
+        const int i = job % paramCount;
 
-				std::ofstream debugStr(sts.str());
+        const int pc = mdts[g].numberOfObjects();
 
-				for (int p = 0; p < pc; p++)
-				{
-					for (int f = 0; f < fc; f++)
-					{
-						debugStr << tracks[p][f] << std::endl;
-					}
+        if (pc < 2) continue; // not really needed, mdts are pre-screened
 
-					debugStr << std::endl;
-				}
+        std::vector<std::vector<gravis::d2Vector>> tracks =
+            motionEstimator->optimize(
+                alignmentSet.CCs[g],
+                alignmentSet.initialTracks[g],
+                sig_v_vals_px[i], sig_a_vals_px[i], sig_d_vals_px[i],
+                alignmentSet.positions[g], alignmentSet.globComp[g],
+                fit_threads);
 
-				debugStr.close();
-			}
+        if (debug)
+        {
+            #pragma omp critical(MotionParamEstimator_debug)
+            {
+                std::cout << "        evaluating: " << sig_vals[i] << " on micrograph " << (g+1) << std::endl;
 
-            RCTOC(paramTimer,timeOpt);
+                std::stringstream sts;
+                sts << "debug-track_" << sig_vals[i][0] << "_" << sig_vals[i][1] << "_" << sig_vals[i][2] << ".dat";
 
-            RCTIC(paramTimer,timeEval);
+                std::ofstream debugStr(sts.str());
 
-            tscsAs[i] += alignmentSet.updateTsc(tracks, g, nr_omp_threads);
+                for (int p = 0; p < pc; p++)
+                {
+                    for (int f = 0; f < fc; f++)
+                    {
+                        debugStr << tracks[p][f] << std::endl;
+                    }
+
+                    debugStr << std::endl;
+                }
 
-            RCTOC(paramTimer,timeEval);
+                debugStr.close();
+            }
         }
 
-    } // micrographs
+        jobTscs[job] = alignmentSet.updateTsc(tracks, g, fit_threads);
+    }
+
+    RCTOC(paramTimer,timeOpt);
+
+    // sum up in a fixed order, so that the result does not depend on the scheduling
+    std::vector<d3Vector> tscsAs(paramCount, d3Vector(0.0, 0.0, 0.0));
+
+    for (long g = 0; g < gc; g++)
+    {
+        for (int i = 0; i < paramCount; i++)
+        {
+            tscsAs[i] += jobTscs[g * paramCount + i];
+        }
+    }
 
     if (debug)
     {
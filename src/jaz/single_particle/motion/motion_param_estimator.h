@@ -79,7 +79,7 @@ class MotionParamEstimator
 
             // read from cmd. line:
             bool estim2, estim3;
-            int minParticles, maxRange, maxIters, seed, group;
+            int minParticles, maxRange, maxIters, patience, seed, group;
             double sV, sD, sA;
             double iniStep, conv;
 			double align_frac, eval_frac;
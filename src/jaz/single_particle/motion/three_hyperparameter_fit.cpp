@@ -50,6 +50,30 @@ double ThreeHyperParameterProblem::f(const std::vector<double>& x, void *tempSto
     return -tsc[0];
 }
 
+void ThreeHyperParameterProblem::fBatch(
+        const std::vector<std::vector<double>>& xs,
+        std::vector<double>& out, void *tempStorage) const
+{
+    const int xc = xs.size();
+    std::vector<d3Vector> vda(xc);
+
+    for (int i = 0; i < xc; i++)
+    {
+        vda[i] = problemToMotion(xs[i]);
+    }
+
+    std::vector<double> tsc(xc);
+
+    motionParamEstimator.evaluateParams(vda, tsc);
+
+    out.resize(xc);
+
+    for (int i = 0; i < xc; i++)
+    {
+        out[i] = -tsc[i];
+    }
+}
+
 void ThreeHyperParameterProblem::report(int iteration, double cost, const std::vector<double>& x) const
 {
 	d3Vector vda = problemToMotion(x);
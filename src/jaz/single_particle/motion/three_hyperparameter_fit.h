@@ -34,6 +34,8 @@ class ThreeHyperParameterProblem : public Optimization
             MotionParamEstimator& motionParamEstimator);
 
         double f(const std::vector<double>& x, void* tempStorage) const;
+        void fBatch(const std::vector<std::vector<double>>& xs,
+                    std::vector<double>& out, void* tempStorage) const;
         void report(int iteration, double cost, const std::vector<double>& x) const;
 
         static gravis::d3Vector problemToMotion(const std::vector<double>& x);
@@ -44,6 +44,31 @@ double TwoHyperParameterProblem::f(const std::vector<double>& x, void *tempStora
     return -tsc[0];
 }
 
+void TwoHyperParameterProblem::fBatch(
+        const std::vector<std::vector<double>>& xs,
+        std::vector<double>& out, void *tempStorage) const
+{
+    const int xc = xs.size();
+    std::vector<d3Vector> vda(xc);
+
+    for (int i = 0; i < xc; i++)
+    {
+        d2Vector vd = problemToMotion(xs[i]);
+        vda[i] = d3Vector(vd[0], vd[1], s_acc);
+    }
+
+    std::vector<double> tsc(xc);
+
+    motionParamEstimator.evaluateParams(vda, tsc);
+
+    out.resize(xc);
+
+    for (int i = 0; i < xc; i++)
+    {
+        out[i] = -tsc[i];
+    }
+}
+
 void TwoHyperParameterProblem::report(int iteration, double cost, const std::vector<double>& x) const
 {
     d2Vector vd = problemToMotion(x);	
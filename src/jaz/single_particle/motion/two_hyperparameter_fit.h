@@ -35,6 +35,8 @@ class TwoHyperParameterProblem : public Optimization
             double s_acc);
 
         double f(const std::vector<double>& x, void* tempStorage) const;
+        void fBatch(const std::vector<std::vector<double>>& xs,
+                    std::vector<double>& out, void* tempStorage) const;
         void report(int iteration, double cost, const std::vector<double>& x) const;
 
         static gravis::d2Vector problemToMotion(const std::vector<double>& x);
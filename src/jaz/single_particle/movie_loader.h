@@ -105,7 +105,7 @@ BufferedImage<T> MovieLoader::readDense(
 		if (isCompressedMRC)
 			reader.readFrameInto(muGraphFrame_xmipp, frame0 + f);
 		else
-			muGraphFrame_xmipp.read(movieFn, true, frame0 + f, false, true);
+			muGraphFrame_xmipp.read(movieFn, true, frame0 + f, false, true, num_threads); // strips of TIFF frames are decoded in parallel
 
 		RawImage<T> muGraphFrame(muGraphFrame_xmipp);
 
@@ -144,6 +144,8 @@ BufferedImage<T> MovieLoader::readEER(
 {
 	EERRenderer renderer;
 	renderer.read(movieFn, eer_upsampling);
+	// only the compressed frames of this chunk are read (1-indexed)
+	renderer.setFramesOfInterest(frame0 * eer_grouping + 1, (frame0 + numFrames) * eer_grouping);
 
 	const long int w0 = renderer.getWidth();
 	const long int h0 = renderer.getHeight();
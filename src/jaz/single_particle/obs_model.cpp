@@ -37,6 +37,63 @@
 using namespace gravis;
 
 
+CtfGeometry::CtfGeometry()
+:	orixdim(0), oriydim(0), angpix(0), hasOffset(false)
+{}
+
+void CtfGeometry::initialise(int _orixdim, int _oriydim, RFLOAT _angpix,
+                             const Matrix2D<RFLOAT>* mag, const BufferedImage<RFLOAT>* _gammaOffset)
+{
+	orixdim = _orixdim;
+	oriydim = _oriydim;
+	angpix = _angpix;
+	hasOffset = (_gammaOffset != NULL);
+
+	const int ydim = oriydim;
+	const int xdim = orixdim/2 + 1;
+
+	X.resize(ydim, xdim);
+	Y.resize(ydim, xdim);
+
+	if (hasOffset)
+	{
+		gammaOffset.resize(ydim, xdim);
+	}
+	else
+	{
+		gammaOffset.clear();
+	}
+
+	const RFLOAT xs = (RFLOAT)orixdim * angpix;
+	const RFLOAT ys = (RFLOAT)oriydim * angpix;
+
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(X)
+	{
+		RFLOAT x = (RFLOAT)jp / xs;
+		RFLOAT y = (RFLOAT)ip / ys;
+
+		if (mag != NULL)
+		{
+			const Matrix2D<RFLOAT>& M = *mag;
+			RFLOAT xd = M(0,0) * x + M(0,1) * y;
+			RFLOAT yd = M(1,0) * x + M(1,1) * y;
+
+			x = xd;
+			y = yd;
+		}
+
+		DIRECT_A2D_ELEM(X, i, j) = x;
+		DIRECT_A2D_ELEM(Y, i, j) = y;
+
+		if (hasOffset)
+		{
+			const int y0 = i <= ydim/2? i : _gammaOffset->ydim + i - ydim;
+			DIRECT_A2D_ELEM(gammaOffset, i, j) = (*_gammaOffset)(j, y0);
+		}
+	}
+}
+
+
 ObservationModel::ObservationModel()
 {
 }
@@ -74,6 +131,7 @@ ObservationModel::ObservationModel(const MetaDataTable &_opticsMdt, bool do_die_
 	hasEvenZernike = opticsMdt.containsLabel(EMDL_IMAGE_EVEN_ZERNIKE_COEFFS);
 	evenZernikeCoeffs = std::vector<std::vector<double> >(opticsMdt.numberOfObjects(), std::vector<double>(0));
 	gammaOffset = std::vector<std::map<int,BufferedImage<RFLOAT> > >(opticsMdt.numberOfObjects());
+	ctfGeometry = std::vector<std::map<int,CtfGeometry> >(opticsMdt.numberOfObjects());
 
 	// antisymmetrical high-order aberrations:
 	hasOddZernike = opticsMdt.containsLabel(EMDL_IMAGE_ODD_ZERNIKE_COEFFS);
@@ -678,6 +736,7 @@ void ObservationModel::setPixelSize(int opticsGroup, RFLOAT newPixelSize)
 
 	phaseCorr[opticsGroup].clear();
 	gammaOffset[opticsGroup].clear();
+	ctfGeometry[opticsGroup].clear();
 
 	// mtfImage can be empty
 	if (mtfImage.size() > 0)
@@ -727,6 +786,7 @@ void ObservationModel::setBoxSize(int opticsGroup, int newBoxSize)
 
 	phaseCorr[opticsGroup].clear();
 	gammaOffset[opticsGroup].clear();
+	ctfGeometry[opticsGroup].clear();
 
 	// mtfImage can be empty
 	if (mtfImage.size() > 0)
@@ -770,6 +830,7 @@ Matrix2D<RFLOAT> ObservationModel::getMagMatrix(int opticsGroup) const
 void ObservationModel::setMagMatrix(int opticsGroup, const Matrix2D<RFLOAT> &M)
 {
 	magMatrices[opticsGroup] = M;
+	ctfGeometry[opticsGroup].clear();
 }
 
 std::vector<Matrix2D<RFLOAT> > ObservationModel::getMagMatrices() const
@@ -1306,6 +1367,33 @@ const BufferedImage<RFLOAT>& ObservationModel::getGammaOffset(int optGroup, int
 	return gammaOffset[optGroup][s];
 }
 
+const CtfGeometry& ObservationModel::getCtfGeometry(int optGroup, int s)
+{
+	const BufferedImage<RFLOAT>* offset = hasEvenZernike? &getGammaOffset(optGroup, s) : NULL;
+	const CtfGeometry* out;
+
+	#pragma omp critical(ObservationModel_getCtfGeometry)
+	{
+		std::map<int,CtfGeometry>::iterator it = ctfGeometry[optGroup].find(s);
+
+		if (it == ctfGeometry[optGroup].end())
+		{
+			if (ctfGeometry[optGroup].size() > 100)
+			{
+				std::cerr << "Warning: " << (ctfGeometry[optGroup].size()+1)
+				          << " CTF geometries in cache for the same ObservationModel." << std::endl;
+			}
+
+			it = ctfGeometry[optGroup].insert(std::make_pair(s, CtfGeometry())).first;
+			it->second.initialise(s, s, angpix[optGroup], hasMagMatrices? &magMatrices[optGroup] : NULL, offset);
+		}
+
+		out = &it->second;
+	}
+
+	return *out;
+}
+
 Matrix2D<RFLOAT> ObservationModel::applyAnisoMag(Matrix2D<RFLOAT> A3D, int opticsGroup)
 {
 	Matrix2D<RFLOAT> out;
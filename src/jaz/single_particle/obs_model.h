@@ -33,6 +33,34 @@
 class BackProjector;
 
 
+// Per-pixel terms of the CTF that only depend on the image geometry and the optics group,
+// in FFTW layout (oriydim x orixdim/2+1). With these, evaluating the CTF of one particle
+// reduces to a few multiply-adds and a sine per pixel (see CTF::getFftwImage).
+// Only the coordinates are stored: their products are cheap, and this keeps the results
+// identical to CTF::getCTF() with less than half of the memory.
+class CtfGeometry
+{
+	public:
+
+		CtfGeometry();
+
+		int orixdim, oriydim;
+		RFLOAT angpix;
+		bool hasOffset;
+
+		// (magnification-corrected) spatial frequencies, in 1/A
+		MultidimArray<RFLOAT> X, Y;
+
+		// phase of the symmetrical aberrations (only if hasOffset)
+		MultidimArray<RFLOAT> gammaOffset;
+
+		// mag and gammaOffset can be NULL; gammaOffset is in the layout of ObservationModel::getGammaOffset()
+		void initialise(int orixdim, int oriydim, RFLOAT angpix,
+		                const Matrix2D<RFLOAT>* mag = NULL,
+		                const BufferedImage<RFLOAT>* gammaOffset = NULL);
+};
+
+
 class ObservationModel
 {
 
@@ -65,6 +93,7 @@ class ObservationModel
 		// e.g.: phaseCorr[opt. group][img. height](x,y)
 		std::vector<std::map<int,BufferedImage<Complex> > > phaseCorr;
 		std::vector<std::map<int,BufferedImage<RFLOAT> > > gammaOffset, mtfImage;
+		std::vector<std::map<int,CtfGeometry> > ctfGeometry;
 		std::map<int,BufferedImage<RFLOAT> > avgMtfImage;
 
 
@@ -132,6 +161,10 @@ class ObservationModel
 		// Nyquist X is positive, Y is negative (non-FFTW!!)
 		const BufferedImage<RFLOAT>& getGammaOffset(int optGroup, int s);
 
+		// geometry-dependent part of the CTF for s x s images at the pixel size of the group (cached)
+		// FFTW layout, includes the magnification matrix and the symmetric aberrations
+		const CtfGeometry& getCtfGeometry(int optGroup, int s);
+
 		Matrix2D<RFLOAT> applyAnisoMag(Matrix2D<RFLOAT> A3D, int opticsGroup);
 
 		Matrix2D<RFLOAT> applyScaleDifference(
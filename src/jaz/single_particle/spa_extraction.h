@@ -24,6 +24,21 @@ class SpaExtraction
 				const std::vector<std::vector<gravis::d2Vector>>* offsets_in,
 				std::vector<std::vector<gravis::d2Vector>>* offsets_out,
 				int num_threads);
+
+		// Extracts the frames of a movie chunk that starts at frame first_frame into
+		// out[p][first_frame + f]. out (and offsets_out, if used) must already hold
+		// all frames, so that a movie can be extracted without ever holding all of it in memory.
+		template <typename T>
+		static void extractMovieFramesFS(
+				const MetaDataTable& mdt,
+				const RawImage<T>& movie_chunk,
+				int first_frame,
+				int boxSize,
+				double outPs, double coordsPs, double moviePs, double dataPs,
+				const std::vector<std::vector<gravis::d2Vector>>* offsets_in,
+				std::vector<std::vector<gravis::d2Vector>>* offsets_out,
+				std::vector<std::vector<Image<Complex>>>& out,
+				int num_threads);
 };
 
 template <typename T>
@@ -39,18 +54,41 @@ std::vector<std::vector<Image<Complex>>> SpaExtraction::extractMovieStackFS(
 	std::vector<std::vector<Image<Complex>>> out(mdt.numberOfObjects());
 	const long pc = mdt.numberOfObjects();
 
-	const int w0 = movie.xdim;
-	const int h0 = movie.ydim;
-	const int fc = movie.zdim;
-
-	if (dataPs < 0) 
+	for (long p = 0; p < pc; p++)
 	{
-		dataPs = outPs;
+		out[p] = std::vector<Image<Complex>>(movie.zdim);
 	}
 
-	for (long p = 0; p < pc; p++)
+	extractMovieFramesFS(
+		mdt, movie, 0, boxSize,
+		outPs, coordsPs, moviePs, dataPs,
+		offsets_in, offsets_out, out,
+		num_threads);
+
+	return out;
+}
+
+template <typename T>
+void SpaExtraction::extractMovieFramesFS(
+		const MetaDataTable& mdt,
+		const RawImage<T>& movie_chunk,
+		int first_frame,
+		int boxSize,
+		double outPs, double coordsPs, double moviePs, double dataPs,
+		const std::vector<std::vector<gravis::d2Vector>>* offsets_in,
+		std::vector<std::vector<gravis::d2Vector>>* offsets_out,
+		std::vector<std::vector<Image<Complex>>>& out,
+		int num_threads)
+{
+	const long pc = mdt.numberOfObjects();
+
+	const int w0 = movie_chunk.xdim;
+	const int h0 = movie_chunk.ydim;
+	const int fc = movie_chunk.zdim;
+
+	if (dataPs < 0) 
 	{
-		out[p] = std::vector<Image<Complex>>(fc);
+		dataPs = outPs;
 	}
 
 	const int sqMg = 2*(int)(0.5 * boxSize * outPs / moviePs + 0.5);
@@ -71,8 +109,9 @@ std::vector<std::vector<Image<Complex>>> SpaExtraction::extractMovieStackFS(
 	}
 
 	#pragma omp parallel for num_threads(num_threads)
-	for (long int f = 0; f < fc; f++)
+	for (long int fl = 0; fl < fc; fl++)
 	{
+		const long int f = first_frame + fl;
 		int tf = omp_get_thread_num();
 
 		for (long p = 0; p < pc; p++)
@@ -121,7 +160,7 @@ std::vector<std::vector<Image<Complex>>> SpaExtraction::extractMovieStackFS(
 				if (yy < 0) yy = 0;
 				else if (yy >= h0) yy = h0 - 1;
 
-				DIRECT_NZYX_ELEM(aux0[t].data, 0, 0, y, x) = movie(xx,yy,f);
+				DIRECT_NZYX_ELEM(aux0[t].data, 0, 0, y, x) = movie_chunk(xx,yy,fl);
 			}
 
 			if (outPs == moviePs)
@@ -137,8 +176,6 @@ std::vector<std::vector<Image<Complex>>> SpaExtraction::extractMovieStackFS(
 			out[p][f](0,0) = Complex(0.0,0.0);
 		}
 	}
-
-	return out;
 }
 
 
@@ -44,13 +44,16 @@
 #include "src/metadata_label.h"
 
 //This is needed for static memory allocation
-std::map<EMDLabel, EMDLabelData> EMDL::data;
-std::map<std::string, EMDLabel> EMDL::names;
+std::vector<EMDLabelData> EMDL::data;
+std::unordered_map<std::string, EMDLabel> EMDL::names;
 std::map<std::string, std::string> EMDL::definitions;
 StaticInitialization EMDL::initialization; //Just for initialization
 
 void EMDL::addLabel(EMDLabel label, EMDLabelType type, std::string name, std::string definition)
 {
+    if (data.size() < EMDL_LAST_LABEL)
+        data.resize(EMDL_LAST_LABEL);
+
     data[label] = EMDLabelData(type, name);
     names[name] = label;
     definitions[name] = definition;
@@ -110,53 +113,63 @@ void EMDL::printDefinitions(std::ostream& out)
 
 EMDLabel  EMDL::str2Label(const std::string &labelName)
 {
-	if (names.find(labelName) == names.end())
+    std::unordered_map<std::string, EMDLabel>::const_iterator it = names.find(labelName);
+    if (it == names.end())
         return EMDL_UNDEFINED;
-    return names[labelName];
+    return it->second;
 }//close function str2Label
 
 std::string  EMDL::label2Str(const EMDLabel &label)
 {
-    if (data.find(label) == data.end())
+    if (label < 0 || label >= data.size())
             return "";
     return data[label].str;
 }//close function label2Str
 
+EMDLabelType EMDL::getType(const EMDLabel &label)
+{
+    if (label < 0 || label >= data.size())
+        return EMDL_UNKNOWN;
+    return data[label].type;
+}
+
 bool EMDL::isInt(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_INT);
+    return (getType(label) == EMDL_INT);
 }
 bool EMDL::isBool(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_BOOL);
+    return (getType(label) == EMDL_BOOL);
 }
 bool EMDL::isString(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_STRING);
+    return (getType(label) == EMDL_STRING);
 }
 bool EMDL::isDouble(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_DOUBLE);
+    return (getType(label) == EMDL_DOUBLE);
 }
 bool EMDL::isNumber(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_DOUBLE || data[label].type == EMDL_INT);
+    const EMDLabelType type = getType(label);
+    return (type == EMDL_DOUBLE || type == EMDL_INT);
 }
 bool EMDL::isIntVector(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_INT_VECTOR);
+    return (getType(label) == EMDL_INT_VECTOR);
 }
 bool EMDL::isDoubleVector(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_DOUBLE_VECTOR);
+    return (getType(label) == EMDL_DOUBLE_VECTOR);
 }
 bool EMDL::isVector(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_DOUBLE_VECTOR || data[label].type == EMDL_INT_VECTOR);
+    const EMDLabelType type = getType(label);
+    return (type == EMDL_DOUBLE_VECTOR || type == EMDL_INT_VECTOR);
 }
 bool EMDL::isUnknown(const EMDLabel &label)
 {
-    return (data[label].type == EMDL_UNKNOWN);
+    return (getType(label) == EMDL_UNKNOWN);
 }
 
 bool EMDL::isValidLabel(const EMDLabel &label)
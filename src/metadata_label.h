@@ -46,6 +46,8 @@
 #define METADATA_LABEL_H
 
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -747,14 +749,18 @@ public:
 	static bool isVector(const EMDLabel &label);
 	static bool isUnknown(const EMDLabel &label);
 
+	// Returns EMDL_UNKNOWN for labels that have not been defined
+	static EMDLabelType getType(const EMDLabel &label);
+
 	static bool isValidLabel(const EMDLabel &label);
 	static bool isValidLabel(const std::string &labelName);
 
 	static void printDefinitions(std::ostream& out);
 
 private:
-	static std::map<EMDLabel, EMDLabelData> data;
-	static std::map<std::string, EMDLabel> names;
+	// Indexed by EMDLabel, so that label2Str and the type checks do not need a search
+	static std::vector<EMDLabelData> data;
+	static std::unordered_map<std::string, EMDLabel> names;
 	static std::map<std::string, std::string> definitions;
 	static StaticInitialization initialization; //Just for initialization
 
@@ -773,6 +779,7 @@ public:
 	std::string str;
 	//Default constructor
 	EMDLabelData()
+	: type(EMDL_UNKNOWN)
 	{
 	}
 	EMDLabelData(EMDLabelType t, std::string s)
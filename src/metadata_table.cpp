@@ -44,6 +44,10 @@
 
 #include "src/metadata_table.h"
 #include "src/metadata_label.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <unordered_map>
 
 MetaDataTable::MetaDataTable()
 :	objects(0),
@@ -506,84 +510,189 @@ bool MetaDataTable::setValueFromString(
 	return false;
 }
 
-// comparators used for sorting
-
-struct MdDoubleComparator
+// Stable sort of a row index in nr_threads chunks, which are then merged pairwise.
+// The chunks are merged in their original order, so the result is identical to std::stable_sort.
+template <typename T, class Comparator>
+static void parallelStableSort(std::vector<T> &idx, Comparator comp, int nr_threads)
 {
-	MdDoubleComparator(long index) : index(index) {}
+	const long n = idx.size();
+	long nr_chunks = XMIPP_MAX(1, XMIPP_MIN((long)nr_threads, n / 1024));
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	if (nr_chunks <= 1)
 	{
-		return lh->doubles[index] < rh->doubles[index];
+		std::stable_sort(idx.begin(), idx.end(), comp);
+		return;
 	}
 
-	long index;
-};
+	std::vector<long> bounds(nr_chunks + 1);
+	for (long c = 0; c <= nr_chunks; c++)
+		bounds[c] = (n * c) / nr_chunks;
 
-struct MdIntComparator
-{
-	MdIntComparator(long index) : index(index) {}
+	#pragma omp parallel for num_threads(nr_threads)
+	for (long c = 0; c < nr_chunks; c++)
+		std::stable_sort(idx.begin() + bounds[c], idx.begin() + bounds[c + 1], comp);
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	for (long width = 1; width < nr_chunks; width *= 2)
 	{
-		return lh->ints[index] < rh->ints[index];
+		#pragma omp parallel for num_threads(nr_threads)
+		for (long c = 0; c < nr_chunks - width; c += 2 * width)
+		{
+			const long last = XMIPP_MIN(c + 2 * width, nr_chunks);
+			std::inplace_merge(idx.begin() + bounds[c], idx.begin() + bounds[c + width], idx.begin() + bounds[last], comp);
+		}
 	}
+}
 
-	long index;
+// Sort keys of one column, copied out of the MetaDataContainers into contiguous memory,
+// so that the comparisons neither go through getValue nor chase the object pointers.
+struct MdSortKeys
+{
+	// STACK_KEY holds "N@stack" names as the stack in strings and N in ints
+	enum KeyType {DOUBLE_KEY, INT_KEY, STRING_KEY, STACK_KEY};
+
+	KeyType type;
+	std::vector<double> doubles;
+	std::vector<long> ints;
+	std::vector<std::string> strings;
+
+	int compare(long lh, long rh) const
+	{
+		switch (type)
+		{
+			case DOUBLE_KEY:
+				return (doubles[lh] < doubles[rh]) ? -1 : ((doubles[rh] < doubles[lh]) ? 1 : 0);
+			case INT_KEY:
+				return (ints[lh] < ints[rh]) ? -1 : ((ints[rh] < ints[lh]) ? 1 : 0);
+			case STACK_KEY:
+			{
+				const int c = strings[lh].compare(strings[rh]);
+				if (c != 0) return c;
+				return (ints[lh] < ints[rh]) ? -1 : ((ints[rh] < ints[lh]) ? 1 : 0);
+			}
+			default:
+				return strings[lh].compare(strings[rh]);
+		}
+	}
 };
 
-struct MdStringComparator
+struct MdMultiKeyComparator
 {
-	MdStringComparator(long index) : index(index) {}
+	MdMultiKeyComparator(const std::vector<MdSortKeys> &keys) : keys(keys) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		return lh->strings[index] < rh->strings[index];
+		for (int k = 0; k < keys.size(); k++)
+		{
+			const int c = keys[k].compare(lh, rh);
+			if (c != 0) return c < 0;
+		}
+
+		return false;
 	}
 
-	long index;
+	const std::vector<MdSortKeys> &keys;
 };
 
-struct MdStringAfterAtComparator
+template <typename T>
+struct MdKeyComparator
 {
-	MdStringAfterAtComparator(long index) : index(index) {}
+	MdKeyComparator(const std::vector<T> &values) : values(values) {}
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	bool operator()(long lh, long rh) const
 	{
-		std::string slh = lh->strings[index];
-		std::string srh = rh->strings[index];
-		slh = slh.substr(slh.find("@")+1);
-		srh = srh.substr(srh.find("@")+1);
-		return slh < srh;
+		return values[lh] < values[rh];
 	}
 
-	long index;
+	const std::vector<T> &values;
 };
 
-struct MdStringBeforeAtComparator
+// Copies the values of one column into sort keys.
+// do_sort_after_at, do_sort_before_at and do_split_at only apply to string labels (see newSort).
+// With do_split_at, "N@stack" is compared by stack first and then by N, so that "2@a" < "10@a".
+// Strings without a numeric N before the "@" are compared as a whole.
+static void extractSortKeys(const std::vector<MetaDataContainer*> &objects, EMDLabel label, long offset,
+                            bool do_sort_after_at, bool do_sort_before_at, bool do_split_at, int nr_threads, MdSortKeys &keys)
 {
-	MdStringBeforeAtComparator(long index) : index(index) {}
+	const long n = objects.size();
 
-	bool operator()(MetaDataContainer *lh, MetaDataContainer *rh) const
+	if (EMDL::isString(label))
 	{
-		std::string slh = lh->strings[index];
-		std::string srh = rh->strings[index];
-		slh = slh.substr(0, slh.find("@"));
-		srh = srh.substr(0, srh.find("@"));
-		std::stringstream stslh, stsrh;
-		stslh << slh;
-		stsrh << srh;
-		long ilh, irh;
-		stslh >> ilh;
-		stsrh >> irh;
+		if (do_split_at)
+		{
+			keys.type = MdSortKeys::STACK_KEY;
+			keys.strings.resize(n);
+			keys.ints.resize(n);
 
-		return ilh < irh;
+			#pragma omp parallel for num_threads(nr_threads)
+			for (long i = 0; i < n; i++)
+			{
+				const std::string &str = objects[i]->strings[offset];
+				const size_t at = str.find("@");
+				char *end = NULL;
+				const long nr = (at != std::string::npos && at > 0)? strtol(str.c_str(), &end, 10) : 0;
+
+				if (end != NULL && end == str.c_str() + at)
+				{
+					keys.strings[i] = str.substr(at + 1);
+					keys.ints[i] = nr;
+				}
+				else
+				{
+					keys.strings[i] = str;
+					keys.ints[i] = 0;
+				}
+			}
+		}
+		else if (do_sort_before_at)
+		{
+			keys.type = MdSortKeys::INT_KEY;
+			keys.ints.resize(n);
+
+			#pragma omp parallel for num_threads(nr_threads)
+			for (long i = 0; i < n; i++)
+			{
+				const std::string &str = objects[i]->strings[offset];
+				std::stringstream sts;
+				sts << str.substr(0, str.find("@"));
+				sts >> keys.ints[i];
+			}
+		}
+		else
+		{
+			keys.type = MdSortKeys::STRING_KEY;
+			keys.strings.resize(n);
+
+			#pragma omp parallel for num_threads(nr_threads)
+			for (long i = 0; i < n; i++)
+			{
+				const std::string &str = objects[i]->strings[offset];
+				keys.strings[i] = do_sort_after_at? str.substr(str.find("@") + 1) : str;
+			}
+		}
 	}
+	else if (EMDL::isDouble(label))
+	{
+		keys.type = MdSortKeys::DOUBLE_KEY;
+		keys.doubles.resize(n);
 
-	long index;
-};
+		for (long i = 0; i < n; i++)
+			keys.doubles[i] = objects[i]->doubles[offset];
+	}
+	else if (EMDL::isInt(label))
+	{
+		keys.type = MdSortKeys::INT_KEY;
+		keys.ints.resize(n);
+
+		for (long i = 0; i < n; i++)
+			keys.ints[i] = objects[i]->ints[offset];
+	}
+	else
+	{
+		REPORT_ERROR("Cannot sort this label: " + EMDL::label2Str(label));
+	}
+}
 
-void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bool do_random)
+void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bool do_random, int nr_threads)
 {
 	if (do_random)
 	{
@@ -620,7 +729,8 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 		i++;
 	}
 
-	std::sort(vp.begin(), vp.end());
+	// The index breaks ties, so a stable sort gives the same result as std::sort
+	parallelStableSort(vp, std::less<std::pair<double,long int> >(), nr_threads);
 	if (do_reverse && !do_random)
 		std::reverse(vp.begin(), vp.end());
 
@@ -648,42 +758,68 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 	firstObject();
 }
 
-void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at, bool do_sort_before_at)
+void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at, bool do_sort_before_at, int nr_threads)
 {
-	if (EMDL::isString(label))
-	{
-		if (do_sort_after_at)
-		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringAfterAtComparator(label2offset[label]));
-		}
-		else if (do_sort_before_at)
-		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringBeforeAtComparator(label2offset[label]));
-		}
-		else
-		{
-			std::stable_sort(objects.begin(), objects.end(), MdStringComparator(label2offset[label]));
-		}
-	}
-	else if (EMDL::isDouble(label))
-	{
-		std::stable_sort(objects.begin(), objects.end(), MdDoubleComparator(label2offset[label]));
-	}
-	else if (EMDL::isInt(label))
+	if (!containsLabel(label))
+		REPORT_ERROR("Cannot sort on a label that is not in the table: " + EMDL::label2Str(label));
+
+	MdSortKeys keys;
+	extractSortKeys(objects, label, label2offset[label], do_sort_after_at, do_sort_before_at, false, nr_threads, keys);
+
+	std::vector<long> idx(objects.size());
+	for (long i = 0; i < idx.size(); i++)
+		idx[i] = i;
+
+	switch (keys.type)
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdIntComparator(label2offset[label]));
+		case MdSortKeys::DOUBLE_KEY:
+			parallelStableSort(idx, MdKeyComparator<double>(keys.doubles), nr_threads);
+			break;
+		case MdSortKeys::INT_KEY:
+			parallelStableSort(idx, MdKeyComparator<long>(keys.ints), nr_threads);
+			break;
+		default:
+			parallelStableSort(idx, MdKeyComparator<std::string>(keys.strings), nr_threads);
 	}
-	else
+
+	permuteObjects(idx, do_reverse);
+}
+
+void MetaDataTable::newSort(const std::vector<EMDLabel> &labels, bool do_reverse, int nr_threads)
+{
+	if (labels.size() == 0)
+		REPORT_ERROR("MetaDataTable::newSort: no labels to sort on");
+
+	std::vector<MdSortKeys> keys(labels.size());
+
+	for (int k = 0; k < labels.size(); k++)
 	{
-		REPORT_ERROR("Cannot sort this label: " + EMDL::label2Str(label));
+		if (!containsLabel(labels[k]))
+			REPORT_ERROR("Cannot sort on a label that is not in the table: " + EMDL::label2Str(labels[k]));
+
+		extractSortKeys(objects, labels[k], label2offset[labels[k]], false, false, true, nr_threads, keys[k]);
 	}
 
-	if (do_reverse)
+	std::vector<long> idx(objects.size());
+	for (long i = 0; i < idx.size(); i++)
+		idx[i] = i;
+
+	parallelStableSort(idx, MdMultiKeyComparator(keys), nr_threads);
+
+	permuteObjects(idx, do_reverse);
+}
+
+void MetaDataTable::permuteObjects(const std::vector<long> &idx, bool do_reverse)
+{
+	const long n = idx.size();
+	std::vector<MetaDataContainer*> objs(n);
+
+	for (long j = 0; j < n; j++)
 	{
-		std::reverse(objects.begin(), objects.end());
+		objs[do_reverse? n - 1 - j : j] = objects[idx[j]];
 	}
+
+	objects = objs;
 }
 
 // Will be removed in 3.2
@@ -1032,6 +1168,42 @@ long int MetaDataTable::goToObject(long int objectID)
 	return current_objectID;
 }
 
+// Fast conversions for readStarLoop. They give the same values as reading the token through
+// an std::istringstream (as setValueFromString does), which is used for anything unusual.
+static inline double parseStarDouble(const std::string &value)
+{
+	const char* str = value.c_str();
+	char* end;
+	double v = strtod(str, &end);
+
+	// strtod also accepts hexadecimal numbers, nan and inf, which an istream does not
+	if (end == str || *end != '\0' || !std::isfinite(v) || value.find_first_of("xX") != std::string::npos)
+	{
+		std::istringstream i(value);
+		v = 0.;
+		i >> v;
+	}
+
+	return v;
+}
+
+static inline long parseStarLong(const std::string &value)
+{
+	const char* str = value.c_str();
+	char* end;
+	errno = 0;
+	long v = strtol(str, &end, 10);
+
+	if (end == str || *end != '\0' || errno != 0)
+	{
+		std::istringstream i(value);
+		v = 0;
+		i >> v;
+	}
+
+	return v;
+}
+
 long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 {
 	setIsList(false);
@@ -1079,6 +1251,15 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 	long int nr_objects = 0;
 	const int num_labels = activeLabels.size();
 
+	// Resolve the type and storage offset of every column once, instead of once per value
+	std::vector<EMDLabelType> column_types(num_labels);
+	std::vector<long> column_offsets(num_labels);
+	for (int i = 0; i < num_labels; i++)
+	{
+		column_types[i] = (activeLabels[i] == EMDL_UNKNOWN_LABEL)? EMDL_UNKNOWN : EMDL::getType(activeLabels[i]);
+		column_offsets[i] = (activeLabels[i] == EMDL_UNKNOWN_LABEL)? -1 : label2offset[activeLabels[i]];
+	}
+
 	while (is_first || getline(in, line, '\n'))
 	{
 		is_first = false;
@@ -1105,14 +1286,23 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 					std::cerr << "Error in line: " << line << std::endl;
 					REPORT_ERROR("A line in the STAR file contains more columns than the number of labels.");
 				}
-				// Check whether this is an unknown label
-				if (activeLabels[labelPosition] == EMDL_UNKNOWN_LABEL)
+				MetaDataContainer* obj = objects[current_objectID];
+				switch (column_types[labelPosition])
 				{
-					setUnknownValue(labelPosition, value);
-				}
-				else
-				{
-					setValueFromString(activeLabels[labelPosition], value);
+					case EMDL_DOUBLE:
+						obj->doubles[column_offsets[labelPosition]] = parseStarDouble(value);
+						break;
+					case EMDL_INT:
+						obj->ints[column_offsets[labelPosition]] = parseStarLong(value);
+						break;
+					case EMDL_STRING:
+						obj->strings[column_offsets[labelPosition]] = value;
+						break;
+					case EMDL_UNKNOWN:
+						setUnknownValue(labelPosition, value);
+						break;
+					default:
+						setValueFromString(activeLabels[labelPosition], value);
 				}
 				labelPosition++;
 			}
@@ -1362,7 +1552,101 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 	return ret;
 }
 
-void MetaDataTable::write(std::ostream& out) const
+// Appends a value padded to at least 10 characters plus a separator,
+// i.e. the same as "out << std::setw(10) << value << ' '"
+static inline void appendStarValue(std::string &buffer, const char* value, size_t length)
+{
+	if (length < 10)
+		buffer.append(10 - length, ' ');
+
+	buffer.append(value, length);
+	buffer += ' ';
+}
+
+void MetaDataTable::writeStarLoopRows(std::string &buffer, long first_row, long last_row) const
+{
+	// Same formats as getValueToString, including the truncation to 12 characters
+	char number[14];
+	std::string val;
+
+	for (long idx = first_row; idx < last_row; idx++)
+	{
+		const MetaDataContainer* obj = objects[idx];
+		std::string entryComment = "";
+
+		for (long i = 0; i < activeLabels.size(); i++)
+		{
+			const EMDLabel l = activeLabels[i];
+
+			if (l == EMDL_UNKNOWN_LABEL)
+			{
+				val = obj->unknowns[unknownLabelPosition2Offset[i]];
+				escapeStringForSTAR(val);
+				appendStarValue(buffer, val.c_str(), val.length());
+			}
+			else if (l == EMDL_COMMENT)
+			{
+				// Empty strings are stored as "\"\"" (see MetaDataContainer::getValue)
+				const std::string &comment = obj->strings[label2offset[l]];
+				entryComment = (comment == "\"\"") ? "" : comment;
+			}
+			else if (l != EMDL_SORTED_IDX)
+			{
+				const long off = label2offset[l];
+
+				switch (EMDL::getType(l))
+				{
+					case EMDL_DOUBLE:
+					{
+						const double v = obj->doubles[off];
+
+						if ((ABS(v) > 0. && ABS(v) < 0.001) || ABS(v) > 100000.)
+							snprintf(number, 13, (v < 0.)? "%12.5e" : "%12.6e", v);
+						else
+							snprintf(number, 13, (v < 0.)? "%12.5f" : "%12.6f", v);
+
+						appendStarValue(buffer, number, strlen(number));
+						break;
+					}
+					case EMDL_INT:
+					{
+						snprintf(number, 13, "%12ld", obj->ints[off]);
+						appendStarValue(buffer, number, strlen(number));
+						break;
+					}
+					case EMDL_BOOL:
+					{
+						snprintf(number, 13, "%12d", (int)obj->bools[off]);
+						appendStarValue(buffer, number, strlen(number));
+						break;
+					}
+					case EMDL_STRING:
+					{
+						val = (obj->strings[off] == "\"\"") ? "" : obj->strings[off];
+						escapeStringForSTAR(val);
+						appendStarValue(buffer, val.c_str(), val.length());
+						break;
+					}
+					default:
+					{
+						getValueToString(l, val, idx, true); // escape=true
+						appendStarValue(buffer, val.c_str(), val.length());
+					}
+				}
+			}
+		}
+
+		if (entryComment != std::string(""))
+		{
+			buffer += "# ";
+			buffer += entryComment;
+		}
+
+		buffer += '\n';
+	}
+}
+
+void MetaDataTable::write(std::ostream& out, int nr_threads) const
 {
 	// Only write tables that have something in them
 	if (isEmpty())
@@ -1405,60 +1689,36 @@ void MetaDataTable::write(std::ostream& out) const
 		}
 
 		// Write actual data block
-        //SHWS 31jul2024: writing of large STAR files on our ceph file system was very slow.
-        //SHWS 31jul2024: writing big data blocks (10,000 lines) in one go is much, much faster
-        std::ostringstream dataBlockStream;
-		for (long int idx = 0; idx < objects.size(); idx++)
+		//SHWS 31jul2024: writing of large STAR files on our ceph file system was very slow.
+		//SHWS 31jul2024: writing big data blocks (10,000 lines) in one go is much, much faster
+		// Blocks of rows are formatted into plain character buffers (in parallel if nr_threads > 1)
+		// and each buffer is written with a single call.
+		const long rows_per_block = 100000;
+		const long nr_blocks = (objects.size() + rows_per_block - 1) / rows_per_block;
+		const int nr_buffers = XMIPP_MAX(1, nr_threads);
+		std::vector<std::string> buffers(nr_buffers);
+
+		for (long first_block = 0; first_block < nr_blocks; first_block += nr_buffers)
 		{
-			std::string entryComment = "";
+			const int nr_todo = XMIPP_MIN((long)nr_buffers, nr_blocks - first_block);
 
-            for (long i = 0; i < activeLabels.size(); i++)
+			#pragma omp parallel for num_threads(nr_buffers)
+			for (int b = 0; b < nr_todo; b++)
 			{
-				EMDLabel l = activeLabels[i];
-
-				if (l == EMDL_UNKNOWN_LABEL)
-				{
-					std::string token, val;
-					long offset = unknownLabelPosition2Offset[i];
-					val = objects[idx]->unknowns[offset];
-					escapeStringForSTAR(val);
-					dataBlockStream << std::setw(10) << val << " ";
-                    //out.width(10);
-                    //out << val << " ";
-				}
-				else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX)
-				{
-					std::string val;
-					getValueToString(l, val, idx, true); // escape=true
-					dataBlockStream << std::setw(10) << val << " ";
-                    //out.width(10);
-                    //out << val << " ";
-				}
-				if (l == EMDL_COMMENT)
-				{
-					getValue(EMDL_COMMENT, entryComment, idx);
-				}
+				const long first_row = (first_block + b) * rows_per_block;
+				const long last_row = XMIPP_MIN(first_row + rows_per_block, (long)objects.size());
+				buffers[b].clear();
+				writeStarLoopRows(buffers[b], first_row, last_row);
 			}
-			if (entryComment != std::string(""))
+
+			for (int b = 0; b < nr_todo; b++)
 			{
-				dataBlockStream << "# " << entryComment;
-                //out << "# " << entryComment;
+				out.write(buffers[b].data(), buffers[b].size());
 			}
-            dataBlockStream << "\n";
-			//out << "\n";
-
-            if ((idx+1)%100000 == 0)
-            {
-                out << dataBlockStream.str();
-                dataBlockStream.str("");
-                dataBlockStream.clear();
-            }
-
 		}
+
 		// Finish table with a white-line
-        dataBlockStream << " \n";
-        //out << " \n";
-        out << dataBlockStream.str();
+		out << " \n";
 
 	}
 	else // isList
@@ -1517,7 +1777,7 @@ void MetaDataTable::write(std::ostream& out) const
 	}
 }
 
-void MetaDataTable::write(const FileName &fn_out) const
+void MetaDataTable::write(const FileName &fn_out, int nr_threads) const
 {
 	std::ofstream  fh;
 	FileName fn_tmp = fn_out + ".tmp";
@@ -1525,7 +1785,7 @@ void MetaDataTable::write(const FileName &fn_out) const
 	if (!fh)
 		REPORT_ERROR( (std::string)"MetaDataTable::write: cannot write to file: " + fn_out);
 //	fh << "# RELION; version " << g_RELION_VERSION << std::endl;
-	write(fh);
+	write(fh, nr_threads);
 	fh.close();
 	// Rename to prevent errors with programs in pipeliner reading in incomplete STAR files
 	std::rename(fn_tmp.c_str(), fn_out.c_str());
@@ -2094,7 +2354,96 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, std::stri
 	return MDout;
 }
 
-MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale, FileName fn_removed, bool verb)
+// Marks particles in one micrograph (or tomogram) that have a later particle of the same group within the threshold.
+// The particles are binned into a uniform grid with a cell size of at least the threshold, so that only the
+// 3x3 (or 3x3x3) neighbouring cells have to be searched. The result is identical to the all-pairs comparison.
+static void findDuplicatesOnGrid(const std::vector<long> &ids,
+                                 const std::vector<RFLOAT> &xs, const std::vector<RFLOAT> &ys, const std::vector<RFLOAT> &zs,
+                                 bool dataIs3D, RFLOAT threshold, std::vector<char> &valid)
+{
+	const long n_particles = ids.size();
+	if (n_particles < 2) return;
+
+	const RFLOAT threshold_sq = threshold * threshold;
+
+	RFLOAT min_x = xs[ids[0]], max_x = min_x;
+	RFLOAT min_y = ys[ids[0]], max_y = min_y;
+	RFLOAT min_z = dataIs3D ? zs[ids[0]] : 0., max_z = min_z;
+	for (long i = 1; i < n_particles; i++)
+	{
+		const long id = ids[i];
+		min_x = XMIPP_MIN(min_x, xs[id]); max_x = XMIPP_MAX(max_x, xs[id]);
+		min_y = XMIPP_MIN(min_y, ys[id]); max_y = XMIPP_MAX(max_y, ys[id]);
+		if (dataIs3D)
+		{
+			min_z = XMIPP_MIN(min_z, zs[id]); max_z = XMIPP_MAX(max_z, zs[id]);
+		}
+	}
+
+	// Cells may be larger than the threshold (never smaller), which keeps the number of cells
+	// per dimension bounded for tiny thresholds. Larger cells only mean more candidates per cell.
+	const RFLOAT max_extent = XMIPP_MAX(max_x - min_x, XMIPP_MAX(max_y - min_y, max_z - min_z));
+	const RFLOAT cell_size = XMIPP_MAX(XMIPP_MAX(threshold, (RFLOAT)1e-6), max_extent / 65536.);
+
+	const long long nx = (long long)((max_x - min_x) / cell_size) + 1;
+	const long long ny = (long long)((max_y - min_y) / cell_size) + 1;
+	const long long nz = dataIs3D ? (long long)((max_z - min_z) / cell_size) + 1 : 1;
+
+	std::vector<long long> cell_x(n_particles), cell_y(n_particles), cell_z(n_particles, 0);
+	std::unordered_map<long long, std::vector<long> > cells;
+	cells.reserve(n_particles);
+
+	for (long i = 0; i < n_particles; i++)
+	{
+		const long id = ids[i];
+		cell_x[i] = XMIPP_MIN((long long)((xs[id] - min_x) / cell_size), nx - 1);
+		cell_y[i] = XMIPP_MIN((long long)((ys[id] - min_y) / cell_size), ny - 1);
+		if (dataIs3D)
+			cell_z[i] = XMIPP_MIN((long long)((zs[id] - min_z) / cell_size), nz - 1);
+
+		// Indices are pushed in increasing order, so every cell list is sorted
+		cells[(cell_z[i] * ny + cell_y[i]) * nx + cell_x[i]].push_back(i);
+	}
+
+	const int dz_range = dataIs3D ? 1 : 0;
+
+	for (long i = 0; i < n_particles; i++)
+	{
+		const long part_id1 = ids[i];
+		bool found = false;
+
+		for (int dz = -dz_range; dz <= dz_range && !found; dz++)
+		for (int dy = -1; dy <= 1 && !found; dy++)
+		for (int dx = -1; dx <= 1 && !found; dx++)
+		{
+			const long long cx = cell_x[i] + dx, cy = cell_y[i] + dy, cz = cell_z[i] + dz;
+			if (cx < 0 || cx >= nx || cy < 0 || cy >= ny || cz < 0 || cz >= nz) continue;
+
+			std::unordered_map<long long, std::vector<long> >::const_iterator it = cells.find((cz * ny + cy) * nx + cx);
+			if (it == cells.end()) continue;
+
+			// Only particles that come later in the group are compared, as in the all-pairs version
+			const std::vector<long> &cell = it->second;
+			for (std::vector<long>::const_iterator jt = std::upper_bound(cell.begin(), cell.end(), i); jt != cell.end(); ++jt)
+			{
+				const long part_id2 = ids[*jt];
+				RFLOAT dist_sq = (xs[part_id1] - xs[part_id2]) * (xs[part_id1] - xs[part_id2]) + (ys[part_id1] - ys[part_id2]) * (ys[part_id1] - ys[part_id2]);
+				if (dataIs3D)
+					dist_sq += (zs[part_id1] - zs[part_id2]) * (zs[part_id1] - zs[part_id2]);
+
+				if (dist_sq <= threshold_sq)
+				{
+					found = true;
+					break;
+				}
+			}
+		}
+
+		if (found) valid[part_id1] = false;
+	}
+}
+
+MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale, FileName fn_removed, bool verb, int nr_threads)
 {
 	// Sanity check
     if (!MDin.containsLabel(EMDL_ORIENT_ORIGIN_X_ANGSTROM) || !MDin.containsLabel(EMDL_ORIENT_ORIGIN_Y_ANGSTROM))
@@ -2109,7 +2458,8 @@ MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label,
 	if (!MDin.containsLabel(mic_label))
 		REPORT_ERROR("STAR file does not contain " + EMDL::label2Str(mic_label));
 
-	std::vector<bool> valid(MDin.numberOfObjects(), true);
+	// char rather than bool: the flags are written concurrently from several threads
+	std::vector<char> valid(MDin.numberOfObjects(), true);
 	std::vector<RFLOAT> xs(MDin.numberOfObjects(), 0.0);
 	std::vector<RFLOAT> ys(MDin.numberOfObjects(), 0.0);
     std::vector<RFLOAT> zs;
@@ -2123,8 +2473,6 @@ MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label,
         zs.resize(MDin.numberOfObjects(), 0.0);
     }
 
-    RFLOAT threshold_sq = threshold * threshold;
-
 	// group by micrograph
 	std::map<std::string, std::vector<long> > grouped;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDin)
@@ -2162,33 +2510,18 @@ MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label,
 		grouped[mic_name].push_back(current_object);
 	}
 
-	// find duplicate
+	// find duplicates
+	std::vector<const std::vector<long>* > groups;
+	groups.reserve(grouped.size());
 	for (std::map<std::string, std::vector<long> >::iterator it = grouped.begin(); it != grouped.end(); ++it)
-	{
-		long n_particles = it->second.size();
+		groups.push_back(&(it->second));
 
-		for (long i = 0; i < n_particles; i++)
-		{
-			long part_id1 = it->second[i];
-
-			for (long j = i + 1; j < n_particles; j++)
-			{
-				long part_id2 = it->second[j];
-				RFLOAT dist_sq = (xs[part_id1] - xs[part_id2]) * (xs[part_id1] - xs[part_id2]) + (ys[part_id1] - ys[part_id2]) * (ys[part_id1] - ys[part_id2]);
-				if (dataIs3D)
-                    dist_sq += (zs[part_id1] - zs[part_id2]) * (zs[part_id1] - zs[part_id2]);
-
-				if (dist_sq <= threshold_sq)
-				{
-//					std::cout << it->first << " " << part_id1 << " " << part_id2 << " " << dist_sq << std::endl;
-					valid[part_id1] = false;
-					break;
-				}
-			}
-		}
+	#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+	for (long g = 0; g < (long)groups.size(); g++)
+	{
+		findDuplicatesOnGrid(*groups[g], xs, ys, zs, dataIs3D, threshold, valid);
 	}
 
-
 	MetaDataTable MDout, MDremoved;
     MDout.setName(MDin.getName());
     MDremoved.setName(MDin.getName());
@@ -206,8 +206,14 @@ public:
 
 	// Sort the order of the elements based on the values in the input label
 	// (only numbers, no strings/bools)
-	void sort(EMDLabel name, bool do_reverse = false, bool only_set_index = false, bool do_random = false);
-	void newSort(const EMDLabel name, bool do_reverse = false, bool do_sort_after_at = false, bool do_sort_before_at = false);
+	void sort(EMDLabel name, bool do_reverse = false, bool only_set_index = false, bool do_random = false, int nr_threads = 1);
+	// Stable sort on a single label (numbers or strings), using nr_threads for the sort itself
+	void newSort(const EMDLabel name, bool do_reverse = false, bool do_sort_after_at = false, bool do_sort_before_at = false, int nr_threads = 1);
+
+	// Stable sort on several labels: ties in labels[0] are broken by labels[1], etc.
+	// String values of the form "N@stack" are compared by stack and then by N.
+	// e.g. newSort({EMDL_MICROGRAPH_NAME, EMDL_IMAGE_NAME}) for grouped I/O
+	void newSort(const std::vector<EMDLabel> &labels, bool do_reverse = false, int nr_threads = 1);
 
 	// Check whether a label is defined in the table.
 	// This is redundant and will be removed in 3.2.
@@ -321,10 +327,11 @@ public:
 	long int read(const FileName &filename, const std::string &name = "", bool do_only_count = false);
 
 	// Write a MetaDataTable in STAR format
-	void write(std::ostream& out = std::cout) const;
+	// Rows are formatted in blocks; nr_threads blocks are formatted in parallel
+	void write(std::ostream& out = std::cout, int nr_threads = 1) const;
 
 	// Write to a single file
-	void write(const FileName & fn_out) const;
+	void write(const FileName & fn_out, int nr_threads = 1) const;
 
 	// Make a histogram of a column
 	void columnHistogram(EMDLabel label, std::vector<RFLOAT> &histX, std::vector<RFLOAT> &histY, int verb = 0, CPlot2D *plot2D = NULL,
@@ -374,6 +381,12 @@ private:
 	 *  Same as setObject, but assumes that all labels are present. */
 	void setObjectUnsafe(MetaDataContainer* data, long objId);
 
+	// Append the STAR representation of rows [first_row, last_row) of a loop to buffer
+	void writeStarLoopRows(std::string &buffer, long first_row, long last_row) const;
+
+	// Reorder the objects so that objects[idx[j]] becomes row j (or row N-1-j for do_reverse)
+	void permuteObjects(const std::vector<long> &idx, bool do_reverse = false);
+
 };
 
 void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
@@ -388,7 +401,8 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, std::stri
 
 // remove duplicated particles that are in the same micrograph (mic_label) and within a given threshold [px]
 // OriginX/Y are multiplied by origin_scale before added to CoordinateX/Y to compensate for down-sampling
-MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale=1.0, FileName fn_removed="", bool verb=true);
+// Particles are binned on a uniform grid per micrograph, and micrographs are processed in parallel using nr_threads
+MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale=1.0, FileName fn_removed="", bool verb=true, int nr_threads=1);
 
 // This flag should be enabled via "cmake -DMDT_TYPE_CHECK=ON"
 #ifdef METADATA_TABLE_TYPE_CHECK
@@ -1854,10 +1854,12 @@ unsigned long long MlWsumModel::getPackSize()
 	// for scale correction in groups
 	packed_size += 2 * nr_groups;
 
-	// for all class-related stuff
+	// for all class-related stuff: only the elements inside the sphere that is used in the reconstruction
 	// data is complex: multiply by two!
-	packed_size += nr_classes * nr_bodies * 2 * (unsigned long long) BPref[0].getSize(); // BPref.data
-	packed_size += nr_classes * nr_bodies * (unsigned long long) BPref[0].getSize(); // BPref.weight
+	FourierSphereLayout layout;
+	BPref[0].getSphereLayout(layout);
+	packed_size += nr_classes * nr_bodies * 2 * (unsigned long long) layout.size(); // BPref.data
+	packed_size += nr_classes * nr_bodies * (unsigned long long) layout.size(); // BPref.weight
 	packed_size += nr_classes * nr_bodies * (unsigned long long) nr_directions; // pdf_directions
 
 	// for pdf_class
@@ -1926,14 +1928,16 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed)
 	for (int iclass = 0; iclass < nr_classes * nr_bodies; iclass++)
 	{
 
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data)
+		FourierSphereLayout layout;
+		BPref[iclass].getSphereLayout(layout);
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n)
 		{
 			DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real;
 			DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).imag;
 		}
 		BPref[iclass].data.clear();
 
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight)
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n)
 		{
 			DIRECT_MULTIDIM_ELEM(packed, idx++) = DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n);
 		}
@@ -2008,13 +2012,16 @@ void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed)
 
 	for (int iclass = 0; iclass < nr_classes * nr_bodies; iclass++)
 	{
-		BPref[iclass].initialiseDataAndWeight(current_size);
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data)
+		// Elements outside the sphere are not packed, and remain zero
+		BPref[iclass].initZeros(current_size);
+		FourierSphereLayout layout;
+		BPref[iclass].getSphereLayout(layout);
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n)
 		{
 			(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real = DIRECT_MULTIDIM_ELEM(packed, idx++);
 			(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).imag = DIRECT_MULTIDIM_ELEM(packed, idx++);
 		}
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight)
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n)
 		{
 			DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n) = DIRECT_MULTIDIM_ELEM(packed, idx++);
 		}
@@ -2066,10 +2073,12 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces
 	packed_size += nr_optics_groups; // sumw_group
 	// for scale correction in groups
 	packed_size += 2 * nr_groups; // wsum_signal_product, wsum_reference_power
-	// for all class-related stuff
+	// for all class-related stuff: only the elements inside the sphere that is used in the reconstruction
 	// data is complex: multiply by two!
-	packed_size += BPref.size() * 2 * (unsigned long long) BPref[0].getSize(); // BPref.data
-	packed_size += BPref.size() * (unsigned long long) BPref[0].getSize(); // BPref.weight
+	FourierSphereLayout layout;
+	BPref[0].getSphereLayout(layout);
+	packed_size += BPref.size() * 2 * (unsigned long long) layout.size(); // BPref.data
+	packed_size += BPref.size() * (unsigned long long) layout.size(); // BPref.weight
 	packed_size += pdf_direction.size() * (unsigned long long) nr_directions; // pdf_directions
 	// for pdf_class
 	packed_size += nr_classes;
@@ -2172,7 +2181,8 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces
 
 	for (int iclass = 0; iclass < BPref.size(); iclass++)
 	{
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data) {
+		BPref[iclass].getSphereLayout(layout);
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n) {
 			if (ori_idx >= idx_start && ori_idx < idx_stop)
 				DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real;
 			ori_idx++;
@@ -2184,7 +2194,7 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, int &piece, int &nr_pieces
 		if (idx == ori_idx && do_clear)
 			BPref[iclass].data.clear();
 
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight) {
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n) {
 			if (ori_idx >= idx_start && ori_idx < idx_stop)
 				DIRECT_MULTIDIM_ELEM(packed, idx++) = DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n);
 			ori_idx++;
@@ -2322,9 +2332,12 @@ void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear
 	}
 
 	for (int iclass = 0; iclass < BPref.size(); iclass++) {
+		// Elements outside the sphere are not packed, and remain zero
 		if (idx == ori_idx)
-			BPref[iclass].initialiseDataAndWeight(current_size);
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data) {
+			BPref[iclass].initZeros(current_size);
+		FourierSphereLayout layout;
+		BPref[iclass].getSphereLayout(layout);
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n) {
 			if (ori_idx >= idx_start && ori_idx < idx_stop)
 				(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real = DIRECT_MULTIDIM_ELEM(packed, idx++);
 			ori_idx++;
@@ -2335,7 +2348,7 @@ void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed, int piece, bool do_clear
 			//DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n) = Complex(re, im);
 		}
 
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight) {
+		FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n) {
 			if (ori_idx >= idx_start && ori_idx < idx_stop)
 				DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n) = DIRECT_MULTIDIM_ELEM(packed, idx++);
 			ori_idx++;
@@ -561,6 +561,8 @@ void MlOptimiser::parseContinue(int argc, char **argv)
     minres_map = textToInteger(getParameter(argc, argv, "--minres_map", "5"));
     abort_at_resolution = textToFloat(parser.getOption("--abort_at_resolution", "Abort when resolution reaches beyond this value", "-1", true));
     gridding_nr_iter = textToInteger(getParameter(argc, argv, "--gridding_iter", "10"));
+    gridding_tolerance = textToFloat(getParameter(argc, argv, "--gridding_tol", "0"));
+    do_gridding_warm_start = checkParameter(argc, argv, "--gridding_warm_start");
     debug1 = textToFloat(getParameter(argc, argv, "--debug1", "0."));
     debug2 = textToFloat(getParameter(argc, argv, "--debug2", "0."));
     debug3 = textToFloat(getParameter(argc, argv, "--debug3", "0."));
@@ -1054,6 +1056,8 @@ void MlOptimiser::parseInitial(int argc, char **argv)
     abort_at_resolution = textToFloat(parser.getOption("--abort_at_resolution", "Abort when resolution reaches beyond this value", "-1", true));
     do_bfactor = checkParameter(argc, argv, "--bfactor");
     gridding_nr_iter = textToInteger(getParameter(argc, argv, "--gridding_iter", "10"));
+    gridding_tolerance = textToFloat(getParameter(argc, argv, "--gridding_tol", "0"));
+    do_gridding_warm_start = checkParameter(argc, argv, "--gridding_warm_start");
     debug1 = textToFloat(getParameter(argc, argv, "--debug1", "0"));
     debug2 = textToFloat(getParameter(argc, argv, "--debug2", "0"));
     debug3 = textToFloat(getParameter(argc, argv, "--debug3", "0"));
@@ -1290,6 +1294,8 @@ void MlOptimiser::read(FileName fn_in, int rank, bool do_prevent_preread)
     minres_map = 5;
     do_bfactor = false;
     gridding_nr_iter = 10;
+    gridding_tolerance = 0.;
+    do_gridding_warm_start = false;
     debug1 = debug2 = debug3 = 0.;
 
     // Then read in sampling, mydata and mymodel stuff
@@ -1524,7 +1530,7 @@ void MlOptimiser::write(bool do_write_sampling, bool do_write_data, bool do_writ
 
     // And write the mydata to file
     if (do_write_data)
-        mydata.write(fn_root + "_data.star", remove_offset_priors_again);
+        mydata.write(fn_root + "_data.star", remove_offset_priors_again, nr_threads);
 
     // And write the sampling object
     if (do_write_sampling)
@@ -2421,6 +2427,11 @@ void MlOptimiser::initialiseGeneral(int rank)
 
     // Initialise the wsum_model according to the mymodel
     wsum_model.initialise(mymodel, sampling.symmetryGroup(), asymmetric_padding, skip_gridding, grad_pseudo_halfsets);
+    for (int i = 0; i < wsum_model.BPref.size(); i++)
+    {
+        wsum_model.BPref[i].gridding_tolerance = gridding_tolerance;
+        wsum_model.BPref[i].do_gridding_warm_start = do_gridding_warm_start;
+    }
 
     // Initialise sums of hidden variable changes
     // In later iterations, this will be done in updateOverallChangesInHiddenVariables
@@ -4753,7 +4764,7 @@ void MlOptimiser::symmetriseReconstructions()
                 }
 
 
-                wsum_model.BPref[ith_recons].applyPointGroupSymmetry();
+                wsum_model.BPref[ith_recons].applyPointGroupSymmetry(nr_threads);
 
 
                 if (grad_pseudo_halfsets)
@@ -4776,7 +4787,7 @@ void MlOptimiser::symmetriseReconstructions()
                     }
 
 
-                    wsum_model.BPref[iclass_half].applyPointGroupSymmetry();
+                    wsum_model.BPref[iclass_half].applyPointGroupSymmetry(nr_threads);
 
                 }
 
@@ -5033,6 +5044,14 @@ void MlOptimiser::maximization()
     if (verb > 0)
         progress_bar(mymodel.nr_classes);
 
+    if (verb > 0 && gridding_tolerance > 0. && !skip_gridding)
+    {
+        std::cout << " Gridding correction iterations per class:";
+        for (int iclass = 0; iclass < wsum_model.BPref.size(); iclass++)
+            std::cout << " " << wsum_model.BPref[iclass].nr_gridding_iter;
+        std::cout << std::endl;
+    }
+
 //	if (skip_class >= 0)
 //		std::cerr << " Class " << skip_class << " replaced due to inactivity." << std::endl;
 }
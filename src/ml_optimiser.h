@@ -623,6 +623,12 @@ public:
 	// Number of iterations for gridding preweighting reconstruction
 	int gridding_nr_iter;
 
+	// Stop the gridding preweighting iterations once the weights change less than this (0 = always do gridding_nr_iter)
+	RFLOAT gridding_tolerance;
+
+	// Start the gridding preweighting from the weights of the previous iteration
+	bool do_gridding_warm_start;
+
 	// Flag whether to do group-wise B-factor correction or not
 	bool do_bfactor;
 
@@ -791,6 +797,8 @@ public:
             has_converged(0),
             only_flip_phases(0),
             gridding_nr_iter(0),
+            gridding_tolerance(0),
+            do_gridding_warm_start(0),
             do_use_reconstruct_images(0),
             fix_sigma_noise(0),
 			min_sigma2_offset(2.),
@@ -68,6 +68,8 @@ void MlOptimiserMpi::read(int argc, char **argv)
     int mpi_section = parser.addSection("MPI options");
     halt_all_followers_except_this = textToInteger(parser.getOption("--halt_all_followers_except", "For debugging: keep all followers except this one waiting", "-1"));
     do_keep_debug_reconstruct_files  = parser.checkOption("--keep_debug_reconstruct_files", "For debugging: keep temporary data and weight files for debug-reconstructions.");
+    do_float_reduction = parser.checkOption("--float_reduction", "Send the weighted sums between MPI processes (and through the temporary files) in single precision; they are still stored and added up in double precision (halves the traffic; the deviation from double precision is reported)");
+    float_reduction_error = float_reduction_norm = 0.;
 
     // Don't put any output to screen for mpi followers
     ori_verb = verb;
@@ -1048,8 +1050,16 @@ void MlOptimiserMpi::expectation()
 					std::cout << "relion_MPI_Bcast debug: rank = " << node->rank << " i = " << i << " MULTIDIM_SIZE(mymodel.PPref[i].data) = " << MULTIDIM_SIZE(mymodel.PPref[i].data) << " sender = " << sender << " followerC = " << node->followerC << std::endl;
 #endif
 					// Communicating over all followers means we don't have to allocate on the leader.
-					node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.PPref[i].data),
-					                       MULTIDIM_SIZE(mymodel.PPref[0].data), MY_MPI_COMPLEX, sender, node->followerC);
+					// Only send the elements inside the sphere that is used for projection; the rest is zero.
+					FourierSphereLayout layout;
+					mymodel.PPref[i].getSphereLayout(layout);
+					MultidimArray<Complex> compressed(layout.size());
+					if (node->followerRank == sender)
+						layout.compress(mymodel.PPref[i].data, MULTIDIM_ARRAY(compressed));
+					node->relion_MPI_Bcast(MULTIDIM_ARRAY(compressed),
+					                       MULTIDIM_SIZE(compressed), MY_MPI_COMPLEX, sender, node->followerC);
+					if (node->followerRank != sender)
+						layout.expand(MULTIDIM_ARRAY(compressed), mymodel.PPref[i].data);
 					// For multibody refinement with overlapping bodies, there may be more PPrefs than bodies!
 					if (i < mymodel.nr_classes * mymodel.nr_bodies)
 						node->relion_MPI_Bcast(MULTIDIM_ARRAY(mymodel.tau2_class[i]),
@@ -1928,6 +1938,7 @@ void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 	timer.tic(TIMING_MPICOMBINEDISC);
 #endif
 	MultidimArray<RFLOAT> Mpack;
+	MultidimArray<float> Mfloat;
 	FileName fn_pack;
 
 	int nr_halfsets = (do_split_random_halves) ? 2 : 1;
@@ -1936,6 +1947,7 @@ void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 	if ((node->size - 1)/nr_halfsets > 1)
 	{
 		// A. First all followers pack up their wsum_model (this is done simultaneously)
+		float_reduction_error = float_reduction_norm = 0.;
 		if (!node->isLeader())
 		{
 			wsum_model.pack(Mpack); // use negative piece and nr_pieces to only make a single Mpack, i.e. do not split into multiple pieces
@@ -1947,7 +1959,13 @@ void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 			if (this_follower == node->rank)
 			{
 				fn_pack.compose(fn_out+"_rank", node->rank, "tmp");
-				Mpack.writeBinary(fn_pack);
+				if (do_float_reduction)
+				{
+					packedSumsToFloat(Mpack, Mfloat);
+					Mfloat.writeBinary(fn_pack);
+				}
+				else
+					Mpack.writeBinary(fn_pack);
 				//std::cerr << "Rank "<< node->rank <<" has written: "<<fn_pack << " sum= "<<Mpack.sum()<< std::endl;
 			}
 			if (!do_parallel_disc_io)
@@ -1964,12 +1982,26 @@ void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 				for (int other_follower = first_follower + nr_halfsets; other_follower < node->size; other_follower+= nr_halfsets )
 				{
 					fn_pack.compose(fn_out+"_rank", other_follower, "tmp");
-					Mpack.readBinaryAndSum(fn_pack);
+					if (do_float_reduction)
+					{
+						Mfloat.resize(Mpack);
+						Mfloat.readBinary(fn_pack);
+						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mpack)
+							DIRECT_MULTIDIM_ELEM(Mpack, n) += DIRECT_MULTIDIM_ELEM(Mfloat, n);
+					}
+					else
+						Mpack.readBinaryAndSum(fn_pack);
 					//std::cerr << "Follower "<<node->rank<<" has read "<<fn_pack<< " sum= "<<Mpack.sum() << std::endl;
 				}
 				// After adding all Mpacks together: write the sum to disc
 				fn_pack.compose(fn_out+"_rank", node->rank, "tmp");
-				Mpack.writeBinary(fn_pack);
+				if (do_float_reduction)
+				{
+					packedSumsToFloat(Mpack, Mfloat);
+					Mfloat.writeBinary(fn_pack);
+				}
+				else
+					Mpack.writeBinary(fn_pack);
 				//std::cerr << "Follower "<<node->rank<<" is writing total SUM in "<<fn_pack << std::endl;
 			}
 			if (!do_parallel_disc_io)
@@ -1992,7 +2024,15 @@ void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 
 				// Read the corresponding Mpack (which now contains the sum of all Mpacks)
 				fn_pack.compose(fn_out+"_rank", first_follower, "tmp");
-				Mpack.readBinary(fn_pack);
+				if (do_float_reduction)
+				{
+					Mfloat.resize(Mpack);
+					Mfloat.readBinary(fn_pack);
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mpack)
+						DIRECT_MULTIDIM_ELEM(Mpack, n) = DIRECT_MULTIDIM_ELEM(Mfloat, n);
+				}
+				else
+					Mpack.readBinary(fn_pack);
 				//std::cerr << "Rank "<< node->rank <<" has read: "<<fn_pack << " sum= "<<Mpack.sum()<< std::endl;
 			}
 			if (!do_parallel_disc_io)
@@ -2016,7 +2056,14 @@ void MlOptimiserMpi::combineAllWeightedSumsViaFile()
 
 		// F. Finally all followers unpack Msum into their wsum_model (do this simultaneously)
 		if (!node->isLeader())
+		{
+			if (do_float_reduction)
+				float_reduction_norm = Mpack.sum2();
 			wsum_model.unpack(Mpack);
+		}
+
+		if (do_float_reduction)
+			reportFloatReductionError();
 
 	} // end if ((node->size - 1)/nr_halfsets > 1)
 #ifdef TIMING
@@ -2046,142 +2093,153 @@ void MlOptimiserMpi::combineAllWeightedSums()
 	if ((node->size - 1)/nr_halfsets > 1)
 	{
 #ifdef USE_MPI_COLLECTIVE
-		if (!node->isLeader())
+		// MPI_Allreduce would add up single-precision values in single precision,
+		// so with --float_reduction use the ring below, which adds them up in double precision
+		if (!do_float_reduction)
 		{
-			// First all followers pack up their wsum_model
-			wsum_model.pack(Mpack);
-			Msum.initZeros(Mpack);
+			if (!node->isLeader())
+			{
+				// First all followers pack up their wsum_model
+				wsum_model.pack(Mpack);
+				Msum.initZeros(Mpack);
 
-			if (do_split_random_halves)
-				node->relion_MPI_Allreduce(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, MPI_SUM, node->splitC);
-			else
-				node->relion_MPI_Allreduce(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, MPI_SUM, node->followerC);
+				MPI_Comm comm = (do_split_random_halves) ? node->splitC : node->followerC;
+				node->relion_MPI_Allreduce(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, MPI_SUM, comm);
  #ifdef DEBUG
-			if (node->rank == 1) std::cerr << " MPI_Allreduce MULTIDIM_SIZE(Mpack)= "<< MULTIDIM_SIZE(Mpack) << std::endl;
+				if (node->rank == 1) std::cerr << " MPI_Allreduce MULTIDIM_SIZE(Mpack)= "<< MULTIDIM_SIZE(Mpack) << std::endl;
  #endif
 
-			Mpack.clear();
-			wsum_model.unpack(Msum);
+				Mpack.clear();
+				wsum_model.unpack(Msum);
+			}
 		}
-#else
-		// Loop over possibly multiple instances of Mpack of maximum size
-		int piece = 0;
-		int nr_pieces = 1;
-		while (piece < nr_pieces)
+		else
+#endif
 		{
-			// All nodes except those who will reset nr_pieces piece will pass while loop in next pass
-			nr_pieces = 0;
-
-			// First all followers pack up their wsum_model
-			if (!node->isLeader())
+			// Loop over possibly multiple instances of Mpack of maximum size
+			int piece = 0;
+			int nr_pieces = 1;
+			float_reduction_error = float_reduction_norm = 0.;
+			while (piece < nr_pieces)
 			{
-				wsum_model.pack(Mpack, piece, nr_pieces);
-				// The first follower(s) set Msum equal to Mpack, the others initialise to zero
-				if (node->rank <= nr_halfsets)
-					Msum = Mpack;
-				else
-					Msum.initZeros(Mpack);
-			}
-
+				// All nodes except those who will reset nr_pieces piece will pass while loop in next pass
+				nr_pieces = 0;
 
-			// Loop through all followers: each follower sends its Msum to the next follower for its subset.
-			// Each next follower sums its own Mpack to the received Msum and sends it on to the next follower
-			for (int this_follower = 1; this_follower < node->size; this_follower++ )
-			{
-				// Find out who is the first follower in this subset
-				int first_follower;
-				if (!do_split_random_halves)
-					first_follower = 1;
-				else
-					first_follower = (this_follower % 2 == 1) ? 1 : 2;
+				// First all followers pack up their wsum_model
+				if (!node->isLeader())
+				{
+					wsum_model.pack(Mpack, piece, nr_pieces);
+					// The first follower(s) set Msum equal to Mpack, the others initialise to zero
+					if (node->rank <= nr_halfsets)
+						Msum = Mpack;
+					else
+						Msum.initZeros(Mpack);
+				}
 
-				// Find out who is the next follower in this subset
-				int other_follower = this_follower + nr_halfsets;
 
-				if (other_follower < node->size)
+				// Loop through all followers: each follower sends its Msum to the next follower for its subset.
+				// Each next follower sums its own Mpack to the received Msum and sends it on to the next follower
+				for (int this_follower = 1; this_follower < node->size; this_follower++ )
 				{
-					if (node->rank == this_follower)
+					// Find out who is the first follower in this subset
+					int first_follower;
+					if (!do_split_random_halves)
+						first_follower = 1;
+					else
+						first_follower = (this_follower % 2 == 1) ? 1 : 2;
+
+					// Find out who is the next follower in this subset
+					int other_follower = this_follower + nr_halfsets;
+
+					if (other_follower < node->size)
 					{
+						if (node->rank == this_follower)
+						{
 #ifdef DEBUG
-						std::cerr << " AA SEND node->rank= " << node->rank << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
-								<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
+							std::cerr << " AA SEND node->rank= " << node->rank << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
+									<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
 #endif
-						node->relion_MPI_Send(MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Msum), MY_MPI_DOUBLE, other_follower, MPITAG_PACK, MPI_COMM_WORLD);
-					}
-					else if (node->rank == other_follower)
-					{
-						node->relion_MPI_Recv(MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Msum), MY_MPI_DOUBLE, this_follower, MPITAG_PACK, MPI_COMM_WORLD, status);
+							sendPackedSums(Msum, other_follower);
+						}
+						else if (node->rank == other_follower)
+						{
+							receivePackedSums(Msum, this_follower);
 #ifdef DEBUG
-						std::cerr << " AA RECV node->rank= " << node->rank  << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
-								<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
+							std::cerr << " AA RECV node->rank= " << node->rank  << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
+									<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
 #endif
-						// Add my own Mpack to send onwards in the next step
-						Msum += Mpack;
+							// Add my own Mpack to send onwards in the next step
+							Msum += Mpack;
+						}
 					}
-				}
-				else
-				{
-					// Now this_follower has reached the last follower, which passes the final Msum to the first one (i.e. first_follower)
-					if (node->rank == this_follower)
+					else
 					{
+						// Now this_follower has reached the last follower, which passes the final Msum to the first one (i.e. first_follower)
+						if (node->rank == this_follower)
+						{
 #ifdef DEBUG
-						std::cerr << " BB SEND node->rank= " << node->rank  << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
-								<< " this_follower= " << this_follower << " first_follower= "<<first_follower << std::endl;
+							std::cerr << " BB SEND node->rank= " << node->rank  << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
+									<< " this_follower= " << this_follower << " first_follower= "<<first_follower << std::endl;
 #endif
-						node->relion_MPI_Send(MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Msum), MY_MPI_DOUBLE, first_follower, MPITAG_PACK, MPI_COMM_WORLD);
-					}
-					else if (node->rank == first_follower)
-					{
-						node->relion_MPI_Recv(MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Msum), MY_MPI_DOUBLE, this_follower, MPITAG_PACK, MPI_COMM_WORLD, status);
+							sendPackedSums(Msum, first_follower);
+						}
+						else if (node->rank == first_follower)
+						{
+							receivePackedSums(Msum, this_follower);
 #ifdef DEBUG
-						std::cerr << " BB RECV node->rank= " << node->rank  << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
-								<< " this_follower= " << this_follower << " first_follower= "<<first_follower << std::endl;
+							std::cerr << " BB RECV node->rank= " << node->rank  << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
+									<< " this_follower= " << this_follower << " first_follower= "<<first_follower << std::endl;
 #endif
+						}
 					}
-				}
-			} // end for this_follower
+				} // end for this_follower
 
-			// Now loop through all followers again to pass around the Msum
-			for (int this_follower = 1; this_follower < node->size; this_follower++ )
-			{
-				// Find out who is the next follower in this subset
-				int other_follower = this_follower + nr_halfsets;
-
-				// Do not send to the last follower, because it already had its Msum from the cycle above, therefore subtract nr_halfsets from node->size
-				if (other_follower < node->size - nr_halfsets)
+				// Now loop through all followers again to pass around the Msum
+				for (int this_follower = 1; this_follower < node->size; this_follower++ )
 				{
-					if (node->rank == this_follower)
+					// Find out who is the next follower in this subset
+					int other_follower = this_follower + nr_halfsets;
+
+					// Do not send to the last follower, because it already had its Msum from the cycle above, therefore subtract nr_halfsets from node->size
+					if (other_follower < node->size - nr_halfsets)
 					{
+						if (node->rank == this_follower)
+						{
 #ifdef DEBUG
-						std::cerr << " CC SEND node->rank= " << node->rank << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
-								<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
+							std::cerr << " CC SEND node->rank= " << node->rank << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
+									<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
 #endif
-						node->relion_MPI_Send(MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Msum), MY_MPI_DOUBLE, other_follower, MPITAG_PACK, MPI_COMM_WORLD);
-					}
-					else if (node->rank == other_follower)
-					{
-						node->relion_MPI_Recv(MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Msum), MY_MPI_DOUBLE, this_follower, MPITAG_PACK, MPI_COMM_WORLD, status);
+							sendPackedSums(Msum, other_follower);
+						}
+						else if (node->rank == other_follower)
+						{
+							receivePackedSums(Msum, this_follower);
 #ifdef DEBUG
-						std::cerr << " CC RECV node->rank= " << node->rank << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
-								<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
+							std::cerr << " CC RECV node->rank= " << node->rank << " MULTIDIM_SIZE(Msum)= "<< MULTIDIM_SIZE(Msum)
+									<< " this_follower= " << this_follower << " other_follower= "<<other_follower << std::endl;
 #endif
+						}
 					}
-				}
-			} // end for this_follower
+				} // end for this_follower
 
 
-			// Finally all followers unpack Msum into their wsum_model
-			if (!node->isLeader())
-			{
-				// Subtract 1 from piece because it was incremented already...
-				wsum_model.unpack(Msum, piece - 1);
-			}
+				// Finally all followers unpack Msum into their wsum_model
+				if (!node->isLeader())
+				{
+					// Subtract 1 from piece because it was incremented already...
+					if (do_float_reduction)
+						float_reduction_norm += Msum.sum2();
+					wsum_model.unpack(Msum, piece - 1);
+				}
 
 
-		} // end for piece
+			} // end for piece
 
-		MPI_Barrier(MPI_COMM_WORLD);
-#endif
+			MPI_Barrier(MPI_COMM_WORLD);
+		}
+
+		if (do_float_reduction)
+			reportFloatReductionError();
 	}
 
 #ifdef TIMING
@@ -2189,6 +2247,63 @@ void MlOptimiserMpi::combineAllWeightedSums()
 #endif
 }
 
+void MlOptimiserMpi::packedSumsToFloat(const MultidimArray<RFLOAT> &Mpack, MultidimArray<float> &Mfloat)
+{
+	Mfloat.resize(Mpack);
+	double err2 = 0.;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mpack)
+	{
+		DIRECT_MULTIDIM_ELEM(Mfloat, n) = (float)DIRECT_MULTIDIM_ELEM(Mpack, n);
+		double diff = (double)DIRECT_MULTIDIM_ELEM(Mpack, n) - (double)DIRECT_MULTIDIM_ELEM(Mfloat, n);
+		err2 += diff * diff;
+	}
+	float_reduction_error += sqrt(err2);
+}
+
+void MlOptimiserMpi::sendPackedSums(MultidimArray<RFLOAT> &Mpack, int dest)
+{
+	if (do_float_reduction)
+	{
+		MultidimArray<float> Mfloat;
+		packedSumsToFloat(Mpack, Mfloat);
+		node->relion_MPI_Send(MULTIDIM_ARRAY(Mfloat), MULTIDIM_SIZE(Mfloat), MPI_FLOAT, dest, MPITAG_PACK, MPI_COMM_WORLD);
+	}
+	else
+		node->relion_MPI_Send(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, dest, MPITAG_PACK, MPI_COMM_WORLD);
+}
+
+void MlOptimiserMpi::receivePackedSums(MultidimArray<RFLOAT> &Mpack, int source)
+{
+	MPI_Status status;
+	if (do_float_reduction)
+	{
+		MultidimArray<float> Mfloat;
+		Mfloat.resize(Mpack);
+		node->relion_MPI_Recv(MULTIDIM_ARRAY(Mfloat), MULTIDIM_SIZE(Mfloat), MPI_FLOAT, source, MPITAG_PACK, MPI_COMM_WORLD, status);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mpack)
+			DIRECT_MULTIDIM_ELEM(Mpack, n) = DIRECT_MULTIDIM_ELEM(Mfloat, n);
+	}
+	else
+		node->relion_MPI_Recv(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, source, MPITAG_PACK, MPI_COMM_WORLD, status);
+}
+
+void MlOptimiserMpi::reportFloatReductionError()
+{
+	if (node->isLeader())
+		return;
+
+	double my_error = float_reduction_error, my_norm = sqrt(float_reduction_norm);
+	double total_error, min_norm;
+	MPI_Allreduce(&my_error, &total_error, 1, MPI_DOUBLE, MPI_SUM, node->followerC);
+	MPI_Allreduce(&my_norm, &min_norm, 1, MPI_DOUBLE, MPI_MIN, node->followerC);
+
+	// The sums are accumulated in double precision, so the summed rounding errors of all transfers
+	// bound the deviation from the double-precision sums (triangle inequality)
+	if (node->rank == 1)
+		std::cout << " Single-precision reduction of the weighted sums: relative deviation from double precision <= "
+		          << ((min_norm > 0.) ? total_error / min_norm : 0.) << std::endl;
+}
+
 void MlOptimiserMpi::combineWeightedSumsTwoRandomHalvesViaFile()
 {
 	// Just sum the weighted halves from follower 1 and follower 2 and Bcast to everyone else
@@ -2482,6 +2597,13 @@ void MlOptimiserMpi::maximization()
 										wsum_model.pdf_class[iclass],
 										minres_map,
 										false);
+
+								// The leader does not reconstruct, so the ranks that do report the gridding convergence themselves
+								if (gridding_tolerance > 0. && !skip_gridding && !gradient_refine)
+									std::cout << " Gridding correction for " << ((mymodel.nr_bodies > 1) ? "body " : "class ") << ith_recons + 1
+									          << ((do_split_random_halves && !do_join_random_halves) ? " (half 1)" : "") << ": "
+									          << wsum_model.BPref[ith_recons].nr_gridding_iter << " of " << gridding_nr_iter << " iterations"
+									          << ((wsum_model.BPref[ith_recons].nr_gridding_iter < gridding_nr_iter) ? ", converged" : "") << std::endl;
 							}
 						}
 					}
@@ -2620,6 +2742,12 @@ void MlOptimiserMpi::maximization()
 											wsum_model.pdf_class[iclass],
 											minres_map,
 											false);
+
+									if (gridding_tolerance > 0. && !skip_gridding && !gradient_refine)
+										std::cout << " Gridding correction for " << ((mymodel.nr_bodies > 1) ? "body " : "class ") << ith_recons + 1
+										          << " (half 2): "
+										          << wsum_model.BPref[ith_recons].nr_gridding_iter << " of " << gridding_nr_iter << " iterations"
+										          << ((wsum_model.BPref[ith_recons].nr_gridding_iter < gridding_nr_iter) ? ", converged" : "") << std::endl;
 								}
 							}
 
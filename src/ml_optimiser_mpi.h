@@ -45,6 +45,12 @@ public:
     // Original verb
     int ori_verb;
 
+    // Send the packed weighted sums in single precision during the MPI reductions (only the transfers: they are stored and added up in double precision)
+    bool do_float_reduction;
+
+    // Summed norms of the rounding errors of all single-precision transfers in the last reduction, and the norm of the sums
+    double float_reduction_error, float_reduction_norm;
+
 	/** Destructor, calls MPI_Finalize */
     ~MlOptimiserMpi()
     {
@@ -87,6 +93,19 @@ public:
      */
     void combineAllWeightedSums();
 
+    /** Send and receive (part of) the packed weighted sums, in single precision if do_float_reduction
+     */
+    void sendPackedSums(MultidimArray<RFLOAT> &Mpack, int dest);
+    void receivePackedSums(MultidimArray<RFLOAT> &Mpack, int source);
+
+    /** Convert the packed weighted sums to single precision, and keep track of the rounding error
+     */
+    void packedSumsToFloat(const MultidimArray<RFLOAT> &Mpack, MultidimArray<float> &Mfloat);
+
+    /** Report the upper bound on the deviation of the reduced weighted sums from a double-precision reduction
+     */
+    void reportFloatReductionError();
+
     /** Join the sums from two random halves
      */
     void combineWeightedSumsTwoRandomHalves();
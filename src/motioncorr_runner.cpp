@@ -18,6 +18,10 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include <omp.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "src/motioncorr_runner.h"
 #ifdef _CUDA_ENABLED
@@ -39,7 +43,6 @@
 	#define RCTOC(label) (MCtimer.toc(label))
 
 	Timer MCtimer;
-	int TIMING_READ_GAIN = MCtimer.setNew("read gain");
 	int TIMING_READ_MOVIE = MCtimer.setNew("read movie");
 	int TIMING_APPLY_GAIN = MCtimer.setNew("apply gain");
 	int TIMING_INITIAL_SUM = MCtimer.setNew("initial sum");
@@ -53,9 +56,6 @@
 	int TIMING_POWER_SPECTRUM_RESIZE = MCtimer.setNew("power - resize");
 	int TIMING_GLOBAL_ALIGNMENT = MCtimer.setNew("global alignment");
 	int TIMING_GLOBAL_IFFT = MCtimer.setNew("global iFFT");
-	int TIMING_PREP_PATCH = MCtimer.setNew("prepare patch");
-	int TIMING_CLIP_PATCH = MCtimer.setNew("prep patch - clip (in thread)");
-	int TIMING_PATCH_FFT = MCtimer.setNew("prep patch - FFT (in thread)");
 	int TIMING_PATCH_ALIGN = MCtimer.setNew("patch alignment");
 	int TIMING_PREP_WEIGHT = MCtimer.setNew("align - prep weight");
 	int TIMING_MAKE_REF = MCtimer.setNew("align - make reference");
@@ -76,6 +76,237 @@
 	#define RCTOC(label)
 #endif
 
+MotioncorrPipeline::MotioncorrPipeline()
+{
+	prefetch_depth = write_depth = 0;
+	current_movie = -1;
+	stopping = false;
+	write_failed = false;
+	n_writing = 0;
+}
+
+MotioncorrPipeline::~MotioncorrPipeline()
+{
+	// Do not throw from the destructor; errors are reported by finish()
+	try
+	{
+		finish();
+	}
+	catch (RelionError &e)
+	{
+		std::cerr << e << std::endl;
+	}
+}
+
+void MotioncorrPipeline::start(const std::vector<FileName> &_fn_movies, MovieReader _reader, int _prefetch_depth, int _write_depth)
+{
+	finish();
+
+	fn_movies = _fn_movies;
+	reader = _reader;
+	prefetch_depth = XMIPP_MAX(0, _prefetch_depth);
+	write_depth = XMIPP_MAX(0, _write_depth);
+	current_movie = -1;
+	stopping = false;
+	loaded_movies.clear();
+	write_error = "";
+	write_failed = false;
+
+	if (prefetch_depth > 0 && fn_movies.size() > 1)
+		loader = std::thread(&MotioncorrPipeline::loadMovies, this);
+	if (write_depth > 0)
+		writer = std::thread(&MotioncorrPipeline::writeImages, this);
+}
+
+void MotioncorrPipeline::beginMovie(long int imovie)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	current_movie = imovie;
+	cond.notify_all();
+}
+
+void MotioncorrPipeline::takeMovie(MotioncorrMovie &movie)
+{
+	if (!loader.joinable())
+	{
+		reader(fn_movies[current_movie], movie);
+		return;
+	}
+
+	{
+		// The loader goes through the movies in order, so it gets to the current one
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [this]{ return loaded_movies.count(current_movie) > 0; });
+		std::map<long int, MotioncorrMovie>::iterator it = loaded_movies.find(current_movie);
+		movie = std::move(it->second);
+		loaded_movies.erase(it);
+		cond.notify_all();
+	}
+
+	if (movie.error != "")
+		REPORT_ERROR("Failed to read " + fn_movies[current_movie] + ": " + movie.error);
+}
+
+void MotioncorrPipeline::write(Image<float> &img, FileName fn_img, RFLOAT angpix, DataType datatype)
+{
+	if (!writer.joinable())
+	{
+		img.setSamplingRateInHeader(angpix, angpix);
+		img.write(fn_img, -1, false, WRITE_OVERWRITE, datatype);
+		return;
+	}
+
+	WriteJob job;
+	job.img = new Image<float>();
+	job.img->data.moveFrom(img.data);
+	img.data.clear(); // img was left as an alias
+	job.fn_img = fn_img;
+	job.angpix = angpix;
+	job.datatype = datatype;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	cond.wait(lock, [this]{ return write_queue.size() < (size_t)write_depth || write_failed; });
+	if (!write_failed)
+		write_queue.push_back(job);
+	else
+		delete job.img;
+	cond.notify_all();
+	lock.unlock();
+
+	checkWriteError();
+}
+
+void MotioncorrPipeline::whenWritten(std::function<void()> task)
+{
+	if (!writer.joinable())
+	{
+		task();
+		return;
+	}
+
+	// Tasks are small, so they do not count towards write_depth
+	WriteJob job;
+	job.img = NULL;
+	job.task = task;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!write_failed)
+		write_queue.push_back(job);
+	cond.notify_all();
+}
+
+void MotioncorrPipeline::finish()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [this]{ return (write_queue.empty() && n_writing == 0) || !writer.joinable(); });
+		stopping = true;
+		cond.notify_all();
+	}
+
+	if (loader.joinable())
+		loader.join();
+	if (writer.joinable())
+		writer.join();
+	loaded_movies.clear();
+
+	checkWriteError();
+}
+
+void MotioncorrPipeline::checkWriteError()
+{
+	std::string error;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		error.swap(write_error);
+	}
+
+	if (error != "")
+		REPORT_ERROR("Failed to write the output of motion correction: " + error);
+}
+
+void MotioncorrPipeline::loadMovies()
+{
+	for (long int imovie = 0; imovie < fn_movies.size(); imovie++)
+	{
+		{
+			// Keep at most prefetch_depth decoded movies ahead of the one being aligned
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait(lock, [this, imovie]{ return stopping || imovie <= current_movie + prefetch_depth; });
+			if (stopping) return;
+		}
+
+		// Errors are reported by takeMovie(), when the aligner gets to this movie
+		MotioncorrMovie movie;
+		try
+		{
+			reader(fn_movies[imovie], movie);
+		}
+		catch (RelionError &e)
+		{
+			movie.Iframes.clear();
+			movie.error = e.msg;
+		}
+		catch (std::exception &e) // e.g. std::bad_alloc; nothing may escape this thread
+		{
+			movie.Iframes.clear();
+			movie.error = e.what();
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping) return;
+		loaded_movies[imovie] = std::move(movie);
+		cond.notify_all();
+	}
+}
+
+void MotioncorrPipeline::writeImages()
+{
+	while (true)
+	{
+		WriteJob job;
+		bool skip;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait(lock, [this]{ return stopping || !write_queue.empty(); });
+			if (write_queue.empty()) return;
+			job = write_queue.front();
+			write_queue.pop_front();
+			skip = write_failed;
+			n_writing++;
+		}
+
+		std::string error;
+		if (!skip)
+		{
+			try
+			{
+				if (job.img != NULL)
+				{
+					job.img->setSamplingRateInHeader(job.angpix, job.angpix);
+					job.img->write(job.fn_img, -1, false, WRITE_OVERWRITE, job.datatype);
+				}
+				else
+					job.task();
+			}
+			catch (RelionError &e)
+			{
+				error = (job.img != NULL) ? job.fn_img + ": " + e.msg : e.msg;
+			}
+		}
+		delete job.img;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (error != "" && !write_failed)
+		{
+			write_error = error;
+			write_failed = true;
+		}
+		n_writing--;
+		cond.notify_all();
+	}
+}
+
 void MotioncorrRunner::read(int argc, char **argv, int rank)
 {
 	parser.setCommandLine(argc, argv);
@@ -85,6 +316,9 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 	do_skip_logfile = parser.checkOption("--skip_logfile", "Skip generation of tracks-part of the logfile.pdf");
 	n_threads = textToInteger(parser.getOption("--j", "Number of threads per movie (= process)", "1"));
 	max_io_threads = textToInteger(parser.getOption("--max_io_threads", "Limit the number of IO threads.", "-1"));
+	prefetch_movies = textToInteger(parser.getOption("--prefetch_movies", "Number of movies to read and decode ahead while a movie is aligned; each takes as much memory as the frames of a movie. The reading threads are taken from --j (half of them, at most --max_io_threads); with --j 1 they are one extra thread. (0 = off; only with --use_own)", "0"));
+	n_loader_threads = 0;
+	write_queue = textToInteger(parser.getOption("--write_queue", "Number of aligned sums that can wait to be written while the next movie is aligned (0 = write immediately; only with --use_own)", "1"));
 	continue_old = parser.checkOption("--only_do_unfinished", "Only run motion correction for those micrographs for which there is not yet an output micrograph.");
 	do_at_most = textToInteger(parser.getOption("--do_at_most", "Only process at most this number of (unprocessed) micrographs.", "-1"));
 	grouping_for_ps = textToInteger(parser.getOption("--grouping_for_ps", "Group this number of frames and write summed power spectrum. -1 == do not write", "-1"));
@@ -202,6 +436,14 @@ void MotioncorrRunner::initialise()
 	}
 	else if (do_own)
 	{
+		// The next movies are read while the current one is aligned, so split the --j threads between the two
+		if (prefetch_movies > 0 && n_threads > 1)
+		{
+			n_loader_threads = n_threads / 2;
+			if (max_io_threads > 0 && n_loader_threads > max_io_threads)
+				n_loader_threads = max_io_threads;
+			n_threads -= n_loader_threads;
+		}
 
 		if (patch_x <= 0 || patch_y <= 0) {
 			REPORT_ERROR("The number of patches must be a positive integer.");
@@ -419,6 +661,7 @@ void MotioncorrRunner::initialise()
 
 void MotioncorrRunner::prepareGainReference(bool write_gain)
 {
+	fn_gain_source = fn_gain_reference;
 	if (fn_gain_reference == "") return;
 	if (fn_gain_reference.getExtension().find("dm") != std::string::npos)
 		REPORT_ERROR("Gain reference in Digital Micrograph format is not supported in RELION. Although UCSF MotionCor2 accepts it, you cannot run Bayesian Polishing afterwards. Please convert the gain reference to MRC format by other programs, for example, dm2mrc in IMOD or e2proc2d.py in EMAN2.");
@@ -462,6 +705,188 @@ void MotioncorrRunner::prepareGainReference(bool write_gain)
 	fn_gain_reference =fn_new_gain;
 }
 
+// Name, size and modification time, to detect changed input files
+static std::string describeFile(const FileName &fn)
+{
+	struct stat st;
+	if (fn == "" || stat(fn.c_str(), &st) != 0)
+		return fn;
+
+	std::ostringstream ss;
+	ss << fn << " " << st.st_size << " " << st.st_mtime;
+	return ss.str();
+}
+
+void MotioncorrRunner::prepareGainDefectCache(bool write_cache)
+{
+	fn_gain_cache = fn_defect_cache = "";
+	if (!do_own || fn_micrographs.size() == 0) return;
+	if (fn_gain_reference == "" && fn_defect == "") return;
+
+	if (fn_gain_reference != "")
+		fn_gain_cache = fn_out + "gain_cache.bin";
+	fn_defect_cache = fn_out + "defect_cache.bin";
+	if (!write_cache) return;
+
+	// The gain is applied before binning, so the binning factor does not matter
+	const FileName fn_movie = fn_micrographs[0];
+	const bool isEER = EERRenderer::isEER(fn_movie);
+	std::ostringstream key;
+	key << "gain: " << describeFile(fn_gain_source) << "\nrotation: " << gain_rotation << " flip: " << gain_flip << "\n";
+	key << "defect: " << describeFile(fn_defect) << "\n";
+	if (isEER)
+		key << "eer_upsampling: " << eer_upsampling << "\n";
+
+	const FileName fn_key = fn_out + "gain_cache.key";
+	if (exists(fn_key) && exists(fn_defect_cache) && (fn_gain_cache == "" || exists(fn_gain_cache)))
+	{
+		std::ifstream f_key(fn_key);
+		std::stringstream old_key;
+		old_key << f_key.rdbuf();
+		if (old_key.str() == key.str())
+		{
+			std::cout << " Reusing the gain and defect cache in " << fn_out << std::endl;
+			return;
+		}
+	}
+	std::remove(fn_key.c_str());
+
+	Image<float> Igain;
+	int nx, ny;
+	if (isEER)
+	{
+		EERRenderer renderer;
+		renderer.read(fn_movie, eer_upsampling);
+		nx = renderer.getWidth(); ny = renderer.getHeight();
+		if (fn_gain_reference != "")
+			renderer.loadEERGain(fn_gain_reference, Igain());
+	}
+	else if (fn_gain_reference != "")
+	{
+		Igain.read(fn_gain_reference);
+		nx = XSIZE(Igain()); ny = YSIZE(Igain());
+	}
+	else if (CompressedMRCReader::isCompressedMRC(fn_movie))
+	{
+		CompressedMRCReader reader;
+		reader.read(fn_movie, 1);
+		nx = XSIZE(reader.Ihead()); ny = YSIZE(reader.Ihead());
+	}
+	else
+	{
+		Image<float> Ihead;
+		Ihead.read(fn_movie, false, -1, false, true); // select_img -1, mmap false, is_2D true
+		nx = XSIZE(Ihead()); ny = YSIZE(Ihead());
+	}
+
+	MultidimArray<bool> bBad(ny, nx);
+	bBad.initZeros();
+	if (fn_defect != "")
+		fillDefectMask(bBad, fn_defect, n_threads);
+	if (fn_gain_reference != "")
+	{
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain())
+			if (DIRECT_MULTIDIM_ELEM(Igain(), n) == 0)
+				DIRECT_MULTIDIM_ELEM(bBad, n) = true;
+
+		// A plain header and the pixels, so that the ranks can map the file and use it in place
+		std::ofstream f_gain(fn_gain_cache, std::ios::binary);
+		const long int gain_header[2] = {XSIZE(Igain()), YSIZE(Igain())};
+		f_gain.write((const char*)gain_header, sizeof(gain_header));
+		f_gain.write((const char*)MULTIDIM_ARRAY(Igain()), gain_header[0] * gain_header[1] * sizeof(float));
+		f_gain.close();
+		if (!f_gain)
+			REPORT_ERROR("Failed to write the gain cache " + fn_gain_cache);
+	}
+
+	std::vector<long int> defects;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(bBad)
+		if (DIRECT_MULTIDIM_ELEM(bBad, n))
+			defects.push_back(n);
+
+	std::ofstream f_defect(fn_defect_cache, std::ios::binary);
+	const long int header[3] = {nx, ny, (long int)defects.size()};
+	f_defect.write((const char*)header, sizeof(header));
+	if (defects.size() > 0)
+		f_defect.write((const char*)&defects[0], defects.size() * sizeof(long int));
+	f_defect.close();
+	if (!f_defect)
+		REPORT_ERROR("Failed to write the defect cache " + fn_defect_cache);
+
+	// The key is written last, so that an incomplete cache is never reused
+	std::ofstream f_key(fn_key);
+	f_key << key.str();
+	f_key.close();
+
+	std::cout << " Prepared the gain and defect cache in " << fn_out << " (" << defects.size() << " defect pixels)" << std::endl;
+}
+
+void MotioncorrRunner::loadGainDefectCache()
+{
+	unmapGainCache();
+	defect_pixels.clear();
+	defect_nx = defect_ny = 0;
+	if (fn_defect_cache == "") return;
+
+	if (fn_gain_cache != "")
+		mapGainCache();
+
+	std::ifstream f_defect(fn_defect_cache, std::ios::binary);
+	long int header[3];
+	if (!f_defect.read((char*)header, sizeof(header)))
+		REPORT_ERROR("Failed to read the defect cache " + fn_defect_cache);
+	defect_nx = header[0]; defect_ny = header[1];
+	defect_pixels.resize(header[2]);
+	if (header[2] > 0 && !f_defect.read((char*)&defect_pixels[0], header[2] * sizeof(long int)))
+		REPORT_ERROR("Failed to read the defect cache " + fn_defect_cache);
+}
+
+void MotioncorrRunner::mapGainCache()
+{
+	unmapGainCache();
+
+	// PROT_READ and MAP_SHARED: the ranks on a node share the pages of the page cache
+	const int fd = open(fn_gain_cache.c_str(), O_RDONLY);
+	if (fd == -1)
+		REPORT_ERROR("Failed to open the gain cache " + fn_gain_cache);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)(2 * sizeof(long int)))
+	{
+		close(fd);
+		REPORT_ERROR("Failed to read the gain cache " + fn_gain_cache);
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+	if (map == MAP_FAILED)
+		REPORT_ERROR("Failed to map the gain cache " + fn_gain_cache);
+	gain_map = map;
+	gain_map_size = st.st_size;
+
+	const long int *header = (const long int*)map;
+	if (header[0] <= 0 || header[1] <= 0 || gain_map_size != sizeof(long int) * 2 + header[0] * header[1] * sizeof(float))
+	{
+		unmapGainCache();
+		REPORT_ERROR("The gain cache " + fn_gain_cache + " is corrupt");
+	}
+
+	// Igain_cache does not own the data, so clear() does not free it; writing to it would fault
+	Igain_cache.setDimensions(header[0], header[1], 1, 1);
+	Igain_cache.data = (float*)(header + 2);
+	Igain_cache.destroyData = false;
+}
+
+void MotioncorrRunner::unmapGainCache()
+{
+	Igain_cache.clear();
+
+	if (gain_map != NULL)
+		munmap(gain_map, gain_map_size);
+	gain_map = NULL;
+	gain_map_size = 0;
+}
+
 FileName MotioncorrRunner::getOutputFileNames(FileName fn_mic, bool continue_even_odd)
 {
 	// If there are any dots in the filename, replace them by underscores
@@ -488,6 +913,8 @@ FileName MotioncorrRunner::getOutputFileNames(FileName fn_mic, bool continue_eve
 void MotioncorrRunner::run()
 {
 	prepareGainReference(true);
+	prepareGainDefectCache(true);
+	loadGainDefectCache();
 
 	int barstep;
 	if (verb > 0)
@@ -503,6 +930,9 @@ void MotioncorrRunner::run()
 		barstep = XMIPP_MAX(1, fn_micrographs.size() / 60);
 	}
 
+	if (do_own)
+		pipeline.start(fn_micrographs, [this](FileName fn_mic, MotioncorrMovie &movie) { readMovie(fn_mic, movie); }, prefetch_movies, write_queue);
+
 	for (long int imic = 0; imic < fn_micrographs.size(); imic++)
 	{
 		if (verb > 0 && imic % barstep == 0)
@@ -512,6 +942,8 @@ void MotioncorrRunner::run()
 		if (pipeline_control_check_abort_job())
 			exit(RELION_EXIT_ABORTED);
 
+		pipeline.beginMovie(imic);
+
 		Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
 
         // Set per-micrograph pre_exposure
@@ -535,6 +967,9 @@ void MotioncorrRunner::run()
 		}
 	}
 
+	// Wait for the remaining sums to be written
+	pipeline.finish();
+
 	if (verb > 0)
 		progress_bar(fn_micrographs.size());
 
@@ -899,9 +1334,10 @@ void MotioncorrRunner::saveModel(Micrograph &mic) {
 	mic.dose_per_frame = dose_per_frame;
 	mic.fnDefect = fn_defect;
 
-	FileName fn_avg = getOutputFileNames(mic.getMovieFilename());
+	FileName fn_star = getOutputFileNames(mic.getMovieFilename()).withoutExtension() + ".star";
 
-	mic.write(fn_avg.withoutExtension() + ".star");
+	// The STAR file marks the micrograph as done for --only_do_unfinished, so it must not be written before the sums
+	pipeline.whenWritten([mic, fn_star]() mutable { mic.write(fn_star); });
 }
 
 void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
@@ -1104,15 +1540,7 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 	}
 }
 
-bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
-	FileName fn_mic = mic.getMovieFilename();
-	FileName fn_avg = getOutputFileNames(fn_mic);
-	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
-	FileName fn_log = fn_avg.withoutExtension() + ".log";
-	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
-	std::ofstream logfile;
-	logfile.open(fn_log);
-
+void MotioncorrRunner::readMovie(FileName fn_mic, MotioncorrMovie &movie) {
 	// EER and compressed MRC related things
 	// TODO: will be refactored
 	EERRenderer renderer;
@@ -1120,26 +1548,14 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	CompressedMRCReader compressedMRCreader;
 	const bool isCompressedMRC = compressedMRCreader.isCompressedMRC(fn_mic);
 
-	int n_io_threads = n_threads;
-	logfile << "Working on " << fn_mic << " with " << n_threads << " thread(s)." << std::endl << std::endl;
+	int n_io_threads = (n_loader_threads > 0) ? n_loader_threads : n_threads;
 	if (max_io_threads > 0 && n_io_threads > max_io_threads)
-	{
 		n_io_threads = max_io_threads;
-		logfile << "Limitted the number of IO threads per movie to " << n_io_threads << " thread(s)." << std::endl;
-	}
 
-	Image<float> Ihead, Igain, Iref, Iref_odd, Iref_even;
-	std::vector<MultidimArray<fComplex> > Fframes;
-	std::vector<Image<float> > Iframes;
-	std::vector<Image<float> > Irefframes;
-	std::vector<int> frames; // 0-indexed
-
-	RFLOAT output_angpix = angpix * bin_factor;
-	RFLOAT prescaling = 1;
-
-	const int hotpixel_sigma = 6;
-	const int fit_rmsd_threshold = 10; // px
-	int nx, ny, nn;
+	Image<float> Ihead;
+	int &nx = movie.nx, &ny = movie.ny, &nn = movie.nn;
+	std::vector<int> &frames = movie.frames; // 0-indexed
+	std::vector<Image<float> > &Iframes = movie.Iframes;
 
 	// Check image size
 	if (isEER)
@@ -1161,21 +1577,94 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 
 	// Which frame to use?
-	logfile << "Movie size: X = " << nx << " Y = " << ny << " N = " << nn << std::endl;
-	logfile << "Frames to be used:";
+	frames.clear();
 	for (int i = 0; i < nn; i++) {
 		// For users, all numbers are 1-indexed. Internally they are 0-indexed.
 		int frame = i + 1;
 		if (frame < first_frame_sum) continue;
 		if (last_frame_sum > 0 && frame > last_frame_sum) continue;
 		frames.push_back(i);
-		logfile << " " << frame;
 	}
-	logfile << std::endl;
 
+	// Movies with too few frames are skipped by executeOwnMotionCorrection()
 	const int n_frames = frames.size();
+	Iframes.clear();
+	if (n_frames / group < 3)
+		return;
+
+	// The gain reference has been prepared by prepareGainDefectCache()
+	const MultidimArray<float> &Igain = Igain_cache;
+	if (fn_gain_reference != "") {
+		if (XSIZE(Igain) != nx || YSIZE(Igain) != ny) {
+			std::cerr << "fn_mic: " << fn_mic << " nx = " << nx << " ny = " << ny << " gain nx = " << XSIZE(Igain) << " gain ny = " << YSIZE(Igain) <<  std::endl;
+			REPORT_ERROR("The size of the image and the size of the gain reference do not match. Make sure the gain reference has been rotated if necessary.");
+		}
+	}
+
+	// Read images
 	Iframes.resize(n_frames);
-	Irefframes.resize(n_frames);
+	// For EER, only the compressed frames we use are read and the gain is applied
+	// to each fraction as soon as it has been rendered.
+	if (isEER)
+		renderer.setFramesOfInterest(frames[0] * eer_grouping + 1, (frames[n_frames - 1] + 1) * eer_grouping);
+	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
+	for (int iframe = 0; iframe < n_frames; iframe++) {
+		if (isEER)
+			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe](), Igain);
+		else if (isCompressedMRC)
+			compressedMRCreader.readFrameInto(Iframes[iframe], frames[iframe]);
+		else
+			Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
+	}
+	if (isEER)
+		renderer.releaseFrames();
+}
+
+bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
+	FileName fn_mic = mic.getMovieFilename();
+	FileName fn_avg = getOutputFileNames(fn_mic);
+	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
+	FileName fn_log = fn_avg.withoutExtension() + ".log";
+	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
+	// Like the STAR file, the log file is written once the sums have been written
+	std::ostringstream logfile;
+
+	const bool isEER = EERRenderer::isEER(fn_mic);
+
+	int n_io_threads = n_threads;
+	logfile << "Working on " << fn_mic << " with " << n_threads << " thread(s)." << std::endl << std::endl;
+	if (max_io_threads > 0 && n_io_threads > max_io_threads)
+	{
+		n_io_threads = max_io_threads;
+		logfile << "Limitted the number of IO threads per movie to " << n_io_threads << " thread(s)." << std::endl;
+	}
+
+	// Read images (or take them from the pipeline, which read them while the previous movie was aligned)
+	RCTIC(TIMING_READ_MOVIE);
+	MotioncorrMovie movie;
+	pipeline.takeMovie(movie);
+	RCTOC(TIMING_READ_MOVIE);
+
+	Image<float> Iref, Iref_odd, Iref_even;
+	std::vector<MultidimArray<fComplex> > Fframes;
+	std::vector<Image<float> > &Iframes = movie.Iframes;
+	const std::vector<int> &frames = movie.frames; // 0-indexed
+
+	RFLOAT output_angpix = angpix * bin_factor;
+	RFLOAT prescaling = 1;
+
+	const int hotpixel_sigma = 6;
+	const int fit_rmsd_threshold = 10; // px
+	int nx = movie.nx, ny = movie.ny, nn = movie.nn;
+
+	// Which frame to use?
+	logfile << "Movie size: X = " << nx << " Y = " << ny << " N = " << nn << std::endl;
+	logfile << "Frames to be used:";
+	for (int i = 0; i < frames.size(); i++)
+		logfile << " " << frames[i] + 1; // For users, all numbers are 1-indexed. Internally they are 0-indexed.
+	logfile << std::endl;
+
+	const int n_frames = frames.size();
 	Fframes.resize(n_frames);
 
 	std::vector<RFLOAT> xshifts(n_frames), yshifts(n_frames);
@@ -1186,6 +1675,8 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	if (n_groups < 3)
 	{
 		std::cerr << "Skipped " << fn_mic << ": too few frames (" << n_groups << " < 3) after grouping . Probably the movie is truncated or you made a mistake in frame grouping." << std::endl;
+		std::ofstream fh_log(fn_log);
+		fh_log << logfile.str();
 		return false;
 	}
 	int n_remaining = n_frames % group;
@@ -1216,41 +1707,14 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	logfile << "interpolate_shifts = " << interpolate_shifts << std::endl;
 	logfile << std::endl;
 
-	// Read gain reference
-	RCTIC(TIMING_READ_GAIN);
-	if (fn_gain_reference != "") {
-		if (isEER)
-			renderer.loadEERGain(fn_gain_reference, Igain());
-		else
-			Igain.read(fn_gain_reference);
-
-		if (XSIZE(Igain()) != nx || YSIZE(Igain()) != ny) {
-			std::cerr << "fn_mic: " << fn_mic << " nx = " << nx << " ny = " << ny << " gain nx = " << XSIZE(Igain()) << " gain ny = " << YSIZE(Igain()) <<  std::endl;
-			REPORT_ERROR("The size of the image and the size of the gain reference do not match. Make sure the gain reference has been rotated if necessary.");
-		}
-	}
-	RCTOC(TIMING_READ_GAIN);
-
-	// Read images
-	RCTIC(TIMING_READ_MOVIE);
-	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		if (isEER)
-			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe]());
-		else if (isCompressedMRC)
-			compressedMRCreader.readFrameInto(Iframes[iframe], frames[iframe]);
-		else
-			Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
-	}
-	RCTOC(TIMING_READ_MOVIE);
-
-	// Apply gain
+	// Apply gain (the gain reference has been prepared by prepareGainDefectCache())
+	const MultidimArray<float> &Igain = Igain_cache;
 	RCTIC(TIMING_APPLY_GAIN);
-	if (fn_gain_reference != "") {
+	if (fn_gain_reference != "" && !isEER) {
 		#pragma omp parallel for num_threads(n_threads)
 		for (int iframe = 0; iframe < n_frames; iframe++) {
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain()) {
-				DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain) {
+				DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n) *= DIRECT_MULTIDIM_ELEM(Igain, n);
 			}
 		}
 	}
@@ -1287,41 +1751,37 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		const RFLOAT threshold = mean + hotpixel_sigma * std;
 		logfile << "In unaligned sum, Mean = " << mean << " Std = " << std << " Hotpixel threshold = " << threshold << std::endl;
 
-		MultidimArray<bool> bBad(ny, nx);
-		bBad.initZeros();
-		if (fn_defect != "")
+		// Bad pixels are kept as sorted pixel indices, so that correction costs O(bad pixels).
+		// Defects from the defect file and zero gain come from the cache.
+		std::vector<long int> movie_defects;
+		const std::vector<long int> *defects = &defect_pixels;
+		if (fn_defect != "" && (nx != defect_nx || ny != defect_ny))
 		{
+			// This movie has a different size from the one used to prepare the cache
+			MultidimArray<bool> bBad(ny, nx);
+			bBad.initZeros();
 			fillDefectMask(bBad, fn_defect, n_threads);
-#ifdef DEBUG_HOTPIXELS
-			Image<RFLOAT> tmp(nx, ny);
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(tmp())
-				DIRECT_MULTIDIM_ELEM(tmp(), n) = DIRECT_MULTIDIM_ELEM(bBad, n);
-			tmp.write("defect.mrc");
-#endif
-		}
-
-		if (fn_gain_reference != "")
-		{
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain())
-			{
-				if (DIRECT_MULTIDIM_ELEM(Igain(), n) == 0)
-				{
-					DIRECT_MULTIDIM_ELEM(bBad, n) = true;
-				}
-			}
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(bBad)
+				if (DIRECT_MULTIDIM_ELEM(bBad, n))
+					movie_defects.push_back(n);
+			defects = &movie_defects;
 		}
 
-		int n_bad = 0;
+		std::vector<long int> hot_pixels;
 		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
-			if (DIRECT_MULTIDIM_ELEM(Isum, n) > threshold && !DIRECT_MULTIDIM_ELEM(bBad, n)) {
-				DIRECT_MULTIDIM_ELEM(bBad, n) = true;
-				n_bad++;
+			if (DIRECT_MULTIDIM_ELEM(Isum, n) > threshold && !std::binary_search(defects->begin(), defects->end(), n)) {
+				hot_pixels.push_back(n);
 				mic.hotpixelX.push_back(n % nx);
 				mic.hotpixelY.push_back(n / nx);
 			}
 		}
+		const int n_bad = hot_pixels.size();
 		logfile << "Detected " << n_bad << " hot pixels to be corrected." << std::endl;
 		Isum.clear();
+
+		std::vector<long int> bad_pixels(defects->size() + hot_pixels.size());
+		std::merge(defects->begin(), defects->end(), hot_pixels.begin(), hot_pixels.end(), bad_pixels.begin());
+		hot_pixels.clear();
 		RCTOC(TIMING_DETECT_HOT);
 
 		RCTIC(TIMING_FIX_DEFECT);
@@ -1331,15 +1791,14 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		const int NUM_MIN_OK = 6;
 		const int D_MAX = isEER ? 4 : 2;
 		const int PBUF_SIZE = 100;
-		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(bBad)
+		// Bad pixels are replaced only by good neighbours, so the order does not matter
+		#pragma omp parallel for num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++)
 		{
-			if (!DIRECT_A2D_ELEM(bBad, i, j)) continue;
-//			std::cout << "Hot pixel at (" << i << ", " << j << ")" << std::endl;
-			#pragma omp parallel for num_threads(n_threads)
-			for (int iframe = 0; iframe < n_frames; iframe++)
+			RFLOAT pbuf[PBUF_SIZE];
+			for (long int ibad = 0; ibad < bad_pixels.size(); ibad++)
 			{
-				RFLOAT pbuf[PBUF_SIZE];
-//				std::cout << "Frame: "<< iframe << std::endl;
+				const int i = bad_pixels[ibad] / nx, j = bad_pixels[ibad] % nx;
 				int n_ok = 0;
 				for (int dy= -D_MAX; dy <= D_MAX; dy++)
 				{
@@ -1349,20 +1808,15 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 					{
 						int x = j + dx;
 						if (x < 0 || x >= nx) continue;
-//						std::cout << " " << DIRECT_A2D_ELEM(Iframes[iframe](), y, x);
-						if (DIRECT_A2D_ELEM(bBad, y, x)) continue;
-//						std::cout << "o";
+						if (std::binary_search(bad_pixels.begin(), bad_pixels.end(), (long int)y * nx + x)) continue;
 						pbuf[n_ok] = DIRECT_A2D_ELEM(Iframes[iframe](), y, x);
 						n_ok++;
 					}
-//					std::cout << std::endl;
 				}
-//				std::cout << "n_ok = " << n_ok;
 				if (n_ok > NUM_MIN_OK)
 					DIRECT_A2D_ELEM(Iframes[iframe](), i, j) = pbuf[rand() % n_ok];
 				else
 					DIRECT_A2D_ELEM(Iframes[iframe](), i, j) = rnd_gaus(frame_mean, frame_std);
-//				std::cout << " set = " << DIRECT_A2D_ELEM(Iframes[iframe](), i, j) << std::endl;
 			}
 		}
 		RCTOC(TIMING_FIX_DEFECT);
@@ -1417,26 +1871,21 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		MultidimArray<fComplex> F_ps, F_ps_small;
 
 		// 0. Group and sum
+		// This is done pixel by pixel in a single pass over the frames, without temporary group sums.
 		PS_sum().initZeros();
 		PS_sum().setXmippOrigin();
-		for (int iframe = 0; iframe < n_frames; iframe += grouping_for_ps)
+		#pragma omp parallel for num_threads(n_threads)
+		FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum()) // logical 2D access, i = logical_y, j = logical_x
 		{
-			MultidimArray<fComplex> F_sum(Fframes[iframe]);
-			for (int j = 1; j < grouping_for_ps && j + iframe < n_frames; j++)
+			// F(i, j) = conj(F(-i, -j))
+			const int fi = (j > 0) ? i : -i, fj = (j > 0) ? j : -j;
+			for (int iframe = 0; iframe < n_frames; iframe += grouping_for_ps)
 			{
-				#pragma omp parallel for num_threads(n_threads)
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(F_sum)
-					DIRECT_MULTIDIM_ELEM(F_sum, n) += DIRECT_MULTIDIM_ELEM(Fframes[j + iframe], n);
-			}
+				fComplex F_sum = FFTW2D_ELEM(Fframes[iframe], fi, fj); // accessor is (Y, X)
+				for (int k = 1; k < grouping_for_ps && k + iframe < n_frames; k++)
+					F_sum += FFTW2D_ELEM(Fframes[k + iframe], fi, fj);
 
-			#pragma omp parallel for num_threads(n_threads)
-			FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum()) // logical 2D access, i = logical_y, j = logical_x
-			{
-				// F(i, j) = conj(F(-i, -j))
-				if (j > 0)
-					A2D_ELEM(PS_sum(), i, j) += abs(FFTW2D_ELEM(F_sum, i, j)); // accessor is (Y, X)
-				else
-					A2D_ELEM(PS_sum(), i, j) += abs(FFTW2D_ELEM(F_sum, -i, -j));
+				A2D_ELEM(PS_sum(), i, j) += abs(F_sum);
 			}
 		}
 //#define DEBUG_PS
@@ -1498,8 +1947,7 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		RCTOC(TIMING_POWER_SPECTRUM_RESIZE);
 
 		// 4. Write
-		PS_sum.setSamplingRateInHeader(ps_angpix, ps_angpix);
-		PS_sum.write(fn_ps);
+		pipeline.write(PS_sum, fn_ps, ps_angpix);
 		logfile << "Written the power spectrum for CTF estimation: " << fn_ps << std::endl;
 		logfile << "The pixel size for CTF estimation: " << ps_angpix << std::endl;
 	}
@@ -1509,7 +1957,7 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	// TODO: Consider frame grouping in global alignment.
 	logfile << std::endl << "Global alignment:" << std::endl;
 	RCTIC(TIMING_GLOBAL_ALIGNMENT);
-	alignPatch(Fframes, nx, ny, bfactor / (prescaling * prescaling), xshifts, yshifts, logfile);
+	alignPatch(Fframes, nx, ny, bfactor / (prescaling * prescaling), xshifts, yshifts, logfile, n_threads);
 	RCTOC(TIMING_GLOBAL_ALIGNMENT);
 	for (int i = 0, ilim = xshifts.size(); i < ilim; i++) {
 		// Should be in the original pixel size
@@ -1525,7 +1973,8 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	for (int iframe = 0; iframe < n_frames; iframe++) {
 		Iframes[iframe]().reshape(ny, nx);
 		NewFFT::inverseFourierTransform(Fframes[iframe], Iframes[iframe]());
-		// Unfortunately, we cannot deallocate Fframes here because of dose-weighting
+		// Fframes are only needed for dose weighting
+		if (!do_dose_weighting) Fframes[iframe].clear();
 	}
 	RCTOC(TIMING_GLOBAL_IFFT);
 
@@ -1540,11 +1989,15 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	if (do_local) {
 		const int patch_nx = nx / patch_x, patch_ny = ny / patch_y, n_patches = patch_x * patch_y;
 		std::vector<RFLOAT> patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys;
-		std::vector<MultidimArray<fComplex> > Fpatches(n_groups);
 
-		int ipatch = 1;
-		for (int iy = 0; iy < patch_y; iy++) {
-			for (int ix = 0; ix < patch_x; ix++) {
+		// Patches are small, so threads work on different patches rather than within a patch.
+		std::vector<int> patch_x_start(n_patches), patch_x_end(n_patches), patch_y_start(n_patches), patch_y_end(n_patches);
+		std::vector<std::vector<RFLOAT> > patch_local_xshifts(n_patches, std::vector<RFLOAT>(n_groups)), patch_local_yshifts(n_patches, std::vector<RFLOAT>(n_groups));
+		std::vector<bool> patch_converged(n_patches);
+		std::vector<std::string> patch_logs(n_patches);
+
+		for (int iy = 0, ipatch = 0; iy < patch_y; iy++) {
+			for (int ix = 0; ix < patch_x; ix++, ipatch++) {
 				int x_start = ix * patch_nx, y_start = iy * patch_ny; // Inclusive
 				int x_end = x_start + patch_nx, y_end = y_start + patch_ny; // Exclusive
 				if (x_end > nx) x_end = nx;
@@ -1558,41 +2011,69 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 					if (y_end == ny) y_start++;
 					else y_end--;
 				}
+				patch_x_start[ipatch] = x_start; patch_x_end[ipatch] = x_end;
+				patch_y_start[ipatch] = y_start; patch_y_end[ipatch] = y_end;
+			}
+		}
 
-				int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
-				logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch << " / " << patch_x * patch_y;
-				logfile << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
-				logfile << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
-				ipatch++;
+		RCTIC(TIMING_PATCH_ALIGN);
+		#pragma omp parallel num_threads(XMIPP_MIN(n_threads, n_patches))
+		{
+			// Buffers and FFTW plans are reused for all patches done by this thread
+			MultidimArray<float> Ipatch;
+			MultidimArray<fComplex> Fpatch;
+			std::vector<MultidimArray<fComplex> > Fpatches(n_groups);
+			NewFFT::FloatPlan *plan = NULL;
+
+			#pragma omp for schedule(dynamic)
+			for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+				const int x_start = patch_x_start[ipatch], x_end = patch_x_end[ipatch];
+				const int y_start = patch_y_start[ipatch], y_end = patch_y_end[ipatch];
+
+				if (plan == NULL || YSIZE(Ipatch) != y_end - y_start || XSIZE(Ipatch) != x_end - x_start) {
+					Ipatch.reshape(y_end - y_start, x_end - x_start); // end is not included
+					Fpatch.reshape(y_end - y_start, (x_end - x_start) / 2 + 1);
+					delete plan;
+					plan = new NewFFT::FloatPlan(Ipatch, Fpatch);
+				}
 
-				std::vector<RFLOAT> local_xshifts(n_groups), local_yshifts(n_groups);
-				RCTIC(TIMING_PREP_PATCH);
-				std::vector<MultidimArray<float> >Ipatches(n_threads);
-				#pragma omp parallel for num_threads(n_threads)
 				for (int igroup = 0; igroup < n_groups; igroup++) {
-					const int tid = omp_get_thread_num();
-					Ipatches[tid].reshape(y_end - y_start, x_end - x_start); // end is not included
-					RCTIC(TIMING_CLIP_PATCH);
 					for (int iframe = group_start[igroup]; iframe < group_start[igroup] + group_size[igroup]; iframe++) {
 						for (int ipy = y_start; ipy < y_end; ipy++) {
 							for (int ipx = x_start; ipx < x_end; ipx++) {
-								DIRECT_A2D_ELEM(Ipatches[tid], ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Iframes[iframe](), ipy, ipx);
+								DIRECT_A2D_ELEM(Ipatch, ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Iframes[iframe](), ipy, ipx);
 							}
 						}
 					}
-					RCTOC(TIMING_CLIP_PATCH);
 
-					RCTIC(TIMING_PATCH_FFT);
-					NewFFT::FourierTransform(Ipatches[tid], Fpatches[igroup]);
-					RCTOC(TIMING_PATCH_FFT);
+					NewFFT::FourierTransform(Ipatch, Fpatch, *plan);
+					Fpatches[igroup] = Fpatch;
 				}
-				RCTOC(TIMING_PREP_PATCH);
 
-				RCTIC(TIMING_PATCH_ALIGN);
-				bool converged = alignPatch(Fpatches, x_end - x_start, y_end - y_start, bfactor / (prescaling * prescaling), local_xshifts, local_yshifts, logfile);
-				RCTOC(TIMING_PATCH_ALIGN);
-				if (!converged) continue;
+				std::ostringstream patch_log;
+				patch_converged[ipatch] = alignPatch(Fpatches, x_end - x_start, y_end - y_start, bfactor / (prescaling * prescaling),
+				                                     patch_local_xshifts[ipatch], patch_local_yshifts[ipatch], patch_log, 1);
+				patch_logs[ipatch] = patch_log.str();
+			}
+
+			delete plan;
+		}
+		RCTOC(TIMING_PATCH_ALIGN);
+
+		// Collect the results in the original order
+		for (int iy = 0, ipatch = 0; iy < patch_y; iy++) {
+			for (int ix = 0; ix < patch_x; ix++, ipatch++) {
+				const int x_start = patch_x_start[ipatch], x_end = patch_x_end[ipatch];
+				const int y_start = patch_y_start[ipatch], y_end = patch_y_end[ipatch];
+				int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
+				logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch + 1 << " / " << patch_x * patch_y;
+				logfile << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
+				logfile << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
+				logfile << patch_logs[ipatch];
+
+				if (!patch_converged[ipatch]) continue;
 
+				std::vector<RFLOAT> &local_xshifts = patch_local_xshifts[ipatch], &local_yshifts = patch_local_yshifts[ipatch];
 				std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
 				interpolateShifts(group_start, group_size, local_xshifts, local_yshifts, n_frames, interpolated_xshifts, interpolated_yshifts);
 				if (interpolate_shifts) {
@@ -1621,7 +2102,6 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 				}
 			}
 		}
-		Fpatches.clear();
 
 		// Fit polynomial model
 
@@ -1735,82 +2215,37 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 
 skip_fitting:
-	if (!do_dose_weighting || save_noDW) {
-		Iref().initZeros(Iframes[0]());
-		Iref_odd().initZeros(Iframes[0]());
-		Iref_even().initZeros(Iframes[0]());
-
-		for (int iframe = 0; iframe < n_frames; iframe++){
-			Irefframes[iframe]().initZeros(Iframes[iframe]());	
-		}
-
-		RCTIC(TIMING_REAL_SPACE_INTERPOLATION);
-		logfile << "Summing frames before dose weighting: ";
-		realSpaceInterpolation_withoutsum(Irefframes, Iframes, mic.model, logfile);
-		logfile << " done" << std::endl;
-		RCTOC(TIMING_REAL_SPACE_INTERPOLATION);
-
-		// Apply binning
-		RCTIC(TIMING_BINNING);
-		if (!early_binning && bin_factor != 1) {
-			binNonSquareImage(Iref, bin_factor);
-		}
-		RCTOC(TIMING_BINNING);
-		
-		// Sum frames and save aligned stack
-		for (int iframe = 0; iframe < n_frames; iframe++)
-		{
-		#pragma omp parallel for num_threads(n_threads)
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iref()) {
-			DIRECT_MULTIDIM_ELEM(Iref(), n) += DIRECT_MULTIDIM_ELEM(Irefframes[iframe](), n);
-			}
-
-		// save odd even aligned stack
-		if (even_odd_split)
-		{
-		if ( iframe % 2 == 0)
-		{
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iref_even()) {
-			DIRECT_MULTIDIM_ELEM(Iref_even(), n) += DIRECT_MULTIDIM_ELEM(Irefframes[iframe](), n);			
-		}
-		}
-		else
-		{
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iref_odd()) {
-			DIRECT_MULTIDIM_ELEM(Iref_odd(), n) += DIRECT_MULTIDIM_ELEM(Irefframes[iframe](), n);			
-
-		}
-		}
-		}
-		}
+	// All sums are accumulated together in one pass over the frames
+	std::vector<AlignedSum> sums;
+	const bool do_noDW = !do_dose_weighting || save_noDW;
+	Image<float> Iref_DW;
+	std::vector<Image<float> > Iframes_DW; // only a batch is held at any time
 
-		// Final output
-                Iref.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref.write(!do_dose_weighting ? fn_avg : fn_avg_noDW, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		logfile << "Written aligned but non-dose weighted sum to " << (!do_dose_weighting ? fn_avg : fn_avg_noDW) << std::endl;
-		// ODD-EVEN Output
-		if (even_odd_split)
-		{
-		Iref_odd.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref_even.setSamplingRateInHeader(output_angpix, output_angpix);
+	if (do_noDW) {
+		Iref().initZeros(Iframes[0]());
+		AlignedSum sum = {&Iframes, &Iref(), -1};
+		sums.push_back(sum);
 
-		Iref_odd.write(fn_avg.withoutExtension() + "_ODD.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		Iref_even.write(fn_avg.withoutExtension() + "_EVN.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		logfile << "Written aligned but non-dose weighted sum of odd frames to " << (fn_avg.withoutExtension() + "_ODD.mrc") << std::endl;
-		logfile << "Written aligned but non-dose weighted sum of even frames to " << (fn_avg.withoutExtension() + "_EVN.mrc") << std::endl;
+		if (even_odd_split) {
+			Iref_even().initZeros(Iframes[0]());
+			Iref_odd().initZeros(Iframes[0]());
+			AlignedSum sum_even = {&Iframes, &Iref_even(), 0}, sum_odd = {&Iframes, &Iref_odd(), 1};
+			sums.push_back(sum_even);
+			sums.push_back(sum_odd);
 		}
 	}
 
 	// Dose weighting
+	std::vector <RFLOAT> doses(n_frames);
+	MultidimArray<RFLOAT> dw_Ne, dw_norm;
+	MultidimArray<fComplex> F_DW_sum; // without a local model, the dose-weighted sum is made in Fourier space
 	if (do_dose_weighting) {
-		RCTIC(TIMING_DOSE_WEIGHTING);
 		if (std::abs(voltage - 300) > 2 && std::abs(voltage - 200) > 2 && std::abs(voltage - 100) > 2) {
 			REPORT_ERROR("Sorry, dose weighting is supported only for 300, 200 or 100 kV");
 		}
 
         logfile << "Pre-exposure: = " << pre_exposure << std::endl;
 
-		std::vector <RFLOAT> doses(n_frames);
 		for (int iframe = 0; iframe < n_frames; iframe++) {
 			// dose AFTER each frame.
 			doses[iframe] = mic.pre_exposure + dose_per_frame * (frames[iframe] + 1);
@@ -1822,41 +2257,110 @@ skip_fitting:
 		}
 
 		RCTIC(TIMING_DW_WEIGHT);
-		doseWeighting(Fframes, doses, angpix * prescaling);
+		prepareDoseWeighting(XSIZE(Fframes[0]), YSIZE(Fframes[0]), doses, angpix * prescaling, dw_Ne, dw_norm);
 		RCTOC(TIMING_DW_WEIGHT);
 
-		// Update real space images
-		RCTIC(TIMING_DW_IFFT);
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			NewFFT::inverseFourierTransform(Fframes[iframe], Iframes[iframe]());
+		if (mic.model != NULL) {
+			Iref_DW().initZeros(ny, nx);
+			Iframes_DW.resize(n_frames);
+			AlignedSum sum = {&Iframes_DW, &Iref_DW(), -1};
+			sums.push_back(sum);
+		} else {
+			F_DW_sum.initZeros(Fframes[0]);
+		}
+
+		// The frames without dose weighting are no longer needed
+		if (!do_noDW) {
+			for (int iframe = 0; iframe < n_frames; iframe++)
+				Iframes[iframe].clear();
+		}
+	}
+
+	// Dose-weighted frames are made and summed in batches of n_threads,
+	// so that only a few of them are in memory at any time.
+	// Each Fourier transform is released as soon as it has been used.
+	logfile << "Summing frames: ";
+	const int batch_size = do_dose_weighting ? n_threads : n_frames;
+	for (int batch_start = 0; batch_start < n_frames; batch_start += batch_size) {
+		const int batch_end = XMIPP_MIN(batch_start + batch_size, n_frames);
+
+		if (do_dose_weighting) {
+			RCTIC(TIMING_DOSE_WEIGHTING);
+			#pragma omp parallel for num_threads(n_threads)
+			for (int iframe = batch_start; iframe < batch_end; iframe++) {
+				doseWeightFrame(Fframes[iframe], doses[iframe], dw_Ne, dw_norm);
+				if (mic.model != NULL) {
+					Iframes_DW[iframe]().reshape(ny, nx);
+					NewFFT::inverseFourierTransform(Fframes[iframe], Iframes_DW[iframe](), NewFFT::FwdOnly, false);
+				}
+			}
+
+			if (mic.model == NULL) {
+				#pragma omp parallel for num_threads(n_threads)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(F_DW_sum) {
+					for (int iframe = batch_start; iframe < batch_end; iframe++) {
+						DIRECT_MULTIDIM_ELEM(F_DW_sum, n) += DIRECT_MULTIDIM_ELEM(Fframes[iframe], n);
+					}
+				}
+			}
+
+			for (int iframe = batch_start; iframe < batch_end; iframe++)
+				Fframes[iframe].clear();
+			RCTOC(TIMING_DOSE_WEIGHTING);
 		}
-		RCTOC(TIMING_DW_IFFT);
-		RCTOC(TIMING_DOSE_WEIGHTING);
 
-		Iref().initZeros(Iframes[0]());
 		RCTIC(TIMING_REAL_SPACE_INTERPOLATION);
-		logfile << "Summing frames after dose weighting: ";
-		realSpaceInterpolation(Iref, Iframes, mic.model, logfile);
-		logfile << " done" << std::endl;
+		for (int iframe = batch_start; iframe < batch_end; iframe++) {
+			logfile << "." << std::flush;
+			realSpaceInterpolation(sums, iframe, mic.model);
+			if (do_dose_weighting && mic.model != NULL)
+				Iframes_DW[iframe].clear();
+		}
 		RCTOC(TIMING_REAL_SPACE_INTERPOLATION);
+	}
+	logfile << " done" << std::endl;
+
+	if (do_dose_weighting && mic.model == NULL) {
+		RCTIC(TIMING_DW_IFFT);
+		Iref_DW().reshape(ny, nx);
+		NewFFT::inverseFourierTransform(F_DW_sum, Iref_DW(), NewFFT::FwdOnly, false);
+		F_DW_sum.clear();
+		RCTOC(TIMING_DW_IFFT);
+	}
+
+	// Apply binning
+	RCTIC(TIMING_BINNING);
+	if (!early_binning && bin_factor != 1) {
+		if (do_noDW) binNonSquareImage(Iref, bin_factor);
+		if (do_dose_weighting) binNonSquareImage(Iref_DW, bin_factor);
+	}
+	RCTOC(TIMING_BINNING);
 
-		// Apply binning
-		RCTIC(TIMING_BINNING);
-		if (!early_binning && bin_factor != 1) {
-			binNonSquareImage(Iref, bin_factor);
+	// Final output
+	if (do_noDW) {
+		pipeline.write(Iref, !do_dose_weighting ? fn_avg : fn_avg_noDW, output_angpix, write_float16 ? Float16: Float);
+		logfile << "Written aligned but non-dose weighted sum to " << (!do_dose_weighting ? fn_avg : fn_avg_noDW) << std::endl;
+		// ODD-EVEN Output
+		if (even_odd_split)
+		{
+		pipeline.write(Iref_odd, fn_avg.withoutExtension() + "_ODD.mrc", output_angpix, write_float16 ? Float16: Float);
+		pipeline.write(Iref_even, fn_avg.withoutExtension() + "_EVN.mrc", output_angpix, write_float16 ? Float16: Float);
+		logfile << "Written aligned but non-dose weighted sum of odd frames to " << (fn_avg.withoutExtension() + "_ODD.mrc") << std::endl;
+		logfile << "Written aligned but non-dose weighted sum of even frames to " << (fn_avg.withoutExtension() + "_EVN.mrc") << std::endl;
 		}
-		RCTOC(TIMING_BINNING);
+	}
 
-		// Final output
-                Iref.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref.write(fn_avg, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+	if (do_dose_weighting) {
+		pipeline.write(Iref_DW, fn_avg, output_angpix, write_float16 ? Float16: Float);
 		logfile << "Written aligned and dose-weighted sum to " << fn_avg << std::endl;
 	}
 
 	// Set the start frame for the local motion model.
 	mic.first_frame = frames[0] + 1; // NOTE that this is 1-indexed.
 
+	const std::string log_text = logfile.str();
+	pipeline.whenWritten([fn_log, log_text]() { std::ofstream fh_log(fn_log); fh_log << log_text; });
+
 	return true;
 }
 
@@ -1894,354 +2398,148 @@ void MotioncorrRunner::interpolateShifts(std::vector<int> &group_start, std::vec
 	}
 }
 
-void MotioncorrRunner::realSpaceInterpolation_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile) {
+void MotioncorrRunner::realSpaceInterpolation(std::vector<AlignedSum> &sums, int iframe, MotionModel *model) {
+	if (sums.size() == 0) return;
+
+	// Sums from the same frames share the interpolation
+	std::vector<std::vector<Image<float> >*> sources;
+	std::vector<int> sum_source(sums.size());
+	for (int isum = 0; isum < sums.size(); isum++) {
+		sum_source[isum] = std::find(sources.begin(), sources.end(), sums[isum].frames) - sources.begin();
+		if (sum_source[isum] == sources.size()) sources.push_back(sums[isum].frames);
+	}
+
 	int model_version = MOTION_MODEL_NULL;
 	if (model != NULL) {
 		model_version = model->getModelVersion();
 	}
 
-	const int n_frames = Iframes.size();
+	const int nx = XSIZE((*sources[0])[iframe]()), ny = YSIZE((*sources[0])[iframe]());
+
+	Matrix1D<RFLOAT> coeffX(18), coeffY(18);
+	if (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL) {
+		coeffX = ((ThirdOrderPolynomialModel*)model)->coeffX;
+		coeffY = ((ThirdOrderPolynomialModel*)model)->coeffY;
+	}
+
 	if (model_version == MOTION_MODEL_NULL) {
 		// Simple sum
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			logfile << "." << std::flush;
+		for (int isum = 0; isum < sums.size(); isum++) {
+			if (sums[isum].parity >= 0 && iframe % 2 != sums[isum].parity) continue;
 
+			MultidimArray<float> &Isum = *sums[isum].sum;
+			const MultidimArray<float> &Iframe = (*sums[isum].frames)[iframe]();
 			#pragma omp parallel for num_threads(n_threads)
-//			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum()) {
-//				DIRECT_MULTIDIM_ELEM(Isum(), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
-//			}
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Ialignedframes[iframe]()) {
-				DIRECT_MULTIDIM_ELEM(Ialignedframes[iframe](), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+				DIRECT_MULTIDIM_ELEM(Isum, n) += DIRECT_MULTIDIM_ELEM(Iframe, n);
 			}
 		}
-	} else if (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL) { // Optimised code
-		ThirdOrderPolynomialModel *polynomial_model = (ThirdOrderPolynomialModel*)model;
-		realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(Ialignedframes, Iframes, *polynomial_model, logfile);
-	} else { // general code
-		const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			logfile << "." << std::flush;
-			const RFLOAT z = iframe;
-
-			#pragma omp parallel for num_threads(n_threads)
-			for (int iy = 0; iy < ny; iy++) {
-				const RFLOAT y = (RFLOAT)iy / ny - 0.5;
-				for (int ix = 0; ix < nx; ix++) {
-					const RFLOAT x = (RFLOAT)ix / nx - 0.5;
-					bool valid = true;
-
-					RFLOAT x_fitted, y_fitted;
-					model->getShiftAt(z, x, y, x_fitted, y_fitted);
-					x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
-
-					int x0 = FLOOR(x_fitted);
-					int y0 = FLOOR(y_fitted);
-					const int x1 = x0 + 1;
-					const int y1 = y0 + 1;
-
-					// some conditions might seem redundant but necessary when overflow happened
-					if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
-					if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
-					if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
-					if (y1 >= ny || y1 >= ny - 1) {y0 = ny - 1; valid = false;}
-					if (!valid) {
-/*						DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-						if (std::isnan(DIRECT_A2D_ELEM(Isum(), iy, ix))) {
-							std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-						}
-*/						DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-						if (std::isnan(DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix))) {
-							std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-						}
-
-						continue;
-					}
-
-					const RFLOAT fx = x_fitted - x0;
-					const RFLOAT fy = y_fitted - y0;
-
-					const RFLOAT d00 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-					const RFLOAT d01 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x1);
-					const RFLOAT d10 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x0);
-					const RFLOAT d11 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x1);
-
-					const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
-					const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
-					const RFLOAT val = LIN_INTERP(fy, dx0, dx1);
-#ifdef DEBUG_OWN
-					if (std::isnan(val)) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << " d00 " << d00 << " d01 " << d01 << " d10 " << d10 << " d11 " << d11 << " dx0 " << dx0 << " dx1 " << dx1 << std::endl;
-					}
-#endif
-					//DIRECT_A2D_ELEM(Isum(), iy, ix) += val;
-					DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix) += val;
-				} // y
-			} // x
-		} // frame
-	} // general model
-}
-
-void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile) {
-	const int n_frames = Iframes.size();
-	const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
-	const Matrix1D<RFLOAT> coeffX = model.coeffX, coeffY = model.coeffY;
-
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		logfile << "." << std::flush;
-
-		const RFLOAT z = iframe, z2 = iframe * iframe;
-		const RFLOAT z3 = z * z2;
-		// Common terms
-		const RFLOAT x_C0 = coeffX(0)  * z + coeffX(1)  * z2 + coeffX(2)  * z3;
-		const RFLOAT x_C1 = coeffX(3)  * z + coeffX(4)  * z2 + coeffX(5)  * z3;
-		const RFLOAT x_C2 = coeffX(6)  * z + coeffX(7)  * z2 + coeffX(8)  * z3;
-		const RFLOAT x_C3 = coeffX(9)  * z + coeffX(10) * z2 + coeffX(11) * z3;
-		const RFLOAT x_C4 = coeffX(12) * z + coeffX(13) * z2 + coeffX(14) * z3;
-		const RFLOAT x_C5 = coeffX(15) * z + coeffX(16) * z2 + coeffX(17) * z3;
-		const RFLOAT y_C0 = coeffY(0)  * z + coeffY(1)  * z2 + coeffY(2)  * z3;
-		const RFLOAT y_C1 = coeffY(3)  * z + coeffY(4)  * z2 + coeffY(5)  * z3;
-		const RFLOAT y_C2 = coeffY(6)  * z + coeffY(7)  * z2 + coeffY(8)  * z3;
-		const RFLOAT y_C3 = coeffY(9)  * z + coeffY(10) * z2 + coeffY(11) * z3;
-		const RFLOAT y_C4 = coeffY(12) * z + coeffY(13) * z2 + coeffY(14) * z3;
-		const RFLOAT y_C5 = coeffY(15) * z + coeffY(16) * z2 + coeffY(17) * z3;
+		return;
+	}
 
-		#pragma omp parallel for num_threads(n_threads)
+	const RFLOAT z = iframe, z2 = iframe * iframe;
+	const RFLOAT z3 = z * z2;
+	// Common terms of the polynomial model
+	const RFLOAT x_C0 = coeffX(0)  * z + coeffX(1)  * z2 + coeffX(2)  * z3;
+	const RFLOAT x_C1 = coeffX(3)  * z + coeffX(4)  * z2 + coeffX(5)  * z3;
+	const RFLOAT x_C2 = coeffX(6)  * z + coeffX(7)  * z2 + coeffX(8)  * z3;
+	const RFLOAT x_C3 = coeffX(9)  * z + coeffX(10) * z2 + coeffX(11) * z3;
+	const RFLOAT x_C4 = coeffX(12) * z + coeffX(13) * z2 + coeffX(14) * z3;
+	const RFLOAT x_C5 = coeffX(15) * z + coeffX(16) * z2 + coeffX(17) * z3;
+	const RFLOAT y_C0 = coeffY(0)  * z + coeffY(1)  * z2 + coeffY(2)  * z3;
+	const RFLOAT y_C1 = coeffY(3)  * z + coeffY(4)  * z2 + coeffY(5)  * z3;
+	const RFLOAT y_C2 = coeffY(6)  * z + coeffY(7)  * z2 + coeffY(8)  * z3;
+	const RFLOAT y_C3 = coeffY(9)  * z + coeffY(10) * z2 + coeffY(11) * z3;
+	const RFLOAT y_C4 = coeffY(12) * z + coeffY(13) * z2 + coeffY(14) * z3;
+	const RFLOAT y_C5 = coeffY(15) * z + coeffY(16) * z2 + coeffY(17) * z3;
+
+	#pragma omp parallel num_threads(n_threads)
+	{
+		// Source positions and interpolated values for one row.
+		// Each step is a simple loop over the row, so that the compiler can vectorise it.
+		std::vector<RFLOAT> row_x(nx), row_y(nx), row_fx(nx), row_fy(nx), row_val(nx);
+		std::vector<long int> row_offset(nx), row_dx(nx), row_dy(nx);
+		RFLOAT *xs = &row_x[0], *ys = &row_y[0], *fxs = &row_fx[0], *fys = &row_fy[0], *vals = &row_val[0];
+		long int *offsets = &row_offset[0], *dxs = &row_dx[0], *dys = &row_dy[0];
+
+		#pragma omp for
 		for (int iy = 0; iy < ny; iy++) {
 			const RFLOAT y = (RFLOAT)iy / ny - 0.5;
-			for (int ix = 0; ix < nx; ix++) {
-				const RFLOAT x = (RFLOAT)ix / nx - 0.5;
-				bool valid = true;
 
-				RFLOAT x_fitted = x_C0 + (x_C1 + x_C2 * x) * x + (x_C3 + x_C4 * y + x_C5 * x) * y;
-				RFLOAT y_fitted = y_C0 + (y_C1 + y_C2 * x) * x + (y_C3 + y_C4 * y + y_C5 * x) * y;
+			if (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL) {
+				// Along a row, the shift is a quadratic function of x
+				const RFLOAT x_A = x_C0 + (x_C3 + x_C4 * y) * y, x_B = x_C1 + x_C5 * y;
+				const RFLOAT y_A = y_C0 + (y_C3 + y_C4 * y) * y, y_B = y_C1 + y_C5 * y;
 
-#ifdef VALIDATE_OPTIMISED_CODE
-				RFLOAT x_fitted2, y_fitted2;
-				model.getShiftAt(z, x, y, x_fitted2, y_fitted2);
-				if (abs(x_fitted - x_fitted2) > 1E-4 || abs(y_fitted - y_fitted2) > 1E-4) {
-					std::cout << "error at " << x << ", " << y << " : " << x_fitted << " " << x_fitted2 << " " << y_fitted << " " << y_fitted2 << std::endl;
+				#pragma omp simd
+				for (int ix = 0; ix < nx; ix++) {
+					const RFLOAT x = (RFLOAT)ix / nx - 0.5;
+					xs[ix] = ix - (x_A + (x_B + x_C2 * x) * x);
+					ys[ix] = iy - (y_A + (y_B + y_C2 * x) * x);
 				}
-#endif
-				x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
+			} else { // general model
+				for (int ix = 0; ix < nx; ix++) {
+					const RFLOAT x = (RFLOAT)ix / nx - 0.5;
+					RFLOAT x_fitted, y_fitted;
+					model->getShiftAt(z, x, y, x_fitted, y_fitted);
+					xs[ix] = ix - x_fitted;
+					ys[ix] = iy - y_fitted;
+				}
+			}
 
-				int x0 = FLOOR(x_fitted);
-				int y0 = FLOOR(y_fitted);
+			// Positions outside the frame take the nearest edge pixel. This is expressed as
+			// an interpolation with zero weights and zero steps, so that there is no branch.
+			#pragma omp simd
+			for (int ix = 0; ix < nx; ix++) {
+				int x0 = FLOOR(xs[ix]);
+				int y0 = FLOOR(ys[ix]);
 				const int x1 = x0 + 1;
 				const int y1 = y0 + 1;
+				bool valid = true;
 
 				// some conditions might seem redundant but necessary when overflow happened
 				if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
 				if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
 				if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
 				if (y1 >= ny || y0 >= ny - 1) {y0 = ny - 1; valid = false;}
-				if (!valid) {
-/*					DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-#ifdef DEBUG_OWN
-					if (std::isnan(DIRECT_A2D_ELEM(Isum(), iy, ix))) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-					}
-#endif
-*/					DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-#ifdef DEBUG_OWN
-					if (std::isnan(DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix))) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-					}
-#endif
-					continue;
-				}
 
-				const RFLOAT fx = x_fitted - x0;
-				const RFLOAT fy = y_fitted - y0;
-
-//				std::cout << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-				const RFLOAT d00 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-				const RFLOAT d01 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x1);
-				const RFLOAT d10 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x0);
-				const RFLOAT d11 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x1);
-
-				const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
-				const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
-				const RFLOAT val = LIN_INTERP(fy, dx0, dx1);
-#ifdef DEBUG_OWN
-				if (std::isnan(val)) {
-					std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << " d00 " << d00 << " d01 " << d01 << " d10 " << d10 << " d11 " << d11 << " dx0 " << dx0 << " dx1 " << dx1 << std::endl;
-				}
-#endif
-				//DIRECT_A2D_ELEM(Isum(), iy, ix) += val;
-				DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix) += val;
+				offsets[ix] = (long int)y0 * nx + x0;
+				dxs[ix] = valid ? 1 : 0;
+				dys[ix] = valid ? nx : 0;
+				fxs[ix] = valid ? xs[ix] - x0 : 0;
+				fys[ix] = valid ? ys[ix] - y0 : 0;
 			}
-		}
-	}
-}
-
-void MotioncorrRunner::realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile) {
-	int model_version = MOTION_MODEL_NULL;
-	if (model != NULL) {
-		model_version = model->getModelVersion();
-	}
-
-	const int n_frames = Iframes.size();
-	if (model_version == MOTION_MODEL_NULL) {
-		// Simple sum
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			logfile << "." << std::flush;
 
-			#pragma omp parallel for num_threads(n_threads)
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum()) {
-				DIRECT_MULTIDIM_ELEM(Isum(), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
-			}
-		}
-	} else if (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL) { // Optimised code
-		ThirdOrderPolynomialModel *polynomial_model = (ThirdOrderPolynomialModel*)model;
-		realSpaceInterpolation_ThirdOrderPolynomial(Isum, Iframes, *polynomial_model, logfile);
-	} else { // general code
-		const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			logfile << "." << std::flush;
-			const RFLOAT z = iframe;
+			for (int isource = 0; isource < sources.size(); isource++) {
+				const float *src = MULTIDIM_ARRAY((*sources[isource])[iframe]());
 
-			#pragma omp parallel for num_threads(n_threads)
-			for (int iy = 0; iy < ny; iy++) {
-				const RFLOAT y = (RFLOAT)iy / ny - 0.5;
+				#pragma omp simd
 				for (int ix = 0; ix < nx; ix++) {
-					const RFLOAT x = (RFLOAT)ix / nx - 0.5;
-					bool valid = true;
-
-					RFLOAT x_fitted, y_fitted;
-					model->getShiftAt(z, x, y, x_fitted, y_fitted);
-					x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
-
-					int x0 = FLOOR(x_fitted);
-					int y0 = FLOOR(y_fitted);
-					const int x1 = x0 + 1;
-					const int y1 = y0 + 1;
-
-					// some conditions might seem redundant but necessary when overflow happened
-					if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
-					if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
-					if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
-					if (y1 >= ny || y1 >= ny - 1) {y0 = ny - 1; valid = false;}
-					if (!valid) {
-						DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-						if (std::isnan(DIRECT_A2D_ELEM(Isum(), iy, ix))) {
-							std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-						}
-						continue;
-					}
-
-					const RFLOAT fx = x_fitted - x0;
-					const RFLOAT fy = y_fitted - y0;
-
-					const RFLOAT d00 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-					const RFLOAT d01 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x1);
-					const RFLOAT d10 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x0);
-					const RFLOAT d11 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x1);
-
-					const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
-					const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
-					const RFLOAT val = LIN_INTERP(fy, dx0, dx1);
-#ifdef DEBUG_OWN
-					if (std::isnan(val)) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << " d00 " << d00 << " d01 " << d01 << " d10 " << d10 << " d11 " << d11 << " dx0 " << dx0 << " dx1 " << dx1 << std::endl;
-					}
-#endif
-					DIRECT_A2D_ELEM(Isum(), iy, ix) += val;
-				} // y
-			} // x
-		} // frame
-	} // general model
-}
-
-void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile) {
-	const int n_frames = Iframes.size();
-	const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
-	const Matrix1D<RFLOAT> coeffX = model.coeffX, coeffY = model.coeffY;
-
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		logfile << "." << std::flush;
-
-		const RFLOAT z = iframe, z2 = iframe * iframe;
-		const RFLOAT z3 = z * z2;
-		// Common terms
-		const RFLOAT x_C0 = coeffX(0)  * z + coeffX(1)  * z2 + coeffX(2)  * z3;
-		const RFLOAT x_C1 = coeffX(3)  * z + coeffX(4)  * z2 + coeffX(5)  * z3;
-		const RFLOAT x_C2 = coeffX(6)  * z + coeffX(7)  * z2 + coeffX(8)  * z3;
-		const RFLOAT x_C3 = coeffX(9)  * z + coeffX(10) * z2 + coeffX(11) * z3;
-		const RFLOAT x_C4 = coeffX(12) * z + coeffX(13) * z2 + coeffX(14) * z3;
-		const RFLOAT x_C5 = coeffX(15) * z + coeffX(16) * z2 + coeffX(17) * z3;
-		const RFLOAT y_C0 = coeffY(0)  * z + coeffY(1)  * z2 + coeffY(2)  * z3;
-		const RFLOAT y_C1 = coeffY(3)  * z + coeffY(4)  * z2 + coeffY(5)  * z3;
-		const RFLOAT y_C2 = coeffY(6)  * z + coeffY(7)  * z2 + coeffY(8)  * z3;
-		const RFLOAT y_C3 = coeffY(9)  * z + coeffY(10) * z2 + coeffY(11) * z3;
-		const RFLOAT y_C4 = coeffY(12) * z + coeffY(13) * z2 + coeffY(14) * z3;
-		const RFLOAT y_C5 = coeffY(15) * z + coeffY(16) * z2 + coeffY(17) * z3;
-
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iy = 0; iy < ny; iy++) {
-			const RFLOAT y = (RFLOAT)iy / ny - 0.5;
-			for (int ix = 0; ix < nx; ix++) {
-				const RFLOAT x = (RFLOAT)ix / nx - 0.5;
-				bool valid = true;
-
-				RFLOAT x_fitted = x_C0 + (x_C1 + x_C2 * x) * x + (x_C3 + x_C4 * y + x_C5 * x) * y;
-				RFLOAT y_fitted = y_C0 + (y_C1 + y_C2 * x) * x + (y_C3 + y_C4 * y + y_C5 * x) * y;
-
-#ifdef VALIDATE_OPTIMISED_CODE
-				RFLOAT x_fitted2, y_fitted2;
-				model.getShiftAt(z, x, y, x_fitted2, y_fitted2);
-				if (abs(x_fitted - x_fitted2) > 1E-4 || abs(y_fitted - y_fitted2) > 1E-4) {
-					std::cout << "error at " << x << ", " << y << " : " << x_fitted << " " << x_fitted2 << " " << y_fitted << " " << y_fitted2 << std::endl;
+					const long int n00 = offsets[ix], n01 = n00 + dxs[ix], n10 = n00 + dys[ix], n11 = n10 + dxs[ix];
+					const RFLOAT dx0 = LIN_INTERP(fxs[ix], (RFLOAT)src[n00], (RFLOAT)src[n01]);
+					const RFLOAT dx1 = LIN_INTERP(fxs[ix], (RFLOAT)src[n10], (RFLOAT)src[n11]);
+					vals[ix] = LIN_INTERP(fys[ix], dx0, dx1);
 				}
-#endif
-				x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
 
-				int x0 = FLOOR(x_fitted);
-				int y0 = FLOOR(y_fitted);
-				const int x1 = x0 + 1;
-				const int y1 = y0 + 1;
+				for (int isum = 0; isum < sums.size(); isum++) {
+					if (sum_source[isum] != isource) continue;
+					if (sums[isum].parity >= 0 && iframe % 2 != sums[isum].parity) continue;
 
-				// some conditions might seem redundant but necessary when overflow happened
-				if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
-				if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
-				if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
-				if (y1 >= ny || y0 >= ny - 1) {y0 = ny - 1; valid = false;}
-				if (!valid) {
-					DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-#ifdef DEBUG_OWN
-					if (std::isnan(DIRECT_A2D_ELEM(Isum(), iy, ix))) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
+					float *dst = &DIRECT_A2D_ELEM(*sums[isum].sum, iy, 0);
+					#pragma omp simd
+					for (int ix = 0; ix < nx; ix++) {
+						dst[ix] += vals[ix];
 					}
-#endif
-					continue;
 				}
-
-				const RFLOAT fx = x_fitted - x0;
-				const RFLOAT fy = y_fitted - y0;
-
-//				std::cout << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-				const RFLOAT d00 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-				const RFLOAT d01 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x1);
-				const RFLOAT d10 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x0);
-				const RFLOAT d11 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x1);
-
-				const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
-				const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
-				const RFLOAT val = LIN_INTERP(fy, dx0, dx1);
-#ifdef DEBUG_OWN
-				if (std::isnan(val)) {
-					std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << " d00 " << d00 << " d01 " << d01 << " d10 " << d10 << " d11 " << d11 << " dx0 " << dx0 << " dx1 " << dx1 << std::endl;
-				}
-#endif
-				DIRECT_A2D_ELEM(Isum(), iy, ix) += val;
 			}
-		}
+		} // y
 	}
 }
 
-bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
-	std::vector<Image<float> > Iccs(n_threads);
+bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile, int nr_threads) {
+	std::vector<Image<float> > Iccs(nr_threads);
 	MultidimArray<fComplex> Fref;
-	std::vector<MultidimArray<fComplex> > Fccs(n_threads);
+	std::vector<MultidimArray<fComplex> > Fccs(nr_threads);
 	MultidimArray<float> weight;
 	std::vector<RFLOAT> cur_xshifts, cur_yshifts;
 	bool converged = false;
@@ -2281,10 +2579,13 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
 	const int nfy_half = nfy / 2;
 
+	// The CCF buffers and their FFTW plans are reused for all frames and iterations
 	Fref.reshape(ccf_nfy, ccf_nfx);
-	for (int i = 0; i < n_threads; i++) {
+	std::vector<NewFFT::FloatPlan> ccf_plans;
+	for (int i = 0; i < nr_threads; i++) {
 		Iccs[i]().reshape(ccf_ny, ccf_nx);
 		Fccs[i].reshape(Fref);
+		ccf_plans.push_back(NewFFT::FloatPlan(Iccs[i](), Fccs[i]));
 	}
 
 #ifdef DEBUG
@@ -2299,7 +2600,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	// Initialize B factor weight
 	weight.reshape(Fref);
 	RCTIC(TIMING_PREP_WEIGHT);
-	#pragma omp parallel for num_threads(n_threads)
+	#pragma omp parallel for num_threads(nr_threads)
 	for (int y = 0; y < ccf_nfy; y++) {
 		const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy) : y;
 		RFLOAT ly2 = ly * (RFLOAT)ly / (nfy * (RFLOAT)nfy);
@@ -2315,7 +2616,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 		RCTIC(TIMING_MAKE_REF);
 		Fref.initZeros();
 
-		#pragma omp parallel for num_threads(n_threads)
+		#pragma omp parallel for num_threads(nr_threads)
 		for (int y = 0; y < ccf_nfy; y++) {
 			const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + nfy) : y;
 			for (int x = 0; x < ccf_nfx; x++) {
@@ -2326,7 +2627,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 		}
 		RCTOC(TIMING_MAKE_REF);
 
-		#pragma omp parallel for num_threads(n_threads)
+		#pragma omp parallel for num_threads(nr_threads)
 		for (int iframe = 0; iframe < n_frames; iframe++) {
 			const int tid = omp_get_thread_num();
 
@@ -2341,7 +2642,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 			RCTOC(TIMING_CCF_CALC);
 
 			RCTIC(TIMING_CCF_IFFT);
-			NewFFT::inverseFourierTransform(Fccs[tid], Iccs[tid]());
+			NewFFT::inverseFourierTransform(Fccs[tid], Iccs[tid](), ccf_plans[tid], NewFFT::FwdOnly, false); // Fccs is overwritten next time anyway
 			RCTOC(TIMING_CCF_IFFT);
 
 			RCTIC(TIMING_CCF_FIND_MAX);
@@ -2413,7 +2714,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 		// Apply shifts
 		// Since the image is not necessarily square, we cannot use the method in fftw.cpp
 		RCTIC(TIMING_FOURIER_SHIFT);
-		#pragma omp parallel for num_threads(n_threads)
+		#pragma omp parallel for num_threads(nr_threads)
 		for (int iframe = 1; iframe < n_frames; iframe++) {
 			shiftNonSquareImageInFourierTransform(Fframes[iframe], -cur_xshifts[iframe] / pnx, -cur_yshifts[iframe] / pny);
 		}
@@ -2460,14 +2761,16 @@ int MotioncorrRunner::findGoodSize(int request) {
 // dose is equivalent dose at 300 kV at the END of the frame.
 // This implements the model by Timothy Grant & Nikolaus Grigorieff on eLife, 2015
 // doi: 10.7554/eLife.06980
-void MotioncorrRunner::doseWeighting(std::vector<MultidimArray<fComplex> > &Fframes, std::vector<RFLOAT> doses, RFLOAT apix) {
-	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
+void MotioncorrRunner::prepareDoseWeighting(const int nfx, const int nfy, std::vector<RFLOAT> &doses, RFLOAT apix, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm) {
 	const int nfy_half = nfy / 2;
 	const RFLOAT nfy2 = (RFLOAT)nfy * nfy;
 	const RFLOAT nfx2 = (RFLOAT)(nfx - 1) * (nfx - 1) * 4; // assuming nx is even
-	const int n_frames= Fframes.size();
+	const int n_frames= doses.size();
 	const RFLOAT A = 0.245, B = -1.665, C = 2.81;
 
+	Ne.reshape(nfy, nfx);
+	norm.reshape(nfy, nfx);
+
 	#pragma omp parallel for num_threads(n_threads)
 	for (int y = 0; y < nfy; y++) {
 		int ly = y;
@@ -2477,30 +2780,35 @@ void MotioncorrRunner::doseWeighting(std::vector<MultidimArray<fComplex> > &Ffra
 		for (int x = 0; x < nfx; x++) {
 			const RFLOAT dinv2 = ly2 + (RFLOAT)x * x / nfx2;
 			const RFLOAT dinv = std::sqrt(dinv2) / apix; // d = N * apix / dist, thus dinv = dist / N / angpix
-			const RFLOAT Ne = (A * std::pow(dinv, B) + C) * 2; // Eq. 3. 2 comes from Eq. 5
+			DIRECT_A2D_ELEM(Ne, y, x) = (A * std::pow(dinv, B) + C) * 2; // Eq. 3. 2 comes from Eq. 5
 			RFLOAT sum_weight_sq = 0;
 
 			for (int iframe = 0; iframe < n_frames; iframe++) {
-				const RFLOAT weight = std::exp(- doses[iframe] / Ne); // Eq. 5. 0.5 is factored out to Ne.
+				const RFLOAT weight = std::exp(- doses[iframe] / DIRECT_A2D_ELEM(Ne, y, x)); // Eq. 5. 0.5 is factored out to Ne.
 				if (std::isnan(weight)) {
-					std::cerr << "dose = " <<  doses[iframe] << " Ne = " << Ne << " frm = " << iframe << " lx = " << x << " ly = " << ly << " reso = " << 1 / dinv << " weight = " << weight << std::endl;
+					std::cerr << "dose = " <<  doses[iframe] << " Ne = " << DIRECT_A2D_ELEM(Ne, y, x) << " frm = " << iframe << " lx = " << x << " ly = " << ly << " reso = " << 1 / dinv << " weight = " << weight << std::endl;
 				}
 				sum_weight_sq += weight * weight;
-				DIRECT_A2D_ELEM(Fframes[iframe], y, x) *= weight;
 			}
 
 			sum_weight_sq = std::sqrt(sum_weight_sq);
 			if (std::isnan(sum_weight_sq)) {
-				std::cerr << " Ne = " << Ne << " lx = " << x << " ly = " << ly << " reso = " << 1 / dinv << " sum_weight_sq NaN" << std::endl;
+				std::cerr << " Ne = " << DIRECT_A2D_ELEM(Ne, y, x) << " lx = " << x << " ly = " << ly << " reso = " << 1 / dinv << " sum_weight_sq NaN" << std::endl;
 				REPORT_ERROR("Shouldn't happen.");
 			}
-			for (int iframe = 0; iframe < n_frames; iframe++) {
-				DIRECT_A2D_ELEM(Fframes[iframe], y, x) /= sum_weight_sq; // Eq. 9
-			}
+			DIRECT_A2D_ELEM(norm, y, x) = sum_weight_sq;
 		}
 	}
 }
 
+void MotioncorrRunner::doseWeightFrame(MultidimArray<fComplex> &Fframe, RFLOAT dose, const MultidimArray<RFLOAT> &Ne, const MultidimArray<RFLOAT> &norm) {
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fframe) {
+		const RFLOAT weight = std::exp(- dose / DIRECT_MULTIDIM_ELEM(Ne, n)); // Eq. 5
+		DIRECT_MULTIDIM_ELEM(Fframe, n) *= weight;
+		DIRECT_MULTIDIM_ELEM(Fframe, n) /= DIRECT_MULTIDIM_ELEM(norm, n); // Eq. 9
+	}
+}
+
 // shiftx, shifty is relative to the (real space) image size
 void MotioncorrRunner::shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty) {
 	const int nfx = XSIZE(frame), nfy = YSIZE(frame);
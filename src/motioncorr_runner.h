@@ -27,6 +27,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <src/time.h>
 #include "src/metadata_table.h"
 #include "src/image.h"
@@ -34,10 +40,105 @@
 #include <src/jaz/single_particle/obs_model.h>
 #include "src/jaz/tomography/tomogram_set.h"
 
+// The frames of one movie, as read by MotioncorrRunner::readMovie()
+struct MotioncorrMovie
+{
+	// Size of the movie (for EER, nn is the number of fractions)
+	int nx, ny, nn;
+
+	// The frames to be used (0-indexed) and their images.
+	// The images are only read if there are enough frames to align.
+	std::vector<int> frames;
+	std::vector<Image<float> > Iframes;
+
+	// Why the movie could not be read
+	std::string error;
+};
+
+// Overlaps disk I/O with the alignment of movies, one after another.
+// A loader thread reads and decodes the next movies, so that their frames are ready
+// when the aligner gets to them. A writer thread writes the aligned sums while
+// the next movie is aligned, followed by the files that mark a movie as done.
+// Both queues are bounded.
+class MotioncorrPipeline
+{
+public:
+
+	typedef std::function<void(FileName, MotioncorrMovie&)> MovieReader;
+
+	MotioncorrPipeline();
+	~MotioncorrPipeline();
+
+	// Movies are aligned in the order of fn_movies and read by reader.
+	// prefetch_depth: how many decoded movies to keep ahead (0 = no loader thread)
+	// write_depth: how many sums may wait to be written (0 = write synchronously)
+	void start(const std::vector<FileName> &fn_movies, MovieReader reader, int prefetch_depth, int write_depth);
+
+	// Call before aligning fn_movies[imovie]
+	void beginMovie(long int imovie);
+
+	// Hands over the frames of the current movie; they are read now if there is no loader thread
+	void takeMovie(MotioncorrMovie &movie);
+
+	// Writes img to fn_img, or queues it for the writer thread.
+	// In the latter case, the data are taken over and img is left empty.
+	void write(Image<float> &img, FileName fn_img, RFLOAT angpix, DataType datatype = Unknown_Type);
+
+	// Runs task once everything passed to write() so far has been written (immediately when writing synchronously).
+	// After a failed write, the task is dropped and the error is reported instead.
+	void whenWritten(std::function<void()> task);
+
+	// Waits for all queued writes and stops the threads
+	void finish();
+
+private:
+
+	// Either an image to write (img != NULL) or a task to run
+	struct WriteJob
+	{
+		Image<float> *img;
+		FileName fn_img;
+		RFLOAT angpix;
+		DataType datatype;
+		std::function<void()> task;
+	};
+
+	std::vector<FileName> fn_movies;
+	MovieReader reader;
+	int prefetch_depth, write_depth;
+	long int current_movie;
+	bool stopping;
+
+	// Movies decoded by the loader thread that have not been taken yet
+	std::map<long int, MotioncorrMovie> loaded_movies;
+
+	// write_failed stays set until the next start(), so that nothing is written after a failure
+	std::string write_error;
+	bool write_failed;
+
+	std::deque<WriteJob> write_queue;
+	int n_writing;
+
+	std::thread loader, writer;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	void loadMovies();
+	void writeImages();
+	void checkWriteError();
+};
+
 class MotioncorrRunner
 {
 public:
 
+	MotioncorrRunner() : gain_map(NULL), gain_map_size(0) {}
+
+	~MotioncorrRunner()
+	{
+		unmapGainCache();
+	}
+
 	// I/O Parser
 	IOParser parser;
 
@@ -48,6 +149,12 @@ public:
 	int n_threads;
 	int max_io_threads;
 
+	// Number of movies to read ahead and number of sums that may wait to be written
+	int prefetch_movies, write_queue;
+	// Threads for reading movies when they are read ahead; these are not part of n_threads
+	int n_loader_threads;
+	MotioncorrPipeline pipeline;
+
 	// Output rootname
 	FileName fn_in, fn_out, fn_movie;
 
@@ -130,6 +237,17 @@ public:
 	// Defect file
 	FileName fn_defect;
 
+	// The gain reference after rotation, flipping and (for EER) inversion and upsampling,
+	// and the sorted indices of defect pixels (from fn_defect and zero gain).
+	// These are prepared once per job by the leader and only read by the other ranks.
+	// Igain_cache is the read-only, shared mapping of fn_gain_cache, so all ranks on a node use one copy.
+	FileName fn_gain_source, fn_gain_cache, fn_defect_cache;
+	MultidimArray<float> Igain_cache;
+	void *gain_map;
+	size_t gain_map_size;
+	std::vector<long int> defect_pixels;
+	int defect_nx, defect_ny;
+
 	// Skip hot pixel detection in own motioncorr
 	bool skip_defect;
 
@@ -176,6 +294,15 @@ public:
 
 	void prepareGainReference(bool write_gain);
 
+	// Writes the gain and defect cache when write_cache (unless an identical one exists).
+	// Call loadGainDefectCache() in each rank once the cache has been written.
+	void prepareGainDefectCache(bool write_cache);
+	void loadGainDefectCache();
+
+	// Maps fn_gain_cache read-only into Igain_cache, without copying it
+	void mapGainCache();
+	void unmapGainCache();
+
 	// Execute all MOTIONCORR jobs
 	void run();
 
@@ -188,13 +315,17 @@ public:
 	// Get the shifts from MOTIONCOR2
 	void getShiftsMotioncor2(FileName fn_log, Micrograph &mic);
 
+	// Read the frames to be used from a movie, for our own implementation.
+	// This is called from the loader thread of the pipeline, so it must not change any members.
+	void readMovie(FileName fn_mic, MotioncorrMovie &movie);
+
 	// Execute our own implementation for a single micrograph
 	bool executeOwnMotionCorrection(Micrograph &mic);
 
 	// Plot the shifts
 	void plotShifts(FileName fn_mic, Micrograph &mic);
 
-	// Save micrograph model
+	// Save micrograph model, once the sums of this micrograph have been written
 	void saveModel(Micrograph &mic);
 
 	// Make a PDF file with all the shifts and write output STAR files
@@ -213,21 +344,29 @@ private:
 	// shiftx, shifty is relative to the (real space) image size
 	void shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty);
 
-	bool alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile);
+	bool alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile, int nr_threads);
 
 	void binNonSquareImage(Image<float> &Iwork, RFLOAT bin_factor);
 
 	int findGoodSize(int request);
 
-	void doseWeighting(std::vector<MultidimArray<fComplex> > &Fframes, std::vector<RFLOAT> doses, RFLOAT apix);
-
-	void realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile);
-
-	void realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile);
-	
-	void realSpaceInterpolation_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile);
-
-	void realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile);
+	// Dose weighting is applied frame by frame, so that frames can be streamed.
+	// The critical exposure Ne and the normalisation over all frames are precomputed.
+	void prepareDoseWeighting(const int nfx, const int nfy, std::vector<RFLOAT> &doses, RFLOAT apix, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm);
+	void doseWeightFrame(MultidimArray<fComplex> &Fframe, RFLOAT dose, const MultidimArray<RFLOAT> &Ne, const MultidimArray<RFLOAT> &norm);
+
+	// A sum of aligned frames: frames with iframe % 2 == parity (all frames if parity < 0)
+	// are interpolated according to the motion model and added to sum.
+	struct AlignedSum
+	{
+		std::vector<Image<float> > *frames;
+		MultidimArray<float> *sum;
+		int parity;
+	};
+
+	// Adds frame iframe to all sums. Each pixel position is computed once for all sums
+	// and the frame is interpolated once for all sums that share it.
+	void realSpaceInterpolation(std::vector<AlignedSum> &sums, int iframe, MotionModel *model);
 
 	void interpolateShifts(std::vector<int> &group_start, std::vector<int> &group_size,
 	                       std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts,
@@ -37,7 +37,9 @@ void MotioncorrRunnerMpi::read(int argc, char **argv)
 void MotioncorrRunnerMpi::run()
 {
 	prepareGainReference(node->isLeader());
-	MPI_Barrier(MPI_COMM_WORLD); // wait for the leader to write the gain reference
+	prepareGainDefectCache(node->isLeader());
+	MPI_Barrier(MPI_COMM_WORLD); // wait for the leader to write the gain reference and the cache
+	loadGainDefectCache();
 
 	// Each node does part of the work
 	long int my_first_micrograph, my_last_micrograph, my_nr_micrographs;
@@ -58,6 +60,12 @@ void MotioncorrRunnerMpi::run()
 		barstep = XMIPP_MAX(1, my_nr_micrographs / 60);
 	}
 
+	if (do_own && my_nr_micrographs > 0)
+	{
+		std::vector<FileName> fn_my_micrographs(fn_micrographs.begin() + my_first_micrograph, fn_micrographs.begin() + my_last_micrograph + 1);
+		pipeline.start(fn_my_micrographs, [this](FileName fn_mic, MotioncorrMovie &movie) { readMovie(fn_mic, movie); }, prefetch_movies, write_queue);
+	}
+
 	for (long int imic = my_first_micrograph; imic <= my_last_micrograph; imic++)
 	{
 		if (verb > 0 && imic % barstep == 0)
@@ -67,6 +75,8 @@ void MotioncorrRunnerMpi::run()
 		if (pipeline_control_check_abort_job())
 			MPI_Abort(MPI_COMM_WORLD, RELION_EXIT_ABORTED);
 
+		pipeline.beginMovie(imic - my_first_micrograph);
+
 		Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
         mic.pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
 
@@ -87,6 +97,10 @@ void MotioncorrRunnerMpi::run()
 			plotShifts(fn_micrographs[imic], mic);
 		}
 	}
+
+	// Wait for the remaining sums to be written
+	pipeline.finish();
+
 	if (verb > 0)
 		progress_bar(my_nr_micrographs);
 
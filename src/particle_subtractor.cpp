@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 
+#include <omp.h>
 #include "src/particle_subtractor.h"
 
 void ParticleSubtractor::read(int argc, char **argv)
@@ -32,6 +33,7 @@ void ParticleSubtractor::read(int argc, char **argv)
 	fn_revert = parser.getOption("--revert", "Name of particle STAR file to revert. When this is provided, all other options are ignored.", "");
 	do_ssnr = parser.checkOption("--ssnr", "Don't subtract, only calculate average spectral SNR in the images");
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to subtract particles in parallel", "1"));
 
 	int center_section = parser.addSection("Centering options");
 	do_recenter_on_mask = parser.checkOption("--recenter_on_mask", "Use this flag to center the subtracted particles on projections of the centre-of-mass of the input mask");
@@ -303,7 +305,6 @@ void ParticleSubtractor::run()
 {
 
 	long int nr_parts = my_last_part_id - my_first_part_id + 1;
-	long int barstep = XMIPP_MAX(1, nr_parts/120);
 	if (verb > 0)
 	{
 		if (do_ssnr) std::cout << " + Calculating SNR for all particles ..." << std::endl;
@@ -313,21 +314,118 @@ void ParticleSubtractor::run()
 	}
 
 	MDimg_out.clear();
-	//for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
-	for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
+
+	// Make sure all columns that are modified inside the threads exist, so that no thread adds a column to MDimg
+	if (!do_ssnr && (do_center || opt.fn_body_masks != "None"))
 	{
+		opt.mydata.MDimg.addLabel(EMDL_ORIENT_ORIGIN_X_ANGSTROM);
+		opt.mydata.MDimg.addLabel(EMDL_ORIENT_ORIGIN_Y_ANGSTROM);
+		if (opt.mymodel.data_dim == 3)
+			opt.mydata.MDimg.addLabel(EMDL_ORIENT_ORIGIN_Z_ANGSTROM);
+		if (opt.fn_body_masks != "None")
+		{
+			opt.mydata.MDimg.addLabel(EMDL_ORIENT_ROT);
+			opt.mydata.MDimg.addLabel(EMDL_ORIENT_TILT);
+			opt.mydata.MDimg.addLabel(EMDL_ORIENT_PSI);
+		}
+	}
 
-		//long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		if (cc % barstep == 0)
+	// All threads share the (read-only) projectors, but each has its own work image, FFTW plans and SSNR sums.
+	// Particles are subtracted in batches; the results of each batch are written out in their original order.
+	std::vector<Image<RFLOAT> > Iwork(nr_threads);
+	std::vector<FourierTransformer> transformers(nr_threads);
+	std::vector<MultidimArray<RFLOAT> > thr_sum_S2(nr_threads), thr_sum_N2(nr_threads), thr_sum_count(nr_threads);
+	if (do_ssnr)
+	{
+		for (int ithread = 0; ithread < nr_threads; ithread++)
 		{
-			if (pipeline_control_check_abort_job())
-				exit(RELION_EXIT_ABORTED);
+			thr_sum_S2[ithread].initZeros(sum_S2);
+			thr_sum_N2[ithread].initZeros(sum_N2);
+			thr_sum_count[ithread].initZeros(sum_count);
+		}
+	}
+
+	const long int batch_size = 16 * nr_threads;
+	std::vector<Image<RFLOAT> > Iout(batch_size);
+	int nr_errors = 0;
+	std::string error_message;
+	for (long int batch_first = 0; batch_first < nr_parts; batch_first += batch_size)
+	{
+		if (pipeline_control_check_abort_job())
+			exit(RELION_EXIT_ABORTED);
+
+		const long int batch_last = XMIPP_MIN(batch_first + batch_size, nr_parts) - 1;
+
+		#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+		for (long int cc = batch_first; cc <= batch_last; cc++)
+		{
+			int my_nr_errors;
+			#pragma omp atomic read
+			my_nr_errors = nr_errors;
+			if (my_nr_errors > 0)
+				continue;
+
+			// An exception must not leave the parallel region: keep the first one and report it below
+			try
+			{
+				const int ithread = omp_get_thread_num();
+				long int part_id = opt.mydata.sorted_idx[my_first_part_id + cc];
+				Image<RFLOAT> &img = Iwork[ithread];
+				subtractOneParticle(part_id, img, transformers[ithread],
+						thr_sum_S2[ithread], thr_sum_N2[ithread], thr_sum_count[ithread]);
+
+				if (do_ssnr)
+					continue;
+
+				// Rebox the image (into a copy, to keep the work image and its FFTW plans)
+				Image<RFLOAT> &out = Iout[cc - batch_first];
+				if (boxsize > 0 && img().getDim() == 2)
+				{
+					img().window(out(), FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
+							   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
+				}
+				else if (boxsize > 0 && img().getDim() == 3)
+				{
+					img().window(out(), FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
+							   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
+				}
+				else
+				{
+					out() = img();
+				}
+			}
+			catch (RelionError &e)
+			{
+				#pragma omp critical(ParticleSubtractor_run_error)
+				{
+					if (nr_errors == 0)
+						error_message = e.msg;
+					#pragma omp atomic
+					nr_errors++;
+				}
+			}
 		}
 
-		long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		subtractOneParticle(part_id, 0, cc);
+		if (nr_errors > 0)
+			REPORT_ERROR(error_message);
+
+		if (!do_ssnr)
+		{
+			for (long int cc = batch_first; cc <= batch_last; cc++)
+				writeOneParticle(opt.mydata.sorted_idx[my_first_part_id + cc], cc, Iout[cc - batch_first]);
+		}
 
-		if (cc % barstep == 0 && verb > 0) progress_bar(cc);
+		if (verb > 0) progress_bar(batch_last + 1);
+	}
+
+	if (do_ssnr)
+	{
+		for (int ithread = 0; ithread < nr_threads; ithread++)
+		{
+			sum_S2 += thr_sum_S2[ithread];
+			sum_N2 += thr_sum_N2[ithread];
+			sum_count += thr_sum_count[ithread];
+		}
 	}
 
 	if (verb > 0) progress_bar(nr_parts);
@@ -417,7 +515,7 @@ void ParticleSubtractor::combineStarFile(int myrank)
 		MDimg_out.append(MD);
 	}
 
-	MDimg_out.sort(EMDL_IMAGE_ID);
+	MDimg_out.sort(EMDL_IMAGE_ID, false, false, false, nr_threads);
 	MDimg_out.deactivateLabel(EMDL_IMAGE_ID);
 	opt.mydata.obsModel.save(MDimg_out, fn_out + "particles_subtracted.star");
 
@@ -462,10 +560,10 @@ FileName ParticleSubtractor::getParticleName(long int imgno, int myrank, int opt
 	return fn_img;
 }
 
-void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, long int counter)
+void ParticleSubtractor::subtractOneParticle(long int part_id, Image<RFLOAT> &img, FourierTransformer &transformer,
+		MultidimArray<RFLOAT> &my_sum_S2, MultidimArray<RFLOAT> &my_sum_N2, MultidimArray<RFLOAT> &my_sum_count)
 {
 	// Read the particle image
-	Image<RFLOAT> img;
 	int optics_group = opt.mydata.getOpticsGroup(part_id);
 	img.read(opt.mydata.particles[part_id].name);
 	img().setXmippOrigin();
@@ -530,7 +628,6 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 	// Now that the particle is centered (for multibody), get the FourierTransform of the particle
 	MultidimArray<Complex> Faux, Fimg;
 	MultidimArray<RFLOAT> Fctf;
-	FourierTransformer transformer;
 	transformer.FourierTransform(img(), Fimg);
 	CenterFFTbySign(Fimg);
 	Fctf.resize(Fimg);
@@ -766,9 +863,9 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 				RFLOAT N2 = norm( dAkij(Fimg, k, i, j) );
 				// division by two keeps the numbers similar to tau2 and sigma2_noise,
 				// which are per real/imaginary component
-				sum_S2(idx_remapped) += S2 / 2.;
-				sum_N2(idx_remapped) += N2 / 2.;
-				sum_count(idx_remapped) += 1.;
+				my_sum_S2(idx_remapped) += S2 / 2.;
+				my_sum_N2(idx_remapped) += N2 / 2.;
+				my_sum_count(idx_remapped) += 1.;
 			}
 		}
 	}
@@ -794,43 +891,32 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 				opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Z_ANGSTROM, my_pixel_size * ZZ(my_residual_offset), part_id);
 			}
 		}
+	}
+}
 
-		// Rebox the image
-		if (boxsize > 0)
-		{
-			if (img().getDim() == 2)
-			{
-				img().window(FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
-						   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
-			}
-			else if (img().getDim() == 3)
-			{
-				img().window(FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize), FIRST_XMIPP_INDEX(boxsize),
-						   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
-			}
-		}
+void ParticleSubtractor::writeOneParticle(long int part_id, long int counter, Image<RFLOAT> &img)
+{
+	int optics_group = opt.mydata.getOpticsGroup(part_id);
 
-		// Now write out the image & set filenames in output metadatatable
-		FileName fn_img = getParticleName(counter, rank, optics_group);
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_img, part_id);
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_ORI_NAME, opt.mydata.particles[part_id].name, part_id);
-		//Also set the original order in the input STAR file for later combination
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_ID, part_id, part_id);
-		MDimg_out.addObject();
-		MDimg_out.setObject(opt.mydata.MDimg.getObject(part_id));
-
-		//printf("Writing: fn_orig = %s counter = %ld rank = %d optics_group = %d fn_img = %s SIZE = %d nr_particles_in_optics_group[optics_group] = %d\n", fn_orig.c_str(), counter, rank, optics_group+1, fn_img.c_str(), XSIZE(img()), nr_particles_in_optics_group[optics_group]);
-		img.setSamplingRateInHeader(my_pixel_size);
-		if (opt.mymodel.data_dim == 3)
-		{
+	// Now write out the image & set filenames in output metadatatable
+	FileName fn_img = getParticleName(counter, rank, optics_group);
+	opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_img, part_id);
+	opt.mydata.MDimg.setValue(EMDL_IMAGE_ORI_NAME, opt.mydata.particles[part_id].name, part_id);
+	//Also set the original order in the input STAR file for later combination
+	opt.mydata.MDimg.setValue(EMDL_IMAGE_ID, part_id, part_id);
+	MDimg_out.addObject();
+	MDimg_out.setObject(opt.mydata.MDimg.getObject(part_id));
+
+	img.setSamplingRateInHeader(opt.mydata.getImagePixelSize(part_id));
+	if (opt.mymodel.data_dim == 3)
+	{
+		img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+	}
+	else
+	{
+		if (nr_particles_in_optics_group[optics_group] == 0)
 			img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		}
 		else
-		{
-			if (nr_particles_in_optics_group[optics_group] == 0)
-				img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-			else
-				img.write(fn_img, -1, false, WRITE_APPEND, write_float16 ? Float16: Float);
-		}
+			img.write(fn_img, -1, false, WRITE_APPEND, write_float16 ? Float16: Float);
 	}
 }
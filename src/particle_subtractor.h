@@ -58,6 +58,9 @@ public:
 	// verbosity
 	int verb;
 
+	// Number of threads to subtract particles in parallel within each MPI rank
+	int nr_threads;
+
 public:
 	// Read command line arguments
 	void read(int argc, char **argv);
@@ -86,8 +89,14 @@ public:
 	// Get name of a single subtracted particle
 	FileName getParticleName(long int imgno, int myrank, int optics_group=-1);
 
-	// subtract one particle
-	void subtractOneParticle(long int part_id, long int imgno, long int counter);
+	// Subtract one particle, leaving the result in img (unless do_ssnr, then only the signal and noise powers are summed).
+	// This is thread-safe, provided each thread has its own img, transformer and sums, and the output labels exist in MDimg.
+	// Passing the same img for every call of a thread lets the transformer reuse its FFTW plans.
+	void subtractOneParticle(long int part_id, Image<RFLOAT> &img, FourierTransformer &transformer,
+			MultidimArray<RFLOAT> &my_sum_S2, MultidimArray<RFLOAT> &my_sum_N2, MultidimArray<RFLOAT> &my_sum_count);
+
+	// Append a subtracted particle to the stack of its optics group, and add it to MDimg_out. Not thread-safe.
+	void writeOneParticle(long int part_id, long int counter, Image<RFLOAT> &img);
 
 private:
 	// Pre-calculated rotation matrix for (0,90,0) rotation, and its transpose, for multi-body orientations
@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 
+#include <omp.h>
 #include "src/postprocessing.h"
 
 void Postprocessing::read(int argc, char **argv)
@@ -60,6 +61,8 @@ void Postprocessing::read(int argc, char **argv)
 	locres_edgwidth = textToFloat(parser.getOption("--locres_edgwidth", "Width of soft edge (in A) on masks for local-resolution map (default = sampling)", "-1"));
 	locres_randomize_fsc = textToFloat(parser.getOption("--locres_randomize_at", "Randomize phases from this resolution (in A)", "25."));
 	locres_minres = textToFloat(parser.getOption("--locres_minres", "Lowest local resolution allowed (in A)", "50."));
+	locres_box = textToInteger(parser.getOption("--locres_box", "Box size (in pixels) of the local windows for the FSC calculations (default = twice the mask diameter; use the map size for the original full-map calculation)", "-1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for local resolution estimation", "1"));
 
 	int expert_section = parser.addSection("Expert options");
 	do_ampl_corr = parser.checkOption("--ampl_corr", "Perform amplitude correlation and DPR, also re-normalize amplitudes for non-uniform angular distributions");
@@ -984,6 +987,31 @@ void Postprocessing::writeFscDat(MetaDataTable &MDfsc)
 	}
 }
 
+// Cut a window of XSIZE(win) pixels, centred at direct index (z0, y0, x0), out of map.
+// With a mask, the window is multiplied by it and is zero outside the map; without, the map is wrapped around.
+static void getLocresWindow(const MultidimArray<RFLOAT> &map, long int z0, long int y0, long int x0,
+		const MultidimArray<RFLOAT> *mask, MultidimArray<RFLOAT> &win)
+{
+	const long int h = XSIZE(win) / 2;
+	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(win)
+	{
+		long int kp = z0 + k - h;
+		long int ip = y0 + i - h;
+		long int jp = x0 + j - h;
+		if (mask == NULL)
+		{
+			kp = (kp % ZSIZE(map) + ZSIZE(map)) % ZSIZE(map);
+			ip = (ip % YSIZE(map) + YSIZE(map)) % YSIZE(map);
+			jp = (jp % XSIZE(map) + XSIZE(map)) % XSIZE(map);
+			DIRECT_A3D_ELEM(win, k, i, j) = DIRECT_A3D_ELEM(map, kp, ip, jp);
+		}
+		else if (kp < 0 || kp >= ZSIZE(map) || ip < 0 || ip >= YSIZE(map) || jp < 0 || jp >= XSIZE(map))
+			DIRECT_A3D_ELEM(win, k, i, j) = 0.;
+		else
+			DIRECT_A3D_ELEM(win, k, i, j) = DIRECT_A3D_ELEM(map, kp, ip, jp) * DIRECT_A3D_ELEM(*mask, k, i, j);
+	}
+}
+
 void Postprocessing::run_locres(int rank, int size)
 {
 	// Read input maps and perform some checks
@@ -992,15 +1020,13 @@ void Postprocessing::run_locres(int rank, int size)
 	// Also read the user-provided mask
 	//getMask();
 
-	MultidimArray<RFLOAT> I1m, I2m, I1p, I2p, Isum, locmask, Ilocres, Ifil, Isumw;
+	MultidimArray<RFLOAT> I1m, I1p, I2p, Isum, Ilocres, Ifil, Isumw;
 
 	// Get sum of two half-maps and sharpen according to estimated or ad-hoc B-factor
 	Isum.resize(I1());
 	I1m.resize(I1());
-	I2m.resize(I1());
 	I1p.resize(I1());
 	I2p.resize(I1());
-	locmask.resize(I1());
 	// Initialise local-resolution maps, weights etc
 	Ifil.initZeros(I1());
 	Ilocres.initZeros(I1());
@@ -1019,6 +1045,9 @@ void Postprocessing::run_locres(int rank, int size)
 	transformer.FourierTransform(Isum, FTsum, true);
 	divideByMtf(FTsum);
 	applyBFactorToMap(FTsum, XSIZE(Isum), adhoc_bfac, angpix);
+	// The local windows for filtering are cut out of the sharpened map in real space
+	transformer.inverseFourierTransform(FTsum, Isum);
+	FTsum.clear();
 
 	// Step size of locres-sampling in pixels
 	int step_size = ROUND(locres_sampling / angpix);
@@ -1038,32 +1067,34 @@ void Postprocessing::run_locres(int rank, int size)
 	randomizePhasesBeyond(I1p, randomize_at);
 	randomizePhasesBeyond(I2p, randomize_at);
 
-	// Write an output STAR file with FSC curves, Guinier plots etc
-	FileName fn_tmp = fn_out + "_locres_fscs.star";
-	std::ofstream  fh;
-	if (rank == 0)
+	// The local FSCs are calculated in windows of wsize pixels around each sampling point, rather than in the full maps.
+	// As the masked maps are zero outside the local mask, this only changes the sampling of the resolution shells.
+	// With wsize equal to the map size, the results are the same as with the full maps.
+	const int ori_size = XSIZE(I1());
+	int wsize = (locres_box > 0) ? locres_box : 4 * (maskrad_pix + edgewidth_pix);
+	wsize = XMIPP_MIN(ori_size, wsize + wsize % 2);
+	if (wsize < ori_size && wsize < 2 * (maskrad_pix + edgewidth_pix) + 2)
+		REPORT_ERROR("Postprocessing::run_locres ERROR: --locres_box should be larger than the diameter of the local mask (including its soft edge).");
+	int randomize_at_win = wsize * angpix / locres_randomize_fsc;
+	if (verb > 0)
 	{
-		if (verb > 0)
-		{
-			std::cout.width(35); std::cout << std::left <<"  + Metadata output file: "; std::cout << fn_tmp<< std::endl;
-		}
-
-		fh.open((fn_tmp).c_str(), std::ios::out);
-		if (!fh)
-			REPORT_ERROR( (std::string)"MlOptimiser::write: Cannot write file: " + fn_tmp);
+		std::cout.width(35); std::cout << std::left << "  + local FSC box size: "; std::cout << wsize << " pixels" << std::endl;
 	}
 
-	// Sample the entire volume (within the provided mask)
-
-	int myrad = XSIZE(I1())/2 - maskrad_pix;
-	float myradf = (float)myrad/(float)step_size;
-	long int nr_samplings = ROUND((4.* PI / 3.) * (myradf*myradf*myradf));
-	if (verb > 0)
+	MultidimArray<RFLOAT> fsc_unmasked_win(wsize / 2 + 1);
+	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_unmasked_win)
 	{
-		std::cout << " Calculating local resolution in " << nr_samplings << " sampling points ..." << std::endl;
-		init_progress_bar(nr_samplings);
+		long int ires = XMIPP_MIN(XSIZE(fsc_unmasked) - 1, ROUND((RFLOAT)i * ori_size / wsize));
+		DIRECT_A1D_ELEM(fsc_unmasked_win, i) = DIRECT_A1D_ELEM(fsc_unmasked, ires);
 	}
 
+	// The local mask is the same for all windows: make it only once
+	MultidimArray<RFLOAT> locmask(wsize, wsize, wsize);
+	raisedCosineMask(locmask, maskrad_pix, maskrad_pix + edgewidth_pix, 0, 0, 0);
+
+	// Sample the entire volume (within the provided mask)
+	int myrad = XSIZE(I1())/2 - maskrad_pix;
+	std::vector<long int> my_kk, my_ii, my_jj;
 	long int nn = 0;
 	for (long int kk=((I1()).zinit); kk<=((I1()).zinit + (I1()).zdim - 1); kk+= step_size)
 	{
@@ -1071,94 +1102,169 @@ void Postprocessing::run_locres(int rank, int size)
 		{
 			for (long int jj=((I1()).xinit); jj<=((I1()).xinit + (I1()).xdim - 1); jj+= step_size)
 			{
-				// Abort through the pipeline_control system, TODO: check how this goes with MPI....
-				if (pipeline_control_check_abort_job())
-					exit(RELION_EXIT_ABORTED);
-
 				// Only calculate local-resolution inside a spherical mask with radius less than half-box-size minus maskrad_pix
 				float rad = sqrt(kk*kk + ii*ii + jj*jj);
 				if (rad < myrad)
 				{
 					if (nn%size == rank)
 					{
-						// Make a spherical mask around (k,i,j), diameter is step_size pixels, soft-edge width is edgewidth_pix
-						raisedCosineMask(locmask, maskrad_pix, maskrad_pix + edgewidth_pix, kk, ii, jj);
-
-						// FSC of masked maps
-						I1m = I1() * locmask;
-						I2m = I2() * locmask;
-						getFSC(I1m, I2m, fsc_masked);
-
-						// FSC of masked randomized-phase map
-						I1m = I1p * locmask;
-						I2m = I2p * locmask;
-						getFSC(I1m, I2m, fsc_random_masked);
-
-						// Now that we have fsc_masked and fsc_random_masked, calculate fsc_true according to Richard's formula
-						// FSC_true = FSC_t - FSC_n / ( )
-						calculateFSCtrue(fsc_true, fsc_unmasked, fsc_masked, fsc_random_masked, randomize_at);
-
-						if (rank == 0)
-						{
-							MetaDataTable MDfsc;
-							FileName fn_name = "fsc_"+integerToString(kk, 5)+"_"+integerToString(ii, 5)+"_"+integerToString(jj, 5);
-							MDfsc.setName(fn_name);
-							FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
-							{
-								MDfsc.addObject();
-								RFLOAT res = (i > 0) ? (XSIZE(I1()) * angpix / (RFLOAT)i) : 999.;
-								MDfsc.setValue(EMDL_SPECTRAL_IDX, (int)i);
-								MDfsc.setValue(EMDL_RESOLUTION, 1./res);
-								MDfsc.setValue(EMDL_RESOLUTION_ANGSTROM, res);
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_TRUE, DIRECT_A1D_ELEM(fsc_true, i) );
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_UNMASKED, DIRECT_A1D_ELEM(fsc_unmasked, i) );
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_MASKED, DIRECT_A1D_ELEM(fsc_masked, i) );
-								MDfsc.setValue(EMDL_POSTPROCESS_FSC_RANDOM_MASKED, DIRECT_A1D_ELEM(fsc_random_masked, i) );
-							}
-							MDfsc.write(fh);
-						}
-
-						float local_resol = 999.;
-						// See where corrected FSC drops below 0.143
-						FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
-						{
-							if ( DIRECT_A1D_ELEM(fsc_true, i) < 0.143)
-								break;
-							local_resol = (i > 0) ? XSIZE(I1())*angpix/(RFLOAT)i : 999.;
-						}
-						local_resol = XMIPP_MIN(locres_minres, local_resol);
-						if (rank == 0)
-							fh << " kk= " << kk << " ii= " << ii << " jj= " << jj << " local resolution= " << local_resol << std::endl;
-
-						// Now low-pass filter Isum to the estimated resolution
-						MultidimArray<Complex > FT = FTsum;
-						applyFscWeighting(FT, fsc_true);
-						lowPassFilterMap(FT, XSIZE(I1()), local_resol, angpix, filter_edge_width);
-
-						// Re-use I1m to save some memory
-						transformer.inverseFourierTransform(FT, I1m);
-
-						// Store weighted sum of local resolution and filtered map
-						FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(I1m)
-						{
-							DIRECT_MULTIDIM_ELEM(Ifil, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n) * DIRECT_MULTIDIM_ELEM(I1m, n);
-							DIRECT_MULTIDIM_ELEM(Ilocres, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n) / local_resol;
-							DIRECT_MULTIDIM_ELEM(Isumw, n) +=  DIRECT_MULTIDIM_ELEM(locmask, n);
-						}
+						my_kk.push_back(kk);
+						my_ii.push_back(ii);
+						my_jj.push_back(jj);
 					}
-
 					nn++;
-					if (verb > 0 && nn <= nr_samplings)
-						progress_bar(nn);
 				}
 			}
 		}
 	}
 
-	fh.close();
+	const long int my_nr_samplings = my_kk.size();
+	long int barstep = XMIPP_MAX(1, my_nr_samplings / 60);
 	if (verb > 0)
-		init_progress_bar(nr_samplings);
+	{
+		std::cout << " Calculating local resolution in " << nn << " sampling points ..." << std::endl;
+		init_progress_bar(my_nr_samplings);
+	}
+
+	// Each thread has its own window and FFTW plans; only the accumulation into the output maps is serialised
+	std::vector<FourierTransformer> transformers(nr_threads);
+	std::vector<MultidimArray<RFLOAT> > Iwin(nr_threads);
+	for (int ithread = 0; ithread < nr_threads; ithread++)
+		Iwin[ithread].resize(wsize, wsize, wsize);
 
+	// Keep the FSC curves, so that the leader can write them out in order
+	std::vector<MultidimArray<RFLOAT> > my_fsc_true(my_nr_samplings), my_fsc_unmasked(my_nr_samplings),
+		my_fsc_masked(my_nr_samplings), my_fsc_random_masked(my_nr_samplings);
+	std::vector<float> my_local_resol(my_nr_samplings);
+
+	long int nr_done = 0;
+	#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+	for (long int ipos = 0; ipos < my_nr_samplings; ipos++)
+	{
+		const int ithread = omp_get_thread_num();
+
+		// Abort through the pipeline_control system, TODO: check how this goes with MPI....
+		if (ithread == 0 && pipeline_control_check_abort_job())
+			exit(RELION_EXIT_ABORTED);
+
+		MultidimArray<RFLOAT> &Iw = Iwin[ithread];
+		FourierTransformer &mytransformer = transformers[ithread];
+
+		// raisedCosineMask() was always called with (kk,ii,jj) as its (x,y,z) centre: keep that
+		const long int z0 = my_jj[ipos] - STARTINGZ(I1());
+		const long int y0 = my_ii[ipos] - STARTINGY(I1());
+		const long int x0 = my_kk[ipos] - STARTINGX(I1());
+
+		MultidimArray<Complex > F1, F2;
+		MultidimArray<RFLOAT> &fsc_true = my_fsc_true[ipos];
+		MultidimArray<RFLOAT> &fsc_unmasked = my_fsc_unmasked[ipos];
+		MultidimArray<RFLOAT> &fsc_masked = my_fsc_masked[ipos];
+		MultidimArray<RFLOAT> &fsc_random_masked = my_fsc_random_masked[ipos];
+		fsc_unmasked = fsc_unmasked_win;
+
+		// FSC of masked maps
+		getLocresWindow(I1(), z0, y0, x0, &locmask, Iw);
+		mytransformer.FourierTransform(Iw, F1);
+		getLocresWindow(I2(), z0, y0, x0, &locmask, Iw);
+		mytransformer.FourierTransform(Iw, F2);
+		getFSC(F1, F2, fsc_masked);
+
+		// FSC of masked randomized-phase map
+		getLocresWindow(I1p, z0, y0, x0, &locmask, Iw);
+		mytransformer.FourierTransform(Iw, F1);
+		getLocresWindow(I2p, z0, y0, x0, &locmask, Iw);
+		mytransformer.FourierTransform(Iw, F2);
+		getFSC(F1, F2, fsc_random_masked);
+
+		// Now that we have fsc_masked and fsc_random_masked, calculate fsc_true according to Richard's formula
+		// FSC_true = FSC_t - FSC_n / ( )
+		calculateFSCtrue(fsc_true, fsc_unmasked, fsc_masked, fsc_random_masked, randomize_at_win);
+
+		float local_resol = 999.;
+		// See where corrected FSC drops below 0.143
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
+		{
+			if ( DIRECT_A1D_ELEM(fsc_true, i) < 0.143)
+				break;
+			local_resol = (i > 0) ? wsize*angpix/(RFLOAT)i : 999.;
+		}
+		local_resol = XMIPP_MIN(locres_minres, local_resol);
+		my_local_resol[ipos] = local_resol;
+
+		// Now low-pass filter the sharpened sum to the estimated resolution
+		getLocresWindow(Isum, z0, y0, x0, NULL, Iw);
+		mytransformer.FourierTransform(Iw, F1);
+		applyFscWeighting(F1, fsc_true);
+		lowPassFilterMap(F1, wsize, local_resol, angpix, filter_edge_width);
+		mytransformer.inverseFourierTransform(F1, Iw);
+
+		// Store weighted sum of local resolution and filtered map
+		#pragma omp critical(Postprocessing_run_locres)
+		{
+			const long int h = wsize / 2;
+			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(locmask)
+			{
+				const RFLOAT w = DIRECT_A3D_ELEM(locmask, k, i, j);
+				const long int kp = z0 + k - h;
+				const long int ip = y0 + i - h;
+				const long int jp = x0 + j - h;
+				if (w <= 0. || kp < 0 || kp >= ZSIZE(Ifil) || ip < 0 || ip >= YSIZE(Ifil) || jp < 0 || jp >= XSIZE(Ifil))
+					continue;
+
+				DIRECT_A3D_ELEM(Ifil, kp, ip, jp) += w * DIRECT_A3D_ELEM(Iw, k, i, j);
+				DIRECT_A3D_ELEM(Ilocres, kp, ip, jp) += w / local_resol;
+				DIRECT_A3D_ELEM(Isumw, kp, ip, jp) += w;
+			}
+		}
+
+		long int my_nr_done;
+		#pragma omp atomic capture
+		my_nr_done = ++nr_done;
+
+		if (my_nr_done % barstep == 0 && verb > 0 && ithread == 0)
+			progress_bar(my_nr_done);
+	}
+
+	if (verb > 0)
+		progress_bar(my_nr_samplings);
+
+	// Write an output STAR file with FSC curves, Guinier plots etc
+	if (rank == 0)
+	{
+		FileName fn_tmp = fn_out + "_locres_fscs.star";
+		if (verb > 0)
+		{
+			std::cout.width(35); std::cout << std::left <<"  + Metadata output file: "; std::cout << fn_tmp<< std::endl;
+		}
+
+		std::ofstream  fh;
+		fh.open((fn_tmp).c_str(), std::ios::out);
+		if (!fh)
+			REPORT_ERROR( (std::string)"MlOptimiser::write: Cannot write file: " + fn_tmp);
+
+		for (long int ipos = 0; ipos < my_nr_samplings; ipos++)
+		{
+			long int kk = my_kk[ipos], ii = my_ii[ipos], jj = my_jj[ipos];
+			MetaDataTable MDfsc;
+			FileName fn_name = "fsc_"+integerToString(kk, 5)+"_"+integerToString(ii, 5)+"_"+integerToString(jj, 5);
+			MDfsc.setName(fn_name);
+			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(my_fsc_true[ipos])
+			{
+				MDfsc.addObject();
+				RFLOAT res = (i > 0) ? (wsize * angpix / (RFLOAT)i) : 999.;
+				MDfsc.setValue(EMDL_SPECTRAL_IDX, (int)i);
+				MDfsc.setValue(EMDL_RESOLUTION, 1./res);
+				MDfsc.setValue(EMDL_RESOLUTION_ANGSTROM, res);
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_TRUE, DIRECT_A1D_ELEM(my_fsc_true[ipos], i) );
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_UNMASKED, DIRECT_A1D_ELEM(my_fsc_unmasked[ipos], i) );
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_MASKED, DIRECT_A1D_ELEM(my_fsc_masked[ipos], i) );
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_RANDOM_MASKED, DIRECT_A1D_ELEM(my_fsc_random_masked[ipos], i) );
+			}
+			MDfsc.write(fh);
+			fh << " kk= " << kk << " ii= " << ii << " jj= " << jj << " local resolution= " << my_local_resol[ipos] << std::endl;
+		}
+		fh.close();
+	}
 
 	if (size > 1)
 	{
@@ -1190,7 +1296,7 @@ void Postprocessing::run_locres(int rank, int size)
 			}
 		}
 
-		fn_tmp = fn_out + "_locres.mrc";
+		FileName fn_tmp = fn_out + "_locres.mrc";
 		I1.setStatisticsInHeader();
 		I1.setSamplingRateInHeader(angpix);
 		I1.write(fn_tmp);
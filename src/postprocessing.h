@@ -110,6 +110,12 @@ public:
 	// Lowest resolution allowed in the locres map
 	RFLOAT locres_minres;
 
+	// Box size (in pixels) of the local windows in which the local FSCs are calculated
+	int locres_box;
+
+	// Number of threads for local resolution estimation
+	int nr_threads;
+
 	//////// Sharpening
 
 	// Filename for the STAR-file with the MTF of the detector
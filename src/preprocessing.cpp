@@ -17,6 +17,8 @@
  * source code. Additional authorship citations may be added, but existing
  * author citations must be preserved.
  ***************************************************************************/
+#include <omp.h>
+#include <algorithm>
 #include "src/preprocessing.h"
 
 //#define PREP_TIMING
@@ -55,6 +57,7 @@ void Preprocessing::read(int argc, char **argv, int rank)
 	fn_pick_star = parser.getOption("--pick_star", "Output STAR file with 2 columns for micrographs and coordinate files", "");
 	fn_data = parser.getOption("--reextract_data_star", "A _data.star file from a refinement to re-extract, e.g. with different binning or re-centered (instead of --coord_suffix)", "");
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to extract the particles of each micrograph", "1"));
 	keep_ctf_from_micrographs  = parser.checkOption("--keep_ctfs_micrographs", "By default, CTFs from fn_data will be kept. Use this flag to keep CTFs from input micrographs STAR file");
 	do_reset_offsets = parser.checkOption("--reset_offsets", "reset the origin offsets from the input _data.star file to zero?");
 	do_recenter = parser.checkOption("--recenter", "Re-center particle according to rlnOriginX/Y in --reextract_data_star STAR file");
@@ -181,6 +184,10 @@ void Preprocessing::initialise()
 			ObservationModel::loadSafely(fn_data, obsModelPart, MDimg, "particles", verb);
 			data_star_has_ctf = MDimg.containsLabel(EMDL_CTF_DEFOCUSU);
 
+			// Group the particles by micrograph, and within each micrograph in the order of their original stacks
+			if (MDimg.containsLabel(EMDL_MICROGRAPH_NAME) && MDimg.containsLabel(EMDL_IMAGE_NAME))
+				MDimg.newSort({EMDL_MICROGRAPH_NAME, EMDL_IMAGE_NAME}, false, nr_threads);
+
 			if (do_recenter && ref_angpix <= 0)
 			{
 				if (!obsModelPart.allPixelSizesIdentical())
@@ -523,6 +530,11 @@ void Preprocessing::runExtractParticles()
 		if (verb > 0 && imic % barstep == 0)
 			progress_bar(imic);
 
+		// Read the next micrograph in the background
+		fn_next_mic = "";
+		if (imic + 1 < nr_mics)
+			MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_next_mic, imic + 1);
+
 		TIMING_TIC(TIMING_TOP);
 		micIsUsed = extractParticlesFromFieldOfView(fn_mic, imic);
 		TIMING_TOC(TIMING_TOP);
@@ -534,6 +546,8 @@ void Preprocessing::runExtractParticles()
 
 		imic++;
 	}
+	stopPrefetching();
+	finishWriting();
 
 	MDmics = MDoutMics;
 	if (verb > 0)
@@ -804,8 +818,9 @@ bool Preprocessing::extractParticlesFromFieldOfView(FileName fn_mic, long int im
 		RFLOAT all_minval = LARGE_NUMBER;
 		RFLOAT all_maxval = -LARGE_NUMBER;
 
+		Image<RFLOAT> Istack;
 		extractParticlesFromOneMicrograph(MDin, fn_mic, imic, fn_output_img_root, fn_oristack,
-				my_current_nr_images, npos, all_avg, all_stddev, all_minval, all_maxval);
+				my_current_nr_images, npos, all_avg, all_stddev, all_minval, all_maxval, Istack);
 
 		MDout.append(MDin);
 		// Keep track of total number of images extracted thus far
@@ -814,7 +829,11 @@ bool Preprocessing::extractParticlesFromFieldOfView(FileName fn_mic, long int im
 		TIMING_TOC(TIMING_EXTCT_FROM_FRAME);
 
 		MDout.setName("images");
-		MDout.write(fn_star);
+
+		TIMING_TIC(TIMING_PER_IMG_OP_WRITE);
+		writeInBackground(Istack, fn_output_img_root + ".mrcs", (npos > 1), MDout, fn_star);
+		TIMING_TOC(TIMING_PER_IMG_OP_WRITE);
+
 		return(true);
 	}
 	else
@@ -824,24 +843,139 @@ bool Preprocessing::extractParticlesFromFieldOfView(FileName fn_mic, long int im
 	}
 }
 
+void Preprocessing::readMicrograph(FileName fn_mic, Image<RFLOAT> &Imic)
+{
+	if (mic_prefetcher.joinable())
+		mic_prefetcher.join();
+
+	if (fn_mic == fn_prefetched_mic)
+	{
+		// Errors of the background reader are reported here, in the main thread
+		if (prefetch_error)
+		{
+			std::exception_ptr error = prefetch_error;
+			prefetch_error = nullptr;
+			fn_prefetched_mic = "";
+			Imic_prefetched.clear();
+			std::rethrow_exception(error);
+		}
+
+		// Take over the data, rather than copying a whole micrograph
+		Imic.clear();
+		Imic.data.moveFrom(Imic_prefetched.data);
+		Imic.MDMainHeader = Imic_prefetched.MDMainHeader;
+		Imic_prefetched.clear(); // Imic_prefetched was left as an alias
+	}
+	else
+	{
+		Imic.read(fn_mic);
+	}
+	fn_prefetched_mic = "";
+	prefetch_error = nullptr;
+
+	// Tomograms are too large to keep two of them in memory
+	if (dimensionality != 2 || fn_next_mic == "" || fn_next_mic == fn_mic || !exists(fn_next_mic))
+		return;
+
+	// Do not read micrographs that will be skipped
+	if (only_extract_unfinished)
+	{
+		FileName fn_pre, fn_jobnr, fn_post;
+		decomposePipelineFileName(fn_next_mic, fn_pre, fn_jobnr, fn_post);
+		if (exists(fn_part_dir + fn_post.withoutExtension() + "_extract.star"))
+			return;
+	}
+
+	fn_prefetched_mic = fn_next_mic;
+	mic_prefetcher = std::thread([this]()
+	{
+		// Nothing may escape this thread
+		try
+		{
+			Imic_prefetched.read(fn_prefetched_mic);
+		}
+		catch (...)
+		{
+			prefetch_error = std::current_exception();
+		}
+	});
+}
+
+void Preprocessing::stopPrefetching()
+{
+	if (mic_prefetcher.joinable())
+		mic_prefetcher.join();
+
+	fn_prefetched_mic = "";
+	prefetch_error = nullptr;
+	Imic_prefetched.clear();
+}
+
+void Preprocessing::writeInBackground(Image<RFLOAT> &Istack, FileName fn_stack, bool is_stack, MetaDataTable &MDout, FileName fn_star)
+{
+	// Only one micrograph is written at a time
+	finishWriting();
+
+	// Take over the data, rather than copying the whole stack
+	Istack_writing.clear();
+	Istack_writing.data.moveFrom(Istack.data);
+	Istack_writing.MDMainHeader = Istack.MDMainHeader;
+	Istack.clear(); // Istack was left as an alias
+	MDout_writing = MDout;
+
+	stack_writer = std::thread([this, fn_stack, is_stack, fn_star]()
+	{
+		// Nothing may escape this thread
+		try
+		{
+			if (NZYXSIZE(Istack_writing()) > 0)
+				Istack_writing.write(fn_stack, -1, is_stack, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+
+			// The STAR file marks the micrograph as done (see only_extract_unfinished), so it goes last
+			MDout_writing.write(fn_star);
+		}
+		catch (...)
+		{
+			write_error = std::current_exception();
+		}
+	});
+}
+
+void Preprocessing::finishWriting()
+{
+	if (stack_writer.joinable())
+		stack_writer.join();
+
+	Istack_writing.clear();
+	MDout_writing.clear();
+
+	// Errors of the background writer are reported here, in the main thread
+	if (write_error)
+	{
+		std::exception_ptr error = write_error;
+		write_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
 // Actually extract particles. This can be from one micrograph
 void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		FileName fn_mic, int imic,
 		FileName fn_output_img_root, FileName fn_oristack, long int &my_current_nr_images, long int my_total_nr_images,
-		RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval)
+		RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval, Image<RFLOAT> &Istack)
 {
-	Image<RFLOAT> Ipart, Imic, Itmp;
+	Image<RFLOAT> Imic;
 
 	bool MDin_has_optics_group = MD.containsLabel(EMDL_IMAGE_OPTICS_GROUP); // i.e. re-extracting
 	bool MDin_has_beamtilt = (MD.containsLabel(EMDL_IMAGE_BEAMTILT_X) || MD.containsLabel(EMDL_IMAGE_BEAMTILT_Y));
 	bool MDin_has_ctf = MD.containsLabel(EMDL_CTF_DEFOCUSU);
 	bool MDin_has_tiltgroup = MD.containsLabel(EMDL_PARTICLE_BEAM_TILT_CLASS);
 	int my_extract_size = (do_phase_flip || do_premultiply_ctf) ? premultiply_ctf_extract_size : extract_size;
-	RFLOAT my_angpix;
+	RFLOAT my_angpix = angpix;
 
 	TIMING_TIC(TIMING_READ_IMG);
 
-	Imic.read(fn_mic);
+	readMicrograph(fn_mic, Imic);
 
 	// Calculate average value in the micrograph, for filling empty region around large-box extraction for premultiplication with CTF
 	RFLOAT mic_avg = Imic().computeAvg();
@@ -860,18 +994,20 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		obsModelMic.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 	}
 
-	// Now window all particles from the micrograph
-	// Now do the actual phase flipping or CTF-multiplication
-	MultidimArray<Complex> FT;
-	FourierTransformer transformer;
-	int ipos = 0;
-	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+	// First read the positions and per-particle CTFs of all particles.
+	// This also updates the box sizes in obsModelPart, so it cannot be done in parallel.
+	const long int npos = MD.numberOfObjects();
+	std::vector<long int> xposs(npos), yposs(npos), zposs(npos, 0);
+	std::vector<CTF> ctfs(npos, ctf);
+	std::vector<RFLOAT> my_angpixs(npos, my_angpix), tilt_degs(npos, 0.), psi_degs(npos, 0.);
+
+	for (long int ipos = 0; ipos < npos; ipos++)
 	{
 		RFLOAT dxpos, dypos, dzpos;
 		long int xpos, ypos, zpos;
 		long int x0, xF, y0, yF, z0, zF;
-		MD.getValue(EMDL_IMAGE_COORD_X, dxpos);
-		MD.getValue(EMDL_IMAGE_COORD_Y, dypos);
+		MD.getValue(EMDL_IMAGE_COORD_X, dxpos, ipos);
+		MD.getValue(EMDL_IMAGE_COORD_Y, dypos, ipos);
 		xpos = (long int)dxpos;
 		ypos = (long int)dypos;
 
@@ -881,11 +1017,14 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		yF = ypos + LAST_XMIPP_INDEX(my_extract_size);
 		if (dimensionality == 3)
 		{
-			MD.getValue(EMDL_IMAGE_COORD_Z, dzpos);
+			MD.getValue(EMDL_IMAGE_COORD_Z, dzpos, ipos);
 			zpos = (long int)dzpos;
 			z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
 			zF = zpos + LAST_XMIPP_INDEX(extract_size);
+			zposs[ipos] = zpos;
 		}
+		xposs[ipos] = xpos;
+		yposs[ipos] = ypos;
 
 		// Discard particles that are completely outside the micrograph and print a warning
 		if (yF < 0 || y0 >= YSIZE(Imic()) || xF < 0 || x0 >= XSIZE(Imic()) ||
@@ -902,127 +1041,246 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		// Read per-particle CTF
 		if (MDin_has_ctf && !keep_ctf_from_micrographs)
 		{
-			ctf.readByGroup(MD, &obsModelPart);
-			optics_group = obsModelPart.getOpticsGroup(MD);
+			ctfs[ipos].readByGroup(MD, &obsModelPart, ipos);
+			optics_group = obsModelPart.getOpticsGroup(MD, ipos);
 			if (obsModelPart.getBoxSize(optics_group) != my_extract_size)
 				obsModelPart.setBoxSize(optics_group, my_extract_size);
-			obsModelPart.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
+			obsModelPart.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpixs[ipos], optics_group);
 		}
 
-		TIMING_TIC(TIMING_WINDOW);
-		// extract one particle in Ipart
-		if (dimensionality == 3)
-			Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
-		else
-			Imic().window(Ipart(), y0, x0, yF, xF, mic_avg);
-		Ipart().setXmippOrigin();
-		TIMING_TOC(TIMING_WINDOW);
+		// Jun24,2015 - Shaoda, extract helical segments
+		if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
+		{
+			MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_degs[ipos], ipos);
+			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_degs[ipos], ipos);
+		}
+	}
 
-		// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
-		if (do_phase_flip || do_premultiply_ctf)
+	// 2D particles go straight into their slice of the output stack, which the caller writes at once.
+	// Sub-tomograms are written to their own files by the thread that made them.
+	const bool output_is_2d = (dimensionality == 2 || do_project_3d);
+	const int output_size = do_rewindow ? window : (do_rescale ? scale : extract_size);
+	Istack.clear();
+	if (output_is_2d)
+		Istack().resize(npos, 1, output_size, output_size);
+
+	std::vector<RFLOAT> avgs(npos), stddevs(npos), minvals(npos), maxvals(npos);
+	std::vector<FourierTransformer> transformers(nr_threads);
+	std::vector<MapResizer> resizers(nr_threads);
+	bool wrong_size = false;
+	int nr_errors = 0;
+	std::string error_message;
+
+	TIMING_TIC(TIMING_PRE_IMG_OPS);
+
+	// When all particles share the pixel size, their CTFs are calculated in one go, sharing the geometry
+	std::vector<MultidimArray<RFLOAT> > Fctfs;
+	if ((do_phase_flip || do_premultiply_ctf) && npos > 0 &&
+	    std::count(my_angpixs.begin(), my_angpixs.end(), my_angpixs[0]) == npos)
+	{
+		CTF::getFftwImages(ctfs, Fctfs, my_extract_size, my_extract_size, my_angpixs[0],
+		                   false, do_phase_flip, do_ctf_intact_first_peak, true, false, nr_threads);
+	}
+
+	#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+	for (long int ipos = 0; ipos < npos; ipos++)
+	{
+		int my_nr_errors;
+		#pragma omp atomic read
+		my_nr_errors = nr_errors;
+		if (my_nr_errors > 0)
+			continue;
+
+		// An exception must not leave the parallel region: keep the first one and report it below
+		try
 		{
-			transformer.FourierTransform(Ipart(), FT, false);
-
-			MultidimArray<RFLOAT> Fctf;
-			Fctf.resize(YSIZE(FT), XSIZE(FT));
-			// do_abs, phase_flip, intact_first_peak, damping, padding
-			// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
-			// The boxsize in ObsModel has been updated above.
-			// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
-			// But we are doing this after extraction, so there is not much merit...
-			ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
-
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
+			const int ithread = omp_get_thread_num();
+			const long int xpos = xposs[ipos], ypos = yposs[ipos], zpos = zposs[ipos];
+			const long int x0 = xpos + FIRST_XMIPP_INDEX(my_extract_size);
+			const long int xF = xpos + LAST_XMIPP_INDEX(my_extract_size);
+			const long int y0 = ypos + FIRST_XMIPP_INDEX(my_extract_size);
+			const long int yF = ypos + LAST_XMIPP_INDEX(my_extract_size);
+			const long int z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
+			const long int zF = zpos + LAST_XMIPP_INDEX(extract_size);
+
+			// extract one particle in Ipart
+			Image<RFLOAT> Ipart;
+			if (dimensionality == 3)
+				Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
+			else
+				Imic().window(Ipart(), y0, x0, yF, xF, mic_avg);
+			Ipart().setXmippOrigin();
+
+			// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
+			if (do_phase_flip || do_premultiply_ctf)
 			{
-				DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+				MultidimArray<Complex> FT;
+				transformers[ithread].FourierTransform(Ipart(), FT, false);
+
+				MultidimArray<RFLOAT> Fctf;
+				if (Fctfs.empty())
+				{
+					Fctf.resize(YSIZE(FT), XSIZE(FT));
+					// do_abs, phase_flip, intact_first_peak, damping, padding
+					// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
+					// The boxsize in ObsModel has been updated above.
+					// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
+					// But we are doing this after extraction, so there is not much merit...
+					ctfs[ipos].getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpixs[ipos], false, do_phase_flip, do_ctf_intact_first_peak, true, false);
+				}
+				else
+				{
+					// Take over the precalculated CTF, so that its memory is freed after this particle
+					Fctf.moveFrom(Fctfs[ipos]);
+				}
+
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
+				{
+					DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+				}
+
+				transformers[ithread].inverseFourierTransform(FT, Ipart());
+
+				if (extract_size != premultiply_ctf_extract_size)
+				{
+					Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
+					               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
+				}
 			}
 
-			transformer.inverseFourierTransform(FT, Ipart());
+			// Check boundaries: fill pixels outside the boundary with the nearest ones inside
+			// This will create lines at the edges, rather than zeros
+			Ipart().setXmippOrigin();
 
-			if (extract_size != premultiply_ctf_extract_size)
+			// X-boundaries
+			if (x0 < 0 || xF >= XSIZE(Imic()) )
 			{
-				Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
-				               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
+				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+				{
+					if (j + xpos < 0)
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
+					else if (j + xpos >= XSIZE(Imic()))
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
+				}
 			}
-		}
 
-		TIMING_TIC(TIMING_BOUNDARY);
-		// Check boundaries: fill pixels outside the boundary with the nearest ones inside
-		// This will create lines at the edges, rather than zeros
-		Ipart().setXmippOrigin();
+			// Y-boundaries
+			if (y0 < 0 || yF >= YSIZE(Imic()))
+			{
+				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+				{
+					if (i + ypos < 0)
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
+					else if (i + ypos >= YSIZE(Imic()))
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
+				}
+			}
 
-		// X-boundaries
-		if (x0 < 0 || xF >= XSIZE(Imic()) )
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			if (dimensionality == 3)
 			{
-				if (j + xpos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
-				else if (j + xpos >= XSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
+				// Z-boundaries
+				if (z0 < 0 || zF >= ZSIZE(Imic()))
+				{
+					FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+					{
+						if (k + zpos < 0)
+							A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
+						else if (k + zpos >= ZSIZE(Imic()))
+							A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
+					}
+				}
 			}
-		}
 
-		// Y-boundaries
-		if (y0 < 0 || yF >= YSIZE(Imic()))
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			// 2D projection of 3D sub-tomograms
+			if (dimensionality == 3 && do_project_3d)
 			{
-				if (i + ypos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
-				else if (i + ypos >= YSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
+				// Project the 3D sub-tomogram into a 2D particle again
+				Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
+				Iproj().setXmippOrigin();
+				FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+				{
+					DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+				}
+				Ipart = Iproj;
 			}
-		}
 
-		if (dimensionality == 3)
-		{
-			// Z-boundaries
-			if (z0 < 0 || zF >= ZSIZE(Imic()))
+			processParticleImage(Ipart, tilt_degs[ipos], psi_degs[ipos], &resizers[ithread]);
+
+			Ipart().computeStats(avgs[ipos], stddevs[ipos], minvals[ipos], maxvals[ipos]);
+
+			if (output_is_2d)
 			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+				if (XSIZE(Ipart()) != output_size || YSIZE(Ipart()) != output_size || ZSIZE(Ipart()) != 1)
 				{
-					if (k + zpos < 0)
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
-					else if (k + zpos >= ZSIZE(Imic()))
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
+					wrong_size = true;
+					continue;
 				}
+
+				memcpy(&DIRECT_NZYX_ELEM(Istack(), ipos, 0, 0, 0), MULTIDIM_ARRAY(Ipart()),
+				       output_size * output_size * sizeof(RFLOAT));
+			}
+			else
+			{
+				Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, minvals[ipos]);
+				Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, maxvals[ipos]);
+				Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_AVG, avgs[ipos]);
+				Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_STDDEV, stddevs[ipos]);
+				Ipart.setSamplingRateInHeader(output_angpix);
+
+				// Write one mrc file for every subtomogram
+				FileName fn_img;
+				fn_img.compose(fn_output_img_root, my_current_nr_images + ipos + 1, "mrc");
+				Ipart.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
 			}
 		}
-
-		// 2D projection of 3D sub-tomograms
-		if (dimensionality == 3 && do_project_3d)
+		catch (RelionError &e)
 		{
-			// Project the 3D sub-tomogram into a 2D particle again
-			Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
-			Iproj().setXmippOrigin();
-			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+			#pragma omp critical(Preprocessing_extract_error)
 			{
-				DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+				if (nr_errors == 0)
+					error_message = e.msg;
+				#pragma omp atomic
+				nr_errors++;
 			}
-			Ipart = Iproj;
 		}
-		TIMING_TOC(TIMING_BOUNDARY);
+	}
 
-		// performPerImageOperations will also append the particle to the output stack in fn_stack
-		// Jun24,2015 - Shaoda, extract helical segments
-		RFLOAT tilt_deg, psi_deg;
-		tilt_deg = psi_deg = 0.;
-		if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
+	TIMING_TOC(TIMING_PRE_IMG_OPS);
+
+	if (nr_errors > 0)
+		REPORT_ERROR(error_message);
+
+	if (wrong_size)
+		REPORT_ERROR("Preprocessing::extractParticlesFromOneMicrograph BUG: unexpected size of an extracted particle from " + fn_mic);
+
+	if (output_is_2d)
+	{
+		// Keep track of overall statistics, in the same order as before
+		for (long int ipos = 0; ipos < npos; ipos++)
 		{
-			MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_deg);
-			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_deg);
+			all_minval = XMIPP_MIN(minvals[ipos], all_minval);
+			all_maxval = XMIPP_MAX(maxvals[ipos], all_maxval);
+			all_avg	+= avgs[ipos];
+			all_stddev += stddevs[ipos] * stddevs[ipos];
 		}
 
-		TIMING_TIC(TIMING_PRE_IMG_OPS);
-		performPerImageOperations(Ipart, fn_output_img_root, my_current_nr_images + ipos, my_total_nr_images,
-		                          tilt_deg, psi_deg, all_avg, all_stddev, all_minval, all_maxval);
-		TIMING_TOC(TIMING_PRE_IMG_OPS);
+		all_avg /= my_total_nr_images;
+		all_stddev = sqrt(all_stddev/my_total_nr_images);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, all_minval);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_MAX, all_maxval);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_AVG, all_avg);
+		Istack.MDMainHeader.setValue(EMDL_IMAGE_STATS_STDDEV, all_stddev);
+		Istack.setSamplingRateInHeader(output_angpix);
+	}
+
+	TIMING_TIC(TIMING_REST);
 
-		TIMING_TIC(TIMING_REST);
+	int ipos = 0;
+	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+	{
 		// Also store all the particles information in the STAR file
 		FileName fn_img;
-		if (Ipart().getDim() == 3)
+		if (!output_is_2d)
 			fn_img.compose(fn_output_img_root, my_current_nr_images + ipos + 1, "mrc");
 		else
 			fn_img.compose(my_current_nr_images + ipos + 1, fn_output_img_root + ".mrcs"); // start image counting in stacks at 1!
@@ -1084,10 +1342,10 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			}
 		}
 
-		TIMING_TOC(TIMING_REST);
-
 		ipos++;
 	}
+
+	TIMING_TOC(TIMING_REST);
 }
 
 void Preprocessing::runOperateOnInputFile()
@@ -1135,28 +1393,22 @@ void Preprocessing::runOperateOnInputFile()
 	std::cout << " Done writing to " << fn_operate_out << std::endl;
 }
 
-void Preprocessing::performPerImageOperations(
-		Image<RFLOAT> &Ipart,
-		FileName fn_output_img_root,
-		long int image_nr,
-		long int nr_of_images,
-		RFLOAT tilt_deg,
-		RFLOAT psi_deg,
-		RFLOAT &all_avg,
-		RFLOAT &all_stddev,
-		RFLOAT &all_minval,
-		RFLOAT &all_maxval)
+void Preprocessing::processParticleImage(Image<RFLOAT> &Ipart, RFLOAT tilt_deg, RFLOAT psi_deg, MapResizer *resizer)
 {
-
 	Ipart().setXmippOrigin();
 
-	if (do_rescale) rescale(Ipart, scale);
+	if (do_rescale)
+	{
+		if (resizer != NULL)
+			resizer->resize(Ipart(), scale);
+		else
+			rescale(Ipart, scale);
+	}
 
 	if (do_rewindow) rewindow(Ipart, window);
 
 	Ipart().setXmippOrigin();
 
-	TIMING_TIC(TIMING_NORMALIZE);
 	// Jun24,2015 - Shaoda, helical segments
 	if (do_normalise)
 	{
@@ -1166,11 +1418,23 @@ void Preprocessing::performPerImageOperations(
 		normalise(Ipart, bg_radius, white_dust_stddev, black_dust_stddev, do_ramp,
 				do_extract_helix, bg_helical_radius, tilt_deg, psi_deg);
 	}
-	TIMING_TOC(TIMING_NORMALIZE);
 
-	TIMING_TIC(TIMING_INV_CONT);
 	if (do_invert_contrast) invert_contrast(Ipart);
-	TIMING_TOC(TIMING_INV_CONT);
+}
+
+void Preprocessing::performPerImageOperations(
+		Image<RFLOAT> &Ipart,
+		FileName fn_output_img_root,
+		long int image_nr,
+		long int nr_of_images,
+		RFLOAT tilt_deg,
+		RFLOAT psi_deg,
+		RFLOAT &all_avg,
+		RFLOAT &all_stddev,
+		RFLOAT &all_minval,
+		RFLOAT &all_maxval)
+{
+	processParticleImage(Ipart, tilt_deg, psi_deg);
 
 	// Calculate mean, stddev, min and max
 	RFLOAT avg, stddev, minval, maxval;
@@ -35,6 +35,8 @@
 #include <src/jaz/single_particle/obs_model.h>
 #include <src/fftw.h>
 #include <src/time.h>
+#include <thread>
+#include <exception>
 
 class Preprocessing
 {
@@ -52,6 +54,9 @@ public:
 	// Write in float16 (MRC mode 12)?
 	bool write_float16;
 
+	// Number of threads to process the particles of one micrograph
+	int nr_threads;
+
 	// Does the input micrograph STAR file or the input data STAR file have CTF information?
 	bool mic_star_has_ctf, data_star_has_ctf;
 
@@ -185,7 +190,26 @@ public:
 	// Name of output stack (only when fn_operate in is given)
 	FileName fn_operate_out;
 
+	// The next micrograph is read in the background while the current one is being extracted
+	FileName fn_next_mic, fn_prefetched_mic;
+	Image<RFLOAT> Imic_prefetched;
+	std::thread mic_prefetcher;
+	std::exception_ptr prefetch_error;
+
+	// The stack and STAR file of a micrograph are written in the background while the next one is being extracted
+	Image<RFLOAT> Istack_writing;
+	MetaDataTable MDout_writing;
+	std::thread stack_writer;
+	std::exception_ptr write_error;
+
 public:
+	~Preprocessing()
+	{
+		stopPrefetching();
+		if (stack_writer.joinable())
+			stack_writer.join();
+	}
+
 	// Read command line arguments
 	void read(int argc, char **argv, int rank = 0);
 
@@ -215,14 +239,33 @@ public:
 	bool extractParticlesFromFieldOfView(FileName fn_mic, long int imic);
 
 	// Actually extract particles. This can be from one micrgraph
+	// 2D particles are returned in Istack, sub-tomograms are written here.
 	void extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			FileName fn_mic, int ipos, FileName fn_output_img_root, FileName fn_oristack,
 			long int &my_current_nr_images, long int my_total_nr_images,
-			RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval);
+			RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval, Image<RFLOAT> &Istack);
 
 	// Perform per-image operations (e.g. normalise, rescaling, rewindowing and inverting contrast) on an input stack (or STAR file)
 	void runOperateOnInputFile();
 
+	// Reads a micrograph, or takes it from the background reader if it was prefetched,
+	// and then starts reading fn_next_mic in the background
+	void readMicrograph(FileName fn_mic, Image<RFLOAT> &Imic);
+
+	// Waits for the background reader and discards what it read
+	void stopPrefetching();
+
+	// Waits for the previous background write, then starts writing Istack (if not empty) and then MDout in the background.
+	// Istack is emptied.
+	void writeInBackground(Image<RFLOAT> &Istack, FileName fn_stack, bool is_stack, MetaDataTable &MDout, FileName fn_star);
+
+	// Waits for the background writer, and reports its error
+	void finishWriting();
+
+	// Rescaling, re-windowing, normalisation and contrast inversion of one image; this is thread-safe.
+	// If resizer is given, it is used for rescaling.
+	void processParticleImage(Image<RFLOAT> &Ipart, RFLOAT tilt_deg, RFLOAT psi_deg, MapResizer *resizer = NULL);
+
 	// Here normalisation, windowing etc is performed on an individual image and it is written to disc
 	// Jun24,2015 - Shaoda, extract helical segments
 	void performPerImageOperations(
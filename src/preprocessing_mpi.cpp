@@ -97,10 +97,17 @@ void PreprocessingMpi::runExtractParticles()
 				if (verb > 0 && imic % barstep == 0)
 					progress_bar(imic);
 
+				// Read the next micrograph in the background
+				fn_next_mic = "";
+				if (imic + 1 <= my_last_mic)
+					MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_next_mic, imic + 1);
+
 				extractParticlesFromFieldOfView(fn_mic, imic);
 			}
 			imic++;
 		}
+		stopPrefetching();
+		finishWriting();
 	}
 
 	// Wait until all nodes have finished to make final star file
@@ -111,6 +111,23 @@ long int Projector::getSize()
 
 }
 
+void Projector::getSphereLayout(FourierSphereLayout &layout)
+{
+	// Trilinear interpolation of points inside ROUND(r_max * padding_factor) touches voxels up to sqrt(3) further out
+	long int r_layout = ROUND(r_max * padding_factor) + 2;
+	switch (ref_dim)
+	{
+		case 2:
+			layout.initialise(pad_size / 2 + 1, pad_size, 1, FIRST_XMIPP_INDEX(pad_size), 0, r_layout * r_layout);
+			break;
+		case 3:
+			layout.initialise(pad_size / 2 + 1, pad_size, pad_size, FIRST_XMIPP_INDEX(pad_size), FIRST_XMIPP_INDEX(pad_size), r_layout * r_layout);
+			break;
+		default:
+			REPORT_ERROR("Projector::getSphereLayout%%ERROR: Dimension of the data array should be 2 or 3");
+	}
+}
+
 
 // Fill data array with oversampled Fourier transform, and calculate its power spectrum
 void Projector::computeFourierTransformMap(
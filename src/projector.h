@@ -68,6 +68,96 @@ extern void scale(RFLOAT *img, size_t sz, RFLOAT val, deviceStream_t stream = 0)
 #define ACT_ON_DATA 0
 #define ACT_ON_WEIGHT 1
 
+/* Packing layout for the (half) Fourier-space arrays of a Projector or BackProjector when they are sent between MPI ranks,
+ * with only the voxels inside a sphere (circle in 2D).
+ * The arrays themselves stay dense in memory: compress() packs them into a buffer and expand() unpacks them again.
+ * The voxels of each (z,y) row that lie inside the sphere are contiguous from x=0,
+ * so the offset of each row in the packed buffer gives O(1) indexing.
+ */
+class FourierSphereLayout
+{
+public:
+	// Size and origin of the dense array
+	long int xdim, ydim, zdim, yinit, zinit;
+
+	// Squared radius of the sphere
+	long int r2_max;
+
+	// Offset of each (z,y) row in the compressed array; the last element is the total size
+	std::vector<long int> row_offset;
+
+	void initialise(long int _xdim, long int _ydim, long int _zdim, long int _yinit, long int _zinit, long int _r2_max)
+	{
+		xdim = _xdim;
+		ydim = _ydim;
+		zdim = _zdim;
+		yinit = _yinit;
+		zinit = _zinit;
+		r2_max = _r2_max;
+
+		row_offset.resize(ydim * zdim + 1);
+		row_offset[0] = 0;
+		for (long int row = 0; row < ydim * zdim; row++)
+		{
+			long int k = zinit + row / ydim;
+			long int i = yinit + row % ydim;
+			long int j = 0;
+			while (j < xdim && k*k + i*i + j*j <= r2_max)
+				j++;
+			row_offset[row + 1] = row_offset[row] + j;
+		}
+	}
+
+	// Number of elements in the compressed array
+	long int size() const
+	{
+		return row_offset.back();
+	}
+
+	// Number of rows in the dense array
+	long int nrRows() const
+	{
+		return ydim * zdim;
+	}
+
+	// Number of elements of a row that lie inside the sphere
+	long int rowLength(long int row) const
+	{
+		return row_offset[row + 1] - row_offset[row];
+	}
+
+	// Index of the logical element (k,i,j) in the compressed array, or -1 if it lies outside the sphere
+	long int index(long int k, long int i, long int j) const
+	{
+		long int row = (k - zinit) * ydim + (i - yinit);
+		return (j < rowLength(row)) ? row_offset[row] + j : -1;
+	}
+
+	// Copy the elements inside the sphere of a dense array with this layout to out (which should hold size() elements)
+	template <typename T>
+	void compress(const MultidimArray<T> &dense, T *out) const
+	{
+		for (long int row = 0; row < nrRows(); row++)
+			for (long int j = 0; j < rowLength(row); j++)
+				*out++ = DIRECT_MULTIDIM_ELEM(dense, row * xdim + j);
+	}
+
+	// Fill a dense array (of the right size) from a compressed one, with zeros outside the sphere
+	template <typename T>
+	void expand(const T *in, MultidimArray<T> &dense) const
+	{
+		dense.initZeros();
+		for (long int row = 0; row < nrRows(); row++)
+			for (long int j = 0; j < rowLength(row); j++)
+				DIRECT_MULTIDIM_ELEM(dense, row * xdim + j) = *in++;
+	}
+};
+
+// Loop over the direct indices n in the dense array of all elements inside a FourierSphereLayout
+#define FOR_ALL_DIRECT_ELEMENTS_IN_SPHERE_LAYOUT(layout, n) \
+	for (long int _row = 0, n = 0; _row < (layout).nrRows(); _row++) \
+		for (n = _row * (layout).xdim; n < _row * (layout).xdim + (layout).rowLength(_row); n++)
+
 class Projector
 {
 public:
@@ -221,6 +311,12 @@ public:
 	 */
 	long int getSize();
 
+	/*
+	 * Get the packing layout for MPI transfers of the data (and weight) array: it holds the elements that are ever set or read
+	 * during (back)projection, symmetrisation and reconstruction, i.e. those within ROUND(r_max * padding_factor) + 2 of the origin
+	 */
+	void getSphereLayout(FourierSphereLayout &layout);
+
 	/* ** Prepares a 3D map for taking slices in its 3D Fourier Transform
 	 *
 	 * This routine does the following:
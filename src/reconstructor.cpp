@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/reconstructor.h"
+#include "src/parallel.h"
 
 void Reconstructor::read(int argc, char **argv)
 {
@@ -33,6 +34,7 @@ void Reconstructor::read(int argc, char **argv)
 	subset = textToInteger(parser.getOption("--subset", "Subset of images to consider (1: only reconstruct half1; 2: only half2; other: reconstruct all)", "-1"));
 	chosen_class = textToInteger(parser.getOption("--class", "Consider only this class (-1: use all classes)", "-1"));
 	angpix  = textToFloat(parser.getOption("--angpix", "Pixel size in the reconstruction (take from first optics group by default)", "-1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to use for reading and back-projecting the images", "1"));
 
 	int ctf_section = parser.addSection("CTF options");
 	do_ctf = parser.checkOption("--ctf", "Apply CTF correction");
@@ -73,6 +75,7 @@ void Reconstructor::read(int argc, char **argv)
 	blob_order = textToInteger(parser.getOption("--blob_m", "Order of blob for gridding interpolation", "0"));
 	blob_alpha = textToFloat(parser.getOption("--blob_a", "Alpha-value of blob for gridding interpolation", "15"));
 	iter = textToInteger(parser.getOption("--iter", "Number of gridding-correction iterations", "10"));
+	gridding_tol = textToFloat(parser.getOption("--gridding_tol", "Stop the gridding-correction iterations once the mean change in the weights is below this value (0 = always do --iter)", "0"));
 	ref_dim = textToInteger(parser.getOption("--refdim", "Dimension of the reconstruction (2D or 3D)", "3"));
 	angular_error = textToFloat(parser.getOption("--angular_error", "Apply random deviations with this standard deviation (in degrees) to each of the 3 Euler angles", "0."));
 	shift_error = textToFloat(parser.getOption("--shift_error", "Apply random deviations with this standard deviation (in Angstrom) to each of the 2 translations", "0."));
@@ -303,26 +306,131 @@ void Reconstructor::backproject(int rank, int size)
 					blob_radius, blob_alpha, data_dim, skip_gridding);
 	backprojector.initZeros(2 * r_max);
 
+	// Up to three threads share a single volume, more threads use a second one to avoid waiting
+	const int nr_acc = (nr_threads > 3)? 2 : 1;
+	extra_backprojectors.assign(nr_acc - 1, backprojector);
+	backprojector_locks.resize(nr_acc);
+	for (int iacc = 0; iacc < nr_acc; iacc++)
+		omp_init_lock(&backprojector_locks[iacc]);
+
+	// Each rank takes a contiguous block of particles, and each thread takes chunks of
+	// consecutive particles within it. Consecutive particles usually come from the same stack,
+	// so this keeps the reads from each stack together.
 	long int nr_parts = DF.numberOfObjects();
-	long int barstep = XMIPP_MAX(1, nr_parts/(size*120));
+	long int my_first_part, my_last_part;
+	divide_equally(nr_parts, size, rank, my_first_part, my_last_part);
+	const long int my_nr_parts = my_last_part - my_first_part + 1;
+
+	long int barstep = XMIPP_MAX(1, my_nr_parts/120);
 	if (verb > 0)
 	{
 		std::cout << " + Back-projecting all images ..." << std::endl;
 		time_config();
-		init_progress_bar(nr_parts);
+		init_progress_bar(my_nr_parts);
 	}
 
-	for (long int ipart = 0; ipart < nr_parts; ipart++)
+	// Draw the random errors in advance, as rnd_gaus() cannot be called from several threads
+	random_errors.clear();
+	first_random_error_part = my_first_part;
+	if (angular_error > 0. || shift_error > 0.)
 	{
-		if (ipart % size == rank)
+		random_errors.resize(6 * my_nr_parts);
+		for (long int n = 0; n < random_errors.size(); n++)
+		{
+			const bool is_angle = (n % 6 < 3);
+			random_errors[n] = rnd_gaus(0., is_angle ? angular_error : shift_error);
+		}
+	}
+
+	long int nr_done = 0;
+	int nr_errors = 0;
+	std::string error_message;
+
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(nr_threads)
+	for (long int ipart = my_first_part; ipart <= my_last_part; ipart++)
+	{
+		int my_nr_errors;
+		#pragma omp atomic read
+		my_nr_errors = nr_errors;
+		if (my_nr_errors > 0)
+			continue;
+
+		// An exception must not leave the parallel region: keep the first one and report it below
+		try
+		{
 			backprojectOneParticle(ipart);
+		}
+		catch (RelionError &e)
+		{
+			#pragma omp critical(Reconstructor_backproject_error)
+			{
+				if (nr_errors == 0)
+					error_message = e.msg;
+				#pragma omp atomic
+				nr_errors++;
+			}
+			continue;
+		}
 
-		if (ipart % barstep == 0 && verb > 0)
-			progress_bar(ipart);
+		long int my_nr_done;
+		#pragma omp atomic capture
+		my_nr_done = ++nr_done;
+
+		if (my_nr_done % barstep == 0 && verb > 0 && omp_get_thread_num() == 0)
+			progress_bar(my_nr_done);
+	}
+
+	if (nr_errors > 0)
+	{
+		for (int iacc = 0; iacc < backprojector_locks.size(); iacc++)
+			omp_destroy_lock(&backprojector_locks[iacc]);
+		backprojector_locks.clear();
+		extra_backprojectors.clear();
+		REPORT_ERROR(error_message);
 	}
 
 	if (verb > 0)
-		progress_bar(nr_parts);
+		progress_bar(my_nr_parts);
+
+	// Sum the extra accumulator into the first one
+	for (int iacc = 1; iacc < nr_acc; iacc++)
+	{
+		const BackProjector &BP = extra_backprojectors[iacc - 1];
+
+		#pragma omp parallel for num_threads(nr_threads)
+		for (long int n = 0; n < MULTIDIM_SIZE(backprojector.data); n++)
+		{
+			DIRECT_MULTIDIM_ELEM(backprojector.data, n) += DIRECT_MULTIDIM_ELEM(BP.data, n);
+			DIRECT_MULTIDIM_ELEM(backprojector.weight, n) += DIRECT_MULTIDIM_ELEM(BP.weight, n);
+		}
+	}
+
+	for (int iacc = 0; iacc < nr_acc; iacc++)
+		omp_destroy_lock(&backprojector_locks[iacc]);
+	backprojector_locks.clear();
+	extra_backprojectors.clear();
+}
+
+int Reconstructor::lockBackprojector()
+{
+	const int nr_acc = backprojector_locks.size();
+	const int first = omp_get_thread_num() % nr_acc;
+
+	// Take whichever accumulator is free, otherwise wait for our own
+	for (int i = 0; i < nr_acc; i++)
+	{
+		const int iacc = (first + i) % nr_acc;
+		if (omp_test_lock(&backprojector_locks[iacc]))
+			return iacc;
+	}
+
+	omp_set_lock(&backprojector_locks[first]);
+	return first;
+}
+
+void Reconstructor::unlockBackprojector(int iacc)
+{
+	omp_unset_lock(&backprojector_locks[iacc]);
 }
 
 void Reconstructor::backprojectOneParticle(long int p)
@@ -359,12 +467,13 @@ void Reconstructor::backprojectOneParticle(long int p)
 	psi = 0.;
 	DF.getValue(EMDL_ORIENT_PSI, psi, p);
 
+	const RFLOAT *my_errors = (random_errors.size() > 0) ? &random_errors[6 * (p - first_random_error_part)] : NULL;
+
 	if (angular_error > 0.)
 	{
-		rot += rnd_gaus(0., angular_error);
-		tilt += rnd_gaus(0., angular_error);
-		psi += rnd_gaus(0., angular_error);
-		//std::cout << rnd_gaus(0., angular_error) << std::endl;
+		rot += my_errors[0];
+		tilt += my_errors[1];
+		psi += my_errors[2];
 	}
 
 	Euler_angles2matrix(rot, tilt, psi, A3D);
@@ -399,8 +508,8 @@ void Reconstructor::backprojectOneParticle(long int p)
 
 	if (shift_error > 0.)
 	{
-		XX(trans) += rnd_gaus(0., shift_error);
-		YY(trans) += rnd_gaus(0., shift_error);
+		XX(trans) += my_errors[3];
+		YY(trans) += my_errors[4];
 	}
 
 	if (data_dim == 3)
@@ -410,7 +519,7 @@ void Reconstructor::backprojectOneParticle(long int p)
 
 		if (shift_error > 0.)
 		{
-			ZZ(trans) += rnd_gaus(0., shift_error);
+			ZZ(trans) += my_errors[5];
 		}
 	}
 
@@ -455,6 +564,8 @@ void Reconstructor::backprojectOneParticle(long int p)
 		DF.getValue(EMDL_IMAGE_OPTICS_GROUP, optics_group);
 
 		// Make coloured noise image
+		// rnd_gaus() keeps a global state, so only one thread at a time can draw the noise
+		#pragma omp critical(Reconstructor_rnd_gaus)
 		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(F2D)
 		{
 			int ires = ROUND(sqrt((RFLOAT)(kp*kp + ip*ip + jp*jp)));
@@ -607,7 +718,9 @@ void Reconstructor::backprojectOneParticle(long int p)
 			DIRECT_MULTIDIM_ELEM(F2D, n) -= DIRECT_MULTIDIM_ELEM(Fsub, n);
 		}
 		// Back-project difference image
-		backprojector.set2DFourierTransform(F2D, A3D);
+		const int iacc = lockBackprojector();
+		getBackprojector(iacc).set2DFourierTransform(F2D, A3D);
+		unlockBackprojector(iacc);
 	}
 	else
 	{
@@ -729,12 +842,16 @@ void Reconstructor::backprojectOneParticle(long int p)
 				magMat.initIdentity();
 			}
 
-			backprojector.set2DFourierTransform(F2DP, A3D, &Fctf, r_ewald_sphere, true, &magMat);
-			backprojector.set2DFourierTransform(F2DQ, A3D, &Fctf, r_ewald_sphere, false, &magMat);
+			const int iacc = lockBackprojector();
+			getBackprojector(iacc).set2DFourierTransform(F2DP, A3D, &Fctf, r_ewald_sphere, true, &magMat);
+			getBackprojector(iacc).set2DFourierTransform(F2DQ, A3D, &Fctf, r_ewald_sphere, false, &magMat);
+			unlockBackprojector(iacc);
 		}
 		else
 		{
-			backprojector.set2DFourierTransform(F2D, A3D, &Fctf);
+			const int iacc = lockBackprojector();
+			getBackprojector(iacc).set2DFourierTransform(F2D, A3D, &Fctf);
+			unlockBackprojector(iacc);
 		}
 	}
 
@@ -768,7 +885,7 @@ void Reconstructor::reconstruct()
 	if (verb > 0)
 		std::cout << " + Starting the reconstruction ..." << std::endl;
 
-	backprojector.symmetrise(nr_helical_asu, helical_twist, helical_rise/angpix);
+	backprojector.symmetrise(nr_helical_asu, helical_twist, helical_rise/angpix, nr_threads);
 
 	if (do_reconstruct_ctf)
 	{
@@ -837,7 +954,10 @@ void Reconstructor::reconstruct()
 		}
 		else
 		{
+			backprojector.gridding_tolerance = gridding_tol;
 			backprojector.reconstruct(vol(), iter, do_map, tau2);
+			if (verb > 0 && !skip_gridding)
+				std::cout << " + Gridding correction used " << backprojector.nr_gridding_iter << " iterations" << std::endl;
 		}
 	}
 
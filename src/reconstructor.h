@@ -29,6 +29,7 @@
 #include <src/time.h>
 #include <src/ml_model.h>
 #include <src/jaz/single_particle/obs_model.h>
+#include <omp.h>
 
 class Reconstructor
 {
@@ -45,10 +46,10 @@ public:
 	int r_max, r_min_nn, blob_order, ref_dim, interpolator, iter,
 	    debug_ori_size, debug_size,
 	    ctf_dim, nr_helical_asu, newbox, width_mask_edge, nr_sectors, subset, chosen_class,
-	    data_dim, output_boxsize, verb;
+	    data_dim, output_boxsize, verb, nr_threads;
 
 	RFLOAT blob_radius, blob_alpha, angular_error, shift_error, angpix, maxres,
-	       helical_rise, helical_twist;
+	       helical_rise, helical_twist, gridding_tol;
 
 	bool do_ctf, ctf_phase_flipped, only_flip_phases, intact_ctf_first_peak,
 	     do_fom_weighting, do_3d_rot, do_reconstruct_ctf, do_ewald, skip_weighting, skip_mask, do_debug,
@@ -65,6 +66,16 @@ public:
 	// A single projector is needed for parallel reconstruction
 	Projector projector;
 
+	// With multiple threads, images are inserted into the backprojector above and, for many threads,
+	// into one extra accumulator, each guarded by a lock. The extra one is added to the first at the end.
+	std::vector<BackProjector> extra_backprojectors;
+	std::vector<omp_lock_t> backprojector_locks;
+
+	// Random angular and shift errors (rot, tilt, psi, x, y, z) for the particles of this rank,
+	// drawn before the threads start because rnd_gaus() is not thread-safe
+	std::vector<RFLOAT> random_errors;
+	long int first_random_error_part;
+
 public:
 	/** Empty constructor
 	 *
@@ -94,9 +105,17 @@ public:
 	// Loop over all particles to be back-projected
 	void backproject(int rank = 0, int size = 1);
 
-	// For parallelisation purposes
+	// Called from several threads by backproject(); errors are collected there and reported after all threads finished
 	void backprojectOneParticle(long int ipart);
 
+	// Locks one of the accumulators for the calling thread and returns its index
+	int lockBackprojector();
+	void unlockBackprojector(int iacc);
+	BackProjector& getBackprojector(int iacc)
+	{
+		return (iacc == 0)? backprojector : extra_backprojectors[iacc - 1];
+	}
+
 	// perform the gridding reconstruction
 	void reconstruct();
 
@@ -20,8 +20,8 @@
 	Timer EERtimer;
 	int TIMING_READ_EER = EERtimer.setNew("read EER");
 	int TIMING_BUILD_INDEX = EERtimer.setNew("build index");
-	int TIMING_UNPACK_RLE = EERtimer.setNew("unpack RLE");
-	int TIMING_RENDER_ELECTRONS = EERtimer.setNew("render electrons");
+	int TIMING_RENDER_ELECTRONS = EERtimer.setNew("unpack and render electrons");
+	int TIMING_REDUCE_FRAMES = EERtimer.setNew("sum partial frames");
 #else
 	#define RCTIC(label)
 	#define RCTOC(label)
@@ -32,6 +32,7 @@ const char EERRenderer::EER_FOOTER_ERR[] = "ThermoFisherECComprERR00";
 const int EERRenderer::EER_4K= 4096;
 const int EERRenderer::EER_2K = 2048;
 const unsigned int EERRenderer::EER_LEN_FOOTER = 24;
+const unsigned int EERRenderer::EER_READ_AHEAD = 8;
 const uint16_t EERRenderer::TIFF_COMPRESSION_EER8bit = 65000;
 const uint16_t EERRenderer::TIFF_COMPRESSION_EER7bit = 65001;
 const uint16_t EERRenderer::TIFF_COMPRESSION_EERDetailed = 65002;
@@ -66,72 +67,6 @@ void EERRenderer::silenceTIFFWarnings()
 	}
 }
 
-template <typename T>
-void EERRenderer::render4K_to_16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = ((positions[i] & 4095) << 2) | (symbols[i] & 3); // 4095 = 111111111111b, 3 = 00000011b
-		int y = ((positions[i] >> 12) << 2) | ((symbols[i] & 12) >> 2); //  4096 = 2^12, 12 = 00001100b
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-template <typename T>
-void EERRenderer::render4K_to_8K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = ((positions[i] & 4095) << 1) | ((symbols[i] & 2) >> 1); // 4095 = 111111111111b, 2 = 00000010b
-		int y = ((positions[i] >> 12) << 1) | ((symbols[i] & 8) >> 3); //  4096 = 2^12, 8 = 00001000b
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-template <typename T>
-void EERRenderer::render4K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = positions[i] & 4095; // 4095 = 111111111111b
-		int y = positions[i] >> 12; //  4096 = 2^12
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-template <typename T>
-void EERRenderer::render2K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = ((positions[i] & 2047) << 1) | (symbols[i] & 1); // 2047 = 11111111111b
-		int y = ((positions[i] >> 11) << 1) | (symbols[i] >> 1); //  2048 = 2^11
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-template <typename T>
-void EERRenderer::render4K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = (positions[i] & 4095) >> 1; // 4095 = 111111111111b
-		int y = (positions[i] >> 12) >> 1; //  4096 = 2^12
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
-template <typename T>
-void EERRenderer::render2K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
-{
-	for (int i = 0; i < n_electrons; i++)
-	{
-		int x = positions[i] & 2047; // 2047 = 11111111111b
-		int y = positions[i] >> 11; //  2048 = 2^11
-		DIRECT_A2D_ELEM(image, y, x)++;
-	}
-}
-
 EERRenderer::EERRenderer()
 {
 	ready = false;
@@ -254,7 +189,7 @@ void EERRenderer::readLegacy(FILE *fh)
 {
 	/* Load everything first */
 	RCTIC(TIMING_READ_EER);
-	buf = (unsigned char*)malloc(file_size);
+	buf = (unsigned char*)calloc(file_size + EER_READ_AHEAD, 1); // padded for the decoder's read-ahead
 	if (buf == NULL)
 		REPORT_ERROR("Failed to allocate the buffer.");
 	if (fread(buf, sizeof(char), file_size, fh) != file_size)
@@ -299,9 +234,9 @@ void EERRenderer::lazyReadFrames()
 		{	
 			TIFF *ftiff = TIFFOpen(fn_movie.c_str(), "r");
 
-			frame_starts.resize(nframes, 0);
-			frame_sizes.resize(nframes, 0);
-			buf = (unsigned char*)malloc(file_size); // This is big enough
+			frame_starts.assign(nframes, 0);
+			frame_sizes.assign(nframes, 0);
+			buf = (unsigned char*)calloc(file_size + EER_READ_AHEAD, 1); // This is big enough, and padded for the decoder's read-ahead
 			if (buf == NULL)
 				REPORT_ERROR("Failed to allocate the buffer for " + fn_movie);
 			long long pos = 0;
@@ -345,6 +280,19 @@ EERRenderer::~EERRenderer()
 		free(buf);
 }
 
+void EERRenderer::releaseFrames()
+{
+	// A legacy container is read in read() and cannot be read again lazily
+	if (is_legacy || !read_data)
+		return;
+
+	free(buf);
+	buf = NULL;
+	frame_starts.clear();
+	frame_sizes.clear();
+	read_data = false;
+}
+
 int EERRenderer::getNFrames()
 {
 	if (!ready)
@@ -375,233 +323,330 @@ int EERRenderer::getHeight()
 	return height << (eer_upsampling - 1);
 }
 
-template <typename T>
-long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image)
+void EERRenderer::getRenderGeometry(EERRenderGeometry &geom)
 {
-	if (!ready)
-		REPORT_ERROR("EERRenderer::renderNFrames called before ready.");
-
-	lazyReadFrames();
+	// An electron at pixel index n_pix with sub-pixel symbol s is rendered at
+	// x = (((n_pix & pos_mask) << up) >> down) | sub_x[s]
+	// y = (((n_pix >> pos_shift) << up) >> down) | sub_y[s]
+	geom.up = geom.down = 0;
 
-	if (frame_start <= 0 || frame_start > getNFrames() ||
-	    frame_end < frame_start || frame_end > getNFrames())
+	if (width == EER_4K)
 	{
-		std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start << ", frame_end = " << frame_end << "),  NFrames = " << getNFrames() << std::endl;
-		REPORT_ERROR("Invalid frame range was requested.");
+		geom.pos_mask = 4095; // 4095 = 111111111111b
+		geom.pos_shift = 12; // 4096 = 2^12
+
+		if (eer_upsampling == 3)
+			geom.up = 2;
+		else if (eer_upsampling == 2)
+			geom.up = 1;
+		else if (eer_upsampling == -1)
+			geom.down = 1;
+		else if (eer_upsampling != 1)
+			REPORT_ERROR("Invalid EER upsamle for 4K images. This must be 3, 2, 1 or -1.");
 	}
+	else if (width == EER_2K)
+	{
+		geom.pos_mask = 2047; // 2047 = 11111111111b
+		geom.pos_shift = 11; // 2048 = 2^11
 
-	// Make this 0-indexed
-	frame_start--;
-	frame_end--;
-
-	long long total_n_electron = 0;
-
-	std::vector<unsigned int> positions;
-	std::vector<unsigned char> symbols;
-	image.initZeros(getHeight(), getWidth());
+		if (eer_upsampling == 2)
+			geom.up = 1;
+		else if (eer_upsampling != 1)
+			REPORT_ERROR("Invalid EER upsamle for 2K images. This must be 2 or 1.");
+	}
+	else
+		REPORT_ERROR("Logic error: an invalid EER size at EERRenderer::renderFrames().");
 
-	for (int iframe = frame_start; iframe <= frame_end; iframe++)
+	for (int s = 0; s < 16; s++)
 	{
-		RCTIC(TIMING_UNPACK_RLE);
-		if ((preread_start > 0 && iframe < preread_start) ||
-	  	    (preread_end > 0 && iframe > preread_end))
+		geom.sub_x[s] = geom.sub_y[s] = 0;
+
+		if (width == EER_4K && eer_upsampling == 3)
 		{
-			std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start + 1 << ", frame_end = " << frame_end + 1<< "),  NFrames = " << getNFrames() << " preread_start = " << preread_start + 1 << " prered_end = " << preread_end + 1<< std::endl;
-			REPORT_ERROR("Tried to render frames outside pre-read region");
-		}		
-
-		long long pos = frame_starts[iframe];
-		unsigned int n_pix = 0, n_electron = 0;
-		const int max_electrons = frame_sizes[iframe] * 2; // at 4 bits per electron (very permissive bound!)
-		if (positions.size() < max_electrons)
+			geom.sub_x[s] = s & 3; // 3 = 00000011b
+			geom.sub_y[s] = (s & 12) >> 2; // 12 = 00001100b
+		}
+		else if (width == EER_4K && eer_upsampling == 2)
 		{
-			positions.resize(max_electrons);
-			symbols.resize(max_electrons);
+			geom.sub_x[s] = (s & 2) >> 1; // 2 = 00000010b
+			geom.sub_y[s] = (s & 8) >> 3; // 8 = 00001000b
 		}
-
-		if (rle_bits == 7 && subpixel_bits == 4)
+		else if (width == EER_2K && eer_upsampling == 2)
 		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
+			geom.sub_x[s] = s & 1;
+			geom.sub_y[s] = s >> 1;
+		}
+	}
+}
 
-			while (true)
-			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 4 bits.
-				// This is faster than unpack 7 and 4 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
+// Adds (or, to revert a corrupted frame, subtracts) one count per decoded electron
+template <typename T, int INCREMENT>
+struct EERPixelCounter
+{
+	EERPixelCounter(MultidimArray<T> &image, const EERRenderGeometry &geom)
+	: image(image), geom(geom)
+	{}
 
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
+	inline void operator()(unsigned int n_pix, unsigned char s)
+	{
+		const int x = (((n_pix & geom.pos_mask) << geom.up) >> geom.down) | geom.sub_x[s];
+		const int y = (((n_pix >> geom.pos_shift) << geom.up) >> geom.down) | geom.sub_y[s];
+		DIRECT_A2D_ELEM(image, y, x) += INCREMENT;
+	}
 
-				p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
-				bit_pos += 7; // TODO: we can remove this for further speed.
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue; // this should be rare.
+	MultidimArray<T> &image;
+	const EERRenderGeometry &geom;
+};
 
-				// 15 = 00001111; 4 bits for symbol. See the 8+4 bit section for 0x0A
-				s = (unsigned char)((chunk >> 7) & 15) ^ 0x0A;
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
+// As EERPixelCounter, but every electron is weighted by the gain at the pixel it lands on
+template <typename T, int SIGN>
+struct EERGainCounter
+{
+	EERGainCounter(MultidimArray<T> &image, const EERRenderGeometry &geom, const MultidimArray<T> &gain)
+	: image(image), geom(geom), gain(gain)
+	{}
 
-				p = (unsigned char)((chunk >> 11) & 127);
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue;
+	inline void operator()(unsigned int n_pix, unsigned char s)
+	{
+		const int x = (((n_pix & geom.pos_mask) << geom.up) >> geom.down) | geom.sub_x[s];
+		const int y = (((n_pix >> geom.pos_shift) << geom.up) >> geom.down) | geom.sub_y[s];
+		DIRECT_A2D_ELEM(image, y, x) += SIGN * DIRECT_A2D_ELEM(gain, y, x);
+	}
 
-				s = (unsigned char)((chunk >> 18) & 15) ^ 0x0A;
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-			}
-		}
-		else if (rle_bits == 7 && subpixel_bits == 2)
+	MultidimArray<T> &image;
+	const EERRenderGeometry &geom;
+	const MultidimArray<T> &gain;
+};
+
+template <typename Emitter>
+unsigned int EERRenderer::decodeFrame(int iframe, Emitter &emit, unsigned int &n_electron)
+{
+	long long pos = frame_starts[iframe];
+	unsigned int n_pix = 0;
+	n_electron = 0;
+
+	if (rle_bits == 7 && (subpixel_bits == 4 || subpixel_bits == 2))
+	{
+		// Fetch 64 bits at a time and unpack as many complete chunks of 7 + 4 (or 7 + 2) bits
+		// as they contain, instead of unpacking 7 and 4 bits sequentially.
+		// Since the buffer is larger than the actual size by the TIFF header size (and padded),
+		// it is always safe to read ahead.
+		// Note that the symbols have to be flipped (see the 8+4 bit section).
+		const unsigned int symbol_bits = (subpixel_bits == 4) ? 4 : 2;
+		const unsigned int symbol_mask = (subpixel_bits == 4) ? 15 : 3; // 15 = 00001111b, 3 = 00000011b
+		const unsigned char symbol_flip = (subpixel_bits == 4) ? 0x0A : 3;
+		const int code_bits = 7 + symbol_bits;
+		unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
+
+		while (true)
 		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
+			// A corrupted frame might not reach total_pixels before the buffer ends
+			if (pos + (bit_pos >> 3) >= file_size) return n_pix;
+
+			uint64_t chunk;
+			memcpy(&chunk, buf + pos + (bit_pos >> 3), sizeof(uint64_t));
+			const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
+			chunk >>= bit_offset_in_first_byte;
+			int bits_available = 64 - bit_offset_in_first_byte;
 
-			while (true)
+			while (bits_available >= code_bits)
 			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 2 bits.
-				// (Note: one cannot unpack 3 chunks because bit_offset_in_first_byte can be 7;
-				//  7 + 9 + 9 + 9 = 34 > 32 so the last subpixel symbol would be lost.)
-				// This is faster than unpack 7 and 2 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
-
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
-
-				p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
-				bit_pos += 7; // TODO: we can remove this for further speed.
+				const unsigned char p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
+				chunk >>= 7;
+				bits_available -= 7;
+				bit_pos += 7;
 				n_pix += p;
-				if (n_pix >= total_pixels) break;
+				if (n_pix >= total_pixels) return n_pix;
 				if (p == 127) continue; // this should be rare.
 
-				// 3 = 00000011; 2 bits for symbol
-				// Note that we have to flip bits (see below).
-				s = (unsigned char)((chunk >> 7) & 3) ^ 3;
-				bit_pos += 2;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
+				const unsigned char s = (unsigned char)(chunk & symbol_mask) ^ symbol_flip;
+				chunk >>= symbol_bits;
+				bits_available -= symbol_bits;
+				bit_pos += symbol_bits;
 
-				p = (unsigned char)((chunk >> 9) & 127);
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue;
-
-				s = (unsigned char)((chunk >> 16) & 3) ^ 3;
-				bit_pos += 2;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
+				emit(n_pix, s);
 				n_electron++;
 				n_pix++;
 			}
 		}
-		else if (rle_bits == 8 && subpixel_bits == 4)
+	}
+	else if (rle_bits == 8 && subpixel_bits == 4)
+	{
+		// unpack every two symbols = 12 bit * 2 = 24 bit = 3 byte
+		// high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
+		const long long pos_limit = frame_starts[iframe] + frame_sizes[iframe];
+
+		// Because there is a footer, it is safe to go beyond the limit by two bytes.
+		while (pos < pos_limit)
 		{
-			// unpack every two symbols = 12 bit * 2 = 24 bit = 3 byte
-			// high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
-			// With SIMD intrinsics at the SSSE3 level, we can unpack 10 symbols (120 bits) simultaneously.
-			unsigned char p1, p2, s1, s2;
-
-			const long long pos_limit = frame_starts[iframe] + frame_sizes[iframe];
-			// Because there is a footer, it is safe to go beyond the limit by two bytes.
-			while (pos < pos_limit)
+			// Symbol is bit tricky: 0000YyXx, where Y and X must be flipped.
+			// In other words, the bits for shifts 0, 1, 2, 3 are 10, 11, 00, 01.
+			// This can be considered as 'signed 2 bit' representation of -2, -1, 0, 1.
+			// For 2 bit symbols (2K EER): 000000YX and Y and X must be flipped.
+			// That is, shifts 0 and 1 correspond to bits 1 and 0.
+			// This is "signed 1 bit" representation of -1 and 0..
+			// ref: Lingbo Yu, TFS (Email to Takanori on 10-11 May 2023)
+			const unsigned char p1 = buf[pos];
+			const unsigned char s1 = (buf[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
+
+			const unsigned char p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4);
+			const unsigned char s2 = (buf[pos + 2] >> 4) ^ 0x0A;
+
+			// Note the order. Add p before checking the size and placing a new electron.
+			n_pix += p1;
+			if (n_pix >= total_pixels) break;
+			if (p1 < 255)
 			{
-				// Symbol is bit tricky: 0000YyXx, where Y and X must be flipped.
-				// In other words, the bits for shifts 0, 1, 2, 3 are 10, 11, 00, 01.
-				// This can be considered as 'signed 2 bit' representation of -2, -1, 0, 1.
-				// For 2 bit symbols (2K EER): 000000YX and Y and X must be flipped.
-				// That is, shifts 0 and 1 correspond to bits 1 and 0.
-				// This is "signed 1 bit" representation of -1 and 0..
-				// ref: Lingbo Yu, TFS (Email to Takanori on 10-11 May 2023)
-				p1 = buf[pos];
-				s1 = (buf[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
-
-				p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4);
-				s2 = (buf[pos + 2] >> 4) ^ 0x0A;
-
-				// Note the order. Add p before checking the size and placing a new electron.
-				n_pix += p1;
-				if (n_pix >= total_pixels) break;
-				if (p1 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s1;
-					n_electron++;
-					n_pix++;
-				}
+				emit(n_pix, s1);
+				n_electron++;
+				n_pix++;
+			}
 
-				n_pix += p2;
-				if (n_pix >= total_pixels) break;
-				if (p2 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s2;
-					n_electron++;
-					n_pix++;
-				}
+			n_pix += p2;
+			if (n_pix >= total_pixels) break;
+			if (p2 < 255)
+			{
+				emit(n_pix, s2);
+				n_electron++;
+				n_pix++;
+			}
 #ifdef DEBUG_EER_DETAIL
-				printf("%d: %u %u, %u %u %d\n", pos, p1, s1, p2, s2, n_pix);
+			printf("%d: %u %u, %u %u %d\n", pos, p1, s1, p2, s2, n_pix);
 #endif
-				pos += 3;
-			}
+			pos += 3;
 		}
+	}
 
-		if (n_pix != total_pixels)
-		{
-			std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
-			continue;
-		}
+	return n_pix;
+}
 
-		RCTOC(TIMING_UNPACK_RLE);
+template <typename T>
+long long EERRenderer::renderOneFrame(int iframe, MultidimArray<T> &image, const EERRenderGeometry &geom, const MultidimArray<T> *gain)
+{
+	unsigned int n_electron, n_pix;
+	if (gain == NULL)
+	{
+		EERPixelCounter<T, 1> add(image, geom);
+		n_pix = decodeFrame(iframe, add, n_electron);
+	}
+	else
+	{
+		EERGainCounter<T, 1> add(image, geom, *gain);
+		n_pix = decodeFrame(iframe, add, n_electron);
+	}
 
-		RCTIC(TIMING_RENDER_ELECTRONS);
-		if (width == EER_4K)
+	if (n_pix != total_pixels)
+	{
+		// The electrons were rendered while decoding, so take them out again.
+		if (gain == NULL)
 		{
-			if (eer_upsampling == 3)
-				render4K_to_16K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 2)
-				render4K_to_8K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 1)
-				render4K_to_4K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == -1)
-				render4K_to_2K(image, positions, symbols, n_electron);
-			else
-				REPORT_ERROR("Invalid EER upsamle for 4K images. This must be 3, 2, 1 or -1.");
+			EERPixelCounter<T, -1> subtract(image, geom);
+			decodeFrame(iframe, subtract, n_electron);
 		}
-		else if (width == EER_2K)
+		else
 		{
-			if (eer_upsampling == 2)
-				render2K_to_4K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 1)
-				render2K_to_2K(image, positions, symbols, n_electron);
-			else
-				REPORT_ERROR("Invalid EER upsamle for 2K images. This must be 2 or 1.");
+			EERGainCounter<T, -1> subtract(image, geom, *gain);
+			decodeFrame(iframe, subtract, n_electron);
 		}
-		else
-			REPORT_ERROR("Logic error: an invalid EER size at EERRenderer::renderFrames().");
 
-		RCTOC(TIMING_RENDER_ELECTRONS);
+		std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
+		return 0;
+	}
 
-		total_n_electron += n_electron;
 #ifdef DEBUG_EER
-		printf("Decoded %lld electrons / %d pixels from frame %5d.\n", n_electron, n_pix, iframe);
+	printf("Decoded %u electrons / %u pixels from frame %5d.\n", n_electron, n_pix, iframe);
 #endif
+
+	return n_electron;
+}
+
+template <typename T>
+long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int nr_threads)
+{
+	return accumulateFrames(frame_start, frame_end, image, (const MultidimArray<T>*)NULL, nr_threads);
+}
+
+template <typename T>
+long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, const MultidimArray<T> &gain, int nr_threads)
+{
+	const bool has_gain = (NZYXSIZE(gain) > 0);
+	if (has_gain && (XSIZE(gain) != getWidth() || YSIZE(gain) != getHeight()))
+		REPORT_ERROR("EERRenderer::renderFrames: the size of the gain reference does not match the rendering grid.");
+
+	// The gain is applied to every electron as it is rendered, rather than in a second pass over the fraction
+	return accumulateFrames(frame_start, frame_end, image, has_gain ? &gain : NULL, nr_threads);
+}
+
+template <typename T>
+long long EERRenderer::accumulateFrames(int frame_start, int frame_end, MultidimArray<T> &image, const MultidimArray<T> *gain, int nr_threads)
+{
+	if (!ready)
+		REPORT_ERROR("EERRenderer::renderNFrames called before ready.");
+
+	lazyReadFrames();
+
+	if (frame_start <= 0 || frame_start > getNFrames() ||
+	    frame_end < frame_start || frame_end > getNFrames())
+	{
+		std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start << ", frame_end = " << frame_end << "),  NFrames = " << getNFrames() << std::endl;
+		REPORT_ERROR("Invalid frame range was requested.");
 	}
+
+	// Make this 0-indexed
+	frame_start--;
+	frame_end--;
+
+	if ((preread_start > 0 && frame_start < preread_start) ||
+	    (preread_end > 0 && frame_end > preread_end))
+	{
+		std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start + 1 << ", frame_end = " << frame_end + 1<< "),  NFrames = " << getNFrames() << " preread_start = " << preread_start + 1 << " prered_end = " << preread_end + 1<< std::endl;
+		REPORT_ERROR("Tried to render frames outside pre-read region");
+	}
+
+	EERRenderGeometry geom;
+	getRenderGeometry(geom);
+
+	long long total_n_electron = 0;
+	image.initZeros(getHeight(), getWidth());
+
+	const int n_frames = frame_end - frame_start + 1;
+	nr_threads = XMIPP_MAX(1, XMIPP_MIN(nr_threads, n_frames));
+
+	// With several threads, each thread renders its frames into its own partial sum;
+	// thread 0 uses the output image. The frames are distributed statically and the partial
+	// sums are added in a fixed order, so gain-weighted sums do not depend on the timing of the threads.
+	std::vector<MultidimArray<T> > partial(nr_threads - 1);
+
+	RCTIC(TIMING_RENDER_ELECTRONS);
+	#pragma omp parallel num_threads(nr_threads) reduction(+:total_n_electron)
+	{
+		const int thread_id = omp_get_thread_num();
+		MultidimArray<T> &my_image = (thread_id == 0) ? image : partial[thread_id - 1];
+		if (thread_id > 0)
+			my_image.initZeros(image);
+
+		#pragma omp for schedule(static)
+		for (int iframe = frame_start; iframe <= frame_end; iframe++)
+			total_n_electron += renderOneFrame(iframe, my_image, geom, gain);
+	}
+	RCTOC(TIMING_RENDER_ELECTRONS);
+
+	if (partial.size() > 0)
+	{
+		RCTIC(TIMING_REDUCE_FRAMES);
+		#pragma omp parallel for num_threads(nr_threads)
+		for (long int n = 0; n < NZYXSIZE(image); n++)
+		{
+			for (int t = 0; t < partial.size(); t++)
+			{
+				// In a nested parallel region, only thread 0 exists and the partial sums stay empty
+				if (NZYXSIZE(partial[t]) > 0)
+					DIRECT_MULTIDIM_ELEM(image, n) += DIRECT_MULTIDIM_ELEM(partial[t], n);
+			}
+		}
+		RCTOC(TIMING_REDUCE_FRAMES);
+	}
+
 #ifdef DEBUG_EER
 	printf("Decoded %lld electrons in total.\n", total_n_electron);
 #endif
@@ -614,9 +659,12 @@ long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArra
 }
 
 // Instantiate for Polishing
-template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image);
-template long long EERRenderer::renderFrames<short>(int frame_start, int frame_end, MultidimArray<short> &image);
-template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image);
-template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image);
-template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image);
-template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image);
+template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image, int nr_threads);
+template long long EERRenderer::renderFrames<short>(int frame_start, int frame_end, MultidimArray<short> &image, int nr_threads);
+template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image, int nr_threads);
+template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image, int nr_threads);
+template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image, int nr_threads);
+template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image, int nr_threads);
+
+// Instantiate for motion correction
+template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image, const MultidimArray<float> &gain, int nr_threads);
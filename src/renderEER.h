@@ -9,6 +9,12 @@
 
 #include <tiffio.h>
 
+struct EERRenderGeometry
+{
+	unsigned int pos_mask, pos_shift, up, down;
+	unsigned char sub_x[16], sub_y[16];
+};
+
 class EERRenderer {
 	private:
 
@@ -16,7 +22,7 @@ class EERRenderer {
 	static const char EER_FOOTER_OK[];
 	static const char EER_FOOTER_ERR[];
 	static const int EER_4K, EER_2K;
-	static const unsigned int EER_LEN_FOOTER;
+	static const unsigned int EER_LEN_FOOTER, EER_READ_AHEAD;
 	static const uint16_t TIFF_COMPRESSION_EER8bit, TIFF_COMPRESSION_EER7bit, TIFF_COMPRESSION_EERDetailed;
 	static const ttag_t TIFFTAG_EER_RLE_DEPTH, TIFFTAG_EER_SUBPIXEL_H_DEPTH, TIFFTAG_EER_SUBPIXEL_V_DEPTH;
 
@@ -37,23 +43,22 @@ class EERRenderer {
 	void readLegacy(FILE *fh);
 	void lazyReadFrames();
 
-	template <typename T>
-	void render4K_to_16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render4K_to_8K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
+	// Maps the decoded pixel index and sub-pixel symbol to the output grid
+	void getRenderGeometry(EERRenderGeometry &geom);
 
-	template <typename T>
-	void render4K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
+	// Decodes one frame and calls emit(pixel_index, symbol) for every electron.
+	// Returns the number of pixels decoded, which is total_pixels unless the frame is corrupted.
+	template <typename Emitter>
+	unsigned int decodeFrame(int iframe, Emitter &emit, unsigned int &n_electron);
 
+	// Adds one (0-indexed) frame to image; corrupted frames are skipped with a warning.
+	// If gain is not NULL, every electron is weighted by the gain at its pixel.
 	template <typename T>
-	void render4K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
+	long long renderOneFrame(int iframe, MultidimArray<T> &image, const EERRenderGeometry &geom, const MultidimArray<T> *gain);
 
+	// Common implementation of the public renderFrames()
 	template <typename T>
-	void render2K_to_4K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
-
-	template <typename T>
-	void render2K_to_2K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
+	long long accumulateFrames(int frame_start, int frame_end, MultidimArray<T> &image, const MultidimArray<T> *gain, int nr_threads);
 
 	static TIFFErrorHandler prevTIFFWarningHandler;
 
@@ -102,8 +107,20 @@ class EERRenderer {
 	// image is cleared.
 	// This function is thread-safe (except for timing).
 	// It is caller's responsibility to make sure type T does not overflow.
+	// With nr_threads > 1, frames are decoded in parallel into per-thread partial sums,
+	// which needs one extra image per thread.
 	template <typename T>
-	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image);
+	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int nr_threads = 1);
+
+	// As above, but every electron is weighted by the gain from loadEERGain() (0 means defect)
+	// while it is rendered, so no separate pass over the fraction is needed. An empty gain is ignored.
+	template <typename T>
+	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, const MultidimArray<T> &gain, int nr_threads = 1);
+
+	// Frees the compressed frames once all fractions have been rendered.
+	// They are read again if another fraction is requested later.
+	// Not thread-safe; must not be called while rendering.
+	void releaseFrames();
 
 	// The gain reference for EER is not multiplicative! So the inverse is taken here.
 	// 0 means defect.
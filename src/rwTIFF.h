@@ -29,7 +29,9 @@
 /** TIFF Reader
   * @ingroup TIFF
 */
-int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack=false, const FileName &name="")
+// With nr_threads > 1, strips are decoded in parallel. Each extra thread opens its own handle
+// to the file (libtiff handles are not thread-safe), so this needs a real file name.
+int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack=false, const FileName &name="", int nr_threads=1)
 {
 //#define DEBUG_TIFF
 #ifdef DEBUG_TIFF
@@ -58,8 +60,9 @@ int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack
 	TIFFGetFieldDefaulted(ftiff, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
 	TIFFGetFieldDefaulted(ftiff, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
 
-	// Find the number of frames
-	while (TIFFSetDirectory(ftiff, _nDim) != 0) _nDim++;
+	// Find the number of frames.
+	// This walks the directory chain once, while TIFFSetDirectory() starts from the first directory every time.
+	_nDim = TIFFNumberOfDirectories(ftiff);
 	// and go back to the start
 	TIFFSetDirectory(ftiff, 0);
 
@@ -176,13 +179,20 @@ int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack
 	{
 		if (img_select == -1) img_select = 0; // img_select starts from 0
 
-		size_t haveread_n = 0;
+		// Make sure image property is consistent for all frames and list the strips to be decoded
+		const size_t page_n = _xDim * _yDim;
+		std::vector<long int> job_page;
+		std::vector<tstrip_t> job_strip;
+		std::vector<size_t> job_offset; // destination in data
+		tsize_t stripSize = 0;
 		for (int i = 0; i < _nDim; i++)
 		{
-			TIFFSetDirectory(ftiff, img_select);
+			if (i == 0)
+				TIFFSetDirectory(ftiff, img_select);
+			else
+				TIFFReadDirectory(ftiff);
 
-			// Make sure image property is consistent for all frames
-			uint32_t cur_width, cur_length;
+			uint32_t cur_width, cur_length, rowsPerStrip;
 			uint16_t cur_sampleFormat, cur_bitsPerSample;
 
 			if (TIFFGetField(ftiff, TIFFTAG_IMAGEWIDTH, &cur_width) != 1 ||
@@ -198,32 +208,77 @@ int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack
 				REPORT_ERROR(name + ": All frames in a TIFF should have same width, height and pixel format.\n");
 			}
 
-			tsize_t stripSize = TIFFStripSize(ftiff);
+			TIFFGetFieldDefaulted(ftiff, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+			if (rowsPerStrip > length)
+				rowsPerStrip = length; // the default is 2^32 - 1
+
+			stripSize = XMIPP_MAX(stripSize, TIFFStripSize(ftiff));
 			tstrip_t numberOfStrips = TIFFNumberOfStrips(ftiff);
-			tdata_t buf = _TIFFmalloc(stripSize);
 #ifdef DEBUG_TIFF
-			size_t readsize_n = stripSize * 8 / bitsPerSample;
-			std::cout << "TIFF stripSize=" << stripSize << " numberOfStrips=" << numberOfStrips << " readsize_n=" << readsize_n << std::endl;
+			std::cout << "TIFF stripSize=" << TIFFStripSize(ftiff) << " numberOfStrips=" << numberOfStrips << " rowsPerStrip=" << rowsPerStrip << std::endl;
 #endif
 			for (tstrip_t strip = 0; strip < numberOfStrips; strip++)
 			{
-				tsize_t actually_read = TIFFReadEncodedStrip(ftiff, strip, buf, stripSize);
+				job_page.push_back(img_select + i);
+				job_strip.push_back(strip);
+				job_offset.push_back(i * page_n + (size_t)strip * rowsPerStrip * _xDim);
+			}
+		}
+
+		// Strips are independent, so they are decoded straight into the destination in parallel.
+		// Each handle takes a contiguous range of strips, so that it rarely has to change the directory.
+		FileName fn_tiff;
+		long int dump;
+		name.decompose(dump, fn_tiff);
+		fn_tiff = fn_tiff.removeFileFormat();
+
+		const long int n_jobs = job_strip.size();
+		const int n_handles = XMIPP_MAX(1, XMIPP_MIN(nr_threads, n_jobs));
+		bool failed = false;
+
+		#pragma omp parallel for num_threads(n_handles) reduction(||:failed)
+		for (int ihandle = 0; ihandle < n_handles; ihandle++)
+		{
+			TIFF *my_tiff = (ihandle == 0) ? ftiff : TIFFOpen(fn_tiff.c_str(), "r");
+			if (my_tiff == NULL)
+			{
+				failed = true;
+				continue;
+			}
+
+			tdata_t buf = _TIFFmalloc(stripSize);
+			long int cur_page = -1;
+			for (long int ijob = n_jobs * ihandle / n_handles; ijob < n_jobs * (ihandle + 1) / n_handles; ijob++)
+			{
+				if (job_page[ijob] != cur_page)
+				{
+					TIFFSetDirectory(my_tiff, job_page[ijob]);
+					cur_page = job_page[ijob];
+				}
+
+				tsize_t actually_read = TIFFReadEncodedStrip(my_tiff, job_strip[ijob], buf, stripSize);
 				if (actually_read == -1)
-					REPORT_ERROR((std::string)"Failed to read an image data from " + name);
+				{
+					failed = true;
+					break;
+				}
 				tsize_t actually_read_n = actually_read * 8 / bitsPerSample;
 #ifdef DEBUG_TIFF
-				std::cout << "Reading strip: " << strip << "actually read byte:" << actually_read << std::endl;
+				std::cout << "Reading strip: " << job_strip[ijob] << " actually read byte:" << actually_read << std::endl;
 #endif
 				if (packed_4bit)
 					actually_read_n *= 2; // convert physical size to logical size
-				castPage2T((char*)buf, MULTIDIM_ARRAY(data) + haveread_n, datatype, actually_read_n);
-				haveread_n += actually_read_n;
+				castPage2T((char*)buf, MULTIDIM_ARRAY(data) + job_offset[ijob], datatype, actually_read_n);
 			}
 
 			_TIFFfree(buf);
-			img_select++;
+			if (ihandle != 0)
+				TIFFClose(my_tiff);
 		}
 
+		if (failed)
+			REPORT_ERROR((std::string)"Failed to read an image data from " + name);
+
 		/* Flip the Y axis.
  
 		   In an MRC file, the origin is bottom-left, +X to the right, +Y to the top.
@@ -240,22 +295,15 @@ int readTIFF(TIFF* ftiff, long int img_select, bool readdata=false, bool isStack
 		   We follow this.
 		*/
 
-		T tmp;
 		const int ylim = _yDim / 2, z = 0;
-		for (int n = 0; n < _nDim; n++)
-			{
-			for (int y1 = 0; y1 < ylim; y1++)
-			{
-				const int y2 = _yDim - 1 - y1;
-				for (int x = 0; x < _xDim; x++)
-				{
-					 // TODO: memcpy or pointer arithmetic is probably faster
-					tmp = DIRECT_NZYX_ELEM(data, n, z, y1, x);
-					DIRECT_NZYX_ELEM(data, n, z, y1, x) = DIRECT_NZYX_ELEM(data, n, z, y2, x);
-					DIRECT_NZYX_ELEM(data, n, z, y2, x) = tmp;
-				}
-			}
-		} 
+		#pragma omp parallel for num_threads(n_handles)
+		for (long int ny1 = 0; ny1 < _nDim * ylim; ny1++)
+		{
+			const int n = ny1 / ylim, y1 = ny1 % ylim;
+			const int y2 = _yDim - 1 - y1;
+			T *row1 = &DIRECT_NZYX_ELEM(data, n, z, y1, 0);
+			std::swap_ranges(row1, row1 + _xDim, &DIRECT_NZYX_ELEM(data, n, z, y2, 0));
+		}
 	}
 
 	return 0;
@@ -42,6 +42,19 @@ RFLOAT TabSine::operator()(RFLOAT val) const
 	return (val < 0 ) ? -retval : retval;
 }
 
+void TabSine::operator()(const RFLOAT *val, RFLOAT *out, long int n) const
+{
+	const RFLOAT *table = MULTIDIM_ARRAY(tabulatedValues);
+	const int size = XSIZE(tabulatedValues);
+	#pragma omp simd
+	for (long int i = 0; i < n; i++)
+	{
+		int idx = (int)( ABS(val[i]) / sampling);
+		RFLOAT retval = table[idx % size];
+		out[i] = (val[i] < 0 ) ? -retval : retval;
+	}
+}
+
 void TabCosine::initialise(const int _nr_elem)
 {
 	sampling = 2 * PI / (RFLOAT) _nr_elem;
@@ -64,6 +77,18 @@ RFLOAT TabCosine::operator()(RFLOAT val) const
 	return DIRECT_A1D_ELEM(tabulatedValues, idx % XSIZE(tabulatedValues));
 }
 
+void TabCosine::operator()(const RFLOAT *val, RFLOAT *out, long int n) const
+{
+	const RFLOAT *table = MULTIDIM_ARRAY(tabulatedValues);
+	const int size = XSIZE(tabulatedValues);
+	#pragma omp simd
+	for (long int i = 0; i < n; i++)
+	{
+		int idx = (int)( ABS(val[i]) / sampling);
+		out[i] = table[idx % size];
+	}
+}
+
 void TabBlob::initialise(RFLOAT _radius, RFLOAT _alpha, int _order, const int _nr_elem)
 {
 	radius = _radius;
@@ -92,6 +117,20 @@ RFLOAT TabBlob::operator()(RFLOAT val) const
 		return DIRECT_A1D_ELEM(tabulatedValues, idx);
 }
 
+void TabBlob::operator()(const RFLOAT *val, RFLOAT *out, long int n) const
+{
+	const RFLOAT *table = MULTIDIM_ARRAY(tabulatedValues);
+	const int size = XSIZE(tabulatedValues);
+	#pragma omp simd
+	for (long int i = 0; i < n; i++)
+	{
+		// Clamp the index, so that the gather is always inside the table
+		RFLOAT idx_val = ABS(val[i]) / sampling;
+		int idx = (idx_val < size) ? (int)idx_val : 0;
+		out[i] = (idx_val < size) ? table[idx] : 0.;
+	}
+}
+
 void TabFtBlob::initialise(RFLOAT _radius, RFLOAT _alpha, int _order, const int _nr_elem)
 {
 	radius = _radius;
@@ -120,3 +159,17 @@ RFLOAT TabFtBlob::operator()(RFLOAT val) const
 		return DIRECT_A1D_ELEM(tabulatedValues, idx);
 }
 
+void TabFtBlob::operator()(const RFLOAT *val, RFLOAT *out, long int n) const
+{
+	const RFLOAT *table = MULTIDIM_ARRAY(tabulatedValues);
+	const int size = XSIZE(tabulatedValues);
+	#pragma omp simd
+	for (long int i = 0; i < n; i++)
+	{
+		// As for TabBlob: zero beyond the end of the table
+		RFLOAT idx_val = ABS(val[i]) / sampling;
+		int idx = (idx_val < size) ? (int)idx_val : 0;
+		out[i] = (idx_val < size) ? table[idx] : 0.;
+	}
+}
+
@@ -25,6 +25,8 @@
 #include "src/funcs.h"
 
 // Class to tabulate some functions
+// Each of them can also be evaluated for an array of n values at once, with the same results as one value at a time;
+// those loops vectorise
 class TabFunction
 {
 
@@ -86,6 +88,9 @@ public:
 	// Value access
 	RFLOAT operator()(RFLOAT val) const;
 
+	// Sines of n values
+	void operator()(const RFLOAT *val, RFLOAT *out, long int n) const;
+
 };
 
 class TabCosine : public TabFunction
@@ -102,6 +107,9 @@ public:
 	// Value access
 	RFLOAT operator()(RFLOAT val) const;
 
+	// Cosines of n values
+	void operator()(const RFLOAT *val, RFLOAT *out, long int n) const;
+
 };
 
 class TabBlob : public TabFunction
@@ -125,6 +133,9 @@ public:
 	// Value access
 	RFLOAT operator()(RFLOAT val) const;
 
+	// Blob values at n distances
+	void operator()(const RFLOAT *val, RFLOAT *out, long int n) const;
+
 };
 
 class TabFtBlob : public TabFunction
@@ -148,6 +159,9 @@ public:
 	// Value access
 	RFLOAT operator()(RFLOAT val) const;
 
+	// Fourier-transformed blob values at n frequencies
+	void operator()(const RFLOAT *val, RFLOAT *out, long int n) const;
+
 };
 
 
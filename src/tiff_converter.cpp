@@ -43,7 +43,7 @@ void TIFFConverter::read(int argc, char **argv)
 	fn_in = parser.getOption("--i", "Input movie to be compressed (an MRC/MRCS file or a list of movies as .star or .lst)");
 	fn_out = parser.getOption("--o", "Directory for output TIFF files", "./");
 	only_do_unfinished = parser.checkOption("--only_do_unfinished", "Only process non-converted movies.");
-	nr_threads = textToInteger(parser.getOption("--j", "Number of threads (useful only for --estimate_gain)", "1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads (frames are read and compressed in parallel)", "1"));
 	fn_gain = parser.getOption("--gain", "Estimated gain map and its reliablity map (read)", "");
 	thresh_reliable = textToInteger(parser.getOption("--thresh", "Number of success needed to consider a pixel reliable", "50"));
 	do_estimate = parser.checkOption("--estimate_gain", "Estimate gain");
@@ -57,8 +57,9 @@ void TIFFConverter::read(int argc, char **argv)
 	eer_short = parser.checkOption("--short", "use unsigned short instead of signed byte for EER rendering");
 
 	int tiff_section = parser.addSection("TIFF writing options");
-	fn_compression = parser.getOption("--compression", "compression type (none, auto, deflate (= zip), lzw)", "auto");
-	deflate_level = textToInteger(parser.getOption("--deflate_level", "deflate level. 1 (fast) to 9 (slowest but best compression)", "6"));
+	fn_compression = parser.getOption("--compression", "compression type (none, auto, deflate (= zip), lzw, zstd, lerc)", "auto");
+	deflate_level = textToInteger(parser.getOption("--deflate_level", "deflate level (also used after lossless LERC). 1 (fast) to 9 (slowest but best compression)", "6"));
+	zstd_level = textToInteger(parser.getOption("--zstd_level", "ZSTD level. 1 (fast) to 22 (slowest but best compression)", "9"));
 	//lossy = parser.checkOption("--lossy", "Allow slightly lossy but better compression on defect pixels");
 	dont_die_on_error = parser.checkOption("--ignore_error", "Don't die on un-expected defect pixels (can be dangerous)");
 	line_by_line = parser.checkOption("--line_by_line", "Use one strip per row");
@@ -151,6 +152,22 @@ int TIFFConverter::decide_filter(int nx, bool isEER)
 		return COMPRESSION_LZW;
 	else if (fn_compression == "deflate" || fn_compression == "zip")
 		return COMPRESSION_DEFLATE;
+#ifdef COMPRESSION_ZSTD
+	else if (fn_compression == "zstd")
+	{
+		if (!TIFFIsCODECConfigured(COMPRESSION_ZSTD))
+			REPORT_ERROR("The TIFF library was built without ZSTD support.");
+		return COMPRESSION_ZSTD;
+	}
+#endif
+#ifdef COMPRESSION_LERC
+	else if (fn_compression == "lerc")
+	{
+		if (!TIFFIsCODECConfigured(COMPRESSION_LERC))
+			REPORT_ERROR("The TIFF library was built without LERC support.");
+		return COMPRESSION_LERC;
+	}
+#endif
 	else if (fn_compression == "auto")
 	{
 		if (nx == 4096 && !isEER)
@@ -159,11 +176,146 @@ int TIFFConverter::decide_filter(int nx, bool isEER)
 			return COMPRESSION_LZW;
 	}
 	else
-		REPORT_ERROR("Compression type must be one of none, auto, deflate (= zip) or lzw.");
+		REPORT_ERROR("Compression type must be one of none, auto, deflate (= zip), lzw, zstd or lerc.");
 
 	return -1;
 }
 
+int TIFFConverter::decide_level(int filter)
+{
+#ifdef COMPRESSION_ZSTD
+	if (filter == COMPRESSION_ZSTD)
+		return zstd_level;
+#endif
+	return deflate_level;
+}
+
+// A growing in-memory file for libtiff
+struct TIFFMemoryFile
+{
+	std::string *data;
+	toff_t pos;
+};
+
+static tsize_t TIFFMemoryReadProc(thandle_t handle, tdata_t buf, tsize_t size)
+{
+	TIFFMemoryFile *file = (TIFFMemoryFile*)handle;
+	if (file->pos >= file->data->size())
+		return 0;
+	if (file->pos + size > file->data->size())
+		size = file->data->size() - file->pos;
+
+	memcpy(buf, &(*file->data)[file->pos], size);
+	file->pos += size;
+
+	return size;
+}
+
+static tsize_t TIFFMemoryWriteProc(thandle_t handle, tdata_t buf, tsize_t size)
+{
+	TIFFMemoryFile *file = (TIFFMemoryFile*)handle;
+	if (file->pos + size > file->data->size())
+		file->data->resize(file->pos + size);
+
+	memcpy(&(*file->data)[file->pos], buf, size);
+	file->pos += size;
+
+	return size;
+}
+
+static toff_t TIFFMemorySeekProc(thandle_t handle, toff_t offset, int whence)
+{
+	TIFFMemoryFile *file = (TIFFMemoryFile*)handle;
+	if (whence == SEEK_SET)
+		file->pos = offset;
+	else if (whence == SEEK_CUR)
+		file->pos += offset;
+	else if (whence == SEEK_END)
+		file->pos = file->data->size() + offset;
+
+	return file->pos;
+}
+
+static int TIFFMemoryCloseProc(thandle_t handle)
+{
+	return 0;
+}
+
+static toff_t TIFFMemorySizeProc(thandle_t handle)
+{
+	return ((TIFFMemoryFile*)handle)->data->size();
+}
+
+static int TIFFMemoryMapProc(thandle_t handle, tdata_t *base, toff_t *size)
+{
+	return 0; // not mapped; libtiff falls back to reading
+}
+
+static void TIFFMemoryUnmapProc(thandle_t handle, tdata_t base, toff_t size)
+{
+}
+
+static TIFF* TIFFMemoryOpen(TIFFMemoryFile &file, const char *mode)
+{
+	file.pos = 0;
+	return TIFFClientOpen("in-memory-tiff", mode, (thandle_t)&file,
+	                      TIFFMemoryReadProc, TIFFMemoryWriteProc, TIFFMemorySeekProc, TIFFMemoryCloseProc,
+	                      TIFFMemorySizeProc, TIFFMemoryMapProc, TIFFMemoryUnmapProc);
+}
+
+template <typename T>
+void TIFFConverter::compress_page(const MultidimArray<T> &buf, std::string &page, float pixel_size, bool isEER)
+{
+	page.clear();
+	TIFFMemoryFile file = {&page, 0};
+	TIFF *tif = TIFFMemoryOpen(file, "w");
+	if (tif == NULL)
+		REPORT_ERROR("Failed to create a TIFF page in memory.");
+
+	const int filter = decide_filter(XSIZE(buf), isEER);
+	write_tiff_one_page(tif, buf, pixel_size, filter, decide_level(filter), line_by_line);
+	TIFFClose(tif);
+}
+
+template <typename T>
+void TIFFConverter::append_page(TIFF *tif, std::string &page, float pixel_size, bool isEER)
+{
+	TIFFMemoryFile file = {&page, 0};
+	TIFF *tif_page = TIFFMemoryOpen(file, "rc"); // c: do not split uncompressed strips
+	if (tif_page == NULL)
+		REPORT_ERROR("Failed to open a TIFF page in memory.");
+
+	uint32_t nx, ny;
+	TIFFGetField(tif_page, TIFFTAG_IMAGEWIDTH, &nx);
+	TIFFGetField(tif_page, TIFFTAG_IMAGELENGTH, &ny);
+	const int filter = decide_filter(nx, isEER);
+	set_tiff_tags<T>(tif, nx, ny, pixel_size, filter, decide_level(filter), line_by_line);
+
+#ifdef COMPRESSION_LERC
+	// LERC records its parameters when encoding, which does not happen for raw strips
+	if (filter == COMPRESSION_LERC)
+	{
+		uint32_t count, *params;
+		if (TIFFGetField(tif_page, TIFFTAG_LERC_PARAMETERS, &count, &params) == 1)
+			TIFFSetField(tif, TIFFTAG_LERC_PARAMETERS, count, params);
+	}
+#endif
+
+	std::vector<char> strip;
+	const tstrip_t n_strips = TIFFNumberOfStrips(tif_page);
+	for (tstrip_t i = 0; i < n_strips; i++)
+	{
+		const tsize_t size = TIFFRawStripSize(tif_page, i);
+		strip.resize(size);
+		if (size <= 0 || TIFFReadRawStrip(tif_page, i, &strip[0], size) != size ||
+		    TIFFWriteRawStrip(tif, i, &strip[0], size) != size)
+			REPORT_ERROR("Failed to copy a compressed strip to the output TIFF file.");
+	}
+
+	TIFFClose(tif_page);
+	TIFFWriteDirectory(tif);
+}
+
 template <typename T>
 void TIFFConverter::unnormalise(FileName fn_movie, FileName fn_tiff)
 {
@@ -173,80 +325,100 @@ void TIFFConverter::unnormalise(FileName fn_movie, FileName fn_tiff)
 		REPORT_ERROR("Failed to open the output TIFF file: " + fn_tiff);
 
 	Image<float> frame;
-	char msg[256];
-
 	frame.read(fn_movie, false, -1, false, true); // select_img -1, mmap false, is_2D true
 	if (XSIZE(frame()) != XSIZE(gain()) || YSIZE(frame()) != YSIZE(gain()))
 		REPORT_ERROR("The movie " + fn_movie + " has a different size from others.");
 
 	const int nframes = NSIZE(frame());
 	const float angpix = frame.samplingRateX();
-	MultidimArray<T> buf(YSIZE(frame()), XSIZE(frame()));
 
-	for (int iframe = 0; iframe < nframes; iframe++)
+	// Frames are converted and compressed in parallel, nr_threads at a time
+	std::vector<std::string> pages(nr_threads);
+	std::vector<int> errors(nr_threads), mismatches(nr_threads);
+	for (int batch_start = 0; batch_start < nframes; batch_start += nr_threads)
 	{
-		int error = 0;
-		
-		frame.read(fn_movie, true, iframe, false, true);
+		const int batch_end = XMIPP_MIN(batch_start + nr_threads, nframes);
 
-		#pragma omp parallel for num_threads(nr_threads) reduction(+:error)
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(frame())
+		#pragma omp parallel for num_threads(nr_threads)
+		for (int iframe = batch_start; iframe < batch_end; iframe++)
 		{
-			const float val = DIRECT_MULTIDIM_ELEM(frame(), n);
-			const float gain_here = DIRECT_MULTIDIM_ELEM(gain(), n);
-			bool is_bad = DIRECT_MULTIDIM_ELEM(defects(), n) < thresh_reliable;
-			
-			if (is_bad)
-			{
-				// TODO: implement other strategy
-				DIRECT_MULTIDIM_ELEM(buf, n) = val;
-				continue;
-			}
-
-			int ival = (int)round(val / gain_here);
-			const float expected = gain_here * ival;
-			if (fabs(expected - val) > 0.0001)
-			{
-				snprintf(msg, 255, " mismatch: %s frame %2d pos %4ld %4ld obs % 8.4f status %d expected % 8.4f gain %.4f\n",
-					 fn_movie.c_str(), iframe + 1, n / XSIZE(gain()), n % XSIZE(gain()), (double)val, DIRECT_MULTIDIM_ELEM(defects(), n),
-					 (double)expected, (double)gain_here);
-				std::cerr << msg << std::endl;
-				if (!dont_die_on_error)
-					REPORT_ERROR("Unexpected pixel value in a pixel that was considered reliable");
-				error++;
-			}
+			Image<float> frame;
+			frame.read(fn_movie, true, iframe, false, true);
+			MultidimArray<T> buf(YSIZE(frame()), XSIZE(frame()));
+			char msg[256];
+			int error = 0, mismatch = 0;
 
-			if (!std::is_same<T, float>::value)
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(frame())
 			{
-				const int overflow = std::is_same<T, short>::value ? 32767: 127;
-				const int underflow = std::is_same<T, short>::value ? -32768: 0;
+				const float val = DIRECT_MULTIDIM_ELEM(frame(), n);
+				const float gain_here = DIRECT_MULTIDIM_ELEM(gain(), n);
+				bool is_bad = DIRECT_MULTIDIM_ELEM(defects(), n) < thresh_reliable;
 
-				if (ival < underflow)
+				if (is_bad)
 				{
-					ival = underflow;
-					error++;
-					
-					printf(" underflow: %s frame %2d pos %4ld %4ld obs % 8.4f expected % 8.4f gain %.4f\n",
-					       fn_movie.c_str(), iframe + 1, n / XSIZE(gain()), n % XSIZE(gain()), (double)val,
-					       (double)expected, (double)gain_here);
+					// TODO: implement other strategy
+					DIRECT_MULTIDIM_ELEM(buf, n) = val;
+					continue;
 				}
-				else if (ival > overflow)
+
+				int ival = (int)round(val / gain_here);
+				const float expected = gain_here * ival;
+				if (fabs(expected - val) > 0.0001)
 				{
-					ival = overflow;
+					snprintf(msg, 255, " mismatch: %s frame %2d pos %4ld %4ld obs % 8.4f status %d expected % 8.4f gain %.4f\n",
+						 fn_movie.c_str(), iframe + 1, n / XSIZE(gain()), n % XSIZE(gain()), (double)val, DIRECT_MULTIDIM_ELEM(defects(), n),
+						 (double)expected, (double)gain_here);
+					std::cerr << msg << std::endl;
+					mismatch++;
 					error++;
+				}
 
-					printf(" overflow: %s frame %2d pos %4ld %4ld obs % 8.4f expected % 8.4f gain %.4f\n",
-					       fn_movie.c_str(), iframe + 1, n / XSIZE(buf), n % XSIZE(buf), (double)val,
-					       (double)expected, (double)gain_here);
+				if (!std::is_same<T, float>::value)
+				{
+					const int overflow = std::is_same<T, short>::value ? 32767: 127;
+					const int underflow = std::is_same<T, short>::value ? -32768: 0;
+
+					if (ival < underflow)
+					{
+						ival = underflow;
+						error++;
+
+						printf(" underflow: %s frame %2d pos %4ld %4ld obs % 8.4f expected % 8.4f gain %.4f\n",
+						       fn_movie.c_str(), iframe + 1, n / XSIZE(gain()), n % XSIZE(gain()), (double)val,
+						       (double)expected, (double)gain_here);
+					}
+					else if (ival > overflow)
+					{
+						ival = overflow;
+						error++;
+
+						printf(" overflow: %s frame %2d pos %4ld %4ld obs % 8.4f expected % 8.4f gain %.4f\n",
+						       fn_movie.c_str(), iframe + 1, n / XSIZE(buf), n % XSIZE(buf), (double)val,
+						       (double)expected, (double)gain_here);
+					}
 				}
+
+				DIRECT_MULTIDIM_ELEM(buf, n) = ival;
 			}
-			
-			DIRECT_MULTIDIM_ELEM(buf, n) = ival;
+
+			compress_page(buf, pages[iframe - batch_start], angpix);
+			errors[iframe - batch_start] = error;
+			mismatches[iframe - batch_start] = mismatch;
 		}
 
-		write_tiff_one_page(tif, buf, angpix, decide_filter(XSIZE(buf)), deflate_level, line_by_line);
+		// Mismatches are only reported here, as an exception must not leave the parallel region
+		if (!dont_die_on_error)
+		{
+			for (int iframe = batch_start; iframe < batch_end; iframe++)
+				if (mismatches[iframe - batch_start] > 0)
+					REPORT_ERROR("Unexpected pixel value in a pixel that was considered reliable");
+		}
 
-		printf(" %s Frame %3d / %3d #Error %10d\n", fn_movie.c_str(), iframe + 1, nframes, error);
+		for (int iframe = batch_start; iframe < batch_end; iframe++)
+		{
+			append_page<T>(tif, pages[iframe - batch_start], angpix);
+			printf(" %s Frame %3d / %3d #Error %10d\n", fn_movie.c_str(), iframe + 1, nframes, errors[iframe - batch_start]);
+		}
 	}
 
 	TIFFClose(tif);
@@ -267,12 +439,26 @@ void TIFFConverter::only_compress(FileName fn_movie, FileName fn_tiff)
 		frame.read(fn_movie, false, -1, false, true); // select_img -1, mmap false, is_2D true
 		const int nframes = NSIZE(frame());
 		const float angpix = frame.samplingRateX();
-		
-		for (int iframe = 0; iframe < nframes; iframe++)
+
+		// Frames are read and compressed in parallel, nr_threads at a time
+		std::vector<std::string> pages(nr_threads);
+		for (int batch_start = 0; batch_start < nframes; batch_start += nr_threads)
 		{
-			frame.read(fn_movie, true, iframe, false, true);
-			write_tiff_one_page(tif, frame(), angpix, decide_filter(XSIZE(frame())), deflate_level, line_by_line);
-			printf(" %s Frame %3d / %3d\n", fn_movie.c_str(), iframe + 1, nframes);
+			const int batch_end = XMIPP_MIN(batch_start + nr_threads, nframes);
+
+			#pragma omp parallel for num_threads(nr_threads)
+			for (int iframe = batch_start; iframe < batch_end; iframe++)
+			{
+				Image<T> frame;
+				frame.read(fn_movie, true, iframe, false, true);
+				compress_page(frame(), pages[iframe - batch_start], angpix);
+			}
+
+			for (int iframe = batch_start; iframe < batch_end; iframe++)
+			{
+				append_page<T>(tif, pages[iframe - batch_start], angpix);
+				printf(" %s Frame %3d / %3d\n", fn_movie.c_str(), iframe + 1, nframes);
+			}
 		}
 	}
 	else
@@ -283,17 +469,26 @@ void TIFFConverter::only_compress(FileName fn_movie, FileName fn_tiff)
 		const int nframes = renderer.getNFrames();
 		std::cout << " Found " << nframes << " raw frames" << std::endl;
 
-		MultidimArray<T> buf;
-		for (int frame = 1; frame < nframes; frame += eer_grouping)
+		// Fractions are rendered and compressed in parallel, nr_threads at a time
+		const int nfractions = nframes / eer_grouping; // remaining frames are truncated
+		std::vector<std::string> pages(nr_threads);
+		for (int batch_start = 0; batch_start < nfractions; batch_start += nr_threads)
 		{
-			const int frame_end = frame + eer_grouping - 1;
-			if (frame_end > nframes)
-				break;
-
-			std::cout << " Rendering EER (hardware) frame " << frame << " to " << frame_end << std::endl;
-			buf.initZeros(renderer.getHeight(), renderer.getWidth());
-			renderer.renderFrames(frame, frame_end, buf);
-			write_tiff_one_page(tif, buf, -1, decide_filter(renderer.getWidth(), true), deflate_level, line_by_line);
+			const int batch_end = XMIPP_MIN(batch_start + nr_threads, nfractions);
+
+			#pragma omp parallel for num_threads(nr_threads)
+			for (int ifraction = batch_start; ifraction < batch_end; ifraction++)
+			{
+				MultidimArray<T> buf;
+				renderer.renderFrames(ifraction * eer_grouping + 1, (ifraction + 1) * eer_grouping, buf);
+				compress_page(buf, pages[ifraction - batch_start], -1, true);
+			}
+
+			for (int ifraction = batch_start; ifraction < batch_end; ifraction++)
+			{
+				std::cout << " Rendered EER (hardware) frame " << ifraction * eer_grouping + 1 << " to " << (ifraction + 1) * eer_grouping << std::endl;
+				append_page<T>(tif, pages[ifraction - batch_start], -1, true);
+			}
 		}
 	}
 
@@ -35,12 +35,12 @@ public:
 	void run();
 
 	template <typename T>
-	static void write_tiff_one_page(TIFF *tif, MultidimArray<T> buf, const float pixel_size=-1, const int filter=COMPRESSION_LZW, const int level=6, const bool strip_per_line=false)
+	static void set_tiff_tags(TIFF *tif, long nx, long ny, const float pixel_size=-1, const int filter=COMPRESSION_LZW, const int level=6, const bool strip_per_line=false)
 	{
 		TIFFSetField(tif, TIFFTAG_SOFTWARE, "RELION");
-		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, XSIZE(buf));
-		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, YSIZE(buf));
-		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, strip_per_line ? 1 : YSIZE(buf));
+		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, nx);
+		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, ny);
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, strip_per_line ? 1 : ny);
 		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
 		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);		
@@ -75,7 +75,7 @@ public:
 			REPORT_ERROR("write_tiff_one_page: unknown data type");
 		}
 
-		// compression is COMPRESSION_LZW or COMPRESSION_DEFLATE or COMPRESSION_NONE
+		// compression is COMPRESSION_LZW, COMPRESSION_DEFLATE, COMPRESSION_ZSTD, COMPRESSION_LERC or COMPRESSION_NONE
 		TIFFSetField(tif, TIFFTAG_COMPRESSION, filter);
 		if (filter == COMPRESSION_DEFLATE)
 		{
@@ -83,6 +83,25 @@ public:
 				REPORT_ERROR("Deflate level must be 1, 2, ..., 9");
 			TIFFSetField(tif, TIFFTAG_ZIPQUALITY, level);
 		}
+#ifdef COMPRESSION_ZSTD
+		else if (filter == COMPRESSION_ZSTD)
+		{
+			if (level <= 0 || level > 22)
+				REPORT_ERROR("ZSTD level must be 1, 2, ..., 22");
+			TIFFSetField(tif, TIFFTAG_ZSTD_LEVEL, level);
+		}
+#endif
+#ifdef COMPRESSION_LERC
+		else if (filter == COMPRESSION_LERC)
+		{
+			// Lossless LERC followed by deflate
+			if (level <= 0 || level > 9)
+				REPORT_ERROR("Deflate level must be 1, 2, ..., 9");
+			TIFFSetField(tif, TIFFTAG_LERC_MAXZERROR, 0.0);
+			TIFFSetField(tif, TIFFTAG_LERC_ADD_COMPRESSION, LERC_ADD_COMPRESSION_DEFLATE);
+			TIFFSetField(tif, TIFFTAG_ZIPQUALITY, level);
+		}
+#endif
 
 		if (pixel_size > 0)
 		{
@@ -90,6 +109,12 @@ public:
 			TIFFSetField(tif, TIFFTAG_XRESOLUTION, 1E8 / pixel_size); // pixels / 1 cm
 			TIFFSetField(tif, TIFFTAG_YRESOLUTION, 1E8 / pixel_size);
 		}
+	}
+
+	template <typename T>
+	static void write_tiff_one_page(TIFF *tif, const MultidimArray<T> &buf, const float pixel_size=-1, const int filter=COMPRESSION_LZW, const int level=6, const bool strip_per_line=false)
+	{
+		set_tiff_tags<T>(tif, XSIZE(buf), YSIZE(buf), pixel_size, filter, level, strip_per_line);
 
 		// Have to flip the Y axis
 		for (int iy = 0; iy < YSIZE(buf); iy++)
@@ -103,7 +128,7 @@ private:
 
 	FileName fn_in, fn_out, fn_gain, fn_compression;
 	bool do_estimate, input_type, lossy, dont_die_on_error, line_by_line, only_do_unfinished, eer_short;
-	int deflate_level, thresh_reliable, nr_threads, eer_upsampling, eer_grouping;
+	int deflate_level, zstd_level, thresh_reliable, nr_threads, eer_upsampling, eer_grouping;
 	IOParser parser;
 
 	MetaDataTable MD;
@@ -113,6 +138,15 @@ private:
 
 	void estimate(FileName fn_movie);
 	int decide_filter(int nx, bool isEER=false);
+	int decide_level(int filter);
+
+	// To compress frames in parallel, each frame is written as a single-page TIFF in memory.
+	// The compressed strips are then appended to the output in order, without re-compression.
+	template <typename T>
+	void compress_page(const MultidimArray<T> &buf, std::string &page, float pixel_size, bool isEER=false);
+
+	template <typename T>
+	void append_page(TIFF *tif, std::string &page, float pixel_size, bool isEER=false);
 
 	template <typename T>
 	void unnormalise(FileName fn_movie, FileName fn_tiff);
@@ -0,0 +1,54 @@
+#include <catch2/catch.hpp>
+#include "src/backprojector.h"
+
+static void getSymmetryMatrices(const BackProjector &BP, std::vector<Matrix2D<RFLOAT> > &R)
+{
+  Matrix2D<RFLOAT> L(4, 4);
+  R.assign(BP.SL.SymsNo(), Matrix2D<RFLOAT>(4, 4));
+  for (int isym = 0; isym < R.size(); isym++)
+    BP.SL.get_matrices(isym, L, R[isym]);
+}
+
+//An I group at a padded r_max of 100 (2.1M voxels x 59 operators) must fit in the default memory limit of the stencils.
+TEST_CASE( "Test symmetry stencil for an I group", "[backprojector]" ) {
+  BackProjector BP(100, 3, "I", TRILINEAR, 2);
+  BP.initZeros(100);
+
+  std::vector<Matrix2D<RFLOAT> > R;
+  getSymmetryMatrices(BP, R);
+  REQUIRE(R.size() == 59);
+
+  const int rmax = ROUND(BP.r_max * BP.padding_factor);
+  REQUIRE(rmax == 100);
+
+  const SymmetryStencil *stencil = BP.getSymmetryStencil(rmax * rmax, R, 4);
+  REQUIRE(stencil != NULL);
+  REQUIRE(stencil->offsets.size() > 2000000L * 59);
+  REQUIRE(stencil->fractions.size() == stencil->offsets.size());
+}
+
+//The quantised fractions of the stencils must give the same symmetrised map as the direct calculation.
+TEST_CASE( "Test applyPointGroupSymmetry with and without stencils", "[backprojector]" ) {
+  BackProjector BPstencil(32, 3, "I", TRILINEAR, 2);
+  BPstencil.initZeros(32);
+
+  init_random_generator(1234);
+  FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPstencil.data)
+  {
+    DIRECT_MULTIDIM_ELEM(BPstencil.data, n) = Complex(rnd_unif(-1., 1.), rnd_unif(-1., 1.));
+    DIRECT_MULTIDIM_ELEM(BPstencil.weight, n) = rnd_unif(0., 1.);
+  }
+
+  BackProjector BPdirect(BPstencil);
+  BPdirect.symmetry_stencil_max_mb = 0;
+
+  BPstencil.applyPointGroupSymmetry(2);
+  BPdirect.applyPointGroupSymmetry(2);
+
+  FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPstencil.data)
+  {
+    REQUIRE(DIRECT_MULTIDIM_ELEM(BPstencil.data, n).real == Approx(DIRECT_MULTIDIM_ELEM(BPdirect.data, n).real).margin(1e-3));
+    REQUIRE(DIRECT_MULTIDIM_ELEM(BPstencil.data, n).imag == Approx(DIRECT_MULTIDIM_ELEM(BPdirect.data, n).imag).margin(1e-3));
+    REQUIRE(DIRECT_MULTIDIM_ELEM(BPstencil.weight, n) == Approx(DIRECT_MULTIDIM_ELEM(BPdirect.weight, n)).margin(1e-3));
+  }
+}
@@ -8,3 +8,91 @@ TEST_CASE( "Test getCTF", "[ctf]" ) {
   float val = ctf.getCTF(10.0, 10.0);
   REQUIRE(val == Approx(0.59154));
 }
+
+//The geometry-dependent terms of getFftwImage are cached per optics group; compare with the direct evaluation of getCTF.
+TEST_CASE( "Test getFftwImage with cached geometry", "[ctf]" ) {
+  const int box = 64;
+  const double angpix = 1.1;
+
+  MetaDataTable opticsMdt;
+  opticsMdt.addObject();
+  opticsMdt.setValue(EMDL_IMAGE_OPTICS_GROUP, 1);
+  opticsMdt.setValue(EMDL_IMAGE_PIXEL_SIZE, angpix);
+  opticsMdt.setValue(EMDL_IMAGE_SIZE, box);
+  opticsMdt.setValue(EMDL_CTF_VOLTAGE, 300.0);
+  opticsMdt.setValue(EMDL_CTF_CS, 2.7);
+  opticsMdt.setValue(EMDL_CTF_Q0, 0.1);
+  opticsMdt.setValue(EMDL_IMAGE_MAG_MATRIX_00, 1.02);
+  opticsMdt.setValue(EMDL_IMAGE_MAG_MATRIX_01, 0.01);
+  opticsMdt.setValue(EMDL_IMAGE_MAG_MATRIX_10, -0.015);
+  opticsMdt.setValue(EMDL_IMAGE_MAG_MATRIX_11, 0.99);
+  std::vector<double> even_zernike = {0.0, 0.05, -0.03, 0.02, 0.01, -0.04};
+  opticsMdt.setValue(EMDL_IMAGE_EVEN_ZERNIKE_COEFFS, even_zernike);
+
+  ObservationModel obsModel(opticsMdt);
+  REQUIRE(obsModel.hasMagMatrices);
+  REQUIRE(obsModel.hasEvenZernike);
+
+  CTF ctf;
+  ctf.setValuesByGroup(&obsModel, 0, 10000.0, 12000.0, 30.0, 50.0);
+
+  MultidimArray<RFLOAT> cached(box, box/2 + 1);
+  ctf.getFftwImage(cached, box, box, angpix);
+
+  // What getFftwImage computes without the cache
+  const BufferedImage<RFLOAT>& gammaOffset = obsModel.getGammaOffset(0, box);
+  const RFLOAT as = box * angpix;
+  for (int y1 = 0; y1 < YSIZE(cached); y1++)
+  for (int x1 = 0; x1 < XSIZE(cached); x1++)
+  {
+    const RFLOAT x = x1 / as;
+    const RFLOAT y = y1 <= box/2? y1 / as : (y1 - box) / as;
+    const int y0 = y1 <= box/2? y1 : gammaOffset.ydim + y1 - box;
+
+    REQUIRE(DIRECT_A2D_ELEM(cached, y1, x1) == Approx(ctf.getCTF(x, y, false, false, false, true, gammaOffset(x1, y0))).margin(1e-6));
+  }
+}
+
+//The batch version shares the geometry between particles; it has to give the same CTFs as one call per particle.
+TEST_CASE( "Test getFftwImages against getFftwImage", "[ctf]" ) {
+  const int box = 64;
+  const double angpix = 1.1;
+
+  MetaDataTable opticsMdt;
+  opticsMdt.addObject();
+  opticsMdt.setValue(EMDL_IMAGE_OPTICS_GROUP, 1);
+  opticsMdt.setValue(EMDL_IMAGE_PIXEL_SIZE, angpix);
+  opticsMdt.setValue(EMDL_IMAGE_SIZE, box);
+  opticsMdt.setValue(EMDL_CTF_VOLTAGE, 300.0);
+  opticsMdt.setValue(EMDL_CTF_CS, 2.7);
+  opticsMdt.setValue(EMDL_CTF_Q0, 0.1);
+  std::vector<double> even_zernike = {0.0, 0.05, -0.03, 0.02, 0.01, -0.04};
+  opticsMdt.setValue(EMDL_IMAGE_EVEN_ZERNIKE_COEFFS, even_zernike);
+  ObservationModel obsModel(opticsMdt);
+
+  // Particles with and without an observation model, with different defoci
+  std::vector<CTF> ctfs(6);
+  for (int i = 0; i < ctfs.size(); i++)
+  {
+    if (i % 2 == 0)
+      ctfs[i].setValuesByGroup(&obsModel, 0, 10000.0 + 500.0 * i, 12000.0 + 300.0 * i, 30.0 + 10.0 * i, 50.0);
+    else
+      ctfs[i].setValues(10000.0 + 500.0 * i, 12000.0 + 300.0 * i, 30.0 + 10.0 * i, 300.0, 2.7, 0.1, 50.0, 1.0, 0.0);
+  }
+
+  std::vector<MultidimArray<RFLOAT> > batch;
+  CTF::getFftwImages(ctfs, batch, box, box, angpix, false, true, false, true, false, 2);
+  REQUIRE(batch.size() == ctfs.size());
+
+  for (int i = 0; i < ctfs.size(); i++)
+  {
+    MultidimArray<RFLOAT> single(box, box/2 + 1);
+    ctfs[i].getFftwImage(single, box, box, angpix, false, true, false, true, false);
+
+    REQUIRE(batch[i].sameShape(single));
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(single)
+    {
+      REQUIRE(DIRECT_MULTIDIM_ELEM(batch[i], n) == Approx(DIRECT_MULTIDIM_ELEM(single, n)).margin(1e-6));
+    }
+  }
+}
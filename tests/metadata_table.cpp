@@ -0,0 +1,49 @@
+#include <catch2/catch.hpp>
+#include <cstdio>
+#include "src/metadata_table.h"
+
+//Empty strings are stored as a placeholder internally; the STAR writer must write them as an empty value and an empty comment as no comment at all.
+TEST_CASE( "Test STAR round trip of empty strings and comments", "[metadata_table]" ) {
+  const FileName fn_star = "test_metadata_table_round_trip.star";
+
+  MetaDataTable MDin;
+  MDin.setName("particles");
+  MDin.addObject();
+  MDin.setValue(EMDL_IMAGE_NAME, std::string("1@stack.mrcs"));
+  MDin.setValue(EMDL_MICROGRAPH_NAME, std::string(""));
+  MDin.setValue(EMDL_COMMENT, std::string(""));
+  MDin.setValue(EMDL_CTF_DEFOCUSU, 10000.0);
+  MDin.addObject();
+  MDin.setValue(EMDL_IMAGE_NAME, std::string(""));
+  MDin.setValue(EMDL_MICROGRAPH_NAME, std::string("mic 2.mrc"));
+  MDin.setValue(EMDL_COMMENT, std::string("second particle"));
+  MDin.setValue(EMDL_CTF_DEFOCUSU, 12000.0);
+
+  std::ostringstream out;
+  MDin.write(out);
+  REQUIRE(out.str().find("# \"\"") == std::string::npos);
+
+  MDin.write(fn_star, 2);
+  MetaDataTable MDout;
+  MDout.read(fn_star, "particles");
+  std::remove(fn_star.c_str());
+
+  REQUIRE(MDout.numberOfObjects() == 2);
+
+  std::string image_name, mic_name;
+  RFLOAT defocus;
+
+  MDout.getValue(EMDL_IMAGE_NAME, image_name, 0);
+  MDout.getValue(EMDL_MICROGRAPH_NAME, mic_name, 0);
+  MDout.getValue(EMDL_CTF_DEFOCUSU, defocus, 0);
+  REQUIRE(image_name == "1@stack.mrcs");
+  REQUIRE(mic_name == "");
+  REQUIRE(defocus == Approx(10000.0));
+
+  MDout.getValue(EMDL_IMAGE_NAME, image_name, 1);
+  MDout.getValue(EMDL_MICROGRAPH_NAME, mic_name, 1);
+  MDout.getValue(EMDL_CTF_DEFOCUSU, defocus, 1);
+  REQUIRE(image_name == "");
+  REQUIRE(mic_name == "mic 2.mrc");
+  REQUIRE(defocus == Approx(12000.0));
+}
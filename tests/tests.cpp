@@ -2,3 +2,5 @@
 
 #include <catch2/catch.hpp>
 #include "ctf.cpp"
+#include "metadata_table.cpp"
+#include "backprojector.cpp"